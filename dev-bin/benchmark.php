@@ -0,0 +1,418 @@
+<?php
+
+declare(strict_types=1);
+
+use MaxMind\Db\Benchmark\DatabaseWriter;
+use MaxMind\Db\Reader;
+
+// Benchmarks the C extension against the pure PHP reader on synthetic
+// databases, which are generated on the first run and reused after that.
+//
+// Usage: php dev-bin/benchmark.php [--output=<file>] [--operations=<n>]
+//            [--networks=<n>] [--data-dir=<dir>] [--extension=<maxminddb.so>]
+//
+// Each backend runs in its own process: the pure PHP reader under `php -n`,
+// so that no ini file can load the extension, and the extension either under
+// `php -n -d extension=<maxminddb.so>` or, without --extension, with the
+// ini files of the PHP running this script. Per operation timings are
+// reported as percentiles in nanoseconds, with the memory used, as JSON on
+// stdout or in the --output file. A summary goes to stderr.
+//
+// PHP offers no count of its allocations, so memory_allocated_bytes is the
+// growth in memory_get_usage() while a scenario's results are kept, and
+// peak_memory_bytes is only reported on PHP 8.2 and later, where the peak
+// can be reset between scenarios.
+
+require_once __DIR__ . '/benchmark/DatabaseWriter.php';
+
+const BENCHMARK_SEED = 20240101;
+
+/**
+ * @param array<int, string> $argv
+ *
+ * @return array<string, string>
+ */
+function parseArguments(array $argv): array
+{
+    $arguments = [];
+    foreach (array_slice($argv, 1) as $argument) {
+        if (!preg_match('/\A--([a-z-]+)(?:=(.*))?\z/', $argument, $matches)) {
+            fwrite(\STDERR, "unexpected argument: $argument\n");
+
+            exit(1);
+        }
+        $arguments[$matches[1]] = $matches[2] ?? '1';
+    }
+
+    return $arguments;
+}
+
+/**
+ * The databases to generate: every record size, for both IP versions, with
+ * small and large records.
+ *
+ * @return array<string, array{ipVersion:int, recordSize:int, recordType:string}>
+ */
+function databaseConfigurations(): array
+{
+    $configurations = [];
+    foreach ([4, 6] as $ipVersion) {
+        foreach ([24, 28, 32] as $recordSize) {
+            foreach (['small', 'large'] as $recordType) {
+                $name = "ipv{$ipVersion}-{$recordSize}-{$recordType}";
+                $configurations[$name] = [
+                    'ipVersion' => $ipVersion,
+                    'recordSize' => $recordSize,
+                    'recordType' => $recordType,
+                ];
+            }
+        }
+    }
+
+    return $configurations;
+}
+
+/**
+ * @return array<string, mixed>
+ */
+function makeRecord(string $recordType, int $n): array
+{
+    $isoCode = chr(65 + $n % 26) . chr(65 + intdiv($n, 26) % 26);
+    if ($recordType === 'small') {
+        return ['country' => ['geoname_id' => 1000 + $n % 250, 'iso_code' => $isoCode]];
+    }
+
+    $names = static function (string $name): array {
+        $names = [];
+        foreach (['de', 'en', 'es', 'fr', 'ja', 'pt-BR', 'ru', 'zh-CN'] as $language) {
+            $names[$language] = "$name ($language)";
+        }
+
+        return $names;
+    };
+
+    return [
+        'city' => ['geoname_id' => 2000000 + $n, 'names' => $names("City $n")],
+        'continent' => [
+            'code' => 'EU',
+            'geoname_id' => 6255148,
+            'names' => $names('Europe'),
+        ],
+        'country' => [
+            'geoname_id' => 1000 + $n % 250,
+            'iso_code' => $isoCode,
+            'names' => $names("Country $isoCode"),
+        ],
+        'location' => [
+            'accuracy_radius' => 10 + $n % 500,
+            'latitude' => ($n % 18000) / 100.0 - 90,
+            'longitude' => ($n % 36000) / 100.0 - 180,
+            'time_zone' => 'Europe/Zone_' . ($n % 40),
+        ],
+        'postal' => ['code' => (string) (10000 + $n % 89999)],
+        'subdivisions' => [
+            ['geoname_id' => 3000000 + $n % 5000, 'iso_code' => (string) ($n % 99), 'names' => $names("Region $n")],
+        ],
+    ];
+}
+
+/**
+ * Writes the database and a list of addresses that are in it and of ones
+ * that are not, unless they exist already.
+ *
+ * @param array{ipVersion:int, recordSize:int, recordType:string} $configuration
+ */
+function generateDatabase(string $dataDir, string $name, array $configuration, int $networks): void
+{
+    $fileName = "$dataDir/$name-$networks.mmdb";
+    if (file_exists($fileName) && file_exists("$fileName.addresses")) {
+        return;
+    }
+    fwrite(\STDERR, "generating $fileName\n");
+
+    mt_srand(BENCHMARK_SEED);
+    $ipVersion = $configuration['ipVersion'];
+    $writer = new DatabaseWriter($ipVersion, $configuration['recordSize']);
+
+    // Random /24 networks in IPv4 databases and /48 networks in IPv6 ones,
+    // sharing a record between every ten or so of them, as real databases do.
+    $prefixBytes = $ipVersion === 6 ? 6 : 3;
+    $addressBytes = $ipVersion === 6 ? 16 : 4;
+    $prefixes = [];
+    while (count($prefixes) < $networks) {
+        $prefix = '';
+        for ($i = 0; $i < $prefixBytes; ++$i) {
+            $prefix .= chr(mt_rand(0, 255));
+        }
+        $prefixes[$prefix] = true;
+    }
+    $recordCount = max(1, intdiv($networks, 10));
+    foreach (array_keys($prefixes) as $i => $prefix) {
+        $writer->insert(
+            str_pad((string) $prefix, $addressBytes, "\x00"),
+            $prefixBytes * 8,
+            makeRecord($configuration['recordType'], $i % $recordCount)
+        );
+    }
+    $writer->write(
+        $fileName,
+        "Benchmark-$name",
+        ['en' => "Synthetic $name database for benchmarks"],
+        ['en']
+    );
+
+    $randomAddress = static function (string $prefix) use ($addressBytes): string {
+        for ($i = \strlen($prefix); $i < $addressBytes; ++$i) {
+            $prefix .= chr(mt_rand(0, 255));
+        }
+
+        return inet_ntop($prefix);
+    };
+
+    $hits = [];
+    $prefixList = array_keys($prefixes);
+    for ($i = 0; $i < 10000; ++$i) {
+        $hits[] = $randomAddress((string) $prefixList[mt_rand(0, count($prefixList) - 1)]);
+    }
+    $misses = [];
+    while (count($misses) < 10000) {
+        $address = $randomAddress('');
+        if (!isset($prefixes[substr((string) inet_pton($address), 0, $prefixBytes)])) {
+            $misses[] = $address;
+        }
+    }
+    file_put_contents("$fileName.addresses", serialize(['hits' => $hits, 'misses' => $misses]));
+}
+
+/**
+ * Times each call to $operation and summarizes the timings.
+ *
+ * @return array<string, mixed>
+ */
+function measure(int $operations, callable $operation): array
+{
+    if (function_exists('hrtime')) {
+        $now = static function (): int {
+            return hrtime(true);
+        };
+    } else {
+        $now = static function (): int {
+            return (int) (microtime(true) * 1e9);
+        };
+    }
+
+    // Warm up caches, the allocator and, where enabled, the JIT.
+    for ($i = 0; $i < min(1000, $operations); ++$i) {
+        $operation($i);
+    }
+
+    // Filled in place, so that it does not count towards the memory used.
+    $timings = array_fill(0, $operations, 0);
+
+    gc_collect_cycles();
+    if (function_exists('memory_reset_peak_usage')) {
+        memory_reset_peak_usage();
+    }
+    $memoryBefore = memory_get_usage();
+
+    $results = [];
+    $start = $now();
+    for ($i = 0; $i < $operations; ++$i) {
+        $t = $now();
+        $results[] = $operation($i);
+        $timings[$i] = $now() - $t;
+    }
+    $total = $now() - $start;
+
+    $memoryAllocated = memory_get_usage() - $memoryBefore;
+    $peakMemory = function_exists('memory_reset_peak_usage')
+        ? memory_get_peak_usage() - $memoryBefore : null;
+    unset($results);
+
+    sort($timings);
+    $percentile = static function (float $p) use ($timings): int {
+        return $timings[max(0, (int) ceil($p / 100 * count($timings)) - 1)];
+    };
+
+    return [
+        'operations' => $operations,
+        'ops_per_second' => $total > 0 ? round($operations / ($total / 1e9)) : null,
+        'mean_ns' => (int) round(array_sum($timings) / count($timings)),
+        'p50_ns' => $percentile(50),
+        'p90_ns' => $percentile(90),
+        'p99_ns' => $percentile(99),
+        'p999_ns' => $percentile(99.9),
+        'max_ns' => $timings[count($timings) - 1],
+        'memory_allocated_bytes' => $memoryAllocated,
+        'peak_memory_bytes' => $peakMemory,
+    ];
+}
+
+/**
+ * Runs every scenario against every database with the Reader this process
+ * has, printing the serialized results.
+ *
+ * @param array<string, string> $arguments
+ */
+function runBackend(array $arguments): void
+{
+    $backend = $arguments['backend'];
+    if (($backend === 'extension') !== extension_loaded('maxminddb')) {
+        fwrite(\STDERR, "the maxminddb extension is not loaded as the $backend backend requires\n");
+
+        exit(1);
+    }
+    if ($backend === 'php') {
+        require_once __DIR__ . '/../autoload.php';
+    }
+
+    $operations = (int) $arguments['operations'];
+    $results = [];
+    foreach (explode(',', $arguments['databases']) as $fileName) {
+        $addresses = unserialize((string) file_get_contents("$fileName.addresses"));
+        $hits = $addresses['hits'];
+        $misses = $addresses['misses'];
+        $count = count($hits);
+
+        $reader = new Reader($fileName);
+        $scenarios = [
+            'get hit' => static function (int $i) use ($reader, $hits, $count) {
+                return $reader->get($hits[$i % $count]);
+            },
+            'get miss' => static function (int $i) use ($reader, $misses, $count) {
+                return $reader->get($misses[$i % $count]);
+            },
+            'getWithPrefixLen hit' => static function (int $i) use ($reader, $hits, $count) {
+                return $reader->getWithPrefixLen($hits[$i % $count]);
+            },
+            'metadata' => static function () use ($reader) {
+                return $reader->metadata();
+            },
+        ];
+        foreach ($scenarios as $scenario => $operation) {
+            $results[] = ['database' => basename($fileName), 'scenario' => $scenario]
+                + measure($operations, $operation);
+        }
+        $reader->close();
+
+        $reader = new Reader($fileName, ['inMemory' => true]);
+        $results[] = ['database' => basename($fileName), 'scenario' => 'get hit in memory']
+            + measure($operations, static function (int $i) use ($reader, $hits, $count) {
+                return $reader->get($hits[$i % $count]);
+            });
+        $reader->close();
+
+        $results[] = ['database' => basename($fileName), 'scenario' => 'open and close']
+            + measure(max(1, intdiv($operations, 10)), static function () use ($fileName): void {
+                $reader = new Reader($fileName);
+                $reader->close();
+            });
+    }
+
+    echo serialize($results);
+}
+
+/**
+ * @param array<int, string> $command
+ *
+ * @return array<int, array<string, mixed>>|null
+ */
+function runChild(array $command): ?array
+{
+    $process = proc_open(
+        implode(' ', array_map('escapeshellarg', $command)),
+        [1 => ['pipe', 'w'], 2 => \STDERR],
+        $pipes
+    );
+    if (!is_resource($process)) {
+        return null;
+    }
+    $output = stream_get_contents($pipes[1]);
+    fclose($pipes[1]);
+    if (proc_close($process) !== 0 || !is_string($output)) {
+        return null;
+    }
+    $results = unserialize($output);
+
+    return is_array($results) ? $results : null;
+}
+
+$arguments = parseArguments($argv);
+
+if (isset($arguments['backend'])) {
+    runBackend($arguments);
+
+    exit(0);
+}
+
+$operations = (int) ($arguments['operations'] ?? 100000);
+$networks = (int) ($arguments['networks'] ?? 20000);
+$dataDir = $arguments['data-dir'] ?? sys_get_temp_dir() . '/maxminddb-benchmark';
+if (!is_dir($dataDir) && !mkdir($dataDir, 0777, true)) {
+    fwrite(\STDERR, "unable to create $dataDir\n");
+
+    exit(1);
+}
+
+$databases = [];
+foreach (databaseConfigurations() as $name => $configuration) {
+    generateDatabase($dataDir, $name, $configuration, $networks);
+    $databases[] = "$dataDir/$name-$networks.mmdb";
+}
+
+$childArguments = [
+    __FILE__,
+    '--operations=' . $operations,
+    '--databases=' . implode(',', $databases),
+];
+$backends = ['php' => array_merge([\PHP_BINARY, '-n'], $childArguments, ['--backend=php'])];
+if (isset($arguments['extension'])) {
+    $backends['extension'] = array_merge(
+        [\PHP_BINARY, '-n', '-d', 'extension=' . $arguments['extension']],
+        $childArguments,
+        ['--backend=extension']
+    );
+} elseif (extension_loaded('maxminddb')) {
+    $backends['extension'] = array_merge([\PHP_BINARY], $childArguments, ['--backend=extension']);
+} else {
+    fwrite(\STDERR, "the maxminddb extension is not loaded; pass --extension to benchmark it\n");
+}
+
+$report = [
+    'php_version' => \PHP_VERSION,
+    'os' => \PHP_OS,
+    'machine' => php_uname('m'),
+    'date' => gmdate('c'),
+    'operations' => $operations,
+    'networks' => $networks,
+    'results' => [],
+];
+foreach ($backends as $backend => $command) {
+    fwrite(\STDERR, "benchmarking the $backend backend\n");
+    $results = runChild($command);
+    if ($results === null) {
+        fwrite(\STDERR, "the $backend backend failed\n");
+
+        exit(1);
+    }
+    foreach ($results as $result) {
+        $report['results'][] = ['backend' => $backend] + $result;
+        fprintf(
+            \STDERR,
+            "%-9s %-20s %-21s %10s ops/s  p50 %7d ns  p99 %7d ns\n",
+            $backend,
+            $result['database'],
+            $result['scenario'],
+            $result['ops_per_second'],
+            $result['p50_ns'],
+            $result['p99_ns']
+        );
+    }
+}
+
+$json = json_encode($report, \JSON_PRETTY_PRINT | \JSON_UNESCAPED_SLASHES) . "\n";
+if (isset($arguments['output'])) {
+    file_put_contents($arguments['output'], $json);
+} else {
+    echo $json;
+}
@@ -0,0 +1,287 @@
+<?php
+
+declare(strict_types=1);
+
+namespace MaxMind\Db\Benchmark;
+
+/**
+ * Writes MaxMind DB files for the benchmarks. It supports what the
+ * benchmarks need and no more: networks must not overlap, and each distinct
+ * record is stored once, without pointers.
+ */
+class DatabaseWriter
+{
+    private const EMPTY = -1;
+
+    /**
+     * @var int
+     */
+    private $ipVersion;
+
+    /**
+     * @var int
+     */
+    private $recordSize;
+
+    /**
+     * The children of each node. A child is a node number, EMPTY, or
+     * -2 - n for the n-th record.
+     *
+     * @var array<int, int>
+     */
+    private $left = [self::EMPTY];
+
+    /**
+     * @var array<int, int>
+     */
+    private $right = [self::EMPTY];
+
+    /**
+     * The encoded records.
+     *
+     * @var array<int, string>
+     */
+    private $records = [];
+
+    /**
+     * Record numbers by encoded record.
+     *
+     * @var array<string, int>
+     */
+    private $recordNumbers = [];
+
+    public function __construct(int $ipVersion, int $recordSize)
+    {
+        if ($ipVersion !== 4 && $ipVersion !== 6) {
+            throw new \InvalidArgumentException("Unsupported IP version $ipVersion");
+        }
+        if (!\in_array($recordSize, [24, 28, 32], true)) {
+            throw new \InvalidArgumentException("Unsupported record size $recordSize");
+        }
+        $this->ipVersion = $ipVersion;
+        $this->recordSize = $recordSize;
+    }
+
+    /**
+     * @param string $network an address packed by inet_pton(), the size of
+     *                        the database's addresses
+     * @param mixed  $record
+     */
+    public function insert(string $network, int $prefixLength, $record): void
+    {
+        if (\strlen($network) !== ($this->ipVersion === 6 ? 16 : 4)) {
+            throw new \InvalidArgumentException('The network does not match the IP version');
+        }
+
+        $encoded = $this->encode($record);
+        if (!isset($this->recordNumbers[$encoded])) {
+            $this->recordNumbers[$encoded] = \count($this->records);
+            $this->records[] = $encoded;
+        }
+        $leaf = -2 - $this->recordNumbers[$encoded];
+
+        $node = 0;
+        for ($i = 0; $i < $prefixLength; ++$i) {
+            $bit = (\ord($network[$i >> 3]) >> (7 - ($i & 7))) & 1;
+            $child = $bit ? $this->right[$node] : $this->left[$node];
+
+            if ($i === $prefixLength - 1) {
+                if ($child !== self::EMPTY) {
+                    throw new \InvalidArgumentException('Networks must not overlap');
+                }
+                $child = $leaf;
+            } elseif ($child === self::EMPTY) {
+                $child = \count($this->left);
+                $this->left[] = self::EMPTY;
+                $this->right[] = self::EMPTY;
+            } elseif ($child < 0) {
+                throw new \InvalidArgumentException('Networks must not overlap');
+            }
+
+            if ($bit) {
+                $this->right[$node] = $child;
+            } else {
+                $this->left[$node] = $child;
+            }
+            $node = $child;
+        }
+    }
+
+    /**
+     * @param array<string, string> $description
+     * @param array<int, string>    $languages
+     */
+    public function write(
+        string $fileName,
+        string $databaseType,
+        array $description = [],
+        array $languages = []
+    ): void {
+        $nodeCount = \count($this->left);
+
+        $dataSection = '';
+        $recordOffsets = [];
+        foreach ($this->records as $number => $record) {
+            $recordOffsets[$number] = \strlen($dataSection);
+            $dataSection .= $record;
+        }
+
+        $maxRecord = $nodeCount + 16 + \strlen($dataSection);
+        if ($maxRecord >= 2 ** $this->recordSize) {
+            throw new \RuntimeException(
+                "The database is too large for a record size of {$this->recordSize}"
+            );
+        }
+
+        $tree = '';
+        for ($node = 0; $node < $nodeCount; ++$node) {
+            $left = $this->recordValue($this->left[$node], $nodeCount, $recordOffsets);
+            $right = $this->recordValue($this->right[$node], $nodeCount, $recordOffsets);
+
+            switch ($this->recordSize) {
+                case 24:
+                    $tree .= substr(pack('N', $left), 1) . substr(pack('N', $right), 1);
+
+                    break;
+
+                case 28:
+                    $tree .= substr(pack('N', $left), 1)
+                        . \chr((($left >> 20) & 0xF0) | (($right >> 24) & 0x0F))
+                        . substr(pack('N', $right), 1);
+
+                    break;
+
+                default:
+                    $tree .= pack('NN', $left, $right);
+            }
+        }
+
+        $metadata = $this->encodeMap([
+            'binary_format_major_version' => $this->encodeUint(2, 5),
+            'binary_format_minor_version' => $this->encodeUint(0, 5),
+            'build_epoch' => $this->encodeUint(time(), 9),
+            'database_type' => $this->encode($databaseType),
+            'description' => $this->encode($description),
+            'ip_version' => $this->encodeUint($this->ipVersion, 5),
+            'languages' => $this->encodeArray($languages),
+            'node_count' => $this->encodeUint($nodeCount, 6),
+            'record_size' => $this->encodeUint($this->recordSize, 5),
+        ]);
+
+        $contents = $tree
+            . str_repeat("\x00", 16)
+            . $dataSection
+            . "\xAB\xCD\xEFMaxMind.com"
+            . $metadata;
+
+        if (file_put_contents($fileName, $contents) !== \strlen($contents)) {
+            throw new \RuntimeException("Unable to write $fileName");
+        }
+    }
+
+    /**
+     * @param array<int, int> $recordOffsets
+     */
+    private function recordValue(int $child, int $nodeCount, array $recordOffsets): int
+    {
+        if ($child === self::EMPTY) {
+            return $nodeCount;
+        }
+        if ($child >= 0) {
+            return $child;
+        }
+
+        return $nodeCount + 16 + $recordOffsets[-2 - $child];
+    }
+
+    /**
+     * Encodes strings, non-negative integers as uint32 or uint64, negative
+     * integers as int32, floats as doubles, booleans, lists as arrays, and
+     * other arrays as maps.
+     *
+     * @param mixed $value
+     */
+    private function encode($value): string
+    {
+        if (\is_string($value)) {
+            return $this->encodeControl(2, \strlen($value)) . $value;
+        }
+        if (\is_int($value)) {
+            if ($value < 0) {
+                return $this->encodeControl(8, 4) . pack('N', $value & 0xFFFFFFFF);
+            }
+
+            return $this->encodeUint($value, $value <= 0xFFFFFFFF ? 6 : 9);
+        }
+        if (\is_float($value)) {
+            return $this->encodeControl(3, 8) . pack('E', $value);
+        }
+        if (\is_bool($value)) {
+            return $this->encodeControl(14, $value ? 1 : 0);
+        }
+        if (\is_array($value)) {
+            if ($value !== [] && array_keys($value) === range(0, \count($value) - 1)) {
+                return $this->encodeArray($value);
+            }
+
+            return $this->encodeMap(array_map([$this, 'encode'], $value));
+        }
+
+        throw new \InvalidArgumentException('Unsupported type ' . \gettype($value));
+    }
+
+    /**
+     * @param array<int, mixed> $values
+     */
+    private function encodeArray(array $values): string
+    {
+        $encoded = $this->encodeControl(11, \count($values));
+        foreach ($values as $value) {
+            $encoded .= $this->encode($value);
+        }
+
+        return $encoded;
+    }
+
+    /**
+     * @param array<int|string, string> $encodedValues
+     */
+    private function encodeMap(array $encodedValues): string
+    {
+        $encoded = $this->encodeControl(7, \count($encodedValues));
+        foreach ($encodedValues as $key => $value) {
+            $encoded .= $this->encode((string) $key) . $value;
+        }
+
+        return $encoded;
+    }
+
+    private function encodeUint(int $value, int $type): string
+    {
+        $bytes = ltrim(pack('J', $value), "\x00");
+
+        return $this->encodeControl($type, \strlen($bytes)) . $bytes;
+    }
+
+    private function encodeControl(int $type, int $size): string
+    {
+        if ($size < 29) {
+            $sizeBytes = '';
+        } elseif ($size < 285) {
+            $sizeBytes = \chr($size - 29);
+            $size = 29;
+        } elseif ($size < 65821) {
+            $sizeBytes = pack('n', $size - 285);
+            $size = 30;
+        } else {
+            $sizeBytes = substr(pack('N', $size - 65821), 1);
+            $size = 31;
+        }
+
+        if ($type <= 7) {
+            return \chr(($type << 5) | $size) . $sizeBytes;
+        }
+
+        return \chr($size) . \chr($type - 7) . $sizeBytes;
+    }
+}
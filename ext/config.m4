@@ -106,6 +106,13 @@ if test $PHP_MAXMINDDB != "no"; then
         CFLAGS="$CFLAGS -Wall -Wextra -Wno-unused-parameter -Wno-missing-field-initializers -Werror"
     fi
 
+    dnl Reader::verify() splits its work across threads when pthreads is
+    dnl available, and runs it on the calling thread otherwise.
+    PHP_CHECK_LIBRARY(pthread, pthread_create, [
+        PHP_ADD_LIBRARY(pthread, 1, MAXMINDDB_SHARED_LIBADD)
+        AC_DEFINE(HAVE_MAXMINDDB_PTHREADS, 1, [Whether pthreads is available to Reader::verify()])
+    ])
+
     PHP_SUBST(MAXMINDDB_SHARED_LIBADD)
 
     PHP_NEW_EXTENSION(maxminddb, $maxminddb_sources, $ext_shared)
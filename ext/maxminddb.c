@@ -21,11 +21,27 @@
 #include <zend.h>
 
 #include "Zend/zend_exceptions.h"
+#include "Zend/zend_interfaces.h"
+#include "Zend/zend_smart_str.h"
 #include "Zend/zend_types.h"
+#include "ext/spl/spl_array.h"
 #include "ext/spl/spl_exceptions.h"
 #include "ext/standard/info.h"
 #include <maxminddb.h>
 
+#ifdef PHP_WIN32
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
 #ifdef ZTS
 #include <TSRM.h>
 #endif
@@ -39,6 +55,10 @@
     ZEND_NS_NAME(PHP_MAXMINDDB_READER_NS, "Metadata")
 #define PHP_MAXMINDDB_READER_EX_NS                                             \
     ZEND_NS_NAME(PHP_MAXMINDDB_READER_NS, "InvalidDatabaseException")
+#define PHP_MAXMINDDB_NETWORK_ITERATOR_NS                                      \
+    ZEND_NS_NAME(PHP_MAXMINDDB_READER_NS, "NetworkIterator")
+#define PHP_MAXMINDDB_LAZY_RECORD_NS                                           \
+    ZEND_NS_NAME(PHP_MAXMINDDB_READER_NS, "LazyRecord")
 
 #define Z_MAXMINDDB_P(zv) php_maxminddb_fetch_object(Z_OBJ_P(zv))
 typedef size_t strsize_t;
@@ -74,29 +94,399 @@ typedef zend_object free_obj_t;
 #define ZEND_THIS (&EX(This))
 #endif
 
+#define CHECK_NOT_CLOSED(mmdb, rv)                                             \
+    if (NULL == (mmdb)) {                                                      \
+        zend_throw_exception_ex(spl_ce_BadMethodCallException,                \
+                                0 TSRMLS_CC,                                   \
+                                "Attempt to read from a closed MaxMind DB.");  \
+        return rv;                                                             \
+    }
+
+/* verify() splits its work across threads where configure found pthreads
+   and the compiler has the atomic builtins the workers mark bitmaps with. */
+#if defined(HAVE_MAXMINDDB_PTHREADS) && !defined(PHP_WIN32) &&                 \
+    (defined(__GNUC__) || defined(__clang__))
+#define MAXMINDDB_VERIFY_THREADS 1
+#include <pthread.h>
+#endif
+
+/* The most threads verify() splits its work across. */
+#define MAXMINDDB_VERIFY_MAX_THREADS 64
+
+/* The number of leading address bits resolved by a jump table. */
+#define MAXMINDDB_JUMP_BITS 16
+#define MAXMINDDB_JUMP_SIZE (1 << MAXMINDDB_JUMP_BITS)
+
+/* The lookups a reader makes before it uses jump tables, so that a reader
+   opened for a few lookups does not pay for building them. */
+#define MAXMINDDB_JUMP_TABLE_LOOKUPS 1000
+
+/* The search tree record reached from a starting node by each value of the
+   next 16 address bits, and the number of bits it took to reach it. A record
+   reached in fewer bits fills every entry sharing its prefix, so lookups that
+   start from the table return the same prefix lengths as full walks. */
+typedef struct _maxminddb_jump_table {
+    /* The depth of the starting node in the tree. */
+    uint16_t start_depth;
+    uint32_t records[MAXMINDDB_JUMP_SIZE];
+    uint8_t depths[MAXMINDDB_JUMP_SIZE];
+} maxminddb_jump_table;
+
+/* An open database. A handle created by the constructor belongs to its
+   reader. One created by Reader::persistent() or maxminddb.preload lives in
+   the process-wide registry instead, keyed by its real path, and is shared by
+   every reader opened on that file until the file is replaced. In thread-safe
+   builds, the handles the constructor creates are shared as well, between the
+   readers that have them open. */
+typedef struct _maxminddb_handle {
+    MMDB_s mmdb;
+    uint32_t refcount;
+    /* Whether the handle is shared, so that it is allocated persistently and
+       its reference count is only changed with the registry locked. */
+    zend_bool persistent;
+    /* The real path of a handle in the table of shared handles, which it is
+       removed from when its last reader lets go of it. */
+    zend_string *shared_path;
+    /* The identity of the file when it was opened, used to tell when it has
+       been replaced or modified. */
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime;
+    /* The jump tables of the readers using the handle, built by the first of
+       them to need each one. Starts at the IPv4 subtree in an IPv6
+       database. */
+    maxminddb_jump_table *ipv4_jump_table;
+    maxminddb_jump_table *ipv6_jump_table;
+    /* The copy of the file made for the inMemory option, which mmdb reads
+       from instead of libmaxminddb's own mapping. That mapping is kept, and
+       put back before MMDB_close() so that libmaxminddb releases what it
+       created. */
+    uint8_t *copy;
+    const uint8_t *mapped_content;
+} maxminddb_handle;
+
+/* A fixed-capacity cache with CLOCK eviction. Entries are keyed by either an
+   integer or a string and hold a zval, which is copied on the way in and out,
+   so cached arrays are shared with the callers until one of them writes to
+   its copy. String keys are passed as bytes, so that finding one allocates
+   nothing. The slots are allocated as the cache fills. */
+typedef struct _maxminddb_cache_slot {
+    zend_ulong h;
+    zend_string *key;
+    zval value;
+    zend_bool referenced;
+} maxminddb_cache_slot;
+
+typedef struct _maxminddb_cache {
+    /* Key => slot number. */
+    HashTable index;
+    maxminddb_cache_slot *slots;
+    uint32_t capacity;
+    uint32_t allocated;
+    uint32_t used;
+    uint32_t hand;
+    zend_ulong hits;
+    zend_ulong misses;
+    zend_ulong evictions;
+} maxminddb_cache;
+
+/* The options accepted by the constructor. */
+typedef struct _maxminddb_open_options {
+    /* Copy the mapped file into anonymous memory. */
+    zend_bool in_memory;
+    /* Start lookups from jump tables, once the reader has made
+       MAXMINDDB_JUMP_TABLE_LOOKUPS lookups. */
+    zend_bool jump_table;
+    /* Read the whole mapping in when opening the file. */
+    zend_bool prefault;
+    /* mlock() the mapping, failing if that is not possible. */
+    zend_bool lock;
+    /* Ask for transparent huge pages. This is advisory. */
+    zend_bool huge_pages;
+    /* Return maps and arrays as LazyRecord objects. */
+    zend_bool lazy_records;
+} maxminddb_open_options;
+
+/* Lookup counters. Each reader keeps its own, and they are added to the
+   process totals when the reader is freed or its counters are reset. */
+typedef struct _maxminddb_stats {
+    zend_ulong lookups;
+    zend_ulong not_found;
+    zend_ulong invalid_addresses;
+    /* Lookups by the depth in the search tree at which they ended. */
+    zend_ulong depths[129];
+    /* Data section values decoded, map keys included, and the size of
+       their payloads. */
+    zend_ulong values_decoded;
+    zend_ulong bytes_decoded;
+    uint64_t lookup_ns;
+} maxminddb_stats;
+
 typedef struct _maxminddb_obj {
     MMDB_s *mmdb;
+    maxminddb_handle *handle;
+    /* The path the reader was opened with, for reloadIfChanged(). */
+    zend_string *path;
+    /* Decoded records by data section offset, or NULL when disabled. */
+    maxminddb_cache *record_cache;
+    /* [record, prefix length, search tree depth] lists by address, or NULL
+       when disabled. IPv4 addresses are keyed by their integer value and
+       IPv6 addresses by their 16 bytes. */
+    maxminddb_cache *address_cache;
+    /* Map key strings by data section offset, created on first use. */
+    HashTable *keys;
+    /* The constructor's options, which reloadIfChanged() applies again. */
+    maxminddb_open_options options;
+    /* The handle's jump tables, once this reader uses them, and the lookups
+       it has made until then. */
+    const maxminddb_jump_table *ipv4_jump_table;
+    const maxminddb_jump_table *ipv6_jump_table;
+    uint32_t jump_table_lookups;
+    /* Created by the first lookup made with maxminddb.stats enabled. */
+    maxminddb_stats *stats;
+    /* The class and decode plan registered with registerSchema(). */
+    struct _maxminddb_schema *schema;
     zend_object std;
 } maxminddb_obj;
 
+/* Keys past this many are decoded without being interned, so that a database
+   with unusually many distinct keys cannot grow the table without bound. */
+#define MAXMINDDB_MAX_INTERNED_KEYS 4096
+
+/* A step along the paths of a schema: the properties that take the value
+   reached so far, and the steps below it by map key or array index. */
+typedef struct _maxminddb_schema_node {
+    /* zend_property_info pointers. */
+    HashTable properties;
+    /* Child nodes by path segment. */
+    HashTable children;
+    /* The segment as an array index, when it is a decimal integer. */
+    zend_long index;
+    zend_bool has_index;
+} maxminddb_schema_node;
+
+/* A schema compiled by registerSchema(). Every path is merged into one tree,
+   so a record is walked once however many properties it fills. */
+typedef struct _maxminddb_schema {
+    zend_class_entry *ce;
+    maxminddb_schema_node root;
+} maxminddb_schema;
+
+/* libmaxminddb's limit on how deeply maps, arrays and pointers may nest. */
+#define MAXMINDDB_MAX_DEPTH 512
+
+/* Returned by decode_data() when it has already thrown an exception, rather
+   than found invalid data for the caller to report. */
+#define MAXMINDDB_DECODE_THROWN (-1)
+
+/* What decode_value() reads from and collects into as it walks the data
+   section, or the metadata section, which is laid out the same way. */
+typedef struct _maxminddb_decoder {
+    const uint8_t *data;
+    uint32_t size;
+    HashTable *keys;
+    maxminddb_stats *stats;
+} maxminddb_decoder;
+
+/* A search tree node still to be visited by a network iterator, with the
+   address bits that lead to it. */
+typedef struct _maxminddb_network {
+    uint64_t node;
+    uint8_t ip[16];
+    uint16_t depth;
+} maxminddb_network;
+
+/* The iterator returned by Reader::networks(). It holds its own reference to
+   the database handle, so closing the reader does not end the iteration. */
+typedef struct _maxminddb_network_iterator_obj {
+    maxminddb_handle *handle;
+    /* Decoded records, so that records shared by neighboring networks are
+       decoded once. */
+    maxminddb_cache *records;
+    HashTable *keys;
+    /* The right branches not yet walked, deepest last. There is at most one
+       per bit of the address. */
+    maxminddb_network stack[128];
+    uint32_t stack_len;
+    /* Where the walk starts: the root of the tree, or the node or record
+       that networksWithin() found for its network. */
+    maxminddb_network start;
+    /* The node that ::/96 leads to in an IPv6 database. Other paths to it are
+       aliases of the IPv4 subtree. */
+    uint64_t ipv4_start;
+    zend_bool include_aliased;
+    zend_bool skip_empty;
+    zval key;
+    zval current;
+    zend_object std;
+} maxminddb_network_iterator_obj;
+
+#define MAXMINDDB_NETWORK_RECORDS_SIZE 4096
+
+static inline maxminddb_network_iterator_obj *
+php_maxminddb_network_iterator_fetch_object(zend_object *obj) {
+    return (maxminddb_network_iterator_obj *)((char *)(obj)-offsetof(
+        maxminddb_network_iterator_obj, std));
+}
+
+#define Z_NETWORK_ITERATOR_P(zv)                                               \
+    php_maxminddb_network_iterator_fetch_object(Z_OBJ_P(zv))
+
+/* A map or array returned by a reader opened with lazyRecords. Like network
+   iterators, it holds its own reference to the database handle. Each entry
+   is decoded the first time it is read, nested maps and arrays becoming lazy
+   records in turn. */
+typedef struct _maxminddb_lazy_record_obj {
+    maxminddb_handle *handle;
+    /* The data section offset of the map or array, after any pointer. */
+    uint32_t offset;
+    /* The number of entries. */
+    uint32_t size;
+    zend_bool is_map;
+    /* The entries decoded so far, by key. */
+    HashTable *values;
+    /* Whether values holds every entry, in the order of the database. */
+    zend_bool complete;
+    /* The result of toArray(), once it has been called. */
+    zval array;
+    zend_object std;
+} maxminddb_lazy_record_obj;
+
+static inline maxminddb_lazy_record_obj *
+php_maxminddb_lazy_record_fetch_object(zend_object *obj) {
+    return (maxminddb_lazy_record_obj *)((char *)(obj)-offsetof(
+        maxminddb_lazy_record_obj, std));
+}
+
+#define Z_LAZY_RECORD_P(zv) php_maxminddb_lazy_record_fetch_object(Z_OBJ_P(zv))
+
+/* Persistent handles by real path. The registry holds a reference to each
+   handle it contains, and every reference count change on a persistent handle
+   is made with the registry locked. */
+static HashTable maxminddb_registry;
+
+#ifdef ZTS
+/* The handles opened by the constructor in any thread, by real path. Unlike
+   the registry, the table does not hold references, so the last reader to
+   close a handle unmaps it. Guarded by the registry lock. */
+static HashTable maxminddb_shared;
+#endif
+
+#ifdef ZTS
+static MUTEX_T maxminddb_registry_mutex;
+#define REGISTRY_LOCK() tsrm_mutex_lock(maxminddb_registry_mutex)
+#define REGISTRY_UNLOCK() tsrm_mutex_unlock(maxminddb_registry_mutex)
+#else
+#define REGISTRY_LOCK()
+#define REGISTRY_UNLOCK()
+#endif
+
+/* Mirrors maxminddb.stats. It is a system setting, so that this can be a
+   plain variable and disabled statistics cost one test per lookup. */
+static zend_bool maxminddb_stats_enabled = 0;
+
+/* The counters of the readers freed or reset so far. Guarded by the registry
+   lock. */
+static maxminddb_stats maxminddb_process_stats;
+
 PHP_FUNCTION(maxminddb);
 
 static int
 get_record(INTERNAL_FUNCTION_PARAMETERS, zval *record, int *prefix_len);
-static const MMDB_entry_data_list_s *
-handle_entry_data_list(const MMDB_entry_data_list_s *entry_data_list,
+static int lookup_record(maxminddb_obj *mmdb_obj,
+                         const char *ip_address,
+                         zval *record,
+                         int *prefix_len TSRMLS_DC);
+static int parse_ip_address(const char *ip_address,
+                            struct sockaddr_storage *address TSRMLS_DC);
+static int lookup_sockaddr(maxminddb_obj *mmdb_obj,
+                           const struct sockaddr *address,
+                           const char *ip_address,
+                           zval *record,
+                           int *prefix_len TSRMLS_DC);
+static void get_many(INTERNAL_FUNCTION_PARAMETERS, zend_bool with_prefix_len);
+static maxminddb_cache *cache_create(uint32_t capacity);
+static void cache_destroy(maxminddb_cache *cache);
+static const zval *cache_find(maxminddb_cache *cache,
+                              zend_ulong h,
+                              const char *key,
+                              size_t key_len);
+static void cache_add(maxminddb_cache *cache,
+                      zend_ulong h,
+                      const char *key,
+                      size_t key_len,
+                      zval *value);
+static void cache_stats(const maxminddb_cache *cache, zval *stats);
+static maxminddb_stats *reader_stats(maxminddb_obj *mmdb_obj);
+static void count_invalid_address(maxminddb_obj *mmdb_obj);
+static uint64_t stats_now(void);
+static void stats_flush(maxminddb_obj *mmdb_obj);
+static void handle_retain(maxminddb_handle *handle);
+static uint32_t find_ipv4_start(const MMDB_s *mmdb, uint16_t *depth);
+static void network_iterator_rewind(maxminddb_network_iterator_obj *it);
+static void
+network_iterator_advance(maxminddb_network_iterator_obj *it TSRMLS_DC);
+static int lookup_entry(maxminddb_obj *mmdb_obj,
+                        const struct sockaddr *address,
+                        const char *ip_address,
+                        MMDB_lookup_result_s *result,
+                        int *prefix_len TSRMLS_DC);
+static int decode_sockaddr(maxminddb_obj *mmdb_obj,
+                           const struct sockaddr *address,
+                           const char *ip_address,
+                           zval *record,
+                           int *prefix_len,
+                           uint16_t *depth TSRMLS_DC);
+static const char **build_lookup_path(zval *path TSRMLS_DC);
+static int decode_entry_data(maxminddb_obj *mmdb_obj,
+                             const MMDB_entry_data_s *entry_data,
+                             zval *z_value TSRMLS_DC);
+static int lazy_record_value(maxminddb_handle *handle,
+                             const MMDB_entry_data_s *entry_data,
+                             zval *z_value TSRMLS_DC);
+static int lazy_record_read(const maxminddb_decoder *decoder,
+                            uint32_t offset,
+                            MMDB_entry_data_s *entry_data);
+static HashTable *object_keys(maxminddb_obj *mmdb_obj);
+static int decode_data(const MMDB_s *mmdb,
+                       uint32_t offset,
+                       HashTable *keys,
+                       maxminddb_stats *stats,
                        zval *z_value TSRMLS_DC);
-static const MMDB_entry_data_list_s *
-handle_array(const MMDB_entry_data_list_s *entry_data_list,
-             zval *z_value TSRMLS_DC);
-static const MMDB_entry_data_list_s *
-handle_map(const MMDB_entry_data_list_s *entry_data_list,
-           zval *z_value TSRMLS_DC);
-static void handle_uint128(const MMDB_entry_data_list_s *entry_data_list,
+static int decoder_read(const maxminddb_decoder *decoder,
+                        uint32_t offset,
+                        MMDB_entry_data_s *entry_data);
+static int decoder_skip(const maxminddb_decoder *decoder,
+                        uint32_t offset,
+                        uint32_t *next,
+                        int depth);
+static int decode_value(const maxminddb_decoder *decoder,
+                        uint32_t offset,
+                        uint32_t *next,
+                        zval *z_value,
+                        int depth TSRMLS_DC);
+static maxminddb_schema *schema_compile(zend_class_entry *ce,
+                                        HashTable *paths TSRMLS_DC);
+static void schema_free(maxminddb_schema *schema);
+static int schema_fill(const MMDB_s *mmdb,
+                       const maxminddb_schema *schema,
+                       uint32_t offset,
+                       HashTable *keys,
+                       maxminddb_stats *stats,
+                       zend_object *object TSRMLS_DC);
+static void verify_database(const MMDB_s *mmdb,
+                            uint32_t max_problems,
+                            uint32_t threads,
+                            zval *return_value);
+static zend_string *map_key(const MMDB_entry_data_s *entry_data,
+                            HashTable *keys);
+static int handle_entry_data(const MMDB_entry_data_s *entry_data,
+                             zval *z_value TSRMLS_DC);
+static void handle_uint128(const MMDB_entry_data_s *entry_data,
                            zval *z_value TSRMLS_DC);
-static void handle_uint64(const MMDB_entry_data_list_s *entry_data_list,
+static void handle_uint64(const MMDB_entry_data_s *entry_data,
                           zval *z_value TSRMLS_DC);
-static void handle_uint32(const MMDB_entry_data_list_s *entry_data_list,
+static void handle_uint32(const MMDB_entry_data_s *entry_data,
                           zval *z_value TSRMLS_DC);
 
 #define CHECK_ALLOCATED(val)                                                   \
@@ -106,34 +496,571 @@ static void handle_uint32(const MMDB_entry_data_list_s *entry_data_list,
     }
 
 static zend_object_handlers maxminddb_obj_handlers;
+static zend_object_handlers network_iterator_obj_handlers;
+static zend_object_handlers lazy_record_obj_handlers;
 static zend_class_entry *maxminddb_ce, *maxminddb_exception_ce, *metadata_ce;
+static zend_class_entry *network_iterator_ce, *lazy_record_ce;
 
 static inline maxminddb_obj *
 php_maxminddb_fetch_object(zend_object *obj TSRMLS_DC) {
     return (maxminddb_obj *)((char *)(obj)-offsetof(maxminddb_obj, std));
 }
 
+/* Opens the file, recording the identity it had in st when it was checked
+   beforehand. */
+static maxminddb_handle *handle_open(const char *db_file,
+                                     zend_bool persistent,
+                                     const zend_stat_t *st,
+                                     int *status) {
+    maxminddb_handle *handle =
+        (maxminddb_handle *)pecalloc(1, sizeof(maxminddb_handle), persistent);
+
+    *status = MMDB_open(db_file, MMDB_MODE_MMAP, &handle->mmdb);
+    if (MMDB_SUCCESS != *status) {
+        pefree(handle, persistent);
+        return NULL;
+    }
+
+    handle->refcount = 1;
+    handle->persistent = persistent;
+    handle->dev = (uint64_t)st->st_dev;
+    handle->ino = (uint64_t)st->st_ino;
+    handle->mtime = (int64_t)st->st_mtime;
+    return handle;
+}
+
+/* Frees what was derived from the reader's database besides its record
+   cache: the interned map keys. The jump tables belong to the handle. */
+static void discard_derived_state(maxminddb_obj *mmdb_obj) {
+    if (mmdb_obj->keys) {
+        zend_hash_destroy(mmdb_obj->keys);
+        FREE_HASHTABLE(mmdb_obj->keys);
+        mmdb_obj->keys = NULL;
+    }
+    mmdb_obj->ipv4_jump_table = NULL;
+    mmdb_obj->ipv6_jump_table = NULL;
+}
+
+/* Whether the file now at the handle's path, described by st, is not the one
+   the handle opened. */
+static zend_bool handle_is_stale(const maxminddb_handle *handle,
+                                 const zend_stat_t *st) {
+    return handle->dev != (uint64_t)st->st_dev ||
+           handle->ino != (uint64_t)st->st_ino ||
+           handle->mtime != (int64_t)st->st_mtime;
+}
+
+#ifndef PHP_WIN32
+/* Points libmaxminddb at another copy of the same file. Of the fields of
+   MMDB_s, only these three point into the file: libmaxminddb reads the
+   search tree through file_content, and sets data_section and
+   metadata_section from it when it opens the file. The metadata it keeps
+   is copied out of the file, and ipv4_start_node is a node number. If a
+   libmaxminddb release adds a pointer into the file, it has to be moved
+   here as well. */
+static void handle_rebase(MMDB_s *mmdb, const uint8_t *content) {
+    mmdb->data_section = content + (mmdb->data_section - mmdb->file_content);
+    mmdb->metadata_section =
+        content + (mmdb->metadata_section - mmdb->file_content);
+    mmdb->file_content = content;
+}
+#endif
+
+/* Drops a reference to a persistent handle. The registry must be locked. */
+static void handle_release_locked(maxminddb_handle *handle) {
+    if (--handle->refcount == 0) {
+#ifdef ZTS
+        if (handle->shared_path) {
+            /* The table may hold a newer handle for the path by now. */
+            if (zend_hash_find_ptr(&maxminddb_shared, handle->shared_path) ==
+                handle) {
+                zend_hash_del(&maxminddb_shared, handle->shared_path);
+            }
+            zend_string_release(handle->shared_path);
+        }
+#endif
+        if (handle->ipv4_jump_table) {
+            pefree(handle->ipv4_jump_table, handle->persistent);
+        }
+        if (handle->ipv6_jump_table) {
+            pefree(handle->ipv6_jump_table, handle->persistent);
+        }
+#ifndef PHP_WIN32
+        if (handle->copy) {
+            /* MMDB_close() unmaps file_content, which has to be the mapping
+               libmaxminddb made. */
+            handle_rebase(&handle->mmdb, handle->mapped_content);
+            munmap(handle->copy, (size_t)handle->mmdb.file_size);
+        }
+#endif
+        MMDB_close(&handle->mmdb);
+        pefree(handle, handle->persistent);
+    }
+}
+
+static void handle_retain(maxminddb_handle *handle) {
+    if (!handle->persistent) {
+        handle->refcount++;
+        return;
+    }
+    REGISTRY_LOCK();
+    handle->refcount++;
+    REGISTRY_UNLOCK();
+}
+
+static void handle_release(maxminddb_handle *handle) {
+    if (!handle->persistent) {
+        handle_release_locked(handle);
+        return;
+    }
+    REGISTRY_LOCK();
+    handle_release_locked(handle);
+    REGISTRY_UNLOCK();
+}
+
+static void registry_entry_dtor(zval *zv) {
+    handle_release_locked((maxminddb_handle *)Z_PTR_P(zv));
+}
+
+/* Returns a new reference to the registry's handle for db_file. The file is
+   opened again, and the old handle dropped from the registry, when the file
+   has been replaced or modified since it was last opened. The old handle
+   stays open until the readers still using it let go of it. */
+static maxminddb_handle *registry_acquire(const char *db_file,
+                                          int *status TSRMLS_DC) {
+    char resolved[MAXPATHLEN];
+    zend_stat_t st;
+
+    if (NULL == VCWD_REALPATH(db_file, resolved) ||
+        0 != VCWD_STAT(resolved, &st)) {
+        *status = MMDB_FILE_OPEN_ERROR;
+        return NULL;
+    }
+    size_t resolved_len = strlen(resolved);
+
+    REGISTRY_LOCK();
+
+    maxminddb_handle *handle = (maxminddb_handle *)zend_hash_str_find_ptr(
+        &maxminddb_registry, resolved, resolved_len);
+    if (handle && handle_is_stale(handle, &st)) {
+        handle = NULL;
+    }
+
+    if (NULL == handle) {
+        handle = handle_open(resolved, 1, &st, status);
+        if (handle) {
+            /* This releases the registry's reference to any stale handle. */
+            zend_hash_str_update_ptr(
+                &maxminddb_registry, resolved, resolved_len, handle);
+        }
+    }
+
+    if (handle) {
+        handle->refcount++;
+    }
+
+    REGISTRY_UNLOCK();
+    return handle;
+}
+
+#ifdef ZTS
+/* Returns a new reference to the shared handle for db_file, opening the file
+   if no thread has it open or if it has been replaced since. st describes the
+   file, as checked by the caller. */
+static maxminddb_handle *
+shared_acquire(const char *db_file, const zend_stat_t *st, int *status) {
+    char resolved[MAXPATHLEN];
+    if (NULL == VCWD_REALPATH(db_file, resolved)) {
+        *status = MMDB_FILE_OPEN_ERROR;
+        return NULL;
+    }
+    size_t resolved_len = strlen(resolved);
+
+    REGISTRY_LOCK();
+
+    maxminddb_handle *handle = (maxminddb_handle *)zend_hash_str_find_ptr(
+        &maxminddb_shared, resolved, resolved_len);
+    if (handle && !handle_is_stale(handle, st)) {
+        handle->refcount++;
+    } else {
+        /* Readers of a stale handle keep it until they close it. */
+        handle = handle_open(resolved, 1, st, status);
+        if (handle) {
+            handle->shared_path = zend_string_init(resolved, resolved_len, 1);
+            zend_hash_update_ptr(
+                &maxminddb_shared, handle->shared_path, handle);
+        }
+    }
+
+    REGISTRY_UNLOCK();
+    return handle;
+}
+#endif
+
+/* Opens the databases listed in maxminddb.preload. This runs in MINIT, so
+   under PHP-FPM the mappings are made once in the master process and shared
+   by every worker it forks. */
+static void preload_databases(const char *list TSRMLS_DC) {
+    const char separator[] = {DEFAULT_DIR_SEPARATOR, '\0'};
+    char *paths = pestrdup(list, 1);
+    char *last = NULL;
+
+    char *path;
+    for (path = php_strtok_r(paths, separator, &last); path;
+         path = php_strtok_r(NULL, separator, &last)) {
+        int status = MMDB_SUCCESS;
+        maxminddb_handle *handle = registry_acquire(path, &status TSRMLS_CC);
+        if (NULL == handle) {
+            php_error_docref(NULL TSRMLS_CC,
+                             E_WARNING,
+                             "Unable to preload the MaxMind DB \"%s\": %s",
+                             path,
+                             MMDB_strerror(status));
+            continue;
+        }
+        /* The registry keeps its own reference. */
+        handle_release(handle);
+    }
+
+    pefree(paths, 1);
+}
+
+static maxminddb_cache *cache_create(uint32_t capacity) {
+    maxminddb_cache *cache = ecalloc(1, sizeof(maxminddb_cache));
+    cache->capacity = capacity;
+    zend_hash_init(&cache->index, MIN(capacity, 1024), NULL, NULL, 0);
+    return cache;
+}
+
+static void cache_destroy(maxminddb_cache *cache) {
+    uint32_t i;
+    for (i = 0; i < cache->used; i++) {
+        zval_ptr_dtor(&cache->slots[i].value);
+        if (cache->slots[i].key) {
+            zend_string_release(cache->slots[i].key);
+        }
+    }
+    if (cache->slots) {
+        efree(cache->slots);
+    }
+    zend_hash_destroy(&cache->index);
+    efree(cache);
+}
+
+static const zval *cache_find(maxminddb_cache *cache,
+                              zend_ulong h,
+                              const char *key,
+                              size_t key_len) {
+    const zval *slot_number =
+        key ? zend_hash_str_find(&cache->index, key, key_len)
+            : zend_hash_index_find(&cache->index, h);
+    if (NULL == slot_number) {
+        cache->misses++;
+        return NULL;
+    }
+    cache->hits++;
+    maxminddb_cache_slot *slot = &cache->slots[Z_LVAL_P(slot_number)];
+    slot->referenced = 1;
+    return &slot->value;
+}
+
+static void cache_add(maxminddb_cache *cache,
+                      zend_ulong h,
+                      const char *key,
+                      size_t key_len,
+                      zval *value) {
+    maxminddb_cache_slot *slot;
+    uint32_t slot_number;
+
+    if (cache->used < cache->capacity) {
+        if (cache->used == cache->allocated) {
+            cache->allocated = cache->allocated > cache->capacity / 2
+                                   ? cache->capacity
+                                   : MIN(MAX(cache->allocated * 2, 16),
+                                         cache->capacity);
+            cache->slots = safe_erealloc(cache->slots,
+                                         cache->allocated,
+                                         sizeof(maxminddb_cache_slot),
+                                         0);
+        }
+        slot_number = cache->used++;
+        slot = &cache->slots[slot_number];
+    } else {
+        /* Sweep the hand past recently used entries, clearing their bits,
+           and evict the first entry that has not been used since the hand
+           last passed it. */
+        for (;;) {
+            slot = &cache->slots[cache->hand];
+            if (!slot->referenced) {
+                break;
+            }
+            slot->referenced = 0;
+            cache->hand = (cache->hand + 1) % cache->capacity;
+        }
+        slot_number = cache->hand;
+        cache->hand = (cache->hand + 1) % cache->capacity;
+
+        if (slot->key) {
+            zend_hash_del(&cache->index, slot->key);
+            zend_string_release(slot->key);
+        } else {
+            zend_hash_index_del(&cache->index, slot->h);
+        }
+        zval_ptr_dtor(&slot->value);
+        cache->evictions++;
+    }
+
+    zval z_slot_number;
+    ZVAL_LONG(&z_slot_number, slot_number);
+    if (key) {
+        slot->key = zend_string_init(key, key_len, 0);
+        zend_hash_add_new(&cache->index, slot->key, &z_slot_number);
+    } else {
+        zend_hash_index_add_new(&cache->index, h, &z_slot_number);
+        slot->key = NULL;
+    }
+    slot->h = h;
+    slot->referenced = 0;
+    ZVAL_COPY(&slot->value, value);
+}
+
+static void cache_stats(const maxminddb_cache *cache, zval *stats) {
+    array_init_size(stats, 5);
+    add_assoc_long(stats, "capacity", cache ? cache->capacity : 0);
+    add_assoc_long(stats, "size", cache ? cache->used : 0);
+    add_assoc_long(stats, "hits", cache ? cache->hits : 0);
+    add_assoc_long(stats, "misses", cache ? cache->misses : 0);
+    add_assoc_long(stats, "evictions", cache ? cache->evictions : 0);
+}
+
+/* The reader's counters, or NULL when statistics are disabled. */
+static maxminddb_stats *reader_stats(maxminddb_obj *mmdb_obj) {
+    if (!maxminddb_stats_enabled) {
+        return NULL;
+    }
+    if (NULL == mmdb_obj->stats) {
+        mmdb_obj->stats = ecalloc(1, sizeof(maxminddb_stats));
+    }
+    return mmdb_obj->stats;
+}
+
+/* Counts a lookup of something that is not an IP address. */
+static void count_invalid_address(maxminddb_obj *mmdb_obj) {
+    maxminddb_stats *stats = reader_stats(mmdb_obj);
+    if (stats) {
+        stats->lookups++;
+        stats->invalid_addresses++;
+    }
+}
+
+/* A monotonic clock in nanoseconds. */
+static uint64_t stats_now(void) {
+#ifdef PHP_WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)((double)count.QuadPart * 1e9 / frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static void stats_add(maxminddb_stats *to, const maxminddb_stats *from) {
+    int i;
+    to->lookups += from->lookups;
+    to->not_found += from->not_found;
+    to->invalid_addresses += from->invalid_addresses;
+    for (i = 0; i < 129; i++) {
+        to->depths[i] += from->depths[i];
+    }
+    to->values_decoded += from->values_decoded;
+    to->bytes_decoded += from->bytes_decoded;
+    to->lookup_ns += from->lookup_ns;
+}
+
+/* Moves the reader's counters to the process totals. */
+static void stats_flush(maxminddb_obj *mmdb_obj) {
+    if (NULL == mmdb_obj->stats) {
+        return;
+    }
+    REGISTRY_LOCK();
+    stats_add(&maxminddb_process_stats, mmdb_obj->stats);
+    REGISTRY_UNLOCK();
+    memset(mmdb_obj->stats, 0, sizeof(maxminddb_stats));
+}
+
+static void
+throw_unknown_option(zend_ulong index, zend_string *name TSRMLS_DC) {
+    if (name) {
+        zend_throw_exception_ex(spl_ce_InvalidArgumentException,
+                                0 TSRMLS_CC,
+                                "Unknown option \"%s\".",
+                                ZSTR_VAL(name));
+    } else {
+        zend_throw_exception_ex(spl_ce_InvalidArgumentException,
+                                0 TSRMLS_CC,
+                                "Unknown option \"" ZEND_LONG_FMT "\".",
+                                (zend_long)index);
+    }
+}
+
+static int parse_open_options(zval *options,
+                              maxminddb_open_options *open_options TSRMLS_DC) {
+    memset(open_options, 0, sizeof(*open_options));
+    if (NULL == options) {
+        return SUCCESS;
+    }
+
+    zend_ulong index;
+    zend_string *name;
+    zval *value;
+    ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(options), index, name, value) {
+        if (name && zend_string_equals_literal(name, "inMemory")) {
+            open_options->in_memory = zend_is_true(value);
+        } else if (name && zend_string_equals_literal(name, "jumpTable")) {
+            open_options->jump_table = zend_is_true(value);
+        } else if (name && zend_string_equals_literal(name, "prefault")) {
+            open_options->prefault = zend_is_true(value);
+        } else if (name && zend_string_equals_literal(name, "lock")) {
+            open_options->lock = zend_is_true(value);
+        } else if (name && zend_string_equals_literal(name, "hugePages")) {
+            open_options->huge_pages = zend_is_true(value);
+        } else if (name && zend_string_equals_literal(name, "lazyRecords")) {
+            open_options->lazy_records = zend_is_true(value);
+        } else if (name && zend_string_equals_literal(name, "apcu")) {
+            /* Only used by the pure PHP reader, which caches what it reads
+               when opening a file. */
+        } else {
+            throw_unknown_option(index, name TSRMLS_CC);
+            return FAILURE;
+        }
+    }
+    ZEND_HASH_FOREACH_END();
+    return SUCCESS;
+}
+
+/* Applies the memory options to a handle the constructor opened. The
+   prefault and huge page options are hints and never fail; copying the file
+   into memory or locking it throws a RuntimeException if it cannot be done,
+   and the caller then releases the handle. */
+static int handle_apply_options(maxminddb_handle *handle,
+                                const maxminddb_open_options *options,
+                                const char *db_file TSRMLS_DC) {
+#ifdef PHP_WIN32
+    /* The other options are hints, and the file stays mapped as it is. */
+    if (options->lock) {
+        zend_throw_exception_ex(spl_ce_RuntimeException,
+                                0 TSRMLS_CC,
+                                "Locking the MaxMind DB (%s) into memory is "
+                                "not supported on this platform.",
+                                db_file);
+        return FAILURE;
+    }
+    return SUCCESS;
+#else
+    MMDB_s *mmdb = &handle->mmdb;
+    const size_t size = (size_t)mmdb->file_size;
+
+    if (options->in_memory) {
+        uint8_t *copy = mmap(NULL,
+                             size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS,
+                             -1,
+                             0);
+        if (MAP_FAILED == (void *)copy) {
+            zend_throw_exception_ex(spl_ce_RuntimeException,
+                                    0 TSRMLS_CC,
+                                    "Unable to copy the MaxMind DB (%s) into "
+                                    "memory: %s",
+                                    db_file,
+                                    strerror(errno));
+            return FAILURE;
+        }
+#ifdef MADV_HUGEPAGE
+        if (options->huge_pages) {
+            /* Before the copy, so that it faults in huge pages. */
+            madvise(copy, size, MADV_HUGEPAGE);
+        }
+#endif
+        memcpy(copy, mmdb->file_content, size);
+        mprotect(copy, size, PROT_READ);
+
+        const uint8_t *file_content = mmdb->file_content;
+        handle->copy = copy;
+        handle->mapped_content = file_content;
+        handle_rebase(mmdb, copy);
+#ifdef MADV_DONTNEED
+        /* The file's mapping stays open for MMDB_close(), but its pages are
+           no longer needed. */
+        madvise((void *)file_content, size, MADV_DONTNEED);
+#endif
+    }
+#ifdef MADV_HUGEPAGE
+    else if (options->huge_pages) {
+        madvise((void *)mmdb->file_content, size, MADV_HUGEPAGE);
+    }
+#endif
+
+    if (options->prefault && !options->in_memory) {
+#ifdef MADV_WILLNEED
+        madvise((void *)mmdb->file_content, size, MADV_WILLNEED);
+#endif
+        /* Touch every page, so that lookups do not wait for them. */
+        const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        volatile uint8_t sink = 0;
+        size_t offset;
+        for (offset = 0; offset < size; offset += page_size) {
+            sink ^= mmdb->file_content[offset];
+        }
+        (void)sink;
+    }
+
+    if (options->lock && 0 != mlock(mmdb->file_content, size)) {
+        zend_throw_exception_ex(spl_ce_RuntimeException,
+                                0 TSRMLS_CC,
+                                "Unable to lock the MaxMind DB (%s) into "
+                                "memory: %s",
+                                db_file,
+                                strerror(errno));
+        return FAILURE;
+    }
+    return SUCCESS;
+#endif
+}
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_maxminddbreader_construct, 0, 0, 1)
 ZEND_ARG_TYPE_INFO(0, db_file, IS_STRING, 0)
+ZEND_ARG_TYPE_INFO(0, options, IS_ARRAY, 0)
 ZEND_END_ARG_INFO()
 
 PHP_METHOD(MaxMind_Db_Reader, __construct) {
     char *db_file = NULL;
     strsize_t name_len;
+    zval *options = NULL;
     zval *_this_zval = NULL;
 
     if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
                                      getThis(),
-                                     "Os",
+                                     "Os|a",
                                      &_this_zval,
                                      maxminddb_ce,
                                      &db_file,
-                                     &name_len) == FAILURE) {
+                                     &name_len,
+                                     &options) == FAILURE) {
+        return;
+    }
+
+    maxminddb_open_options open_options;
+    if (parse_open_options(options, &open_options TSRMLS_CC) == FAILURE) {
         return;
     }
 
+    zend_stat_t st;
     if (0 != php_check_open_basedir(db_file TSRMLS_CC) ||
-        0 != access(db_file, R_OK)) {
+        0 != access(db_file, R_OK) || 0 != VCWD_STAT(db_file, &st)) {
         zend_throw_exception_ex(
             spl_ce_InvalidArgumentException,
             0 TSRMLS_CC,
@@ -142,22 +1069,88 @@ PHP_METHOD(MaxMind_Db_Reader, __construct) {
         return;
     }
 
-    MMDB_s *mmdb = (MMDB_s *)ecalloc(1, sizeof(MMDB_s));
-    int const status = MMDB_open(db_file, MMDB_MODE_MMAP, mmdb);
+    int status = MMDB_SUCCESS;
+    maxminddb_handle *handle;
+#ifdef ZTS
+    /* A copied or locked mapping belongs to the reader that asked for it. */
+    if (!open_options.in_memory && !open_options.lock) {
+        handle = shared_acquire(db_file, &st, &status);
+    } else {
+        handle = handle_open(db_file, 0, &st, &status);
+    }
+#else
+    handle = handle_open(db_file, 0, &st, &status);
+#endif
 
-    if (MMDB_SUCCESS != status) {
+    if (NULL == handle) {
         zend_throw_exception_ex(
             maxminddb_exception_ce,
             0 TSRMLS_CC,
             "Error opening database file (%s). Is this a valid "
             "MaxMind DB file?",
             db_file);
-        efree(mmdb);
+        return;
+    }
+    if (handle_apply_options(handle, &open_options, db_file TSRMLS_CC) ==
+        FAILURE) {
+        handle_release(handle);
         return;
     }
 
     maxminddb_obj *mmdb_obj = Z_MAXMINDDB_P(ZEND_THIS);
-    mmdb_obj->mmdb = mmdb;
+    mmdb_obj->handle = handle;
+    mmdb_obj->mmdb = &handle->mmdb;
+    mmdb_obj->path = zend_string_init(db_file, name_len, 0);
+    mmdb_obj->options = open_options;
+}
+
+ZEND_BEGIN_ARG_WITH_RETURN_OBJ_INFO_EX(arginfo_maxminddbreader_persistent,
+                                       0,
+                                       1,
+                                       MaxMind\\Db\\Reader,
+                                       0)
+ZEND_ARG_TYPE_INFO(0, db_file, IS_STRING, 0)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(MaxMind_Db_Reader, persistent) {
+    char *db_file = NULL;
+    strsize_t name_len;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                              "s",
+                              &db_file,
+                              &name_len) == FAILURE) {
+        return;
+    }
+
+    if (0 != php_check_open_basedir(db_file TSRMLS_CC) ||
+        0 != access(db_file, R_OK)) {
+        zend_throw_exception_ex(
+            spl_ce_InvalidArgumentException,
+            0 TSRMLS_CC,
+            "The file \"%s\" does not exist or is not readable.",
+            db_file);
+        return;
+    }
+
+    int status = MMDB_SUCCESS;
+    maxminddb_handle *handle = registry_acquire(db_file, &status TSRMLS_CC);
+
+    if (NULL == handle) {
+        zend_throw_exception_ex(
+            maxminddb_exception_ce,
+            0 TSRMLS_CC,
+            "Error opening database file (%s). Is this a valid "
+            "MaxMind DB file?",
+            db_file);
+        return;
+    }
+
+    object_init_ex(return_value, maxminddb_ce);
+    maxminddb_obj *mmdb_obj = Z_MAXMINDDB_P(return_value);
+    mmdb_obj->handle = handle;
+    mmdb_obj->mmdb = &handle->mmdb;
+    mmdb_obj->path = zend_string_init(db_file, name_len, 0);
 }
 
 ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
@@ -191,10 +1184,28 @@ PHP_METHOD(MaxMind_Db_Reader, getWithPrefixLen) {
     add_next_index_zval(return_value, &z_prefix_len);
 }
 
-static int
-get_record(INTERNAL_FUNCTION_PARAMETERS, zval *record, int *prefix_len) {
-    char *ip_address = NULL;
-    strsize_t name_len;
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_maxminddbreader_getMany, 0, 1, IS_ARRAY, 0)
+ZEND_ARG_TYPE_INFO(0, ip_addresses, IS_ARRAY, 0)
+ZEND_ARG_TYPE_INFO(1, errors, IS_ARRAY, 1)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(MaxMind_Db_Reader, getMany) {
+    get_many(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
+}
+
+PHP_METHOD(MaxMind_Db_Reader, getManyWithPrefixLen) {
+    get_many(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
+}
+
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_maxminddbreader_getPacked, 0, 1, IS_MIXED, 1)
+ZEND_ARG_TYPE_INFO(0, packed_address, IS_STRING, 0)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(MaxMind_Db_Reader, getPacked) {
+    char *packed_address = NULL;
+    strsize_t packed_len;
     zval *this_zval = NULL;
 
     if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
@@ -202,538 +1213,4701 @@ get_record(INTERNAL_FUNCTION_PARAMETERS, zval *record, int *prefix_len) {
                                      "Os",
                                      &this_zval,
                                      maxminddb_ce,
-                                     &ip_address,
-                                     &name_len) == FAILURE) {
-        return FAILURE;
+                                     &packed_address,
+                                     &packed_len) == FAILURE) {
+        return;
     }
 
-    const maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
-
+    maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
     MMDB_s *mmdb = mmdb_obj->mmdb;
 
-    if (NULL == mmdb) {
-        zend_throw_exception_ex(spl_ce_BadMethodCallException,
-                                0 TSRMLS_CC,
-                                "Attempt to read from a closed MaxMind DB.");
-        return FAILURE;
-    }
-
-    struct addrinfo hints = {
-        .ai_family = AF_UNSPEC,
-        .ai_flags = AI_NUMERICHOST,
-        /* We set ai_socktype so that we only get one result back */
-        .ai_socktype = SOCK_STREAM};
+    CHECK_NOT_CLOSED(mmdb, );
 
-    struct addrinfo *addresses = NULL;
-    int gai_status = getaddrinfo(ip_address, NULL, &hints, &addresses);
-    if (gai_status) {
-        zend_throw_exception_ex(spl_ce_InvalidArgumentException,
-                                0 TSRMLS_CC,
-                                "The value \"%s\" is not a valid IP address.",
-                                ip_address);
-        return FAILURE;
-    }
-    if (!addresses || !addresses->ai_addr) {
+    struct sockaddr_storage address;
+    if (4 == packed_len) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&address;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, packed_address, 4);
+    } else if (16 == packed_len) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&address;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, packed_address, 16);
+    } else {
         zend_throw_exception_ex(
             spl_ce_InvalidArgumentException,
             0 TSRMLS_CC,
-            "getaddrinfo was successful but failed to set the addrinfo");
-        return FAILURE;
+            "The packed address must be 4 or 16 bytes long, %d given.",
+            (int)packed_len);
+        count_invalid_address(mmdb_obj);
+        return;
     }
 
-    int sa_family = addresses->ai_addr->sa_family;
+    int prefix_len = 0;
+    lookup_sockaddr(mmdb_obj,
+                    (const struct sockaddr *)&address,
+                    NULL,
+                    return_value,
+                    &prefix_len TSRMLS_CC);
+}
 
-    int mmdb_error = MMDB_SUCCESS;
-    MMDB_lookup_result_s result =
-        MMDB_lookup_sockaddr(mmdb, addresses->ai_addr, &mmdb_error);
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_maxminddbreader_getFields, 0, 2, IS_ARRAY, 1)
+ZEND_ARG_TYPE_INFO(0, ip_address, IS_STRING, 0)
+ZEND_ARG_TYPE_INFO(0, paths, IS_ARRAY, 0)
+ZEND_END_ARG_INFO()
 
-    freeaddrinfo(addresses);
+PHP_METHOD(MaxMind_Db_Reader, getFields) {
+    char *ip_address = NULL;
+    strsize_t name_len;
+    zval *paths = NULL;
+    zval *this_zval = NULL;
 
-    if (MMDB_SUCCESS != mmdb_error) {
-        zend_class_entry *ex;
-        if (MMDB_IPV6_LOOKUP_IN_IPV4_DATABASE_ERROR == mmdb_error) {
-            ex = spl_ce_InvalidArgumentException;
-        } else {
-            ex = maxminddb_exception_ce;
-        }
-        zend_throw_exception_ex(ex,
-                                0 TSRMLS_CC,
-                                "Error looking up %s. %s",
-                                ip_address,
-                                MMDB_strerror(mmdb_error));
-        return FAILURE;
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "Osa",
+                                     &this_zval,
+                                     maxminddb_ce,
+                                     &ip_address,
+                                     &name_len,
+                                     &paths) == FAILURE) {
+        return;
     }
 
-    *prefix_len = result.netmask;
+    maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
+    MMDB_s *mmdb = mmdb_obj->mmdb;
 
-    if (sa_family == AF_INET && mmdb->metadata.ip_version == 6) {
-        /* We return the prefix length given the IPv4 address. If there is
-           no IPv4 subtree, we return a prefix length of 0. */
-        *prefix_len = *prefix_len >= 96 ? *prefix_len - 96 : 0;
+    CHECK_NOT_CLOSED(mmdb, );
+
+    struct sockaddr_storage address;
+    if (parse_ip_address(ip_address, &address TSRMLS_CC) == FAILURE) {
+        count_invalid_address(mmdb_obj);
+        return;
+    }
+
+    maxminddb_stats *stats = reader_stats(mmdb_obj);
+    uint64_t start = stats ? stats_now() : 0;
+
+    MMDB_lookup_result_s result;
+    int prefix_len = 0;
+    if (lookup_entry(mmdb_obj,
+                     (const struct sockaddr *)&address,
+                     ip_address,
+                     &result,
+                     &prefix_len TSRMLS_CC) == FAILURE) {
+        return;
     }
 
     if (!result.found_entry) {
-        ZVAL_NULL(record);
-        return SUCCESS;
+        if (stats) {
+            stats->lookup_ns += stats_now() - start;
+        }
+        RETURN_NULL();
     }
 
-    MMDB_entry_data_list_s *entry_data_list = NULL;
-    int status = MMDB_get_entry_data_list(&result.entry, &entry_data_list);
+    array_init_size(return_value, zend_hash_num_elements(Z_ARRVAL_P(paths)));
 
-    if (MMDB_SUCCESS != status) {
-        zend_throw_exception_ex(maxminddb_exception_ce,
-                                0 TSRMLS_CC,
-                                "Error while looking up data for %s. %s",
-                                ip_address,
-                                MMDB_strerror(status));
-        MMDB_free_entry_data_list(entry_data_list);
-        return FAILURE;
-    } else if (NULL == entry_data_list) {
-        zend_throw_exception_ex(
-            maxminddb_exception_ce,
-            0 TSRMLS_CC,
-            "Error while looking up data for %s. Your database may "
-            "be corrupt or you have found a bug in libmaxminddb.",
-            ip_address);
-        return FAILURE;
+    zend_ulong index;
+    zend_string *key;
+    zval *path;
+    ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(paths), index, key, path) {
+        const char **lookup_path = build_lookup_path(path TSRMLS_CC);
+        if (NULL == lookup_path) {
+            return;
+        }
+
+        MMDB_entry_data_s entry_data;
+        int status = MMDB_aget_value(&result.entry, &entry_data, lookup_path);
+        efree(lookup_path);
+
+        zval value;
+        if (MMDB_SUCCESS == status && entry_data.has_data) {
+            if (decode_entry_data(mmdb_obj, &entry_data, &value TSRMLS_CC) ==
+                FAILURE) {
+                return;
+            }
+        } else if (MMDB_SUCCESS == status ||
+                   MMDB_LOOKUP_PATH_DOES_NOT_MATCH_DATA_ERROR == status ||
+                   MMDB_INVALID_LOOKUP_PATH_ERROR == status) {
+            /* The path is not in this record. */
+            ZVAL_NULL(&value);
+        } else {
+            zend_throw_exception_ex(maxminddb_exception_ce,
+                                    0 TSRMLS_CC,
+                                    "Error while looking up data for %s. %s",
+                                    ip_address,
+                                    MMDB_strerror(status));
+            return;
+        }
+
+        if (key) {
+            zend_hash_update(Z_ARRVAL_P(return_value), key, &value);
+        } else {
+            zend_hash_index_update(Z_ARRVAL_P(return_value), index, &value);
+        }
     }
+    ZEND_HASH_FOREACH_END();
 
-    const MMDB_entry_data_list_s *rv =
-        handle_entry_data_list(entry_data_list, record TSRMLS_CC);
-    if (rv == NULL) {
-        /* We should have already thrown the exception in handle_entry_data_list
-         */
-        return FAILURE;
+    if (stats) {
+        stats->lookup_ns += stats_now() - start;
     }
-    MMDB_free_entry_data_list(entry_data_list);
-    return SUCCESS;
 }
 
-ZEND_BEGIN_ARG_INFO_EX(arginfo_maxminddbreader_void, 0, 0, 0)
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_maxminddbreader_registerSchema, 0, 2, IS_VOID, 0)
+ZEND_ARG_TYPE_INFO(0, class, IS_STRING, 0)
+ZEND_ARG_TYPE_INFO(0, paths, IS_ARRAY, 0)
 ZEND_END_ARG_INFO()
 
-PHP_METHOD(MaxMind_Db_Reader, metadata) {
+PHP_METHOD(MaxMind_Db_Reader, registerSchema) {
+    zend_string *class_name = NULL;
+    zval *paths = NULL;
     zval *this_zval = NULL;
 
     if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
                                      getThis(),
-                                     "O",
+                                     "OSa",
                                      &this_zval,
-                                     maxminddb_ce) == FAILURE) {
+                                     maxminddb_ce,
+                                     &class_name,
+                                     &paths) == FAILURE) {
         return;
     }
 
-    const maxminddb_obj *const mmdb_obj =
-        (maxminddb_obj *)Z_MAXMINDDB_P(this_zval);
-
-    if (NULL == mmdb_obj->mmdb) {
-        zend_throw_exception_ex(spl_ce_BadMethodCallException,
-                                0 TSRMLS_CC,
-                                "Attempt to read from a closed MaxMind DB.");
-        return;
-    }
+    maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
 
-    object_init_ex(return_value, metadata_ce);
+    CHECK_NOT_CLOSED(mmdb_obj->mmdb, );
 
-    MMDB_entry_data_list_s *entry_data_list;
-    int status =
-        MMDB_get_metadata_as_entry_data_list(mmdb_obj->mmdb, &entry_data_list);
-    if (status != MMDB_SUCCESS) {
-        zend_throw_exception_ex(maxminddb_exception_ce,
-                                0 TSRMLS_CC,
-                                "Error while decoding metadata. %s",
-                                MMDB_strerror(status));
+    zend_class_entry *ce = zend_lookup_class(class_name);
+    if (NULL == ce) {
+        if (!EG(exception)) {
+            zend_throw_exception_ex(spl_ce_InvalidArgumentException,
+                                    0 TSRMLS_CC,
+                                    "Class %s does not exist.",
+                                    ZSTR_VAL(class_name));
+        }
         return;
     }
 
-    zval metadata_array;
-    const MMDB_entry_data_list_s *rv =
-        handle_entry_data_list(entry_data_list, &metadata_array TSRMLS_CC);
-    if (rv == NULL) {
+    maxminddb_schema *schema =
+        schema_compile(ce, Z_ARRVAL_P(paths) TSRMLS_CC);
+    if (NULL == schema) {
         return;
     }
-    MMDB_free_entry_data_list(entry_data_list);
-    zend_call_method_with_1_params(PROP_OBJ(return_value),
-                                   metadata_ce,
-                                   &metadata_ce->constructor,
-                                   ZEND_CONSTRUCTOR_FUNC_NAME,
-                                   NULL,
-                                   &metadata_array);
-    zval_ptr_dtor(&metadata_array);
+    if (mmdb_obj->schema) {
+        schema_free(mmdb_obj->schema);
+    }
+    mmdb_obj->schema = schema;
 }
 
-PHP_METHOD(MaxMind_Db_Reader, close) {
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_maxminddbreader_getObject, 0, 1, IS_OBJECT, 1)
+ZEND_ARG_TYPE_INFO(0, ip_address, IS_STRING, 0)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(MaxMind_Db_Reader, getObject) {
+    char *ip_address = NULL;
+    strsize_t name_len;
     zval *this_zval = NULL;
 
     if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
                                      getThis(),
-                                     "O",
+                                     "Os",
                                      &this_zval,
-                                     maxminddb_ce) == FAILURE) {
+                                     maxminddb_ce,
+                                     &ip_address,
+                                     &name_len) == FAILURE) {
         return;
     }
 
-    maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(this_zval);
+    maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
+    MMDB_s *mmdb = mmdb_obj->mmdb;
 
-    if (NULL == mmdb_obj->mmdb) {
-        zend_throw_exception_ex(spl_ce_BadMethodCallException,
-                                0 TSRMLS_CC,
-                                "Attempt to close a closed MaxMind DB.");
+    CHECK_NOT_CLOSED(mmdb, );
+
+    if (NULL == mmdb_obj->schema) {
+        zend_throw_exception_ex(
+            spl_ce_BadMethodCallException,
+            0 TSRMLS_CC,
+            "No schema has been registered. Call registerSchema() first.");
         return;
     }
-    MMDB_close(mmdb_obj->mmdb);
-    efree(mmdb_obj->mmdb);
-    mmdb_obj->mmdb = NULL;
+
+    struct sockaddr_storage address;
+    if (parse_ip_address(ip_address, &address TSRMLS_CC) == FAILURE) {
+        count_invalid_address(mmdb_obj);
+        return;
+    }
+
+    maxminddb_stats *stats = reader_stats(mmdb_obj);
+    uint64_t start = stats ? stats_now() : 0;
+
+    MMDB_lookup_result_s result;
+    int prefix_len = 0;
+    if (lookup_entry(mmdb_obj,
+                     (const struct sockaddr *)&address,
+                     ip_address,
+                     &result,
+                     &prefix_len TSRMLS_CC) == FAILURE) {
+        return;
+    }
+
+    if (!result.found_entry) {
+        if (stats) {
+            stats->lookup_ns += stats_now() - start;
+        }
+        RETURN_NULL();
+    }
+
+    /* The constructor is not called, as for an object being unserialized;
+       the properties start at their defaults. */
+    if (object_init_ex(return_value, mmdb_obj->schema->ce) == FAILURE) {
+        return;
+    }
+    int status = schema_fill(mmdb,
+                             mmdb_obj->schema,
+                             result.entry.offset,
+                             object_keys(mmdb_obj),
+                             stats,
+                             Z_OBJ_P(return_value) TSRMLS_CC);
+    if (MMDB_SUCCESS != status) {
+        if (MAXMINDDB_DECODE_THROWN != status) {
+            zend_throw_exception_ex(maxminddb_exception_ce,
+                                    0 TSRMLS_CC,
+                                    "Error while looking up data for %s. %s",
+                                    ip_address,
+                                    MMDB_strerror(status));
+        }
+        zval_ptr_dtor(return_value);
+        ZVAL_NULL(return_value);
+        return;
+    }
+
+    if (stats) {
+        stats->lookup_ns += stats_now() - start;
+    }
 }
 
-static const MMDB_entry_data_list_s *
-handle_entry_data_list(const MMDB_entry_data_list_s *entry_data_list,
-                       zval *z_value TSRMLS_DC) {
-    switch (entry_data_list->entry_data.type) {
-        case MMDB_DATA_TYPE_MAP:
-            return handle_map(entry_data_list, z_value TSRMLS_CC);
-        case MMDB_DATA_TYPE_ARRAY:
-            return handle_array(entry_data_list, z_value TSRMLS_CC);
-        case MMDB_DATA_TYPE_UTF8_STRING:
-            ZVAL_STRINGL(z_value,
-                         entry_data_list->entry_data.utf8_string,
-                         entry_data_list->entry_data.data_size);
-            break;
-        case MMDB_DATA_TYPE_BYTES:
-            ZVAL_STRINGL(z_value,
-                         (char const *)entry_data_list->entry_data.bytes,
-                         entry_data_list->entry_data.data_size);
-            break;
-        case MMDB_DATA_TYPE_DOUBLE:
-            ZVAL_DOUBLE(z_value, entry_data_list->entry_data.double_value);
-            break;
-        case MMDB_DATA_TYPE_FLOAT:
-            ZVAL_DOUBLE(z_value, entry_data_list->entry_data.float_value);
-            break;
-        case MMDB_DATA_TYPE_UINT16:
-            ZVAL_LONG(z_value, entry_data_list->entry_data.uint16);
-            break;
-        case MMDB_DATA_TYPE_UINT32:
-            handle_uint32(entry_data_list, z_value TSRMLS_CC);
+/* The output enrichStream() collects before writing it out. */
+#define MAXMINDDB_OUTPUT_BUFFER_SIZE 65536
+
+#ifndef PHP_DOUBLE_MAX_LENGTH
+#define PHP_DOUBLE_MAX_LENGTH 1080
+#endif
+
+typedef struct _maxminddb_enrich_options {
+    /* The paths to write, or NULL to write the whole record. */
+    HashTable *fields;
+    const char ***paths;
+    /* Whether the paths' keys are 0, 1, ..., so that json_encode() would
+       write them as a JSON array. */
+    zend_bool fields_list;
+    zend_bool tsv;
+    /* The column holding the address, or -1 for the whole line. */
+    zend_long column;
+    char delimiter;
+} maxminddb_enrich_options;
+
+/* Returns the length of the UTF-8 sequence at s, storing its code point, or
+   0 if it is not valid UTF-8. */
+static size_t
+utf8_sequence(const unsigned char *s, size_t len, uint32_t *code_point) {
+    const unsigned char c = s[0];
+    size_t n;
+    if (c < 0x80) {
+        *code_point = c;
+        return 1;
+    }
+    if (c < 0xC2) {
+        return 0;
+    }
+    n = c < 0xE0 ? 2 : c < 0xF0 ? 3 : c < 0xF5 ? 4 : 0;
+    if (0 == n || n > len) {
+        return 0;
+    }
+
+    uint32_t cp = c & (0x7F >> n);
+    size_t i;
+    for (i = 1; i < n; i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+        cp = (cp << 6) | (s[i] & 0x3F);
+    }
+    if ((3 == n && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))) ||
+        (4 == n && (cp < 0x10000 || cp > 0x10FFFF))) {
+        return 0;
+    }
+    *code_point = cp;
+    return n;
+}
+
+/* Appends the string as json_encode() writes it with the flags the pure PHP
+   reader passes it: slashes and Unicode characters are left alone, and
+   invalid UTF-8 is replaced with U+FFFD. */
+static void json_append_string(smart_str *out, const char *str, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    const unsigned char *s = (const unsigned char *)str;
+    const unsigned char *end = s + len;
+    const unsigned char *run = s;
+
+    smart_str_appendc(out, '"');
+    while (s < end) {
+        const unsigned char c = *s;
+        if (c >= 0x20 && c != '"' && c != '\\' && c < 0x80) {
+            s++;
+            continue;
+        }
+        if (c >= 0x80) {
+            uint32_t cp;
+            size_t n = utf8_sequence(s, (size_t)(end - s), &cp);
+            if (n > 0 && 0x2028 != cp && 0x2029 != cp) {
+                s += n;
+                continue;
+            }
+            smart_str_appendl(out, (const char *)run, (size_t)(s - run));
+            if (0 == n) {
+                smart_str_appendl(out, "\xEF\xBF\xBD", 3);
+                n = 1;
+            } else {
+                smart_str_appendl(
+                    out, 0x2028 == cp ? "\\u2028" : "\\u2029", 6);
+            }
+            s += n;
+            run = s;
+            continue;
+        }
+
+        smart_str_appendl(out, (const char *)run, (size_t)(s - run));
+        switch (c) {
+            case '"':
+                smart_str_appendl(out, "\\\"", 2);
+                break;
+            case '\\':
+                smart_str_appendl(out, "\\\\", 2);
+                break;
+            case '\b':
+                smart_str_appendl(out, "\\b", 2);
+                break;
+            case '\f':
+                smart_str_appendl(out, "\\f", 2);
+                break;
+            case '\n':
+                smart_str_appendl(out, "\\n", 2);
+                break;
+            case '\r':
+                smart_str_appendl(out, "\\r", 2);
+                break;
+            case '\t':
+                smart_str_appendl(out, "\\t", 2);
+                break;
+            default:
+                smart_str_appendl(out, "\\u00", 4);
+                smart_str_appendc(out, digits[c >> 4]);
+                smart_str_appendc(out, digits[c & 0xF]);
+                break;
+        }
+        s++;
+        run = s;
+    }
+    smart_str_appendl(out, (const char *)run, (size_t)(s - run));
+    smart_str_appendc(out, '"');
+}
+
+/* Appends the string for the tsv format, escaping what would end the field
+   or the line. */
+static void tsv_append_string(smart_str *out, const char *s, size_t len) {
+    const char *end = s + len;
+    const char *run = s;
+
+    for (; s < end; s++) {
+        const char *escape;
+        switch (*s) {
+            case '\\':
+                escape = "\\\\";
+                break;
+            case '\t':
+                escape = "\\t";
+                break;
+            case '\n':
+                escape = "\\n";
+                break;
+            case '\r':
+                escape = "\\r";
+                break;
+            default:
+                continue;
+        }
+        smart_str_appendl(out, run, (size_t)(s - run));
+        smart_str_appendl(out, escape, 2);
+        run = s + 1;
+    }
+    smart_str_appendl(out, run, (size_t)(s - run));
+}
+
+static void
+append_string(smart_str *out, const char *s, size_t len, zend_bool tsv) {
+    if (tsv) {
+        tsv_append_string(out, s, len);
+    } else {
+        json_append_string(out, s, len);
+    }
+}
+
+/* Appends a scalar as json_encode() writes the value get() returns for it.
+   Strings are written for the tsv format if tsv is set. */
+static int append_scalar(smart_str *out,
+                         const MMDB_entry_data_s *entry_data,
+                         zend_bool tsv TSRMLS_DC) {
+    if (MMDB_DATA_TYPE_UTF8_STRING == entry_data->type) {
+        append_string(
+            out, entry_data->utf8_string, entry_data->data_size, tsv);
+        return SUCCESS;
+    }
+    if (MMDB_DATA_TYPE_BYTES == entry_data->type) {
+        append_string(out,
+                      (const char *)entry_data->bytes,
+                      entry_data->data_size,
+                      tsv);
+        return SUCCESS;
+    }
+
+    /* The other types only need a string for integers too large for PHP. */
+    zval value;
+    if (handle_entry_data(entry_data, &value TSRMLS_CC) == FAILURE) {
+        return FAILURE;
+    }
+    switch (Z_TYPE(value)) {
+        case IS_LONG:
+            smart_str_append_long(out, Z_LVAL(value));
             break;
-        case MMDB_DATA_TYPE_BOOLEAN:
-            ZVAL_BOOL(z_value, entry_data_list->entry_data.boolean);
+        case IS_DOUBLE:
+            if (zend_finite(Z_DVAL(value))) {
+                char num[PHP_DOUBLE_MAX_LENGTH];
+                php_gcvt(Z_DVAL(value),
+                         (int)PG(serialize_precision),
+                         '.',
+                         'e',
+                         num);
+                smart_str_appends(out, num);
+            } else {
+                /* json_encode() writes 0 with JSON_PARTIAL_OUTPUT_ON_ERROR */
+                smart_str_appendc(out, '0');
+            }
             break;
-        case MMDB_DATA_TYPE_UINT64:
-            handle_uint64(entry_data_list, z_value TSRMLS_CC);
+        case IS_TRUE:
+            smart_str_appendl(out, "true", 4);
             break;
-        case MMDB_DATA_TYPE_UINT128:
-            handle_uint128(entry_data_list, z_value TSRMLS_CC);
+        case IS_FALSE:
+            smart_str_appendl(out, "false", 5);
             break;
-        case MMDB_DATA_TYPE_INT32:
-            ZVAL_LONG(z_value, entry_data_list->entry_data.int32);
+        case IS_STRING:
+            append_string(out, Z_STRVAL(value), Z_STRLEN(value), tsv);
+            zval_ptr_dtor(&value);
             break;
-        default:
-            zend_throw_exception_ex(maxminddb_exception_ce,
-                                    0 TSRMLS_CC,
-                                    "Invalid data type arguments: %d",
-                                    entry_data_list->entry_data.type);
-            return NULL;
     }
-    return entry_data_list;
+    return SUCCESS;
 }
 
-static const MMDB_entry_data_list_s *
-handle_map(const MMDB_entry_data_list_s *entry_data_list,
-           zval *z_value TSRMLS_DC) {
-    array_init(z_value);
-    const uint32_t map_size = entry_data_list->entry_data.data_size;
-
-    uint32_t i;
-    for (i = 0; i < map_size && entry_data_list; i++) {
-        entry_data_list = entry_data_list->next;
-
-        char *key = estrndup(entry_data_list->entry_data.utf8_string,
-                             entry_data_list->entry_data.data_size);
-        if (NULL == key) {
-            zend_throw_exception_ex(maxminddb_exception_ce,
-                                    0 TSRMLS_CC,
-                                    "Invalid data type arguments");
-            return NULL;
+/* Reads the map key at offset, following a pointer, and sets next to the
+   offset of its value. */
+static int json_read_key(const maxminddb_decoder *decoder,
+                         uint32_t offset,
+                         uint32_t *next,
+                         MMDB_entry_data_s *key) {
+    int status = decoder_read(decoder, offset, key);
+    if (MMDB_SUCCESS == status) {
+        *next = key->offset_to_next;
+        if (MMDB_DATA_TYPE_POINTER == key->type) {
+            status = decoder_read(decoder, key->pointer, key);
         }
+    }
+    if (MMDB_SUCCESS == status && MMDB_DATA_TYPE_UTF8_STRING != key->type) {
+        status = MMDB_INVALID_DATA_ERROR;
+    }
+    return status;
+}
 
-        entry_data_list = entry_data_list->next;
-        zval new_value;
-        entry_data_list =
-            handle_entry_data_list(entry_data_list, &new_value TSRMLS_CC);
-        if (entry_data_list != NULL) {
-            add_assoc_zval(z_value, key, &new_value);
+/* Whether the keys of the map are "0", "1", ..., which get() turns into the
+   keys of a list, so that json_encode() writes the map as a JSON array. */
+static zend_bool json_map_is_list(const maxminddb_decoder *decoder,
+                                  const MMDB_entry_data_s *map,
+                                  int depth) {
+    uint32_t offset = map->offset_to_next;
+    uint32_t i;
+    for (i = 0; i < map->data_size; i++) {
+        char index[11];
+        const int len = snprintf(index, sizeof(index), "%" PRIu32, i);
+        MMDB_entry_data_s key;
+        if (json_read_key(decoder, offset, &offset, &key) != MMDB_SUCCESS ||
+            key.data_size != (uint32_t)len ||
+            memcmp(key.utf8_string, index, len) != 0 ||
+            decoder_skip(decoder, offset, &offset, depth) != MMDB_SUCCESS) {
+            return 0;
         }
-        efree(key);
     }
-    return entry_data_list;
+    return 1;
 }
 
-static const MMDB_entry_data_list_s *
-handle_array(const MMDB_entry_data_list_s *entry_data_list,
-             zval *z_value TSRMLS_DC) {
-    const uint32_t size = entry_data_list->entry_data.data_size;
+/* Appends the value at offset as json_encode() writes what get() returns for
+   it, and sets next to the offset after it. Pointers are followed and depth
+   is limited as in decode_value(), and failures are returned the same
+   way. */
+static int json_append_value(const maxminddb_decoder *decoder,
+                             smart_str *out,
+                             uint32_t offset,
+                             uint32_t *next,
+                             int depth TSRMLS_DC) {
+    if (depth >= MAXMINDDB_MAX_DEPTH) {
+        return MMDB_INVALID_DATA_ERROR;
+    }
+    depth++;
+
+    MMDB_entry_data_s entry_data;
+    int status = decoder_read(decoder, offset, &entry_data);
+    if (MMDB_SUCCESS != status) {
+        return status;
+    }
+    *next = entry_data.offset_to_next;
 
-    array_init(z_value);
+    if (MMDB_DATA_TYPE_POINTER == entry_data.type) {
+        status = decoder_read(decoder, entry_data.pointer, &entry_data);
+        if (MMDB_SUCCESS == status &&
+            MMDB_DATA_TYPE_POINTER == entry_data.type) {
+            status = MMDB_INVALID_DATA_ERROR;
+        }
+        if (MMDB_SUCCESS != status) {
+            return status;
+        }
+        depth++;
+    }
 
+    if (decoder->stats) {
+        decoder->stats->values_decoded++;
+    }
+    const uint32_t size = entry_data.data_size;
     uint32_t i;
-    for (i = 0; i < size && entry_data_list; i++) {
-        entry_data_list = entry_data_list->next;
-        zval new_value;
-        entry_data_list =
-            handle_entry_data_list(entry_data_list, &new_value TSRMLS_CC);
-        if (entry_data_list != NULL) {
-            add_next_index_zval(z_value, &new_value);
+    offset = entry_data.offset_to_next;
+    switch (entry_data.type) {
+        case MMDB_DATA_TYPE_MAP: {
+            /* get() returns an empty or list-like map as a list, which
+               json_encode() writes as a JSON array. */
+            const zend_bool list =
+                0 == size || json_map_is_list(decoder, &entry_data, depth);
+            smart_str_appendc(out, list ? '[' : '{');
+            for (i = 0; i < size; i++) {
+                MMDB_entry_data_s key;
+                status = json_read_key(decoder, offset, &offset, &key);
+                if (MMDB_SUCCESS != status) {
+                    return status;
+                }
+                if (decoder->stats) {
+                    decoder->stats->values_decoded++;
+                    decoder->stats->bytes_decoded += key.data_size;
+                }
+                if (i > 0) {
+                    smart_str_appendc(out, ',');
+                }
+                if (!list) {
+                    json_append_string(out, key.utf8_string, key.data_size);
+                    smart_str_appendc(out, ':');
+                }
+                status = json_append_value(
+                    decoder, out, offset, &offset, depth TSRMLS_CC);
+                if (MMDB_SUCCESS != status) {
+                    return status;
+                }
+            }
+            smart_str_appendc(out, list ? ']' : '}');
+            break;
         }
+        case MMDB_DATA_TYPE_ARRAY:
+            smart_str_appendc(out, '[');
+            for (i = 0; i < size; i++) {
+                if (i > 0) {
+                    smart_str_appendc(out, ',');
+                }
+                status = json_append_value(
+                    decoder, out, offset, &offset, depth TSRMLS_CC);
+                if (MMDB_SUCCESS != status) {
+                    return status;
+                }
+            }
+            smart_str_appendc(out, ']');
+            break;
+        default:
+            if (decoder->stats) {
+                decoder->stats->bytes_decoded += size;
+            }
+            if (append_scalar(out, &entry_data, 0 TSRMLS_CC) == FAILURE) {
+                return MAXMINDDB_DECODE_THROWN;
+            }
+            return MMDB_SUCCESS;
     }
-    return entry_data_list;
+    return MMDB_SUCCESS;
 }
 
-static void handle_uint128(const MMDB_entry_data_list_s *entry_data_list,
-                           zval *z_value TSRMLS_DC) {
-    uint64_t high = 0;
-    uint64_t low = 0;
-#if MMDB_UINT128_IS_BYTE_ARRAY
+/* Appends the map or array at the entry as JSON. */
+static int append_entry(maxminddb_obj *mmdb_obj,
+                        smart_str *out,
+                        const MMDB_entry_s *entry TSRMLS_DC) {
+    const maxminddb_decoder decoder = {
+        .data = mmdb_obj->mmdb->data_section,
+        .size = mmdb_obj->mmdb->data_section_size,
+        .stats = reader_stats(mmdb_obj)};
+    uint32_t next;
+    int status =
+        json_append_value(&decoder, out, entry->offset, &next, 0 TSRMLS_CC);
+    if (MMDB_SUCCESS != status) {
+        if (MAXMINDDB_DECODE_THROWN != status) {
+            zend_throw_exception_ex(
+                maxminddb_exception_ce,
+                0 TSRMLS_CC,
+                "Error while decoding data at offset %u. %s",
+                entry->offset,
+                MMDB_strerror(status));
+        }
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/* Appends the value of each field, as JSON or for the tsv format. */
+static int append_fields(maxminddb_obj *mmdb_obj,
+                         smart_str *out,
+                         const maxminddb_enrich_options *options,
+                         const MMDB_lookup_result_s *result,
+                         const char *ip_address TSRMLS_DC) {
+    const zend_bool tsv = options->tsv;
+    if (!tsv) {
+        smart_str_appendc(out, options->fields_list ? '[' : '{');
+    }
+
+    size_t i = 0;
+    zend_ulong index;
+    zend_string *key;
+    ZEND_HASH_FOREACH_KEY(options->fields, index, key) {
+        if (tsv) {
+            smart_str_appendc(out, '\t');
+        } else if (i > 0) {
+            smart_str_appendc(out, ',');
+        }
+        if (!tsv && !options->fields_list) {
+            if (key) {
+                json_append_string(out, ZSTR_VAL(key), ZSTR_LEN(key));
+            } else {
+                smart_str_appendc(out, '"');
+                smart_str_append_long(out, (zend_long)index);
+                smart_str_appendc(out, '"');
+            }
+            smart_str_appendc(out, ':');
+        }
+
+        MMDB_entry_data_s entry_data;
+        int status =
+            MMDB_aget_value(&result->entry, &entry_data, options->paths[i++]);
+        if (MMDB_SUCCESS == status && entry_data.has_data) {
+            if (MMDB_DATA_TYPE_MAP == entry_data.type ||
+                MMDB_DATA_TYPE_ARRAY == entry_data.type) {
+                MMDB_entry_s entry = {.mmdb = mmdb_obj->mmdb,
+                                      .offset = entry_data.offset};
+                if (append_entry(mmdb_obj, out, &entry TSRMLS_CC) ==
+                    FAILURE) {
+                    return FAILURE;
+                }
+            } else if (append_scalar(out, &entry_data, tsv TSRMLS_CC) ==
+                       FAILURE) {
+                return FAILURE;
+            }
+        } else if (MMDB_SUCCESS == status ||
+                   MMDB_LOOKUP_PATH_DOES_NOT_MATCH_DATA_ERROR == status ||
+                   MMDB_INVALID_LOOKUP_PATH_ERROR == status) {
+            /* The path is not in this record. */
+            if (!tsv) {
+                smart_str_appendl(out, "null", 4);
+            }
+        } else {
+            zend_throw_exception_ex(maxminddb_exception_ce,
+                                    0 TSRMLS_CC,
+                                    "Error while looking up data for %s. %s",
+                                    ip_address,
+                                    MMDB_strerror(status));
+            return FAILURE;
+        }
+    }
+    ZEND_HASH_FOREACH_END();
+
+    if (!tsv) {
+        smart_str_appendc(out, options->fields_list ? ']' : '}');
+    }
+    return SUCCESS;
+}
+
+/* Looks up the address on one line of enrichStream()'s input and appends the
+   line of output for it. Blank lines are skipped. */
+static int enrich_line(maxminddb_obj *mmdb_obj,
+                       smart_str *out,
+                       const maxminddb_enrich_options *options,
+                       char *line,
+                       size_t len,
+                       zend_bool *written TSRMLS_DC) {
+    while (len > 0 && ('\n' == line[len - 1] || '\r' == line[len - 1])) {
+        len--;
+    }
+    *written = len > 0;
+    if (0 == len) {
+        return SUCCESS;
+    }
+
+    char *end = line + len;
+    char *address = line;
+    zend_long column;
+    for (column = options->column; column > 0 && address < end; column--) {
+        char *delimiter = memchr(address, options->delimiter, end - address);
+        address = delimiter ? delimiter + 1 : end;
+    }
+    if (options->column >= 0) {
+        char *delimiter = memchr(address, options->delimiter, end - address);
+        if (delimiter) {
+            end = delimiter;
+        }
+    }
+    while (address < end && (' ' == *address || '\t' == *address)) {
+        address++;
+    }
+    while (end > address && (' ' == end[-1] || '\t' == end[-1])) {
+        end--;
+    }
+    /* The line is ours to change, and is followed by at least its NUL. */
+    *end = '\0';
+
+    struct sockaddr_storage sockaddr;
+    MMDB_lookup_result_s result;
+    int prefix_len = 0;
+    memset(&result, 0, sizeof(result));
+    if (parse_ip_address(address, &sockaddr TSRMLS_CC) == FAILURE) {
+        count_invalid_address(mmdb_obj);
+    } else {
+        lookup_entry(mmdb_obj,
+                     (const struct sockaddr *)&sockaddr,
+                     address,
+                     &result,
+                     &prefix_len TSRMLS_CC);
+    }
+    if (EG(exception)) {
+        /* Addresses that cannot be looked up are written without a record;
+           errors reading the database end the stream. */
+        if (!instanceof_function(EG(exception)->ce,
+                                 spl_ce_InvalidArgumentException)) {
+            return FAILURE;
+        }
+        zend_clear_exception();
+        result.found_entry = 0;
+    }
+
+    if (options->tsv) {
+        tsv_append_string(out, address, (size_t)(end - address));
+    } else {
+        smart_str_appendl(out, "{\"ip\":", 6);
+        json_append_string(out, address, (size_t)(end - address));
+        smart_str_appendl(out, ",\"record\":", 10);
+    }
+
+    int status = SUCCESS;
+    if (!result.found_entry) {
+        if (options->tsv) {
+            uint32_t i;
+            for (i = 0; i < zend_hash_num_elements(options->fields); i++) {
+                smart_str_appendc(out, '\t');
+            }
+        } else {
+            smart_str_appendl(out, "null", 4);
+        }
+    } else if (options->fields) {
+        status = append_fields(
+            mmdb_obj, out, options, &result, address TSRMLS_CC);
+    } else {
+        status = append_entry(mmdb_obj, out, &result.entry TSRMLS_CC);
+    }
+
+    if (!options->tsv) {
+        smart_str_appendc(out, '}');
+    }
+    smart_str_appendc(out, '\n');
+    return status;
+}
+
+/* Parses the options of enrichStream() and builds the lookup paths of the
+   fields. */
+static int parse_enrich_options(zval *z_options,
+                                maxminddb_enrich_options *options TSRMLS_DC) {
+    memset(options, 0, sizeof(*options));
+    options->column = -1;
+    options->delimiter = '\t';
+
+    if (z_options) {
+        zend_ulong index;
+        zend_string *name;
+        zval *value;
+        ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(z_options), index, name, value) {
+            ZVAL_DEREF(value);
+            const char *error = NULL;
+            if (name && zend_string_equals_literal(name, "format")) {
+                if (Z_TYPE_P(value) == IS_STRING &&
+                    zend_string_equals_literal(Z_STR_P(value), "tsv")) {
+                    options->tsv = 1;
+                } else if (Z_TYPE_P(value) == IS_STRING &&
+                           zend_string_equals_literal(Z_STR_P(value),
+                                                      "jsonl")) {
+                    options->tsv = 0;
+                } else {
+                    error = "The format must be \"jsonl\" or \"tsv\".";
+                }
+            } else if (name && zend_string_equals_literal(name, "fields")) {
+                if (Z_TYPE_P(value) == IS_ARRAY) {
+                    options->fields = Z_ARRVAL_P(value);
+                } else {
+                    error = "The fields must be an array of paths.";
+                }
+            } else if (name && zend_string_equals_literal(name, "column")) {
+                if (Z_TYPE_P(value) == IS_NULL) {
+                    options->column = -1;
+                } else if (Z_TYPE_P(value) == IS_LONG &&
+                           Z_LVAL_P(value) >= 0) {
+                    options->column = Z_LVAL_P(value);
+                } else {
+                    error = "The column must be a non-negative integer.";
+                }
+            } else if (name &&
+                       zend_string_equals_literal(name, "delimiter")) {
+                if (Z_TYPE_P(value) == IS_STRING && Z_STRLEN_P(value) == 1) {
+                    options->delimiter = Z_STRVAL_P(value)[0];
+                } else {
+                    error = "The delimiter must be a single character.";
+                }
+            } else {
+                throw_unknown_option(index, name TSRMLS_CC);
+                return FAILURE;
+            }
+            if (error) {
+                zend_throw_exception_ex(spl_ce_InvalidArgumentException,
+                                        0 TSRMLS_CC,
+                                        "%s",
+                                        error);
+                return FAILURE;
+            }
+        }
+        ZEND_HASH_FOREACH_END();
+    }
+
+    if (NULL == options->fields) {
+        if (options->tsv) {
+            zend_throw_exception_ex(spl_ce_InvalidArgumentException,
+                                    0 TSRMLS_CC,
+                                    "The tsv format requires fields.");
+            return FAILURE;
+        }
+        return SUCCESS;
+    }
+
+    options->paths = (const char ***)safe_emalloc(
+        zend_hash_num_elements(options->fields) + 1, sizeof(char **), 0);
+    options->fields_list = 1;
+
+    size_t i = 0;
+    zend_ulong index;
+    zend_string *key;
+    zval *path;
+    ZEND_HASH_FOREACH_KEY_VAL(options->fields, index, key, path) {
+        if (key || index != i) {
+            options->fields_list = 0;
+        }
+        ZVAL_DEREF(path);
+        options->paths[i] = build_lookup_path(path TSRMLS_CC);
+        if (NULL == options->paths[i]) {
+            while (i > 0) {
+                efree(options->paths[--i]);
+            }
+            efree(options->paths);
+            options->paths = NULL;
+            return FAILURE;
+        }
+        i++;
+    }
+    ZEND_HASH_FOREACH_END();
+    return SUCCESS;
+}
+
+static php_stream *enrich_stream(zval *z_stream, const char *name TSRMLS_DC) {
+    php_stream *stream = NULL;
+    if (Z_TYPE_P(z_stream) == IS_RESOURCE) {
+        /* No type name, so that a resource of another type is not an
+           error here. */
+        stream = (php_stream *)zend_fetch_resource2(Z_RES_P(z_stream),
+                                                    NULL,
+                                                    php_file_le_stream(),
+                                                    php_file_le_pstream());
+    }
+    if (NULL == stream) {
+        zend_throw_exception_ex(spl_ce_InvalidArgumentException,
+                                0 TSRMLS_CC,
+                                "The %s must be a stream.",
+                                name);
+    }
+    return stream;
+}
+
+/* Writes out what has been collected, keeping the buffer for reuse. */
+static int enrich_flush(php_stream *stream, smart_str *out TSRMLS_DC) {
+    if (NULL == out->s || 0 == ZSTR_LEN(out->s)) {
+        return SUCCESS;
+    }
+    if ((size_t)php_stream_write(stream, ZSTR_VAL(out->s), ZSTR_LEN(out->s)) !=
+        ZSTR_LEN(out->s)) {
+        zend_throw_exception_ex(spl_ce_RuntimeException,
+                                0 TSRMLS_CC,
+                                "Unable to write to the output stream.");
+        return FAILURE;
+    }
+    ZSTR_LEN(out->s) = 0;
+    return SUCCESS;
+}
+
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_maxminddbreader_enrichStream, 0, 2, IS_LONG, 0)
+ZEND_ARG_INFO(0, input)
+ZEND_ARG_INFO(0, output)
+ZEND_ARG_TYPE_INFO(0, options, IS_ARRAY, 0)
+ZEND_END_ARG_INFO()
+
+/* Looks up the address on each line of the input and writes its record to the
+   output, encoding the records straight from the database's entries rather
+   than through PHP values. */
+PHP_METHOD(MaxMind_Db_Reader, enrichStream) {
+    zval *z_input = NULL;
+    zval *z_output = NULL;
+    zval *z_options = NULL;
+    zval *this_zval = NULL;
+
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "Ozz|a",
+                                     &this_zval,
+                                     maxminddb_ce,
+                                     &z_input,
+                                     &z_output,
+                                     &z_options) == FAILURE) {
+        return;
+    }
+
+    maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
+
+    CHECK_NOT_CLOSED(mmdb_obj->mmdb, );
+
+    php_stream *input = enrich_stream(z_input, "input" TSRMLS_CC);
+    if (NULL == input) {
+        return;
+    }
+    php_stream *output = enrich_stream(z_output, "output" TSRMLS_CC);
+    if (NULL == output) {
+        return;
+    }
+
+    maxminddb_enrich_options options;
+    if (parse_enrich_options(z_options, &options TSRMLS_CC) == FAILURE) {
+        return;
+    }
+
+    smart_str out = {0};
+    zend_long lines = 0;
+    int status = SUCCESS;
+    /* The length of the whole lines in the buffer. */
+    size_t complete = 0;
+    char *line;
+    size_t len;
+    while (SUCCESS == status &&
+           (line = php_stream_get_line(input, NULL, 0, &len)) != NULL) {
+        zend_bool written;
+        status = enrich_line(
+            mmdb_obj, &out, &options, line, len, &written TSRMLS_CC);
+        efree(line);
+        if (FAILURE == status) {
+            /* Write out the lines before the one that failed, so that the
+               output ends with a whole line. The exception is already
+               thrown, so a failed write is not reported. */
+            if (complete > 0) {
+                php_stream_write(output, ZSTR_VAL(out.s), complete);
+            }
+            break;
+        }
+        if (written) {
+            lines++;
+        }
+        if (out.s && ZSTR_LEN(out.s) >= MAXMINDDB_OUTPUT_BUFFER_SIZE) {
+            status = enrich_flush(output, &out TSRMLS_CC);
+        }
+        complete = out.s ? ZSTR_LEN(out.s) : 0;
+    }
+    if (SUCCESS == status) {
+        status = enrich_flush(output, &out TSRMLS_CC);
+    }
+
+    smart_str_free(&out);
+    if (options.paths) {
+        uint32_t i;
+        for (i = 0; i < zend_hash_num_elements(options.fields); i++) {
+            efree(options.paths[i]);
+        }
+        efree(options.paths);
+    }
+    if (SUCCESS == status) {
+        RETURN_LONG(lines);
+    }
+}
+
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_maxminddbreader_enableRecordCache, 0, 1, IS_VOID, 0)
+ZEND_ARG_TYPE_INFO(0, capacity, IS_LONG, 0)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(MaxMind_Db_Reader, enableRecordCache) {
+    zend_long capacity;
+    zval *this_zval = NULL;
+
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "Ol",
+                                     &this_zval,
+                                     maxminddb_ce,
+                                     &capacity) == FAILURE) {
+        return;
+    }
+
+    maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
+
+    CHECK_NOT_CLOSED(mmdb_obj->mmdb, );
+
+    if (capacity < 0) {
+        zend_throw_exception_ex(
+            spl_ce_InvalidArgumentException,
+            0 TSRMLS_CC,
+            "The record cache capacity must not be negative.");
+        return;
+    }
+
+    if (mmdb_obj->record_cache) {
+        cache_destroy(mmdb_obj->record_cache);
+        mmdb_obj->record_cache = NULL;
+    }
+#if ZEND_LONG_MAX > UINT32_MAX
+    if (capacity > UINT32_MAX) {
+        capacity = UINT32_MAX;
+    }
+#endif
+    if (capacity > 0) {
+        mmdb_obj->record_cache = cache_create((uint32_t)capacity);
+    }
+}
+
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_maxminddbreader_cacheStats, 0, 0, IS_ARRAY, 0)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(MaxMind_Db_Reader, recordCacheStats) {
+    zval *this_zval = NULL;
+
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "O",
+                                     &this_zval,
+                                     maxminddb_ce) == FAILURE) {
+        return;
+    }
+
+    const maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
+    cache_stats(mmdb_obj->record_cache, return_value);
+}
+
+PHP_METHOD(MaxMind_Db_Reader, enableAddressCache) {
+    zend_long capacity;
+    zval *this_zval = NULL;
+
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "Ol",
+                                     &this_zval,
+                                     maxminddb_ce,
+                                     &capacity) == FAILURE) {
+        return;
+    }
+
+    maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
+
+    CHECK_NOT_CLOSED(mmdb_obj->mmdb, );
+
+    if (capacity < 0) {
+        zend_throw_exception_ex(
+            spl_ce_InvalidArgumentException,
+            0 TSRMLS_CC,
+            "The address cache capacity must not be negative.");
+        return;
+    }
+
+    if (mmdb_obj->address_cache) {
+        cache_destroy(mmdb_obj->address_cache);
+        mmdb_obj->address_cache = NULL;
+    }
+#if ZEND_LONG_MAX > UINT32_MAX
+    if (capacity > UINT32_MAX) {
+        capacity = UINT32_MAX;
+    }
+#endif
+    if (capacity > 0) {
+        mmdb_obj->address_cache = cache_create((uint32_t)capacity);
+    }
+}
+
+PHP_METHOD(MaxMind_Db_Reader, addressCacheStats) {
+    zval *this_zval = NULL;
+
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "O",
+                                     &this_zval,
+                                     maxminddb_ce) == FAILURE) {
+        return;
+    }
+
+    const maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
+    cache_stats(mmdb_obj->address_cache, return_value);
+}
+
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_maxminddbreader_stats, 0, 0, IS_ARRAY, 0)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(MaxMind_Db_Reader, stats) {
+    zval *this_zval = NULL;
+
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "O",
+                                     &this_zval,
+                                     maxminddb_ce) == FAILURE) {
+        return;
+    }
+
+    const maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
+    maxminddb_stats none;
+    const maxminddb_stats *stats = mmdb_obj->stats;
+    if (NULL == stats) {
+        memset(&none, 0, sizeof(none));
+        stats = &none;
+    }
+
+    zval depths;
+    array_init(&depths);
     int i;
-    for (i = 0; i < 8; i++) {
-        high = (high << 8) | entry_data_list->entry_data.uint128[i];
+    for (i = 0; i < 129; i++) {
+        if (stats->depths[i]) {
+            add_index_long(&depths, i, (zend_long)stats->depths[i]);
+        }
+    }
+
+    array_init_size(return_value, 8);
+    add_assoc_bool(return_value, "enabled", maxminddb_stats_enabled);
+    add_assoc_long(return_value, "lookups", (zend_long)stats->lookups);
+    add_assoc_long(return_value, "not_found", (zend_long)stats->not_found);
+    add_assoc_long(
+        return_value, "invalid_addresses", (zend_long)stats->invalid_addresses);
+    add_assoc_zval(return_value, "depths", &depths);
+    add_assoc_long(
+        return_value, "bytes_decoded", (zend_long)stats->bytes_decoded);
+    add_assoc_long(
+        return_value, "values_decoded", (zend_long)stats->values_decoded);
+    add_assoc_double(
+        return_value, "lookup_time", (double)stats->lookup_ns / 1e9);
+}
+
+PHP_METHOD(MaxMind_Db_Reader, resetStats) {
+    zval *this_zval = NULL;
+
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "O",
+                                     &this_zval,
+                                     maxminddb_ce) == FAILURE) {
+        return;
+    }
+
+    stats_flush((maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS));
+}
+
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_maxminddbreader_reloadIfChanged, 0, 0, _IS_BOOL, 0)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(MaxMind_Db_Reader, reloadIfChanged) {
+    zval *this_zval = NULL;
+
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "O",
+                                     &this_zval,
+                                     maxminddb_ce) == FAILURE) {
+        return;
+    }
+
+    maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
+
+    CHECK_NOT_CLOSED(mmdb_obj->mmdb, );
+
+    /* A file that has gone missing is most likely being replaced. Keep using
+       the one that is open until its replacement appears. */
+    const char *db_file = ZSTR_VAL(mmdb_obj->path);
+    zend_stat_t st;
+    if (0 != VCWD_STAT(db_file, &st) ||
+        !handle_is_stale(mmdb_obj->handle, &st)) {
+        RETURN_FALSE;
+    }
+
+    int status = MMDB_SUCCESS;
+    maxminddb_handle *handle;
+    if (!mmdb_obj->handle->persistent) {
+        handle = handle_open(db_file, 0, &st, &status);
+#ifdef ZTS
+    } else if (mmdb_obj->handle->shared_path) {
+        handle = shared_acquire(db_file, &st, &status);
+#endif
+    } else {
+        handle = registry_acquire(db_file, &status TSRMLS_CC);
+    }
+
+    if (NULL == handle) {
+        zend_throw_exception_ex(
+            maxminddb_exception_ce,
+            0 TSRMLS_CC,
+            "Error opening database file (%s). Is this a valid "
+            "MaxMind DB file?",
+            db_file);
+        return;
+    }
+    if ((!handle->persistent || handle->shared_path) &&
+        handle_apply_options(handle, &mmdb_obj->options, db_file TSRMLS_CC) ==
+            FAILURE) {
+        handle_release(handle);
+        return;
+    }
+    if (handle == mmdb_obj->handle) {
+        handle_release(handle);
+        RETURN_FALSE;
+    }
+
+    /* Iterators from networks() hold their own references, so the old
+       mapping stays open until the last of them is done with it. */
+    handle_release(mmdb_obj->handle);
+    mmdb_obj->handle = handle;
+    mmdb_obj->mmdb = &handle->mmdb;
+
+    discard_derived_state(mmdb_obj);
+    if (mmdb_obj->record_cache) {
+        const uint32_t capacity = mmdb_obj->record_cache->capacity;
+        cache_destroy(mmdb_obj->record_cache);
+        mmdb_obj->record_cache = cache_create(capacity);
+    }
+    if (mmdb_obj->address_cache) {
+        const uint32_t capacity = mmdb_obj->address_cache->capacity;
+        cache_destroy(mmdb_obj->address_cache);
+        mmdb_obj->address_cache = cache_create(capacity);
+    }
+
+    RETURN_TRUE;
+}
+
+ZEND_BEGIN_ARG_WITH_RETURN_OBJ_INFO_EX(
+    arginfo_maxminddbreader_networks, 0, 0, Iterator, 0)
+ZEND_ARG_TYPE_INFO(0, options, IS_ARRAY, 0)
+ZEND_END_ARG_INFO()
+
+/* Parses the options of networks() and networksWithin(). */
+static int parse_network_options(zval *options,
+                                 zend_bool *include_aliased,
+                                 zend_bool *skip_empty TSRMLS_DC) {
+    *include_aliased = 0;
+    *skip_empty = 0;
+    if (NULL == options) {
+        return SUCCESS;
+    }
+
+    zend_ulong index;
+    zend_string *name;
+    zval *value;
+    ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(options), index, name, value) {
+        if (name &&
+            zend_string_equals_literal(name, "includeAliasedNetworks")) {
+            *include_aliased = zend_is_true(value);
+        } else if (name &&
+                   zend_string_equals_literal(name, "skipEmptyValues")) {
+            *skip_empty = zend_is_true(value);
+        } else {
+            throw_unknown_option(index, name TSRMLS_CC);
+            return FAILURE;
+        }
+    }
+    ZEND_HASH_FOREACH_END();
+    return SUCCESS;
+}
+
+/* Returns an iterator that walks the tree from start. */
+static void network_iterator_init(zval *return_value,
+                                  maxminddb_handle *handle,
+                                  const maxminddb_network *start,
+                                  zend_bool include_aliased,
+                                  zend_bool skip_empty TSRMLS_DC) {
+    object_init_ex(return_value, network_iterator_ce);
+    maxminddb_network_iterator_obj *it = Z_NETWORK_ITERATOR_P(return_value);
+
+    handle_retain(handle);
+    it->handle = handle;
+    it->records = cache_create(MAXMINDDB_NETWORK_RECORDS_SIZE);
+    ALLOC_HASHTABLE(it->keys);
+    zend_hash_init(it->keys, 64, NULL, ZVAL_PTR_DTOR, 0);
+    it->include_aliased = include_aliased;
+    it->skip_empty = skip_empty;
+    it->start = *start;
+
+    MMDB_s *mmdb = &it->handle->mmdb;
+    it->ipv4_start = UINT64_MAX;
+    if (6 == mmdb->metadata.ip_version) {
+        uint16_t depth;
+        it->ipv4_start = find_ipv4_start(mmdb, &depth);
+    }
+
+    network_iterator_rewind(it);
+    network_iterator_advance(it TSRMLS_CC);
+}
+
+PHP_METHOD(MaxMind_Db_Reader, networks) {
+    zval *options = NULL;
+    zval *this_zval = NULL;
+
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "O|a",
+                                     &this_zval,
+                                     maxminddb_ce,
+                                     &options) == FAILURE) {
+        return;
+    }
+
+    const maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
+
+    CHECK_NOT_CLOSED(mmdb_obj->mmdb, );
+
+    zend_bool include_aliased;
+    zend_bool skip_empty;
+    if (parse_network_options(
+            options, &include_aliased, &skip_empty TSRMLS_CC) == FAILURE) {
+        return;
+    }
+
+    maxminddb_network start;
+    memset(&start, 0, sizeof(start));
+    network_iterator_init(return_value,
+                          mmdb_obj->handle,
+                          &start,
+                          include_aliased,
+                          skip_empty TSRMLS_CC);
+}
+
+/* Clears the address bits past the first depth. */
+static void mask_network(uint8_t ip[16], uint16_t depth) {
+    int i;
+    for (i = 0; i < 16; i++) {
+        int bits = (int)depth - i * 8;
+        if (bits <= 0) {
+            ip[i] = 0;
+        } else if (bits < 8) {
+            ip[i] &= (uint8_t)(0xFF << (8 - bits));
+        }
+    }
+}
+
+/* Parses a network in CIDR notation into the address bits the database's
+   tree uses for it and their count. An IPv4 network in an IPv6 database is
+   the matching network in ::/96. */
+static int parse_network(const char *network,
+                         const MMDB_s *mmdb,
+                         uint8_t ip[16],
+                         uint16_t *depth TSRMLS_DC) {
+    char address[INET6_ADDRSTRLEN];
+    const char *slash = strchr(network, '/');
+    size_t address_len = slash ? (size_t)(slash - network) : 0;
+    int bit_count = 0;
+
+    memset(ip, 0, 16);
+    if (address_len > 0 && address_len < sizeof(address)) {
+        memcpy(address, network, address_len);
+        address[address_len] = '\0';
+        if (inet_pton(AF_INET, address, ip + 12) == 1) {
+            bit_count = 32;
+        } else if (inet_pton(AF_INET6, address, ip) == 1) {
+            bit_count = 128;
+        }
+    }
+
+    char *end = NULL;
+    long prefix_len = -1;
+    if (bit_count && slash[1] >= '0' && slash[1] <= '9') {
+        prefix_len = strtol(slash + 1, &end, 10);
+    }
+    if (prefix_len < 0 || prefix_len > bit_count || '\0' != *end) {
+        zend_throw_exception_ex(spl_ce_InvalidArgumentException,
+                                0 TSRMLS_CC,
+                                "The value \"%s\" is not a valid network.",
+                                network);
+        return FAILURE;
+    }
+
+    if (4 == mmdb->metadata.ip_version) {
+        if (128 == bit_count) {
+            zend_throw_exception_ex(
+                spl_ce_InvalidArgumentException,
+                0 TSRMLS_CC,
+                "Error looking up %s. You attempted to look up an IPv6 "
+                "address in an IPv4-only database.",
+                network);
+            return FAILURE;
+        }
+        memmove(ip, ip + 12, 4);
+        memset(ip + 4, 0, 12);
+        *depth = (uint16_t)prefix_len;
+    } else {
+        *depth = (uint16_t)(32 == bit_count ? prefix_len + 96 : prefix_len);
+    }
+    mask_network(ip, *depth);
+    return SUCCESS;
+}
+
+ZEND_BEGIN_ARG_WITH_RETURN_OBJ_INFO_EX(
+    arginfo_maxminddbreader_networksWithin, 0, 1, Iterator, 0)
+ZEND_ARG_TYPE_INFO(0, network, IS_STRING, 0)
+ZEND_ARG_TYPE_INFO(0, options, IS_ARRAY, 0)
+ZEND_END_ARG_INFO()
+
+/* Like networks(), but only walks the subtree of the given network. If the
+   database has a record for a larger network containing it, that network is
+   the only one returned. */
+PHP_METHOD(MaxMind_Db_Reader, networksWithin) {
+    char *network = NULL;
+    strsize_t network_len;
+    zval *options = NULL;
+    zval *this_zval = NULL;
+
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "Os|a",
+                                     &this_zval,
+                                     maxminddb_ce,
+                                     &network,
+                                     &network_len,
+                                     &options) == FAILURE) {
+        return;
+    }
+
+    const maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
+
+    CHECK_NOT_CLOSED(mmdb_obj->mmdb, );
+
+    zend_bool include_aliased;
+    zend_bool skip_empty;
+    if (parse_network_options(
+            options, &include_aliased, &skip_empty TSRMLS_CC) == FAILURE) {
+        return;
+    }
+
+    MMDB_s *mmdb = mmdb_obj->mmdb;
+    maxminddb_network start;
+    uint16_t prefix_len;
+    memset(&start, 0, sizeof(start));
+    if (parse_network(network, mmdb, start.ip, &prefix_len TSRMLS_CC) ==
+        FAILURE) {
+        return;
+    }
+
+    /* Follow the network's bits until they run out or reach a record. */
+    const uint64_t node_count = mmdb->metadata.node_count;
+    while (start.depth < prefix_len && start.node < node_count) {
+        MMDB_search_node_s search_node;
+        int status = MMDB_read_node(mmdb, (uint32_t)start.node, &search_node);
+        if (MMDB_SUCCESS != status) {
+            zend_throw_exception_ex(
+                maxminddb_exception_ce,
+                0 TSRMLS_CC,
+                "Error reading search tree node %" PRIu64 ". %s",
+                start.node,
+                MMDB_strerror(status));
+            return;
+        }
+        const int bit =
+            (start.ip[start.depth >> 3] >> (7 - (start.depth & 7))) & 1;
+        start.node = bit ? search_node.right_record : search_node.left_record;
+        start.depth++;
+    }
+    mask_network(start.ip, start.depth);
+
+    network_iterator_init(return_value,
+                          mmdb_obj->handle,
+                          &start,
+                          include_aliased,
+                          skip_empty TSRMLS_CC);
+}
+
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_maxminddbreader_verify, 0, 0, IS_ARRAY, 0)
+ZEND_ARG_TYPE_INFO(0, options, IS_ARRAY, 0)
+ZEND_END_ARG_INFO()
+
+/* Parses the options of verify(). */
+static int parse_verify_options(zval *options,
+                                uint32_t *max_problems,
+                                uint32_t *threads TSRMLS_DC) {
+    *max_problems = 100;
+    *threads = 1;
+    if (NULL == options) {
+        return SUCCESS;
+    }
+
+    zend_ulong index;
+    zend_string *name;
+    zval *value;
+    ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(options), index, name, value) {
+        ZVAL_DEREF(value);
+        const char *error = NULL;
+        if (name && zend_string_equals_literal(name, "maxProblems")) {
+            if (Z_TYPE_P(value) == IS_LONG && Z_LVAL_P(value) > 0) {
+                *max_problems = (uint64_t)Z_LVAL_P(value) > UINT32_MAX
+                                    ? UINT32_MAX
+                                    : (uint32_t)Z_LVAL_P(value);
+            } else {
+                error =
+                    "The maximum number of problems must be a positive "
+                    "integer.";
+            }
+        } else if (name && zend_string_equals_literal(name, "threads")) {
+            if (Z_TYPE_P(value) == IS_LONG && Z_LVAL_P(value) > 0) {
+                *threads = (uint32_t)MIN(Z_LVAL_P(value),
+                                         MAXMINDDB_VERIFY_MAX_THREADS);
+            } else {
+                error = "The number of threads must be a positive integer.";
+            }
+        } else {
+            throw_unknown_option(index, name TSRMLS_CC);
+            return FAILURE;
+        }
+        if (error) {
+            zend_throw_exception_ex(
+                spl_ce_InvalidArgumentException, 0 TSRMLS_CC, "%s", error);
+            return FAILURE;
+        }
+    }
+    ZEND_HASH_FOREACH_END();
+    return SUCCESS;
+}
+
+PHP_METHOD(MaxMind_Db_Reader, verify) {
+    zval *options = NULL;
+    zval *this_zval = NULL;
+
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "O|a",
+                                     &this_zval,
+                                     maxminddb_ce,
+                                     &options) == FAILURE) {
+        return;
+    }
+
+    const maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
+
+    CHECK_NOT_CLOSED(mmdb_obj->mmdb, );
+
+    uint32_t max_problems;
+    uint32_t threads;
+    if (parse_verify_options(options, &max_problems, &threads TSRMLS_CC) ==
+        FAILURE) {
+        return;
+    }
+
+    verify_database(mmdb_obj->mmdb, max_problems, threads, return_value);
+}
+
+/* Moves the pending exception into errors under the entry's key, or simply
+   discards it if the caller did not ask for errors. As in the pure PHP
+   reader, only the exceptions a lookup throws for an invalid address or an
+   invalid database are taken; any other is left pending, and FAILURE is
+   returned so that the caller gives up on the batch. */
+static int
+take_exception(zval *errors, zend_ulong index, zend_string *key TSRMLS_DC) {
+    zend_class_entry *ce = EG(exception)->ce;
+    if (!instanceof_function(ce, spl_ce_InvalidArgumentException) &&
+        !instanceof_function(ce, maxminddb_exception_ce)) {
+        return FAILURE;
+    }
+
+    zval ex;
+
+    ZVAL_OBJ(&ex, EG(exception));
+    Z_ADDREF(ex);
+    zend_clear_exception();
+
+    if (NULL == errors) {
+        zval_ptr_dtor(&ex);
+    } else if (key) {
+        zend_hash_update(Z_ARRVAL_P(errors), key, &ex);
+    } else {
+        zend_hash_index_update(Z_ARRVAL_P(errors), index, &ex);
+    }
+    return SUCCESS;
+}
+
+/* Looks up an address for getMany() through a subclass's override of
+   getWithPrefixLen(), which the pure PHP reader calls for each address. */
+static int get_many_override(zval *object,
+                             zend_function *override,
+                             zval *ip_address,
+                             zval *record,
+                             int *prefix_len TSRMLS_DC) {
+    zval result;
+    zend_call_method_with_1_params(PROP_OBJ(object),
+                                   Z_OBJCE_P(object),
+                                   &override,
+                                   "getwithprefixlen",
+                                   &result,
+                                   ip_address);
+    if (EG(exception)) {
+        zval_ptr_dtor(&result);
+        return FAILURE;
+    }
+
+    zval *value = NULL;
+    zval *len = NULL;
+    if (Z_TYPE(result) == IS_ARRAY) {
+        value = zend_hash_index_find(Z_ARRVAL(result), 0);
+        len = zend_hash_index_find(Z_ARRVAL(result), 1);
+    }
+    if (value) {
+        ZVAL_COPY(record, value);
+    } else {
+        ZVAL_NULL(record);
+    }
+    *prefix_len = len ? (int)zval_get_long(len) : 0;
+    zval_ptr_dtor(&result);
+    return SUCCESS;
+}
+
+static void get_many(INTERNAL_FUNCTION_PARAMETERS, zend_bool with_prefix_len) {
+    zval *ip_addresses = NULL;
+    zval *errors_ref = NULL;
+    zval *this_zval = NULL;
+
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "Oa|z",
+                                     &this_zval,
+                                     maxminddb_ce,
+                                     &ip_addresses,
+                                     &errors_ref) == FAILURE) {
+        return;
+    }
+
+    maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
+    MMDB_s *mmdb = mmdb_obj->mmdb;
+
+    CHECK_NOT_CLOSED(mmdb, );
+
+    zend_function *override =
+        zend_hash_str_find_ptr(&Z_OBJCE_P(ZEND_THIS)->function_table,
+                               ZEND_STRL("getwithprefixlen"));
+    if (override && override->common.scope == maxminddb_ce) {
+        override = NULL;
+    }
+
+    zval errors;
+    array_init(&errors);
+
+    array_init_size(return_value,
+                    zend_hash_num_elements(Z_ARRVAL_P(ip_addresses)));
+
+    zend_ulong index;
+    zend_string *key;
+    zval *entry;
+    ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(ip_addresses), index, key, entry) {
+        zval record;
+        int prefix_len = 0;
+
+        ZVAL_DEREF(entry);
+        if (Z_TYPE_P(entry) != IS_STRING) {
+            zend_throw_exception_ex(spl_ce_InvalidArgumentException,
+                                    0 TSRMLS_CC,
+                                    "Expected the IP address to be a string.");
+            take_exception(
+                errors_ref ? &errors : NULL, index, key TSRMLS_CC);
+            continue;
+        }
+
+        int rv = override ? get_many_override(ZEND_THIS,
+                                              override,
+                                              entry,
+                                              &record,
+                                              &prefix_len TSRMLS_CC)
+                          : lookup_record(mmdb_obj,
+                                          Z_STRVAL_P(entry),
+                                          &record,
+                                          &prefix_len TSRMLS_CC);
+        if (FAILURE == rv) {
+            if (take_exception(errors_ref ? &errors : NULL,
+                               index,
+                               key TSRMLS_CC) == FAILURE) {
+                break;
+            }
+            continue;
+        }
+
+        if (with_prefix_len) {
+            zval pair;
+            array_init_size(&pair, 2);
+            add_next_index_zval(&pair, &record);
+            add_next_index_long(&pair, prefix_len);
+            ZVAL_COPY_VALUE(&record, &pair);
+        }
+
+        if (key) {
+            zend_hash_update(Z_ARRVAL_P(return_value), key, &record);
+        } else {
+            zend_hash_index_update(Z_ARRVAL_P(return_value), index, &record);
+        }
+    }
+    ZEND_HASH_FOREACH_END();
+
+    if (errors_ref) {
+#if PHP_VERSION_ID >= 70400
+        /* Checks the type when $errors is a typed property passed by
+           reference, and frees the array if it does not fit. */
+        ZEND_TRY_ASSIGN_REF_ARR(errors_ref, Z_ARR(errors));
+#else
+        ZVAL_DEREF(errors_ref);
+        zval_ptr_dtor(errors_ref);
+        ZVAL_COPY_VALUE(errors_ref, &errors);
+#endif
+    } else {
+        zval_ptr_dtor(&errors);
+    }
+}
+
+static int
+get_record(INTERNAL_FUNCTION_PARAMETERS, zval *record, int *prefix_len) {
+    char *ip_address = NULL;
+    strsize_t name_len;
+    zval *this_zval = NULL;
+
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "Os",
+                                     &this_zval,
+                                     maxminddb_ce,
+                                     &ip_address,
+                                     &name_len) == FAILURE) {
+        return FAILURE;
+    }
+
+    maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(ZEND_THIS);
+
+    MMDB_s *mmdb = mmdb_obj->mmdb;
+
+    CHECK_NOT_CLOSED(mmdb, FAILURE);
+
+    return lookup_record(mmdb_obj, ip_address, record, prefix_len TSRMLS_CC);
+}
+
+static int lookup_record(maxminddb_obj *mmdb_obj,
+                         const char *ip_address,
+                         zval *record,
+                         int *prefix_len TSRMLS_DC) {
+    struct sockaddr_storage address;
+
+    if (parse_ip_address(ip_address, &address TSRMLS_CC) == FAILURE) {
+        count_invalid_address(mmdb_obj);
+        return FAILURE;
+    }
+
+    return lookup_sockaddr(mmdb_obj,
+                           (const struct sockaddr *)&address,
+                           ip_address,
+                           record,
+                           prefix_len TSRMLS_CC);
+}
+
+/* Converts a textual IP address to a socket address. The usual dotted-quad and
+   IPv6 forms are handled by inet_pton(), which neither allocates nor goes
+   through the resolver. getaddrinfo() is only consulted for the remaining
+   forms that it alone accepts, such as IPv6 zone IDs and the shorthand IPv4
+   notations, so that they keep working as they always have. */
+static int parse_ip_address(const char *ip_address,
+                            struct sockaddr_storage *address TSRMLS_DC) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)address;
+    if (inet_pton(AF_INET, ip_address, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        return SUCCESS;
+    }
+
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)address;
+    if (inet_pton(AF_INET6, ip_address, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        return SUCCESS;
+    }
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_flags = AI_NUMERICHOST,
+        /* We set ai_socktype so that we only get one result back */
+        .ai_socktype = SOCK_STREAM};
+
+    struct addrinfo *addresses = NULL;
+    int gai_status = getaddrinfo(ip_address, NULL, &hints, &addresses);
+    if (gai_status) {
+        zend_throw_exception_ex(spl_ce_InvalidArgumentException,
+                                0 TSRMLS_CC,
+                                "The value \"%s\" is not a valid IP address.",
+                                ip_address);
+        return FAILURE;
+    }
+    if (!addresses || !addresses->ai_addr ||
+        addresses->ai_addrlen > sizeof(*address)) {
+        zend_throw_exception_ex(
+            spl_ce_InvalidArgumentException,
+            0 TSRMLS_CC,
+            "getaddrinfo was successful but failed to set the addrinfo");
+        if (addresses) {
+            freeaddrinfo(addresses);
+        }
+        return FAILURE;
+    }
+
+    memcpy(address, addresses->ai_addr, addresses->ai_addrlen);
+    freeaddrinfo(addresses);
+    return SUCCESS;
+}
+
+/* Formats the address for an error message. This is only done when a lookup
+   fails, so that lookups by packed address never pay for it. */
+static const char *format_sockaddr(const struct sockaddr *address,
+                                   char *buf,
+                                   size_t buf_len) {
+    const void *addr;
+    if (address->sa_family == AF_INET) {
+        addr = &((const struct sockaddr_in *)address)->sin_addr;
+    } else {
+        addr = &((const struct sockaddr_in6 *)address)->sin6_addr;
+    }
+    if (NULL == inet_ntop(address->sa_family, addr, buf, buf_len)) {
+        return "(unprintable address)";
+    }
+    return buf;
+}
+
+/* Returns one of the two records of a search tree node. */
+static inline uint32_t
+read_record(const MMDB_s *mmdb, uint32_t node, int right) {
+    const uint8_t *p =
+        mmdb->file_content + (size_t)node * mmdb->full_record_byte_size;
+
+    switch (mmdb->metadata.record_size) {
+        case 24:
+            p += right * 3;
+            return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+        case 28:
+            /* The middle byte holds the high nibble of each record. */
+            if (right) {
+                return ((uint32_t)(p[3] & 0x0F) << 24) |
+                       ((uint32_t)p[4] << 16) | ((uint32_t)p[5] << 8) | p[6];
+            }
+            return ((uint32_t)(p[3] & 0xF0) << 20) | ((uint32_t)p[0] << 16) |
+                   ((uint32_t)p[1] << 8) | p[2];
+        default:
+            p += right * 4;
+            return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                   ((uint32_t)p[2] << 8) | p[3];
+    }
+}
+
+/* Follows the 96 zero bits that lead to the IPv4 subtree of an IPv6
+   database. The depth is less than 96 if a record is reached first. */
+static uint32_t find_ipv4_start(const MMDB_s *mmdb, uint16_t *depth) {
+    uint32_t node = 0;
+    uint16_t i;
+    for (i = 0; i < 96 && node < mmdb->metadata.node_count; i++) {
+        node = read_record(mmdb, node, 0);
+    }
+    *depth = i;
+    return node;
+}
+
+static void jump_table_fill(const MMDB_s *mmdb,
+                            maxminddb_jump_table *table,
+                            uint32_t record,
+                            uint32_t prefix,
+                            int depth) {
+    if (record < mmdb->metadata.node_count && depth < MAXMINDDB_JUMP_BITS) {
+        prefix <<= 1;
+        jump_table_fill(
+            mmdb, table, read_record(mmdb, record, 0), prefix, depth + 1);
+        jump_table_fill(
+            mmdb, table, read_record(mmdb, record, 1), prefix | 1, depth + 1);
+        return;
+    }
+
+    const int shift = MAXMINDDB_JUMP_BITS - depth;
+    uint32_t i;
+    for (i = prefix << shift; i < (prefix + 1) << shift; i++) {
+        table->records[i] = record;
+        table->depths[i] = (uint8_t)depth;
+    }
+}
+
+/* Returns the handle's jump table for the address family, building it if no
+   reader of the handle has yet. A shared handle's tables are built with the
+   registry locked, so that threads build each one once and see it whole. */
+static const maxminddb_jump_table *jump_table_get(maxminddb_handle *handle,
+                                                  zend_bool ipv4) {
+    maxminddb_jump_table **table_p =
+        ipv4 ? &handle->ipv4_jump_table : &handle->ipv6_jump_table;
+    const MMDB_s *mmdb = &handle->mmdb;
+
+    if (handle->persistent) {
+        REGISTRY_LOCK();
+    }
+    if (NULL == *table_p) {
+        uint32_t start = 0;
+        uint16_t start_depth = 0;
+        if (ipv4 && 6 == mmdb->metadata.ip_version) {
+            start = find_ipv4_start(mmdb, &start_depth);
+        }
+        maxminddb_jump_table *table =
+            pemalloc(sizeof(maxminddb_jump_table), handle->persistent);
+        table->start_depth = start_depth;
+        jump_table_fill(mmdb, table, start, 0, 0);
+        *table_p = table;
+    }
+    const maxminddb_jump_table *table = *table_p;
+    if (handle->persistent) {
+        REGISTRY_UNLOCK();
+    }
+    return table;
+}
+
+/* Does what MMDB_lookup_sockaddr() does, but starts from the jump table entry
+   for the first 16 bits of the address rather than from the root. The tables
+   are only used once the reader has made MAXMINDDB_JUMP_TABLE_LOOKUPS
+   lookups, and the reader keeps its own pointers to them, so that lookups
+   after that take no lock. */
+static int jump_table_lookup(maxminddb_obj *mmdb_obj,
+                             const struct sockaddr *address,
+                             MMDB_lookup_result_s *result) {
+    const MMDB_s *mmdb = mmdb_obj->mmdb;
+    const uint8_t *bytes;
+    int bit_count;
+    const maxminddb_jump_table **table_p;
+    const zend_bool ipv4 = address->sa_family == AF_INET;
+
+    if (ipv4) {
+        bytes = (const uint8_t *)&((const struct sockaddr_in *)address)
+                    ->sin_addr.s_addr;
+        bit_count = 32;
+        table_p = &mmdb_obj->ipv4_jump_table;
+    } else {
+        if (4 == mmdb->metadata.ip_version) {
+            return MMDB_IPV6_LOOKUP_IN_IPV4_DATABASE_ERROR;
+        }
+        bytes = ((const struct sockaddr_in6 *)address)->sin6_addr.s6_addr;
+        bit_count = 128;
+        table_p = &mmdb_obj->ipv6_jump_table;
+    }
+
+    if (NULL == *table_p) {
+        if (mmdb_obj->jump_table_lookups < MAXMINDDB_JUMP_TABLE_LOOKUPS) {
+            int mmdb_error = MMDB_SUCCESS;
+            mmdb_obj->jump_table_lookups++;
+            *result = MMDB_lookup_sockaddr(mmdb, address, &mmdb_error);
+            return mmdb_error;
+        }
+        *table_p = jump_table_get(mmdb_obj->handle, ipv4);
+    }
+
+    const maxminddb_jump_table *table = *table_p;
+    const uint32_t index = ((uint32_t)bytes[0] << 8) | bytes[1];
+    const uint32_t node_count = mmdb->metadata.node_count;
+    uint32_t record = table->records[index];
+    int depth = table->depths[index];
+
+    while (record < node_count && depth < bit_count) {
+        record = read_record(
+            mmdb, record, (bytes[depth >> 3] >> (7 - (depth & 7))) & 1);
+        depth++;
+    }
+
+    memset(result, 0, sizeof(*result));
+    result->netmask = (uint16_t)(table->start_depth + depth);
+    if (record < node_count ||
+        (uint64_t)record >= (uint64_t)node_count + mmdb->data_section_size) {
+        return MMDB_CORRUPT_SEARCH_TREE_ERROR;
+    }
+    if (record > node_count) {
+        result->found_entry = true;
+        result->entry.mmdb = mmdb;
+        result->entry.offset =
+            record - node_count - MMDB_DATA_SECTION_SEPARATOR;
+    }
+    return MMDB_SUCCESS;
+}
+
+/* Finds the data section entry for the address, throwing on failure. The
+   entry is only decoded by the caller, which may want just part of it. */
+static int lookup_entry(maxminddb_obj *mmdb_obj,
+                        const struct sockaddr *address,
+                        const char *ip_address,
+                        MMDB_lookup_result_s *result,
+                        int *prefix_len TSRMLS_DC) {
+    char address_buf[INET6_ADDRSTRLEN];
+    const MMDB_s *mmdb = mmdb_obj->mmdb;
+
+    int mmdb_error = MMDB_SUCCESS;
+    if (mmdb_obj->options.jump_table) {
+        mmdb_error = jump_table_lookup(mmdb_obj, address, result);
+    } else {
+        *result = MMDB_lookup_sockaddr(mmdb, address, &mmdb_error);
+    }
+
+    maxminddb_stats *stats = reader_stats(mmdb_obj);
+    if (stats) {
+        stats->lookups++;
+    }
+
+    if (MMDB_SUCCESS != mmdb_error) {
+        zend_class_entry *ex;
+        if (MMDB_IPV6_LOOKUP_IN_IPV4_DATABASE_ERROR == mmdb_error) {
+            ex = spl_ce_InvalidArgumentException;
+            if (stats) {
+                stats->invalid_addresses++;
+            }
+        } else {
+            ex = maxminddb_exception_ce;
+        }
+        if (NULL == ip_address) {
+            ip_address =
+                format_sockaddr(address, address_buf, sizeof(address_buf));
+        }
+        zend_throw_exception_ex(ex,
+                                0 TSRMLS_CC,
+                                "Error looking up %s. %s",
+                                ip_address,
+                                MMDB_strerror(mmdb_error));
+        return FAILURE;
+    }
+
+    if (stats) {
+        stats->depths[result->netmask <= 128 ? result->netmask : 128]++;
+        if (!result->found_entry) {
+            stats->not_found++;
+        }
+    }
+
+    *prefix_len = result->netmask;
+
+    if (address->sa_family == AF_INET && mmdb->metadata.ip_version == 6) {
+        /* We return the prefix length given the IPv4 address. If there is
+           no IPv4 subtree, we return a prefix length of 0. */
+        *prefix_len = *prefix_len >= 96 ? *prefix_len - 96 : 0;
+    }
+
+    return SUCCESS;
+}
+
+/* Looks up and decodes the address's record. depth, if not NULL, is set to
+   the depth in the search tree at which the lookup ended. */
+static int decode_sockaddr(maxminddb_obj *mmdb_obj,
+                           const struct sockaddr *address,
+                           const char *ip_address,
+                           zval *record,
+                           int *prefix_len,
+                           uint16_t *depth TSRMLS_DC) {
+    char address_buf[INET6_ADDRSTRLEN];
+    MMDB_lookup_result_s result;
+
+    if (lookup_entry(
+            mmdb_obj, address, ip_address, &result, prefix_len TSRMLS_CC) ==
+        FAILURE) {
+        return FAILURE;
+    }
+    if (depth) {
+        *depth = result.netmask <= 128 ? result.netmask : 128;
+    }
+
+    if (!result.found_entry) {
+        ZVAL_NULL(record);
+        return SUCCESS;
+    }
+
+    maxminddb_cache *cache = mmdb_obj->record_cache;
+    if (cache) {
+        const zval *cached = cache_find(cache, result.entry.offset, NULL, 0);
+        if (cached) {
+            ZVAL_COPY(record, cached);
+            return SUCCESS;
+        }
+    }
+
+    if (mmdb_obj->options.lazy_records) {
+        /* Reading the record's first entry gives the type and size of a map
+           or an array. */
+        const maxminddb_decoder decoder = {
+            .data = mmdb_obj->mmdb->data_section,
+            .size = mmdb_obj->mmdb->data_section_size};
+        MMDB_entry_data_s entry_data;
+        int status =
+            lazy_record_read(&decoder, result.entry.offset, &entry_data);
+        if (MMDB_SUCCESS != status) {
+            if (NULL == ip_address) {
+                ip_address =
+                    format_sockaddr(address, address_buf, sizeof(address_buf));
+            }
+            zend_throw_exception_ex(maxminddb_exception_ce,
+                                    0 TSRMLS_CC,
+                                    "Error while looking up data for %s. %s",
+                                    ip_address,
+                                    MMDB_strerror(status));
+            ZVAL_NULL(record);
+            return FAILURE;
+        }
+        if (lazy_record_value(
+                mmdb_obj->handle, &entry_data, record TSRMLS_CC) == FAILURE) {
+            return FAILURE;
+        }
+        if (cache) {
+            cache_add(cache, result.entry.offset, NULL, 0, record);
+        }
+        return SUCCESS;
+    }
+
+    int status = decode_data(mmdb_obj->mmdb,
+                             result.entry.offset,
+                             object_keys(mmdb_obj),
+                             reader_stats(mmdb_obj),
+                             record TSRMLS_CC);
+    if (MMDB_SUCCESS != status) {
+        if (MAXMINDDB_DECODE_THROWN != status) {
+            if (NULL == ip_address) {
+                ip_address =
+                    format_sockaddr(address, address_buf, sizeof(address_buf));
+            }
+            zend_throw_exception_ex(maxminddb_exception_ce,
+                                    0 TSRMLS_CC,
+                                    "Error while looking up data for %s. %s",
+                                    ip_address,
+                                    MMDB_strerror(status));
+        }
+        return FAILURE;
+    }
+    if (cache) {
+        cache_add(cache, result.entry.offset, NULL, 0, record);
+    }
+    return SUCCESS;
+}
+
+/* Returns the address's record and prefix length from the address cache,
+   or looks them up and adds them to it. Failed lookups are not cached. A
+   cached address is counted in the statistics as a lookup ending where the
+   lookup that cached it did, but nothing is decoded for it. */
+static int cached_decode_sockaddr(maxminddb_obj *mmdb_obj,
+                                  const struct sockaddr *address,
+                                  const char *ip_address,
+                                  zval *record,
+                                  int *prefix_len TSRMLS_DC) {
+    maxminddb_cache *cache = mmdb_obj->address_cache;
+    if (NULL == cache) {
+        return decode_sockaddr(
+            mmdb_obj, address, ip_address, record, prefix_len, NULL TSRMLS_CC);
+    }
+
+    zend_ulong h = 0;
+    const char *key = NULL;
+    if (address->sa_family == AF_INET) {
+        h = ntohl(((const struct sockaddr_in *)address)->sin_addr.s_addr);
+    } else {
+        key = (const char *)((const struct sockaddr_in6 *)address)
+                  ->sin6_addr.s6_addr;
+    }
+
+    int rv = SUCCESS;
+    const zval *cached = cache_find(cache, h, key, 16);
+    if (cached) {
+        ZVAL_COPY(record, zend_hash_index_find(Z_ARRVAL_P(cached), 0));
+        *prefix_len =
+            (int)Z_LVAL_P(zend_hash_index_find(Z_ARRVAL_P(cached), 1));
+        maxminddb_stats *stats = reader_stats(mmdb_obj);
+        if (stats) {
+            stats->lookups++;
+            const zval *depth = zend_hash_index_find(Z_ARRVAL_P(cached), 2);
+            stats->depths[Z_LVAL_P(depth)]++;
+            if (Z_TYPE_P(record) == IS_NULL) {
+                stats->not_found++;
+            }
+        }
+    } else {
+        uint16_t depth;
+        rv = decode_sockaddr(mmdb_obj,
+                             address,
+                             ip_address,
+                             record,
+                             prefix_len,
+                             &depth TSRMLS_CC);
+        if (SUCCESS == rv) {
+            zval entry;
+            array_init_size(&entry, 3);
+            Z_TRY_ADDREF_P(record);
+            add_next_index_zval(&entry, record);
+            add_next_index_long(&entry, *prefix_len);
+            add_next_index_long(&entry, depth);
+            cache_add(cache, h, key, 16, &entry);
+            zval_ptr_dtor(&entry);
+        }
+    }
+    return rv;
+}
+
+/* Looks up and decodes the address's record, timing it when statistics are
+   enabled. */
+static int lookup_sockaddr(maxminddb_obj *mmdb_obj,
+                           const struct sockaddr *address,
+                           const char *ip_address,
+                           zval *record,
+                           int *prefix_len TSRMLS_DC) {
+    if (!maxminddb_stats_enabled) {
+        return cached_decode_sockaddr(
+            mmdb_obj, address, ip_address, record, prefix_len TSRMLS_CC);
+    }
+
+    uint64_t start = stats_now();
+    int rv = cached_decode_sockaddr(
+        mmdb_obj, address, ip_address, record, prefix_len TSRMLS_CC);
+    reader_stats(mmdb_obj)->lookup_ns += stats_now() - start;
+    return rv;
+}
+
+/* Builds the NULL-terminated key list MMDB_aget_value() expects from a path
+   given either as a dot-separated string or as an array of keys. The keys
+   are stored after the pointers in the same allocation, so the caller frees
+   the whole path with a single efree(). */
+static const char **build_lookup_path(zval *path TSRMLS_DC) {
+    size_t count = 0;
+    size_t size = 0;
+    zval *segment;
+
+    if (Z_TYPE_P(path) == IS_STRING) {
+        const char *p;
+        count = 1;
+        for (p = Z_STRVAL_P(path); p < Z_STRVAL_P(path) + Z_STRLEN_P(path);
+             p++) {
+            if ('.' == *p) {
+                count++;
+            }
+        }
+        size = Z_STRLEN_P(path) + 1;
+    } else if (Z_TYPE_P(path) == IS_ARRAY) {
+        ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(path), segment) {
+            if (Z_TYPE_P(segment) == IS_STRING) {
+                size += Z_STRLEN_P(segment) + 1;
+            } else if (Z_TYPE_P(segment) == IS_LONG) {
+                size += MAX_LENGTH_OF_LONG + 1;
+            } else {
+                zend_throw_exception_ex(
+                    spl_ce_InvalidArgumentException,
+                    0 TSRMLS_CC,
+                    "Each key in a path must be a string or an integer.");
+                return NULL;
+            }
+            count++;
+        }
+        ZEND_HASH_FOREACH_END();
+    } else {
+        zend_throw_exception_ex(
+            spl_ce_InvalidArgumentException,
+            0 TSRMLS_CC,
+            "Each path must be a string or an array of keys.");
+        return NULL;
+    }
+
+    const char **keys =
+        safe_emalloc(count + 1, sizeof(char *), size > 0 ? size : 1);
+    char *buf = (char *)(keys + count + 1);
+
+    if (Z_TYPE_P(path) == IS_STRING) {
+        size_t i = 0;
+        char *p;
+        memcpy(buf, Z_STRVAL_P(path), Z_STRLEN_P(path) + 1);
+        keys[i++] = buf;
+        for (p = buf; p < buf + Z_STRLEN_P(path); p++) {
+            if ('.' == *p) {
+                *p = '\0';
+                keys[i++] = p + 1;
+            }
+        }
+        keys[i] = NULL;
+        return keys;
+    }
+
+    size_t i = 0;
+    ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(path), segment) {
+        keys[i++] = buf;
+        if (Z_TYPE_P(segment) == IS_STRING) {
+            memcpy(buf, Z_STRVAL_P(segment), Z_STRLEN_P(segment) + 1);
+            buf += Z_STRLEN_P(segment) + 1;
+        } else {
+            buf += snprintf(buf,
+                            MAX_LENGTH_OF_LONG + 1,
+                            ZEND_LONG_FMT,
+                            Z_LVAL_P(segment)) +
+                   1;
+        }
+    }
+    ZEND_HASH_FOREACH_END();
+    keys[i] = NULL;
+    return keys;
+}
+
+/* Decodes the value MMDB_aget_value() found. Scalars are converted directly;
+   only a map or array is walked by decode_data(). */
+static int decode_entry_data(maxminddb_obj *mmdb_obj,
+                             const MMDB_entry_data_s *entry_data,
+                             zval *z_value TSRMLS_DC) {
+    maxminddb_stats *stats = reader_stats(mmdb_obj);
+    if (MMDB_DATA_TYPE_MAP != entry_data->type &&
+        MMDB_DATA_TYPE_ARRAY != entry_data->type) {
+        if (stats) {
+            stats->values_decoded++;
+            stats->bytes_decoded += entry_data->data_size;
+        }
+        return handle_entry_data(entry_data, z_value TSRMLS_CC);
+    }
+
+    int status = decode_data(mmdb_obj->mmdb,
+                             entry_data->offset,
+                             object_keys(mmdb_obj),
+                             stats,
+                             z_value TSRMLS_CC);
+    if (MMDB_SUCCESS != status) {
+        if (MAXMINDDB_DECODE_THROWN != status) {
+            zend_throw_exception_ex(
+                maxminddb_exception_ce,
+                0 TSRMLS_CC,
+                "Error while decoding data at offset %u. %s",
+                entry_data->offset,
+                MMDB_strerror(status));
+        }
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_maxminddbreader_void, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(MaxMind_Db_Reader, metadata) {
+    zval *this_zval = NULL;
+
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "O",
+                                     &this_zval,
+                                     maxminddb_ce) == FAILURE) {
+        return;
+    }
+
+    const maxminddb_obj *const mmdb_obj =
+        (maxminddb_obj *)Z_MAXMINDDB_P(this_zval);
+
+    if (NULL == mmdb_obj->mmdb) {
+        zend_throw_exception_ex(spl_ce_BadMethodCallException,
+                                0 TSRMLS_CC,
+                                "Attempt to read from a closed MaxMind DB.");
+        return;
+    }
+
+    /* The metadata section is laid out like the data section, and its
+       pointers are relative to its start. */
+    const maxminddb_decoder decoder = {
+        .data = mmdb_obj->mmdb->metadata_section,
+        .size = mmdb_obj->mmdb->metadata_section_size};
+    zval metadata_array;
+    uint32_t next;
+    int status =
+        decode_value(&decoder, 0, &next, &metadata_array, 0 TSRMLS_CC);
+    if (MMDB_SUCCESS != status) {
+        if (MAXMINDDB_DECODE_THROWN != status) {
+            zend_throw_exception_ex(maxminddb_exception_ce,
+                                    0 TSRMLS_CC,
+                                    "Error while decoding metadata. %s",
+                                    MMDB_strerror(status));
+        }
+        return;
+    }
+
+    object_init_ex(return_value, metadata_ce);
+    zend_call_method_with_1_params(PROP_OBJ(return_value),
+                                   metadata_ce,
+                                   &metadata_ce->constructor,
+                                   ZEND_CONSTRUCTOR_FUNC_NAME,
+                                   NULL,
+                                   &metadata_array);
+    zval_ptr_dtor(&metadata_array);
+}
+
+PHP_METHOD(MaxMind_Db_Reader, close) {
+    zval *this_zval = NULL;
+
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "O",
+                                     &this_zval,
+                                     maxminddb_ce) == FAILURE) {
+        return;
+    }
+
+    maxminddb_obj *mmdb_obj = (maxminddb_obj *)Z_MAXMINDDB_P(this_zval);
+
+    if (NULL == mmdb_obj->mmdb) {
+        zend_throw_exception_ex(spl_ce_BadMethodCallException,
+                                0 TSRMLS_CC,
+                                "Attempt to close a closed MaxMind DB.");
+        return;
+    }
+    handle_release(mmdb_obj->handle);
+    mmdb_obj->handle = NULL;
+    mmdb_obj->mmdb = NULL;
+    if (mmdb_obj->record_cache) {
+        cache_destroy(mmdb_obj->record_cache);
+        mmdb_obj->record_cache = NULL;
+    }
+    if (mmdb_obj->address_cache) {
+        cache_destroy(mmdb_obj->address_cache);
+        mmdb_obj->address_cache = NULL;
+    }
+    discard_derived_state(mmdb_obj);
+}
+
+static uint64_t decoder_uint(const uint8_t *bytes, uint32_t size) {
+    uint64_t value = 0;
+    uint32_t i;
+    for (i = 0; i < size; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+/* Decodes the control byte and the payload of the value at offset into
+   entry_data, applying the same checks as libmaxminddb's decode_one().
+   Pointers are not followed, and maps and arrays only get their size. */
+static int decoder_read(const maxminddb_decoder *decoder,
+                        uint32_t offset,
+                        MMDB_entry_data_s *entry_data) {
+    const uint8_t *mem = decoder->data;
+    const uint32_t size_limit = decoder->size;
+
+    if (offset >= size_limit) {
+        return MMDB_INVALID_DATA_ERROR;
+    }
+    entry_data->offset = offset;
+    entry_data->has_data = true;
+
+    const uint8_t ctrl = mem[offset++];
+    uint32_t type = ctrl >> 5;
+    if (MMDB_DATA_TYPE_EXTENDED == type) {
+        if (offset >= size_limit) {
+            return MMDB_INVALID_DATA_ERROR;
+        }
+        type = 7 + mem[offset++];
+    }
+    entry_data->type = type;
+
+    if (MMDB_DATA_TYPE_POINTER == type) {
+        const uint32_t psize = ((ctrl >> 3) & 3) + 1;
+        if (psize > size_limit - offset) {
+            return MMDB_INVALID_DATA_ERROR;
+        }
+        const uint8_t *p = mem + offset;
+        const uint32_t high = ctrl & 7;
+        switch (psize) {
+            case 1:
+                entry_data->pointer = (high << 8) + p[0];
+                break;
+            case 2:
+                entry_data->pointer =
+                    2048 + (high << 16) + (uint32_t)decoder_uint(p, 2);
+                break;
+            case 3:
+                entry_data->pointer =
+                    526336 + (high << 24) + (uint32_t)decoder_uint(p, 3);
+                break;
+            default:
+                entry_data->pointer = (uint32_t)decoder_uint(p, 4);
+                break;
+        }
+        entry_data->data_size = psize;
+        entry_data->offset_to_next = offset + psize;
+        return MMDB_SUCCESS;
+    }
+
+    uint32_t size = ctrl & 31;
+    if (size >= 29) {
+        const uint32_t bytes = size - 28;
+        if (bytes > size_limit - offset) {
+            return MMDB_INVALID_DATA_ERROR;
+        }
+        const uint32_t extra = (uint32_t)decoder_uint(mem + offset, bytes);
+        size = (29 == size ? 29 : 30 == size ? 285 : 65821) + extra;
+        offset += bytes;
+    }
+
+    if (MMDB_DATA_TYPE_MAP == type || MMDB_DATA_TYPE_ARRAY == type) {
+        entry_data->data_size = size;
+        entry_data->offset_to_next = offset;
+        return MMDB_SUCCESS;
+    }
+    if (MMDB_DATA_TYPE_BOOLEAN == type) {
+        entry_data->boolean = size ? true : false;
+        entry_data->data_size = 0;
+        entry_data->offset_to_next = offset;
+        return MMDB_SUCCESS;
+    }
+
+    if (size > size_limit - offset) {
+        return MMDB_INVALID_DATA_ERROR;
+    }
+    const uint8_t *p = mem + offset;
+    switch (type) {
+        case MMDB_DATA_TYPE_UINT16:
+            if (size > 2) {
+                return MMDB_INVALID_DATA_ERROR;
+            }
+            entry_data->uint16 = (uint16_t)decoder_uint(p, size);
+            break;
+        case MMDB_DATA_TYPE_UINT32:
+            if (size > 4) {
+                return MMDB_INVALID_DATA_ERROR;
+            }
+            entry_data->uint32 = (uint32_t)decoder_uint(p, size);
+            break;
+        case MMDB_DATA_TYPE_INT32:
+            if (size > 4) {
+                return MMDB_INVALID_DATA_ERROR;
+            }
+            entry_data->int32 = (int32_t)(uint32_t)decoder_uint(p, size);
+            break;
+        case MMDB_DATA_TYPE_UINT64:
+            if (size > 8) {
+                return MMDB_INVALID_DATA_ERROR;
+            }
+            entry_data->uint64 = decoder_uint(p, size);
+            break;
+        case MMDB_DATA_TYPE_UINT128:
+            if (size > 16) {
+                return MMDB_INVALID_DATA_ERROR;
+            }
+#if MMDB_UINT128_IS_BYTE_ARRAY
+            memset(entry_data->uint128, 0, 16);
+            memcpy(entry_data->uint128 + 16 - size, p, size);
+#else
+            {
+                mmdb_uint128_t value = 0;
+                uint32_t i;
+                for (i = 0; i < size; i++) {
+                    value = (value << 8) | p[i];
+                }
+                entry_data->uint128 = value;
+            }
+#endif
+            break;
+        case MMDB_DATA_TYPE_FLOAT: {
+            if (size != 4) {
+                return MMDB_INVALID_DATA_ERROR;
+            }
+            const uint32_t bits = (uint32_t)decoder_uint(p, 4);
+            memcpy(&entry_data->float_value, &bits, sizeof(bits));
+            break;
+        }
+        case MMDB_DATA_TYPE_DOUBLE: {
+            if (size != 8) {
+                return MMDB_INVALID_DATA_ERROR;
+            }
+            const uint64_t bits = decoder_uint(p, 8);
+            memcpy(&entry_data->double_value, &bits, sizeof(bits));
+            break;
+        }
+        case MMDB_DATA_TYPE_UTF8_STRING:
+            entry_data->utf8_string = (const char *)p;
+            break;
+        case MMDB_DATA_TYPE_BYTES:
+            entry_data->bytes = p;
+            break;
+        default:
+            /* handle_entry_data() rejects the type. */
+            break;
+    }
+    entry_data->data_size = size;
+    entry_data->offset_to_next = offset + size;
+    return MMDB_SUCCESS;
+}
+
+static int decode_map(const maxminddb_decoder *decoder,
+                      const MMDB_entry_data_s *map,
+                      uint32_t *next,
+                      zval *z_value,
+                      int depth TSRMLS_DC) {
+    const uint32_t size = map->data_size;
+    uint32_t offset = map->offset_to_next;
+    array_init_size(z_value, size);
+
+    uint32_t i;
+    for (i = 0; i < size; i++) {
+        MMDB_entry_data_s key;
+        int status = decoder_read(decoder, offset, &key);
+        if (MMDB_SUCCESS == status) {
+            offset = key.offset_to_next;
+            if (MMDB_DATA_TYPE_POINTER == key.type) {
+                status = decoder_read(decoder, key.pointer, &key);
+            }
+        }
+        if (MMDB_SUCCESS == status &&
+            MMDB_DATA_TYPE_UTF8_STRING != key.type) {
+            status = MMDB_INVALID_DATA_ERROR;
+        }
+        if (MMDB_SUCCESS != status) {
+            zval_ptr_dtor(z_value);
+            ZVAL_NULL(z_value);
+            return status;
+        }
+        if (decoder->stats) {
+            decoder->stats->values_decoded++;
+            decoder->stats->bytes_decoded += key.data_size;
+        }
+
+        zend_string *name = map_key(&key, decoder->keys);
+        zval new_value;
+        status =
+            decode_value(decoder, offset, &offset, &new_value, depth TSRMLS_CC);
+        if (MMDB_SUCCESS != status) {
+            zend_string_release(name);
+            zval_ptr_dtor(z_value);
+            ZVAL_NULL(z_value);
+            return status;
+        }
+        zend_symtable_update(Z_ARRVAL_P(z_value), name, &new_value);
+        zend_string_release(name);
+    }
+    *next = offset;
+    return MMDB_SUCCESS;
+}
+
+static int decode_array(const maxminddb_decoder *decoder,
+                        const MMDB_entry_data_s *array,
+                        uint32_t *next,
+                        zval *z_value,
+                        int depth TSRMLS_DC) {
+    const uint32_t size = array->data_size;
+    uint32_t offset = array->offset_to_next;
+    array_init_size(z_value, size);
+    if (size > 0) {
+        zend_hash_real_init(Z_ARRVAL_P(z_value), 1);
+    }
+
+    uint32_t i;
+    for (i = 0; i < size; i++) {
+        zval new_value;
+        int status =
+            decode_value(decoder, offset, &offset, &new_value, depth TSRMLS_CC);
+        if (MMDB_SUCCESS != status) {
+            zval_ptr_dtor(z_value);
+            ZVAL_NULL(z_value);
+            return status;
+        }
+        add_next_index_zval(z_value, &new_value);
+    }
+    *next = offset;
+    return MMDB_SUCCESS;
+}
+
+/* Decodes the value at offset into z_value and sets next to the offset
+   after it. A pointer is followed once; as in libmaxminddb, it may not point
+   to another pointer, and pointers, maps and arrays together may not nest
+   deeper than MAXMINDDB_MAX_DEPTH. */
+static int decode_value(const maxminddb_decoder *decoder,
+                        uint32_t offset,
+                        uint32_t *next,
+                        zval *z_value,
+                        int depth TSRMLS_DC) {
+    if (depth >= MAXMINDDB_MAX_DEPTH) {
+        ZVAL_NULL(z_value);
+        return MMDB_INVALID_DATA_ERROR;
+    }
+    depth++;
+
+    MMDB_entry_data_s entry_data;
+    int status = decoder_read(decoder, offset, &entry_data);
+    if (MMDB_SUCCESS != status) {
+        ZVAL_NULL(z_value);
+        return status;
+    }
+    *next = entry_data.offset_to_next;
+
+    if (MMDB_DATA_TYPE_POINTER == entry_data.type) {
+        const uint32_t target = entry_data.pointer;
+        status = decoder_read(decoder, target, &entry_data);
+        if (MMDB_SUCCESS == status &&
+            MMDB_DATA_TYPE_POINTER == entry_data.type) {
+            status = MMDB_INVALID_DATA_ERROR;
+        }
+        if (MMDB_SUCCESS != status) {
+            ZVAL_NULL(z_value);
+            return status;
+        }
+        if (MMDB_DATA_TYPE_MAP == entry_data.type ||
+            MMDB_DATA_TYPE_ARRAY == entry_data.type) {
+            uint32_t ignored;
+            return decode_value(
+                decoder, target, &ignored, z_value, depth TSRMLS_CC);
+        }
+    }
+
+    if (decoder->stats) {
+        decoder->stats->values_decoded++;
+    }
+    switch (entry_data.type) {
+        case MMDB_DATA_TYPE_MAP:
+            return decode_map(
+                decoder, &entry_data, next, z_value, depth TSRMLS_CC);
+        case MMDB_DATA_TYPE_ARRAY:
+            return decode_array(
+                decoder, &entry_data, next, z_value, depth TSRMLS_CC);
+        default:
+            if (decoder->stats) {
+                decoder->stats->bytes_decoded += entry_data.data_size;
+            }
+            if (handle_entry_data(&entry_data, z_value TSRMLS_CC) ==
+                FAILURE) {
+                return MAXMINDDB_DECODE_THROWN;
+            }
+            return MMDB_SUCCESS;
+    }
+}
+
+/* Converts the value at a data section offset straight to a zval. On
+   failure z_value is null and the libmaxminddb error is returned for the
+   caller to report, or MAXMINDDB_DECODE_THROWN if an exception has already
+   been thrown. */
+static int decode_data(const MMDB_s *mmdb,
+                       uint32_t offset,
+                       HashTable *keys,
+                       maxminddb_stats *stats,
+                       zval *z_value TSRMLS_DC) {
+    const maxminddb_decoder decoder = {.data = mmdb->data_section,
+                                       .size = mmdb->data_section_size,
+                                       .keys = keys,
+                                       .stats = stats};
+    uint32_t next;
+    return decode_value(&decoder, offset, &next, z_value, 0 TSRMLS_CC);
+}
+
+/* Sets next to the offset after the value at offset without converting it.
+   A pointer is skipped, not followed. */
+static int decoder_skip(const maxminddb_decoder *decoder,
+                        uint32_t offset,
+                        uint32_t *next,
+                        int depth) {
+    if (depth >= MAXMINDDB_MAX_DEPTH) {
+        return MMDB_INVALID_DATA_ERROR;
+    }
+    depth++;
+
+    MMDB_entry_data_s entry_data;
+    int status = decoder_read(decoder, offset, &entry_data);
+    if (MMDB_SUCCESS != status) {
+        return status;
+    }
+    offset = entry_data.offset_to_next;
+
+    if (MMDB_DATA_TYPE_MAP == entry_data.type ||
+        MMDB_DATA_TYPE_ARRAY == entry_data.type) {
+        uint64_t count = entry_data.data_size;
+        if (MMDB_DATA_TYPE_MAP == entry_data.type) {
+            count *= 2;
+        }
+        uint64_t i;
+        for (i = 0; i < count; i++) {
+            status = decoder_skip(decoder, offset, &offset, depth);
+            if (MMDB_SUCCESS != status) {
+                return status;
+            }
+        }
+    }
+    *next = offset;
+    return MMDB_SUCCESS;
+}
+
+static void schema_node_destroy(maxminddb_schema_node *node) {
+    zend_hash_destroy(&node->properties);
+    zend_hash_destroy(&node->children);
+}
+
+static void schema_node_dtor(zval *zv) {
+    maxminddb_schema_node *node = (maxminddb_schema_node *)Z_PTR_P(zv);
+    schema_node_destroy(node);
+    efree(node);
+}
+
+static void schema_node_init(maxminddb_schema_node *node) {
+    zend_hash_init(&node->properties, 4, NULL, NULL, 0);
+    zend_hash_init(&node->children, 4, NULL, schema_node_dtor, 0);
+    node->index = 0;
+    node->has_index = 0;
+}
+
+/* Returns the child of node for the segment, creating it if needed. */
+static maxminddb_schema_node *schema_node_child(maxminddb_schema_node *node,
+                                                const char *segment,
+                                                size_t len) {
+    maxminddb_schema_node *child =
+        zend_hash_str_find_ptr(&node->children, segment, len);
+    if (child) {
+        return child;
+    }
+
+    child = emalloc(sizeof(maxminddb_schema_node));
+    schema_node_init(child);
+
+    /* As in libmaxminddb, a segment indexes an array when it is a decimal
+       integer, and a negative one counts back from the end. */
+    const char *p = segment;
+    const char *end = segment + len;
+    if (p < end && '-' == *p) {
+        p++;
+    }
+    if (p < end && (size_t)(end - p) < MAX_LENGTH_OF_LONG - 1) {
+        zend_long index = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            index = index * 10 + (*p - '0');
+        }
+        if (p == end) {
+            child->index = '-' == segment[0] ? -index : index;
+            child->has_index = 1;
+        }
+    }
+
+    zend_hash_str_add_ptr(&node->children, segment, len, child);
+    return child;
+}
+
+static void schema_free(maxminddb_schema *schema) {
+    schema_node_destroy(&schema->root);
+    efree(schema);
+}
+
+/* Checks that the class can be filled without running any of its code and
+   merges each property's path into the decode plan. */
+static maxminddb_schema *schema_compile(zend_class_entry *ce,
+                                        HashTable *paths TSRMLS_DC) {
+    uint32_t not_instantiable = ZEND_ACC_INTERFACE | ZEND_ACC_TRAIT |
+                                ZEND_ACC_IMPLICIT_ABSTRACT_CLASS |
+                                ZEND_ACC_EXPLICIT_ABSTRACT_CLASS;
+#ifdef ZEND_ACC_ENUM
+    not_instantiable |= ZEND_ACC_ENUM;
+#endif
+    if (ZEND_USER_CLASS != ce->type || !(ce->ce_flags & ZEND_ACC_FINAL) ||
+        (ce->ce_flags & not_instantiable)) {
+        zend_throw_exception_ex(spl_ce_InvalidArgumentException,
+                                0 TSRMLS_CC,
+                                "The schema class must be a final, "
+                                "user-defined class; %s is not.",
+                                ZSTR_VAL(ce->name));
+        return NULL;
+    }
+
+    /* Static properties and, from PHP 8.4, virtual ones have no slot in
+       the object. */
+    uint32_t no_slot = ZEND_ACC_STATIC;
+#ifdef ZEND_ACC_VIRTUAL
+    no_slot |= ZEND_ACC_VIRTUAL;
+#endif
+
+    maxminddb_schema *schema = emalloc(sizeof(maxminddb_schema));
+    schema->ce = ce;
+    schema_node_init(&schema->root);
+
+    zend_string *name;
+    zval *path;
+    ZEND_HASH_FOREACH_STR_KEY_VAL(paths, name, path) {
+        if (NULL == name) {
+            zend_throw_exception_ex(
+                spl_ce_InvalidArgumentException,
+                0 TSRMLS_CC,
+                "Each key of the schema must be a property name.");
+            schema_free(schema);
+            return NULL;
+        }
+
+        zend_property_info *info =
+            zend_hash_find_ptr(&ce->properties_info, name);
+        if (NULL == info || (info->flags & no_slot) ||
+            ((info->flags & ZEND_ACC_PRIVATE) && info->ce != ce)) {
+            zend_throw_exception_ex(
+                spl_ce_InvalidArgumentException,
+                0 TSRMLS_CC,
+                "%s::$%s is not a declared instance property.",
+                ZSTR_VAL(ce->name),
+                ZSTR_VAL(name));
+            schema_free(schema);
+            return NULL;
+        }
+
+        const char **segments = build_lookup_path(path TSRMLS_CC);
+        if (NULL == segments) {
+            schema_free(schema);
+            return NULL;
+        }
+        maxminddb_schema_node *node = &schema->root;
+        const char **segment;
+        for (segment = segments; *segment; segment++) {
+            node = schema_node_child(node, *segment, strlen(*segment));
+        }
+        efree(segments);
+
+        zend_hash_next_index_insert_ptr(&node->properties, info);
+    }
+    ZEND_HASH_FOREACH_END();
+
+    return schema;
+}
+
+/* Stores a copy of the value in the property's slot, checking it against
+   the property's type as a strict assignment would. */
+static int schema_assign(zend_object *object,
+                         zend_property_info *info,
+                         zval *value TSRMLS_DC) {
+    zval copy;
+    ZVAL_COPY(&copy, value);
+#if PHP_VERSION_ID >= 70400
+    if (ZEND_TYPE_IS_SET(info->type) &&
+        !zend_verify_property_type(info, &copy, 1)) {
+        zval_ptr_dtor(&copy);
+        return FAILURE;
+    }
+#endif
+    zval *slot = OBJ_PROP(object, info->offset);
+    zval_ptr_dtor(slot);
+    ZVAL_COPY_VALUE(slot, &copy);
+    return SUCCESS;
+}
+
+/* Fills the properties of node and its children from the value at offset.
+   Only the values at the end of a path are converted; map entries that no
+   path goes through are skipped. */
+static int schema_fill_node(const maxminddb_decoder *decoder,
+                            const maxminddb_schema_node *node,
+                            uint32_t offset,
+                            zend_object *object,
+                            int depth TSRMLS_DC) {
+    int status;
+
+    if (zend_hash_num_elements(&node->properties) > 0) {
+        zval value;
+        uint32_t next;
+        status = decode_value(decoder, offset, &next, &value, depth TSRMLS_CC);
+        if (MMDB_SUCCESS != status) {
+            return status;
+        }
+        zend_property_info *info;
+        ZEND_HASH_FOREACH_PTR(&node->properties, info) {
+            if (schema_assign(object, info, &value TSRMLS_CC) == FAILURE) {
+                zval_ptr_dtor(&value);
+                return MAXMINDDB_DECODE_THROWN;
+            }
+        }
+        ZEND_HASH_FOREACH_END();
+        zval_ptr_dtor(&value);
+    }
+
+    if (0 == zend_hash_num_elements(&node->children)) {
+        return MMDB_SUCCESS;
+    }
+    if (depth >= MAXMINDDB_MAX_DEPTH) {
+        return MMDB_INVALID_DATA_ERROR;
+    }
+    depth++;
+
+    MMDB_entry_data_s entry_data;
+    status = decoder_read(decoder, offset, &entry_data);
+    if (MMDB_SUCCESS == status && MMDB_DATA_TYPE_POINTER == entry_data.type) {
+        status = decoder_read(decoder, entry_data.pointer, &entry_data);
+        if (MMDB_SUCCESS == status &&
+            MMDB_DATA_TYPE_POINTER == entry_data.type) {
+            status = MMDB_INVALID_DATA_ERROR;
+        }
+    }
+    if (MMDB_SUCCESS != status) {
+        return status;
+    }
+
+    const uint32_t size = entry_data.data_size;
+    const maxminddb_schema_node *child;
+    if (MMDB_DATA_TYPE_MAP == entry_data.type) {
+        offset = entry_data.offset_to_next;
+        uint32_t i;
+        for (i = 0; i < size; i++) {
+            MMDB_entry_data_s key;
+            status = decoder_read(decoder, offset, &key);
+            if (MMDB_SUCCESS == status) {
+                offset = key.offset_to_next;
+                if (MMDB_DATA_TYPE_POINTER == key.type) {
+                    status = decoder_read(decoder, key.pointer, &key);
+                }
+            }
+            if (MMDB_SUCCESS == status &&
+                MMDB_DATA_TYPE_UTF8_STRING != key.type) {
+                status = MMDB_INVALID_DATA_ERROR;
+            }
+            if (MMDB_SUCCESS != status) {
+                return status;
+            }
+
+            child = zend_hash_str_find_ptr(
+                &node->children, key.utf8_string, key.data_size);
+            if (child) {
+                status = schema_fill_node(
+                    decoder, child, offset, object, depth TSRMLS_CC);
+                if (MMDB_SUCCESS != status) {
+                    return status;
+                }
+            }
+            status = decoder_skip(decoder, offset, &offset, depth);
+            if (MMDB_SUCCESS != status) {
+                return status;
+            }
+        }
+    } else if (MMDB_DATA_TYPE_ARRAY == entry_data.type) {
+        ZEND_HASH_FOREACH_PTR(&node->children, child) {
+            if (!child->has_index) {
+                continue;
+            }
+            zend_long index = child->index < 0 ? child->index + (zend_long)size
+                                               : child->index;
+            if (index < 0 || index >= (zend_long)size) {
+                continue;
+            }
+            offset = entry_data.offset_to_next;
+            zend_long i;
+            for (i = 0; i < index; i++) {
+                status = decoder_skip(decoder, offset, &offset, depth);
+                if (MMDB_SUCCESS != status) {
+                    return status;
+                }
+            }
+            status = schema_fill_node(
+                decoder, child, offset, object, depth TSRMLS_CC);
+            if (MMDB_SUCCESS != status) {
+                return status;
+            }
+        }
+        ZEND_HASH_FOREACH_END();
+    }
+    /* Otherwise the rest of the paths are not in this record. */
+    return MMDB_SUCCESS;
+}
+
+/* Fills the object's properties from the record at a data section offset.
+   Returns the libmaxminddb error for the caller to report, or
+   MAXMINDDB_DECODE_THROWN if an exception has already been thrown. */
+static int schema_fill(const MMDB_s *mmdb,
+                       const maxminddb_schema *schema,
+                       uint32_t offset,
+                       HashTable *keys,
+                       maxminddb_stats *stats,
+                       zend_object *object TSRMLS_DC) {
+    const maxminddb_decoder decoder = {.data = mmdb->data_section,
+                                       .size = mmdb->data_section_size,
+                                       .keys = keys,
+                                       .stats = stats};
+    return schema_fill_node(
+        &decoder, &schema->root, offset, object, 0 TSRMLS_CC);
+}
+
+/* The marker that precedes the metadata, which ends the data section. */
+#define MAXMINDDB_METADATA_MARKER_LENGTH 14
+
+#define MAXMINDDB_VERIFY_INVALID                                               \
+    "the value is truncated or its size is not valid for its type"
+#define MAXMINDDB_VERIFY_UNKNOWN_TYPE "the value has an unknown data type"
+#define MAXMINDDB_VERIFY_POINTER "a pointer points to another pointer"
+#define MAXMINDDB_VERIFY_KEY "a map key is not a string"
+#define MAXMINDDB_VERIFY_DEPTH "maps, arrays and pointers are nested too deeply"
+
+/* A problem verify() found, at an offset in the file. */
+typedef struct _maxminddb_problem {
+    uint64_t offset;
+    /* The order the problem was found in, among those at its offset. */
+    size_t sequence;
+    char message[128];
+} maxminddb_problem;
+
+/* What the phases of verify() share. The bitmaps have a bit per offset in
+   the data section and are only written through verify_bit_set(), so that
+   workers can share them. */
+typedef struct _maxminddb_verifier {
+    const MMDB_s *mmdb;
+    maxminddb_decoder decoder;
+    /* The file offset of the data section. */
+    uint64_t data_start;
+    /* Records the search tree points to. */
+    uint8_t *starts;
+    /* Maps and arrays that pointers lead to and that have been verified. */
+    uint8_t *verified;
+    uint32_t max_problems;
+} maxminddb_verifier;
+
+/* A range of nodes or data offsets for one worker, with the problems it
+   finds there, in order. PHP's allocator belongs to the calling thread, so
+   a task run on a thread of its own collects its problems with realloc()
+   instead, and the calling thread frees them. */
+typedef struct _maxminddb_verify_task {
+    const maxminddb_verifier *verifier;
+    uint64_t from;
+    uint64_t to;
+    maxminddb_problem *problems;
+    uint32_t problems_len;
+    uint32_t problems_size;
+    zend_bool on_thread;
+} maxminddb_verify_task;
+
+static zend_bool verify_bit(const uint8_t *bitmap, uint64_t bit) {
+    return (bitmap[bit >> 3] >> (bit & 7)) & 1;
+}
+
+static void verify_bit_set(uint8_t *bitmap, uint64_t bit) {
+#ifdef MAXMINDDB_VERIFY_THREADS
+    __atomic_fetch_or(
+        &bitmap[bit >> 3], (uint8_t)(1 << (bit & 7)), __ATOMIC_RELAXED);
+#else
+    bitmap[bit >> 3] |= (uint8_t)(1 << (bit & 7));
+#endif
+}
+
+static zend_bool verify_bit_get(const uint8_t *bitmap, uint64_t bit) {
+#ifdef MAXMINDDB_VERIFY_THREADS
+    return (__atomic_load_n(&bitmap[bit >> 3], __ATOMIC_RELAXED) >>
+            (bit & 7)) &
+           1;
+#else
+    return verify_bit(bitmap, bit);
+#endif
+}
+
+static void verify_report(maxminddb_verify_task *task,
+                          uint64_t offset,
+                          const char *format,
+                          ...) {
+    if (task->problems_len >= task->verifier->max_problems) {
+        return;
+    }
+    if (task->problems_len == task->problems_size) {
+        const uint32_t size =
+            task->problems_size ? 2 * task->problems_size : 16;
+        maxminddb_problem *problems;
+        if (task->on_thread) {
+            problems =
+                realloc(task->problems, size * sizeof(maxminddb_problem));
+            if (NULL == problems) {
+                return;
+            }
+        } else {
+            problems = safe_erealloc(
+                task->problems, size, sizeof(maxminddb_problem), 0);
+        }
+        task->problems = problems;
+        task->problems_size = size;
+    }
+    maxminddb_problem *problem = &task->problems[task->problems_len++];
+    problem->offset = offset;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(problem->message, sizeof(problem->message), format, args);
+    va_end(args);
+}
+
+/* Checks the value at offset, following pointers, and sets next to the
+   offset after it. Returns NULL or why the value is invalid. Only the
+   data section is read, so workers can run this concurrently. */
+static const char *verify_value(const maxminddb_verifier *verifier,
+                                uint32_t offset,
+                                uint32_t *next,
+                                zend_bool is_key,
+                                int depth) {
+    if (depth >= MAXMINDDB_MAX_DEPTH) {
+        return MAXMINDDB_VERIFY_DEPTH;
+    }
+    depth++;
+
+    MMDB_entry_data_s entry_data;
+    if (decoder_read(&verifier->decoder, offset, &entry_data) !=
+        MMDB_SUCCESS) {
+        return MAXMINDDB_VERIFY_INVALID;
+    }
+    *next = entry_data.offset_to_next;
+
+    if (MMDB_DATA_TYPE_POINTER == entry_data.type) {
+        const uint32_t target = entry_data.pointer;
+        if (decoder_read(&verifier->decoder, target, &entry_data) !=
+            MMDB_SUCCESS) {
+            return MAXMINDDB_VERIFY_INVALID;
+        }
+        if (MMDB_DATA_TYPE_POINTER == entry_data.type) {
+            return MAXMINDDB_VERIFY_POINTER;
+        }
+        if (is_key && MMDB_DATA_TYPE_UTF8_STRING != entry_data.type) {
+            return MAXMINDDB_VERIFY_KEY;
+        }
+        if (MMDB_DATA_TYPE_MAP != entry_data.type &&
+            MMDB_DATA_TYPE_ARRAY != entry_data.type) {
+            return verify_value(verifier, target, &offset, is_key, depth);
+        }
+        if (verify_bit_get(verifier->verified, target)) {
+            return NULL;
+        }
+        const char *error =
+            verify_value(verifier, target, &offset, is_key, depth);
+        if (NULL == error) {
+            verify_bit_set(verifier->verified, target);
+        }
+        return error;
+    }
+
+    if (is_key && MMDB_DATA_TYPE_UTF8_STRING != entry_data.type) {
+        return MAXMINDDB_VERIFY_KEY;
+    }
+
+    uint32_t i;
+    const char *error;
+    switch (entry_data.type) {
+        case MMDB_DATA_TYPE_MAP:
+            offset = entry_data.offset_to_next;
+            for (i = 0; i < entry_data.data_size; i++) {
+                error = verify_value(verifier, offset, &offset, 1, depth);
+                if (NULL == error) {
+                    error = verify_value(verifier, offset, &offset, 0, depth);
+                }
+                if (error) {
+                    return error;
+                }
+            }
+            *next = offset;
+            return NULL;
+        case MMDB_DATA_TYPE_ARRAY:
+            offset = entry_data.offset_to_next;
+            for (i = 0; i < entry_data.data_size; i++) {
+                error = verify_value(verifier, offset, &offset, 0, depth);
+                if (error) {
+                    return error;
+                }
+            }
+            *next = offset;
+            return NULL;
+        case MMDB_DATA_TYPE_UTF8_STRING:
+        case MMDB_DATA_TYPE_DOUBLE:
+        case MMDB_DATA_TYPE_BYTES:
+        case MMDB_DATA_TYPE_UINT16:
+        case MMDB_DATA_TYPE_UINT32:
+        case MMDB_DATA_TYPE_INT32:
+        case MMDB_DATA_TYPE_UINT64:
+        case MMDB_DATA_TYPE_UINT128:
+        case MMDB_DATA_TYPE_BOOLEAN:
+        case MMDB_DATA_TYPE_FLOAT:
+            return NULL;
+        default:
+            return MAXMINDDB_VERIFY_UNKNOWN_TYPE;
+    }
+}
+
+/* Checks the records of the task's nodes and marks the records they point
+   to in the data section. */
+static void *verify_nodes(void *arg) {
+    maxminddb_verify_task *task = (maxminddb_verify_task *)arg;
+    const maxminddb_verifier *verifier = task->verifier;
+    const MMDB_s *mmdb = verifier->mmdb;
+    const uint64_t node_count = mmdb->metadata.node_count;
+    const uint64_t node_size = mmdb->full_record_byte_size;
+    const uint64_t data_size = verifier->decoder.size;
+
+    uint64_t node;
+    for (node = task->from; node < task->to; node++) {
+        int right;
+        for (right = 0; right < 2; right++) {
+            const uint64_t record = read_record(mmdb, (uint32_t)node, right);
+            if (record <= node_count) {
+                continue;
+            }
+            if (record < node_count + MMDB_DATA_SECTION_SEPARATOR) {
+                verify_report(task,
+                              node * node_size,
+                              "Node %" PRIu64 " has a record that points into "
+                              "the data section separator.",
+                              node);
+            } else if (record - node_count - MMDB_DATA_SECTION_SEPARATOR >=
+                       data_size) {
+                verify_report(task,
+                              node * node_size,
+                              "Node %" PRIu64 " has a record that points past "
+                              "the end of the data section.",
+                              node);
+            } else {
+                verify_bit_set(verifier->starts,
+                               record - node_count -
+                                   MMDB_DATA_SECTION_SEPARATOR);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Verifies the records that start in the task's range of the data section,
+   in order. */
+static void *verify_records(void *arg) {
+    maxminddb_verify_task *task = (maxminddb_verify_task *)arg;
+    const maxminddb_verifier *verifier = task->verifier;
+
+    uint64_t offset;
+    for (offset = task->from; offset < task->to; offset++) {
+        if (0 == verifier->starts[offset >> 3]) {
+            offset |= 7;
+            continue;
+        }
+        if (!verify_bit(verifier->starts, offset)) {
+            continue;
+        }
+        uint32_t next;
+        const char *error =
+            verify_value(verifier, (uint32_t)offset, &next, 0, 0);
+        if (error) {
+            verify_report(task,
+                          verifier->data_start + offset,
+                          "The record is invalid: %s.",
+                          error);
+        }
+    }
+    return NULL;
+}
+
+/* Runs the tasks, on threads when there is more than one and the build
+   supports them. A task whose thread cannot be started runs here. */
+static void verify_run(void *(*work)(void *),
+                       maxminddb_verify_task *tasks,
+                       uint32_t count) {
+#ifdef MAXMINDDB_VERIFY_THREADS
+    if (count > 1) {
+        pthread_t threads[MAXMINDDB_VERIFY_MAX_THREADS];
+        zend_bool started[MAXMINDDB_VERIFY_MAX_THREADS];
+        uint32_t i;
+        for (i = 0; i < count; i++) {
+            tasks[i].on_thread = 1;
+            started[i] =
+                0 == pthread_create(&threads[i], NULL, work, &tasks[i]);
+            if (!started[i]) {
+                tasks[i].on_thread = 0;
+                work(&tasks[i]);
+            }
+        }
+        for (i = 0; i < count; i++) {
+            if (started[i]) {
+                pthread_join(threads[i], NULL);
+            }
+        }
+        return;
+    }
+#endif
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        work(&tasks[i]);
+    }
+}
+
+/* Splits [0, size) into count ranges. With align, each range starts on a
+   byte of the bitmaps, so no two workers scan the same byte. */
+static void verify_split(maxminddb_verify_task *tasks,
+                         uint32_t count,
+                         uint64_t size,
+                         zend_bool align) {
+    uint64_t step = size / count + 1;
+    if (align) {
+        step = (step + 7) & ~(uint64_t)7;
+    }
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        tasks[i].from = MIN(size, (uint64_t)i * step);
+        tasks[i].to = MIN(size, (uint64_t)(i + 1) * step);
+    }
+}
+
+/* Checks that every node lies on a path no longer than an address, which
+   also rules out cycles. heights holds 0 for a node not reached yet, 1 for
+   one on the current path, and otherwise 2 plus the number of nodes on the
+   longest path down from it. */
+static void verify_depth(maxminddb_verify_task *task) {
+    const MMDB_s *mmdb = task->verifier->mmdb;
+    const uint32_t node_count = mmdb->metadata.node_count;
+    const uint64_t node_size = mmdb->full_record_byte_size;
+    const uint32_t bits = 4 == mmdb->metadata.ip_version ? 32 : 128;
+
+    struct {
+        uint32_t node;
+        uint8_t record;
+        uint8_t height;
+    } stack[129];
+    uint8_t *heights = ecalloc(node_count, 1);
+    uint32_t len = 1;
+    stack[0].node = 0;
+    stack[0].record = 0;
+    stack[0].height = 0;
+    heights[0] = 1;
+
+    while (len > 0) {
+        uint32_t top = len - 1;
+        if (stack[top].record == 2) {
+            const uint32_t height = stack[top].height + 1;
+            heights[stack[top].node] = (uint8_t)(2 + height);
+            len--;
+            if (len > 0 && height > stack[len - 1].height) {
+                stack[len - 1].height = (uint8_t)height;
+            }
+            continue;
+        }
+
+        const uint32_t record =
+            read_record(mmdb, stack[top].node, stack[top].record++);
+        if (record >= node_count) {
+            continue;
+        }
+
+        const uint32_t child = (uint32_t)record;
+        if (1 == heights[child]) {
+            verify_report(task,
+                          (uint64_t)child * node_size,
+                          "Node %" PRIu32
+                          " is part of a cycle in the search tree.",
+                          child);
+        } else if (0 == heights[child]) {
+            if (len >= bits) {
+                verify_report(task,
+                              (uint64_t)child * node_size,
+                              "Node %" PRIu32 " can be reached through more "
+                              "bits than an IPv%d address has.",
+                              child,
+                              mmdb->metadata.ip_version);
+                continue;
+            }
+            heights[child] = 1;
+            stack[len].node = child;
+            stack[len].record = 0;
+            stack[len].height = 0;
+            len++;
+        } else {
+            const uint32_t height = heights[child] - 2;
+            if (len + height > bits) {
+                verify_report(task,
+                              (uint64_t)child * node_size,
+                              "Node %" PRIu32 " can be reached through more "
+                              "bits than an IPv%d address has.",
+                              child,
+                              mmdb->metadata.ip_version);
+            } else if (height > stack[top].height) {
+                stack[top].height = (uint8_t)height;
+            }
+        }
+    }
+    efree(heights);
+}
+
+static void verify_metadata(maxminddb_verify_task *task) {
+    const MMDB_s *mmdb = task->verifier->mmdb;
+    const MMDB_metadata_s *metadata = &mmdb->metadata;
+    const uint64_t offset = mmdb->metadata_section - mmdb->file_content;
+
+    if (2 != metadata->binary_format_major_version) {
+        verify_report(task,
+                      offset,
+                      "The binary format major version is %d, not 2.",
+                      (int)metadata->binary_format_major_version);
+    }
+    if (24 != metadata->record_size && 28 != metadata->record_size &&
+        32 != metadata->record_size) {
+        verify_report(task,
+                      offset,
+                      "The record size is %d, not 24, 28 or 32.",
+                      (int)metadata->record_size);
+    }
+    if (4 != metadata->ip_version && 6 != metadata->ip_version) {
+        verify_report(task,
+                      offset,
+                      "The IP version is %d, not 4 or 6.",
+                      (int)metadata->ip_version);
+    }
+    if (0 == metadata->node_count) {
+        verify_report(task, offset, "The search tree has no nodes.");
+    }
+    if (NULL == metadata->database_type || '\0' == *metadata->database_type) {
+        verify_report(task, offset, "The database type is empty.");
+    }
+
+    const uint8_t *separator = mmdb->data_section - MMDB_DATA_SECTION_SEPARATOR;
+    int i;
+    for (i = 0; i < MMDB_DATA_SECTION_SEPARATOR; i++) {
+        if (separator[i]) {
+            verify_report(task,
+                          separator - mmdb->file_content,
+                          "The data section separator is not all zeros.");
+            break;
+        }
+    }
+}
+
+static int verify_problem_compare(const void *a, const void *b) {
+    const maxminddb_problem *left = (const maxminddb_problem *)a;
+    const maxminddb_problem *right = (const maxminddb_problem *)b;
+    if (left->offset != right->offset) {
+        return left->offset < right->offset ? -1 : 1;
+    }
+    return left->sequence < right->sequence   ? -1
+           : left->sequence > right->sequence ? 1
+                                              : 0;
+}
+
+/* Verifies the whole database and sets return_value to the first
+   max_problems problems by offset. */
+static void verify_database(const MMDB_s *mmdb,
+                            uint32_t max_problems,
+                            uint32_t threads,
+                            zval *return_value) {
+    const uint8_t *data_end =
+        mmdb->metadata_section - MAXMINDDB_METADATA_MARKER_LENGTH;
+    maxminddb_verifier verifier;
+    memset(&verifier, 0, sizeof(verifier));
+    verifier.mmdb = mmdb;
+    verifier.decoder.data = mmdb->data_section;
+    verifier.decoder.size =
+        data_end > mmdb->data_section
+            ? (uint32_t)(data_end - mmdb->data_section)
+            : 0;
+    verifier.data_start = mmdb->data_section - mmdb->file_content;
+    verifier.max_problems = max_problems;
+    const size_t bitmap_size = (size_t)verifier.decoder.size / 8 + 1;
+    /* The workers only read and write these, so they can come from PHP's
+       allocator and count towards memory_limit. */
+    verifier.starts = ecalloc(bitmap_size, 1);
+    verifier.verified = ecalloc(bitmap_size, 1);
+
+    /* The node and record phases get a task per thread, and the metadata
+       and depth checks one more. */
+    const uint32_t count = 2 * threads + 1;
+    maxminddb_verify_task *tasks =
+        safe_emalloc(count, sizeof(maxminddb_verify_task), 0);
+    memset(tasks, 0, count * sizeof(maxminddb_verify_task));
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        tasks[i].verifier = &verifier;
+    }
+    maxminddb_verify_task *node_tasks = tasks;
+    maxminddb_verify_task *record_tasks = tasks + threads;
+    maxminddb_verify_task *tree_task = tasks + 2 * threads;
+
+    verify_metadata(tree_task);
+
+    /* The records have all been marked once the node phase is done, so the
+       record phase can split the data section among the workers. */
+    verify_split(node_tasks, threads, mmdb->metadata.node_count, 0);
+    verify_run(verify_nodes, node_tasks, threads);
+
+    if (mmdb->metadata.node_count > 0) {
+        verify_depth(tree_task);
+    }
+
+    verify_split(record_tasks, threads, verifier.decoder.size, 1);
+    verify_run(verify_records, record_tasks, threads);
+
+    size_t problems_len = 0;
+    for (i = 0; i < count; i++) {
+        problems_len += tasks[i].problems_len;
+    }
+    maxminddb_problem *problems =
+        safe_emalloc(problems_len + 1, sizeof(maxminddb_problem), 0);
+    problems_len = 0;
+    for (i = 0; i < count; i++) {
+        uint32_t j;
+        for (j = 0; j < tasks[i].problems_len; j++) {
+            problems[problems_len] = tasks[i].problems[j];
+            problems[problems_len].sequence = problems_len;
+            problems_len++;
+        }
+        if (tasks[i].on_thread) {
+            free(tasks[i].problems);
+        } else if (tasks[i].problems) {
+            efree(tasks[i].problems);
+        }
+    }
+    qsort(problems,
+          problems_len,
+          sizeof(maxminddb_problem),
+          verify_problem_compare);
+
+    array_init(return_value);
+    size_t j;
+    for (j = 0; j < problems_len && j < max_problems; j++) {
+        zval problem;
+        array_init_size(&problem, 2);
+        add_assoc_long(&problem, "offset", (zend_long)problems[j].offset);
+        add_assoc_string(&problem, "message", problems[j].message);
+        add_next_index_zval(return_value, &problem);
+    }
+
+    efree(problems);
+    efree(tasks);
+    efree(verifier.starts);
+    efree(verifier.verified);
+}
+
+/* Converts a single scalar value. Maps and arrays are decoded by
+   decode_value(). */
+static int handle_entry_data(const MMDB_entry_data_s *entry_data,
+                             zval *z_value TSRMLS_DC) {
+    switch (entry_data->type) {
+        case MMDB_DATA_TYPE_UTF8_STRING:
+            ZVAL_STRINGL(
+                z_value, entry_data->utf8_string, entry_data->data_size);
+            break;
+        case MMDB_DATA_TYPE_BYTES:
+            ZVAL_STRINGL(z_value,
+                         (char const *)entry_data->bytes,
+                         entry_data->data_size);
+            break;
+        case MMDB_DATA_TYPE_DOUBLE:
+            ZVAL_DOUBLE(z_value, entry_data->double_value);
+            break;
+        case MMDB_DATA_TYPE_FLOAT:
+            ZVAL_DOUBLE(z_value, entry_data->float_value);
+            break;
+        case MMDB_DATA_TYPE_UINT16:
+            ZVAL_LONG(z_value, entry_data->uint16);
+            break;
+        case MMDB_DATA_TYPE_UINT32:
+            handle_uint32(entry_data, z_value TSRMLS_CC);
+            break;
+        case MMDB_DATA_TYPE_BOOLEAN:
+            ZVAL_BOOL(z_value, entry_data->boolean);
+            break;
+        case MMDB_DATA_TYPE_UINT64:
+            handle_uint64(entry_data, z_value TSRMLS_CC);
+            break;
+        case MMDB_DATA_TYPE_UINT128:
+            handle_uint128(entry_data, z_value TSRMLS_CC);
+            break;
+        case MMDB_DATA_TYPE_INT32:
+            ZVAL_LONG(z_value, entry_data->int32);
+            break;
+        default:
+            ZVAL_NULL(z_value);
+            zend_throw_exception_ex(maxminddb_exception_ce,
+                                    0 TSRMLS_CC,
+                                    "Invalid data type arguments: %d",
+                                    entry_data->type);
+            return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/* Returns the string for a map key. Keys are stored once in the data section
+   and referenced by pointers from every record that uses them, so the
+   offset identifies the key, and the table returns the same string, with its
+   hash already computed, for each use. */
+static zend_string *map_key(const MMDB_entry_data_s *entry_data,
+                            HashTable *keys) {
+    zval *interned;
+    if (keys &&
+        (interned = zend_hash_index_find(keys, entry_data->offset)) != NULL) {
+        return zend_string_copy(Z_STR_P(interned));
+    }
+
+    zend_string *key = zend_string_init(
+        entry_data->utf8_string, entry_data->data_size, 0);
+    if (keys && zend_hash_num_elements(keys) < MAXMINDDB_MAX_INTERNED_KEYS) {
+        zval z_key;
+        zend_string_hash_val(key);
+        ZVAL_STR_COPY(&z_key, key);
+        zend_hash_index_add_new(keys, entry_data->offset, &z_key);
+    }
+    return key;
+}
+
+static HashTable *object_keys(maxminddb_obj *mmdb_obj) {
+    if (NULL == mmdb_obj->keys) {
+        ALLOC_HASHTABLE(mmdb_obj->keys);
+        zend_hash_init(mmdb_obj->keys, 64, NULL, ZVAL_PTR_DTOR, 0);
+    }
+    return mmdb_obj->keys;
+}
+
+static void handle_uint128(const MMDB_entry_data_s *entry_data,
+                           zval *z_value TSRMLS_DC) {
+    uint64_t high = 0;
+    uint64_t low = 0;
+#if MMDB_UINT128_IS_BYTE_ARRAY
+    int i;
+    for (i = 0; i < 8; i++) {
+        high = (high << 8) | entry_data->uint128[i];
+    }
+
+    for (i = 8; i < 16; i++) {
+        low = (low << 8) | entry_data->uint128[i];
+    }
+#else
+    high = entry_data->uint128 >> 64;
+    low = (uint64_t)entry_data->uint128;
+#endif
+
+    char *num_str;
+    spprintf(&num_str, 0, "0x%016" PRIX64 "%016" PRIX64, high, low);
+    CHECK_ALLOCATED(num_str);
+
+    ZVAL_STRING(z_value, num_str);
+    efree(num_str);
+}
+
+static void handle_uint32(const MMDB_entry_data_s *entry_data,
+                          zval *z_value TSRMLS_DC) {
+    uint32_t val = entry_data->uint32;
+
+#if LONG_MAX >= UINT32_MAX
+    ZVAL_LONG(z_value, val);
+    return;
+#else
+    if (val <= LONG_MAX) {
+        ZVAL_LONG(z_value, val);
+        return;
+    }
+
+    char *int_str;
+    spprintf(&int_str, 0, "%" PRIu32, val);
+    CHECK_ALLOCATED(int_str);
+
+    ZVAL_STRING(z_value, int_str);
+    efree(int_str);
+#endif
+}
+
+static void handle_uint64(const MMDB_entry_data_s *entry_data,
+                          zval *z_value TSRMLS_DC) {
+    uint64_t val = entry_data->uint64;
+
+#if LONG_MAX >= UINT64_MAX
+    ZVAL_LONG(z_value, val);
+    return;
+#else
+    if (val <= LONG_MAX) {
+        ZVAL_LONG(z_value, val);
+        return;
+    }
+
+    char *int_str;
+    spprintf(&int_str, 0, "%" PRIu64, val);
+    CHECK_ALLOCATED(int_str);
+
+    ZVAL_STRING(z_value, int_str);
+    efree(int_str);
+#endif
+}
+
+static void maxminddb_free_storage(free_obj_t *object TSRMLS_DC) {
+    maxminddb_obj *obj =
+        php_maxminddb_fetch_object((zend_object *)object TSRMLS_CC);
+    if (obj->handle != NULL) {
+        handle_release(obj->handle);
+    }
+    if (obj->record_cache != NULL) {
+        cache_destroy(obj->record_cache);
+    }
+    if (obj->address_cache != NULL) {
+        cache_destroy(obj->address_cache);
+    }
+    if (obj->path != NULL) {
+        zend_string_release(obj->path);
+    }
+    if (obj->stats != NULL) {
+        stats_flush(obj);
+        efree(obj->stats);
+    }
+    if (obj->schema != NULL) {
+        schema_free(obj->schema);
+    }
+    discard_derived_state(obj);
+
+    zend_object_std_dtor(&obj->std TSRMLS_CC);
+}
+
+static zend_object *maxminddb_create_handler(zend_class_entry *type TSRMLS_DC) {
+    maxminddb_obj *obj = (maxminddb_obj *)ecalloc(1, sizeof(maxminddb_obj));
+    zend_object_std_init(&obj->std, type TSRMLS_CC);
+    object_properties_init(&(obj->std), type);
+
+    obj->std.handlers = &maxminddb_obj_handlers;
+
+    return &obj->std;
+}
+
+/* clang-format off */
+static zend_function_entry maxminddb_methods[] = {
+    PHP_ME(MaxMind_Db_Reader, __construct, arginfo_maxminddbreader_construct,
+           ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
+    PHP_ME(MaxMind_Db_Reader, persistent, arginfo_maxminddbreader_persistent,
+           ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+    PHP_ME(MaxMind_Db_Reader, close, arginfo_maxminddbreader_void, ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, get, arginfo_maxminddbreader_get,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, getWithPrefixLen, arginfo_maxminddbreader_getWithPrefixLen,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, getMany, arginfo_maxminddbreader_getMany,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, getManyWithPrefixLen, arginfo_maxminddbreader_getMany,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, getPacked, arginfo_maxminddbreader_getPacked,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, getFields, arginfo_maxminddbreader_getFields,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, registerSchema, arginfo_maxminddbreader_registerSchema,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, getObject, arginfo_maxminddbreader_getObject,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, enrichStream, arginfo_maxminddbreader_enrichStream,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, enableRecordCache, arginfo_maxminddbreader_enableRecordCache,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, recordCacheStats, arginfo_maxminddbreader_cacheStats,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, enableAddressCache, arginfo_maxminddbreader_enableRecordCache,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, addressCacheStats, arginfo_maxminddbreader_cacheStats,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, stats, arginfo_maxminddbreader_stats,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, resetStats, arginfo_maxminddbreader_void,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, reloadIfChanged, arginfo_maxminddbreader_reloadIfChanged,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, networks, arginfo_maxminddbreader_networks,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, networksWithin, arginfo_maxminddbreader_networksWithin,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, verify, arginfo_maxminddbreader_verify,  ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader, metadata, arginfo_maxminddbreader_void, ZEND_ACC_PUBLIC)
+    { NULL, NULL, NULL }
+};
+/* clang-format on */
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_metadata_construct, 0, 0, 1)
+ZEND_ARG_TYPE_INFO(0, metadata, IS_ARRAY, 0)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(MaxMind_Db_Reader_Metadata, __construct) {
+    zval *object = NULL;
+    zval *metadata_array = NULL;
+    zend_long node_count = 0;
+    zend_long record_size = 0;
+
+    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                                     getThis(),
+                                     "Oa",
+                                     &object,
+                                     metadata_ce,
+                                     &metadata_array) == FAILURE) {
+        return;
+    }
+
+    zval *tmp = NULL;
+    if ((tmp = zend_hash_str_find(HASH_OF(metadata_array),
+                                  "binary_format_major_version",
+                                  sizeof("binary_format_major_version") - 1))) {
+        zend_update_property(metadata_ce,
+                             PROP_OBJ(object),
+                             "binaryFormatMajorVersion",
+                             sizeof("binaryFormatMajorVersion") - 1,
+                             tmp);
+    }
+
+    if ((tmp = zend_hash_str_find(HASH_OF(metadata_array),
+                                  "binary_format_minor_version",
+                                  sizeof("binary_format_minor_version") - 1))) {
+        zend_update_property(metadata_ce,
+                             PROP_OBJ(object),
+                             "binaryFormatMinorVersion",
+                             sizeof("binaryFormatMinorVersion") - 1,
+                             tmp);
+    }
+
+    if ((tmp = zend_hash_str_find(HASH_OF(metadata_array),
+                                  "build_epoch",
+                                  sizeof("build_epoch") - 1))) {
+        zend_update_property(metadata_ce,
+                             PROP_OBJ(object),
+                             "buildEpoch",
+                             sizeof("buildEpoch") - 1,
+                             tmp);
+    }
+
+    if ((tmp = zend_hash_str_find(HASH_OF(metadata_array),
+                                  "database_type",
+                                  sizeof("database_type") - 1))) {
+        zend_update_property(metadata_ce,
+                             PROP_OBJ(object),
+                             "databaseType",
+                             sizeof("databaseType") - 1,
+                             tmp);
+    }
+
+    if ((tmp = zend_hash_str_find(HASH_OF(metadata_array),
+                                  "description",
+                                  sizeof("description") - 1))) {
+        zend_update_property(metadata_ce,
+                             PROP_OBJ(object),
+                             "description",
+                             sizeof("description") - 1,
+                             tmp);
+    }
+
+    if ((tmp = zend_hash_str_find(HASH_OF(metadata_array),
+                                  "ip_version",
+                                  sizeof("ip_version") - 1))) {
+        zend_update_property(metadata_ce,
+                             PROP_OBJ(object),
+                             "ipVersion",
+                             sizeof("ipVersion") - 1,
+                             tmp);
+    }
+
+    if ((tmp = zend_hash_str_find(
+             HASH_OF(metadata_array), "languages", sizeof("languages") - 1))) {
+        zend_update_property(metadata_ce,
+                             PROP_OBJ(object),
+                             "languages",
+                             sizeof("languages") - 1,
+                             tmp);
+    }
+
+    if ((tmp = zend_hash_str_find(HASH_OF(metadata_array),
+                                  "record_size",
+                                  sizeof("record_size") - 1))) {
+        zend_update_property(metadata_ce,
+                             PROP_OBJ(object),
+                             "recordSize",
+                             sizeof("recordSize") - 1,
+                             tmp);
+        if (Z_TYPE_P(tmp) == IS_LONG) {
+            record_size = Z_LVAL_P(tmp);
+        }
+    }
+
+    if (record_size != 0) {
+        zend_update_property_long(metadata_ce,
+                                  PROP_OBJ(object),
+                                  "nodeByteSize",
+                                  sizeof("nodeByteSize") - 1,
+                                  record_size / 4);
+    }
+
+    if ((tmp = zend_hash_str_find(HASH_OF(metadata_array),
+                                  "node_count",
+                                  sizeof("node_count") - 1))) {
+        zend_update_property(metadata_ce,
+                             PROP_OBJ(object),
+                             "nodeCount",
+                             sizeof("nodeCount") - 1,
+                             tmp);
+        if (Z_TYPE_P(tmp) == IS_LONG) {
+            node_count = Z_LVAL_P(tmp);
+        }
+    }
+
+    if (record_size != 0) {
+        zend_update_property_long(metadata_ce,
+                                  PROP_OBJ(object),
+                                  "searchTreeSize",
+                                  sizeof("searchTreeSize") - 1,
+                                  record_size * node_count / 4);
+    }
+}
+
+// clang-format off
+static zend_function_entry metadata_methods[] = {
+    PHP_ME(MaxMind_Db_Reader_Metadata, __construct, arginfo_metadata_construct, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
+    {NULL, NULL, NULL}
+};
+// clang-format on
+
+static void network_iterator_rewind(maxminddb_network_iterator_obj *it) {
+    it->stack[0] = it->start;
+    it->stack_len = 1;
+}
+
+static zend_string *format_network(const uint8_t *ip,
+                                   uint16_t depth,
+                                   uint16_t ip_version) {
+    static const uint8_t ipv4_subtree[12] = {0};
+    char buf[INET6_ADDRSTRLEN];
+
+    if (4 == ip_version) {
+        inet_ntop(AF_INET, ip, buf, sizeof(buf));
+    } else if (depth >= 96 && 0 == memcmp(ip, ipv4_subtree, 12)) {
+        /* A network in ::/96 is an IPv4 network. */
+        inet_ntop(AF_INET, ip + 12, buf, sizeof(buf));
+        depth -= 96;
+    } else {
+        inet_ntop(AF_INET6, ip, buf, sizeof(buf));
+    }
+    return strpprintf(0, "%s/%u", buf, (unsigned int)depth);
+}
+
+/* Moves to the next network with a record, leaving it in key and current.
+   Both are left undefined once the tree has been walked or on an error. */
+static void
+network_iterator_advance(maxminddb_network_iterator_obj *it TSRMLS_DC) {
+    static const uint8_t ipv4_subtree[12] = {0};
+
+    zval_ptr_dtor(&it->key);
+    ZVAL_UNDEF(&it->key);
+    zval_ptr_dtor(&it->current);
+    ZVAL_UNDEF(&it->current);
+
+    if (NULL == it->handle) {
+        return;
+    }
+
+    MMDB_s *mmdb = &it->handle->mmdb;
+    const uint64_t node_count = mmdb->metadata.node_count;
+    const uint16_t bit_count = 6 == mmdb->metadata.ip_version ? 128 : 32;
+
+    while (it->stack_len > 0) {
+        maxminddb_network network = it->stack[--it->stack_len];
+        zend_bool aliased = 0;
+
+        while (network.node < node_count) {
+            if (network.node == it->ipv4_start && !it->include_aliased &&
+                (96 != network.depth ||
+                 0 != memcmp(network.ip, ipv4_subtree, 12))) {
+                aliased = 1;
+                break;
+            }
+            if (network.depth >= bit_count) {
+                zend_throw_exception_ex(
+                    maxminddb_exception_ce,
+                    0 TSRMLS_CC,
+                    "The MaxMind DB file's search tree is corrupt");
+                return;
+            }
+
+            MMDB_search_node_s search_node;
+            int status =
+                MMDB_read_node(mmdb, (uint32_t)network.node, &search_node);
+            if (MMDB_SUCCESS != status) {
+                zend_throw_exception_ex(
+                    maxminddb_exception_ce,
+                    0 TSRMLS_CC,
+                    "Error reading search tree node %" PRIu64 ". %s",
+                    network.node,
+                    MMDB_strerror(status));
+                return;
+            }
+
+            maxminddb_network *right = &it->stack[it->stack_len++];
+            *right = network;
+            right->node = search_node.right_record;
+            right->ip[network.depth >> 3] |= 0x80 >> (network.depth & 7);
+            right->depth++;
+
+            network.node = search_node.left_record;
+            network.depth++;
+        }
+
+        if (aliased || network.node == node_count) {
+            continue;
+        }
+
+        const uint32_t offset = (uint32_t)(network.node - node_count -
+                                           MMDB_DATA_SECTION_SEPARATOR);
+        zval record;
+        const zval *cached = cache_find(it->records, offset, NULL, 0);
+        if (cached) {
+            ZVAL_COPY(&record, cached);
+        } else {
+            int status =
+                decode_data(mmdb, offset, it->keys, NULL, &record TSRMLS_CC);
+            if (MMDB_SUCCESS != status) {
+                if (MAXMINDDB_DECODE_THROWN != status) {
+                    zend_throw_exception_ex(
+                        maxminddb_exception_ce,
+                        0 TSRMLS_CC,
+                        "Error while decoding data at offset %u. %s",
+                        offset,
+                        MMDB_strerror(status));
+                }
+                return;
+            }
+            cache_add(it->records, offset, NULL, 0, &record);
+        }
+
+        if (it->skip_empty && Z_TYPE(record) == IS_ARRAY &&
+            0 == zend_hash_num_elements(Z_ARRVAL(record))) {
+            zval_ptr_dtor(&record);
+            continue;
+        }
+
+        ZVAL_STR(&it->key,
+                 format_network(
+                     network.ip, network.depth, mmdb->metadata.ip_version));
+        ZVAL_COPY_VALUE(&it->current, &record);
+        return;
+    }
+}
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_network_iterator_construct, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(MaxMind_Db_Reader_NetworkIterator, __construct) {}
+
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_network_iterator_mixed, 0, 0, IS_MIXED, 1)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_network_iterator_void, 0, 0, IS_VOID, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_network_iterator_valid, 0, 0, _IS_BOOL, 0)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(MaxMind_Db_Reader_NetworkIterator, current) {
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
+    }
+    maxminddb_network_iterator_obj *it = Z_NETWORK_ITERATOR_P(ZEND_THIS);
+    if (Z_TYPE(it->current) != IS_UNDEF) {
+        RETURN_ZVAL(&it->current, 1, 0);
+    }
+    RETURN_NULL();
+}
+
+PHP_METHOD(MaxMind_Db_Reader_NetworkIterator, key) {
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
+    }
+    maxminddb_network_iterator_obj *it = Z_NETWORK_ITERATOR_P(ZEND_THIS);
+    if (Z_TYPE(it->key) != IS_UNDEF) {
+        RETURN_ZVAL(&it->key, 1, 0);
+    }
+    RETURN_NULL();
+}
+
+PHP_METHOD(MaxMind_Db_Reader_NetworkIterator, next) {
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
+    }
+    network_iterator_advance(Z_NETWORK_ITERATOR_P(ZEND_THIS) TSRMLS_CC);
+}
+
+PHP_METHOD(MaxMind_Db_Reader_NetworkIterator, rewind) {
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
+    }
+    maxminddb_network_iterator_obj *it = Z_NETWORK_ITERATOR_P(ZEND_THIS);
+    network_iterator_rewind(it);
+    network_iterator_advance(it TSRMLS_CC);
+}
+
+PHP_METHOD(MaxMind_Db_Reader_NetworkIterator, valid) {
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
+    }
+    maxminddb_network_iterator_obj *it = Z_NETWORK_ITERATOR_P(ZEND_THIS);
+    RETURN_BOOL(Z_TYPE(it->key) != IS_UNDEF);
+}
+
+static void network_iterator_free_storage(free_obj_t *object TSRMLS_DC) {
+    maxminddb_network_iterator_obj *it =
+        php_maxminddb_network_iterator_fetch_object((zend_object *)object);
+
+    zval_ptr_dtor(&it->key);
+    zval_ptr_dtor(&it->current);
+    if (it->records) {
+        cache_destroy(it->records);
+    }
+    if (it->keys) {
+        zend_hash_destroy(it->keys);
+        FREE_HASHTABLE(it->keys);
+    }
+    if (it->handle) {
+        handle_release(it->handle);
+    }
+
+    zend_object_std_dtor(&it->std TSRMLS_CC);
+}
+
+static zend_object *
+network_iterator_create_handler(zend_class_entry *type TSRMLS_DC) {
+    maxminddb_network_iterator_obj *it =
+        ecalloc(1, sizeof(maxminddb_network_iterator_obj));
+    zend_object_std_init(&it->std, type TSRMLS_CC);
+    object_properties_init(&(it->std), type);
+
+    it->std.handlers = &network_iterator_obj_handlers;
+
+    return &it->std;
+}
+
+// clang-format off
+static zend_function_entry network_iterator_methods[] = {
+    PHP_ME(MaxMind_Db_Reader_NetworkIterator, __construct, arginfo_network_iterator_construct, ZEND_ACC_PRIVATE | ZEND_ACC_CTOR)
+    PHP_ME(MaxMind_Db_Reader_NetworkIterator, current, arginfo_network_iterator_mixed, ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader_NetworkIterator, key, arginfo_network_iterator_mixed, ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader_NetworkIterator, next, arginfo_network_iterator_void, ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader_NetworkIterator, rewind, arginfo_network_iterator_void, ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader_NetworkIterator, valid, arginfo_network_iterator_valid, ZEND_ACC_PUBLIC)
+    {NULL, NULL, NULL}
+};
+// clang-format on
+
+/* Sets z_value to a lazy record for a map or an array, or to the value of
+   any other entry. */
+static int lazy_record_value(maxminddb_handle *handle,
+                             const MMDB_entry_data_s *entry_data,
+                             zval *z_value TSRMLS_DC) {
+    if (MMDB_DATA_TYPE_MAP != entry_data->type &&
+        MMDB_DATA_TYPE_ARRAY != entry_data->type) {
+        return handle_entry_data(entry_data, z_value TSRMLS_CC);
+    }
+
+    object_init_ex(z_value, lazy_record_ce);
+    maxminddb_lazy_record_obj *record = Z_LAZY_RECORD_P(z_value);
+
+    handle_retain(handle);
+    record->handle = handle;
+    record->offset = entry_data->offset;
+    record->size = entry_data->data_size;
+    record->is_map = MMDB_DATA_TYPE_MAP == entry_data->type;
+    ALLOC_HASHTABLE(record->values);
+    zend_hash_init(record->values, 8, NULL, ZVAL_PTR_DTOR, 0);
+    return SUCCESS;
+}
+
+/* Reads the entry at offset into entry_data, following a pointer to the
+   entry it points to. */
+static int lazy_record_read(const maxminddb_decoder *decoder,
+                            uint32_t offset,
+                            MMDB_entry_data_s *entry_data) {
+    int status = decoder_read(decoder, offset, entry_data);
+    if (MMDB_SUCCESS == status && MMDB_DATA_TYPE_POINTER == entry_data->type) {
+        status = decoder_read(decoder, entry_data->pointer, entry_data);
+        if (MMDB_SUCCESS == status &&
+            MMDB_DATA_TYPE_POINTER == entry_data->type) {
+            status = MMDB_INVALID_DATA_ERROR;
+        }
+    }
+    return status;
+}
+
+/* Decodes every entry not decoded yet, putting the entries in the order of
+   the database. */
+static int lazy_record_complete(maxminddb_lazy_record_obj *record TSRMLS_DC) {
+    if (record->complete) {
+        return SUCCESS;
+    }
+
+    const MMDB_s *mmdb = &record->handle->mmdb;
+    const maxminddb_decoder decoder = {.data = mmdb->data_section,
+                                       .size = mmdb->data_section_size};
+    MMDB_entry_data_s entry_data;
+    int status = decoder_read(&decoder, record->offset, &entry_data);
+
+    HashTable *values;
+    ALLOC_HASHTABLE(values);
+    zend_hash_init(values, record->size, NULL, ZVAL_PTR_DTOR, 0);
+
+    uint32_t offset = MMDB_SUCCESS == status ? entry_data.offset_to_next : 0;
+    uint32_t i;
+    for (i = 0; MMDB_SUCCESS == status && i < record->size; i++) {
+        zend_string *key = NULL;
+        if (record->is_map) {
+            status = lazy_record_read(&decoder, offset, &entry_data);
+            if (MMDB_SUCCESS != status) {
+                break;
+            }
+            if (MMDB_DATA_TYPE_UTF8_STRING != entry_data.type) {
+                status = MMDB_INVALID_DATA_ERROR;
+                break;
+            }
+            key = zend_string_init(
+                entry_data.utf8_string, entry_data.data_size, 0);
+            status = decoder_skip(&decoder, offset, &offset, 0);
+            if (MMDB_SUCCESS != status) {
+                zend_string_release(key);
+                break;
+            }
+        }
+
+        zval value;
+        zval *existing = key ? zend_symtable_find(record->values, key)
+                             : zend_hash_index_find(record->values, i);
+        if (existing) {
+            ZVAL_COPY(&value, existing);
+        } else {
+            status = lazy_record_read(&decoder, offset, &entry_data);
+            if (MMDB_SUCCESS == status &&
+                lazy_record_value(record->handle,
+                                  &entry_data,
+                                  &value TSRMLS_CC) == FAILURE) {
+                status = MAXMINDDB_DECODE_THROWN;
+            }
+            if (MMDB_SUCCESS != status) {
+                if (key) {
+                    zend_string_release(key);
+                }
+                break;
+            }
+        }
+
+        if (key) {
+            zend_symtable_update(values, key, &value);
+            zend_string_release(key);
+        } else {
+            zend_hash_index_update(values, i, &value);
+        }
+        status = decoder_skip(&decoder, offset, &offset, 0);
+    }
+
+    if (MMDB_SUCCESS != status) {
+        if (MAXMINDDB_DECODE_THROWN != status) {
+            zend_throw_exception_ex(
+                maxminddb_exception_ce,
+                0 TSRMLS_CC,
+                "Error while decoding data at offset %u. %s",
+                record->offset,
+                MMDB_strerror(status));
+        }
+        zend_hash_destroy(values);
+        FREE_HASHTABLE(values);
+        return FAILURE;
+    }
+
+    zend_hash_destroy(record->values);
+    FREE_HASHTABLE(record->values);
+    record->values = values;
+    record->complete = 1;
+    return SUCCESS;
+}
+
+/* Returns the entry at offset, decoding it the first time, or NULL if there
+   is no such entry or it could not be decoded, in which case an exception
+   has been thrown. */
+static zval *lazy_record_entry(maxminddb_lazy_record_obj *record,
+                               zval *offset TSRMLS_DC) {
+    zend_string *key = NULL;
+    zend_ulong index = 0;
+
+    if (Z_TYPE_P(offset) == IS_LONG) {
+        index = (zend_ulong)Z_LVAL_P(offset);
+    } else if (Z_TYPE_P(offset) == IS_STRING) {
+        if (!ZEND_HANDLE_NUMERIC_STR(
+                Z_STRVAL_P(offset), Z_STRLEN_P(offset), index)) {
+            key = Z_STR_P(offset);
+        }
+    } else {
+        return NULL;
+    }
+
+    zval *value = key ? zend_hash_find(record->values, key)
+                      : zend_hash_index_find(record->values, index);
+    if (value || record->complete) {
+        return value;
+    }
+
+    /* A map entry is found by its key, which is an integer index when
+       PHP has turned a numeric string into one. */
+    char index_buf[MAX_LENGTH_OF_LONG + 1];
+    const char *name = NULL;
+    size_t name_len = 0;
+    if (!record->is_map) {
+        if (key || index >= record->size) {
+            return NULL;
+        }
+    } else if (key) {
+        name = ZSTR_VAL(key);
+        name_len = ZSTR_LEN(key);
+    } else {
+        name_len = snprintf(
+            index_buf, sizeof(index_buf), ZEND_LONG_FMT, (zend_long)index);
+        name = index_buf;
+    }
+
+    const MMDB_s *mmdb = &record->handle->mmdb;
+    const maxminddb_decoder decoder = {.data = mmdb->data_section,
+                                       .size = mmdb->data_section_size};
+    MMDB_entry_data_s entry_data;
+    int status = decoder_read(&decoder, record->offset, &entry_data);
+    uint32_t at = MMDB_SUCCESS == status ? entry_data.offset_to_next : 0;
+    zend_bool found = 0;
+    uint32_t i;
+    for (i = 0; MMDB_SUCCESS == status && !found && i < record->size; i++) {
+        if (!record->is_map) {
+            found = i == index;
+        } else {
+            status = lazy_record_read(&decoder, at, &entry_data);
+            if (MMDB_SUCCESS == status &&
+                MMDB_DATA_TYPE_UTF8_STRING != entry_data.type) {
+                status = MMDB_INVALID_DATA_ERROR;
+            }
+            if (MMDB_SUCCESS != status) {
+                break;
+            }
+            found = entry_data.data_size == name_len &&
+                    0 == memcmp(entry_data.utf8_string, name, name_len);
+            status = decoder_skip(&decoder, at, &at, 0);
+        }
+        if (MMDB_SUCCESS == status) {
+            status = found ? lazy_record_read(&decoder, at, &entry_data)
+                           : decoder_skip(&decoder, at, &at, 0);
+        }
+    }
+    if (MMDB_SUCCESS != status) {
+        zend_throw_exception_ex(maxminddb_exception_ce,
+                                0 TSRMLS_CC,
+                                "Error while decoding data at offset %u. %s",
+                                record->offset,
+                                MMDB_strerror(status));
+        return NULL;
+    }
+    if (!found) {
+        return NULL;
+    }
+
+    zval new_value;
+    if (lazy_record_value(record->handle, &entry_data, &new_value TSRMLS_CC) ==
+        FAILURE) {
+        return NULL;
     }
+    return key ? zend_hash_add_new(record->values, key, &new_value)
+               : zend_hash_index_add_new(record->values, index, &new_value);
+}
 
-    for (i = 8; i < 16; i++) {
-        low = (low << 8) | entry_data_list->entry_data.uint128[i];
-    }
-#else
-    high = entry_data_list->entry_data.uint128 >> 64;
-    low = (uint64_t)entry_data_list->entry_data.uint128;
-#endif
+ZEND_BEGIN_ARG_INFO_EX(arginfo_lazy_record_construct, 0, 0, 0)
+ZEND_END_ARG_INFO()
 
-    char *num_str;
-    spprintf(&num_str, 0, "0x%016" PRIX64 "%016" PRIX64, high, low);
-    CHECK_ALLOCATED(num_str);
+PHP_METHOD(MaxMind_Db_Reader_LazyRecord, __construct) {}
 
-    ZVAL_STRING(z_value, num_str);
-    efree(num_str);
-}
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_lazy_record_offsetExists, 0, 1, _IS_BOOL, 0)
+ZEND_ARG_INFO(0, offset)
+ZEND_END_ARG_INFO()
 
-static void handle_uint32(const MMDB_entry_data_list_s *entry_data_list,
-                          zval *z_value TSRMLS_DC) {
-    uint32_t val = entry_data_list->entry_data.uint32;
+PHP_METHOD(MaxMind_Db_Reader_LazyRecord, offsetExists) {
+    zval *offset;
 
-#if LONG_MAX >= UINT32_MAX
-    ZVAL_LONG(z_value, val);
-    return;
-#else
-    if (val <= LONG_MAX) {
-        ZVAL_LONG(z_value, val);
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &offset) ==
+        FAILURE) {
         return;
     }
 
-    char *int_str;
-    spprintf(&int_str, 0, "%" PRIu32, val);
-    CHECK_ALLOCATED(int_str);
-
-    ZVAL_STRING(z_value, int_str);
-    efree(int_str);
-#endif
+    RETURN_BOOL(lazy_record_entry(Z_LAZY_RECORD_P(ZEND_THIS),
+                                  offset TSRMLS_CC) != NULL);
 }
 
-static void handle_uint64(const MMDB_entry_data_list_s *entry_data_list,
-                          zval *z_value TSRMLS_DC) {
-    uint64_t val = entry_data_list->entry_data.uint64;
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_lazy_record_offsetGet, 0, 1, IS_MIXED, 1)
+ZEND_ARG_INFO(0, offset)
+ZEND_END_ARG_INFO()
 
-#if LONG_MAX >= UINT64_MAX
-    ZVAL_LONG(z_value, val);
-    return;
-#else
-    if (val <= LONG_MAX) {
-        ZVAL_LONG(z_value, val);
+PHP_METHOD(MaxMind_Db_Reader_LazyRecord, offsetGet) {
+    zval *offset;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &offset) ==
+        FAILURE) {
         return;
     }
 
-    char *int_str;
-    spprintf(&int_str, 0, "%" PRIu64, val);
-    CHECK_ALLOCATED(int_str);
-
-    ZVAL_STRING(z_value, int_str);
-    efree(int_str);
-#endif
+    zval *value =
+        lazy_record_entry(Z_LAZY_RECORD_P(ZEND_THIS), offset TSRMLS_CC);
+    if (value) {
+        RETURN_ZVAL(value, 1, 0);
+    }
+    RETURN_NULL();
 }
 
-static void maxminddb_free_storage(free_obj_t *object TSRMLS_DC) {
-    maxminddb_obj *obj =
-        php_maxminddb_fetch_object((zend_object *)object TSRMLS_CC);
-    if (obj->mmdb != NULL) {
-        MMDB_close(obj->mmdb);
-        efree(obj->mmdb);
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_lazy_record_offsetSet, 0, 2, IS_VOID, 0)
+ZEND_ARG_INFO(0, offset)
+ZEND_ARG_INFO(0, value)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(MaxMind_Db_Reader_LazyRecord, offsetSet) {
+    zval *offset;
+    zval *value;
+
+    if (zend_parse_parameters(
+            ZEND_NUM_ARGS() TSRMLS_CC, "zz", &offset, &value) == FAILURE) {
+        return;
     }
 
-    zend_object_std_dtor(&obj->std TSRMLS_CC);
+    zend_throw_exception_ex(spl_ce_BadMethodCallException,
+                            0 TSRMLS_CC,
+                            "Lazy records are read-only.");
 }
 
-static zend_object *maxminddb_create_handler(zend_class_entry *type TSRMLS_DC) {
-    maxminddb_obj *obj = (maxminddb_obj *)ecalloc(1, sizeof(maxminddb_obj));
-    zend_object_std_init(&obj->std, type TSRMLS_CC);
-    object_properties_init(&(obj->std), type);
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_lazy_record_offsetUnset, 0, 1, IS_VOID, 0)
+ZEND_ARG_INFO(0, offset)
+ZEND_END_ARG_INFO()
 
-    obj->std.handlers = &maxminddb_obj_handlers;
+PHP_METHOD(MaxMind_Db_Reader_LazyRecord, offsetUnset) {
+    zval *offset;
 
-    return &obj->std;
-}
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &offset) ==
+        FAILURE) {
+        return;
+    }
 
-/* clang-format off */
-static zend_function_entry maxminddb_methods[] = {
-    PHP_ME(MaxMind_Db_Reader, __construct, arginfo_maxminddbreader_construct,
-           ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
-    PHP_ME(MaxMind_Db_Reader, close, arginfo_maxminddbreader_void, ZEND_ACC_PUBLIC)
-    PHP_ME(MaxMind_Db_Reader, get, arginfo_maxminddbreader_get,  ZEND_ACC_PUBLIC)
-    PHP_ME(MaxMind_Db_Reader, getWithPrefixLen, arginfo_maxminddbreader_getWithPrefixLen,  ZEND_ACC_PUBLIC)
-    PHP_ME(MaxMind_Db_Reader, metadata, arginfo_maxminddbreader_void, ZEND_ACC_PUBLIC)
-    { NULL, NULL, NULL }
-};
-/* clang-format on */
+    zend_throw_exception_ex(spl_ce_BadMethodCallException,
+                            0 TSRMLS_CC,
+                            "Lazy records are read-only.");
+}
 
-ZEND_BEGIN_ARG_INFO_EX(arginfo_metadata_construct, 0, 0, 1)
-ZEND_ARG_TYPE_INFO(0, metadata, IS_ARRAY, 0)
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_lazy_record_count, 0, 0, IS_LONG, 0)
 ZEND_END_ARG_INFO()
 
-PHP_METHOD(MaxMind_Db_Reader_Metadata, __construct) {
-    zval *object = NULL;
-    zval *metadata_array = NULL;
-    zend_long node_count = 0;
-    zend_long record_size = 0;
-
-    if (zend_parse_method_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
-                                     getThis(),
-                                     "Oa",
-                                     &object,
-                                     metadata_ce,
-                                     &metadata_array) == FAILURE) {
+PHP_METHOD(MaxMind_Db_Reader_LazyRecord, count) {
+    if (zend_parse_parameters_none() == FAILURE) {
         return;
     }
 
-    zval *tmp = NULL;
-    if ((tmp = zend_hash_str_find(HASH_OF(metadata_array),
-                                  "binary_format_major_version",
-                                  sizeof("binary_format_major_version") - 1))) {
-        zend_update_property(metadata_ce,
-                             PROP_OBJ(object),
-                             "binaryFormatMajorVersion",
-                             sizeof("binaryFormatMajorVersion") - 1,
-                             tmp);
-    }
+    RETURN_LONG(Z_LAZY_RECORD_P(ZEND_THIS)->size);
+}
 
-    if ((tmp = zend_hash_str_find(HASH_OF(metadata_array),
-                                  "binary_format_minor_version",
-                                  sizeof("binary_format_minor_version") - 1))) {
-        zend_update_property(metadata_ce,
-                             PROP_OBJ(object),
-                             "binaryFormatMinorVersion",
-                             sizeof("binaryFormatMinorVersion") - 1,
-                             tmp);
-    }
+ZEND_BEGIN_ARG_WITH_RETURN_OBJ_INFO_EX(
+    arginfo_lazy_record_getIterator, 0, 0, Iterator, 0)
+ZEND_END_ARG_INFO()
 
-    if ((tmp = zend_hash_str_find(HASH_OF(metadata_array),
-                                  "build_epoch",
-                                  sizeof("build_epoch") - 1))) {
-        zend_update_property(metadata_ce,
-                             PROP_OBJ(object),
-                             "buildEpoch",
-                             sizeof("buildEpoch") - 1,
-                             tmp);
+PHP_METHOD(MaxMind_Db_Reader_LazyRecord, getIterator) {
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
     }
 
-    if ((tmp = zend_hash_str_find(HASH_OF(metadata_array),
-                                  "database_type",
-                                  sizeof("database_type") - 1))) {
-        zend_update_property(metadata_ce,
-                             PROP_OBJ(object),
-                             "databaseType",
-                             sizeof("databaseType") - 1,
-                             tmp);
+    maxminddb_lazy_record_obj *record = Z_LAZY_RECORD_P(ZEND_THIS);
+    if (lazy_record_complete(record TSRMLS_CC) == FAILURE) {
+        return;
     }
 
-    if ((tmp = zend_hash_str_find(HASH_OF(metadata_array),
-                                  "description",
-                                  sizeof("description") - 1))) {
-        zend_update_property(metadata_ce,
-                             PROP_OBJ(object),
-                             "description",
-                             sizeof("description") - 1,
-                             tmp);
-    }
+    zval values;
+    ZVAL_ARR(&values, zend_array_dup(record->values));
+    object_init_ex(return_value, spl_ce_ArrayIterator);
+    zend_call_method_with_1_params(PROP_OBJ(return_value),
+                                   spl_ce_ArrayIterator,
+                                   &spl_ce_ArrayIterator->constructor,
+                                   ZEND_CONSTRUCTOR_FUNC_NAME,
+                                   NULL,
+                                   &values);
+    zval_ptr_dtor(&values);
+}
 
-    if ((tmp = zend_hash_str_find(HASH_OF(metadata_array),
-                                  "ip_version",
-                                  sizeof("ip_version") - 1))) {
-        zend_update_property(metadata_ce,
-                             PROP_OBJ(object),
-                             "ipVersion",
-                             sizeof("ipVersion") - 1,
-                             tmp);
-    }
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(
+    arginfo_lazy_record_toArray, 0, 0, IS_ARRAY, 0)
+ZEND_END_ARG_INFO()
 
-    if ((tmp = zend_hash_str_find(
-             HASH_OF(metadata_array), "languages", sizeof("languages") - 1))) {
-        zend_update_property(metadata_ce,
-                             PROP_OBJ(object),
-                             "languages",
-                             sizeof("languages") - 1,
-                             tmp);
+PHP_METHOD(MaxMind_Db_Reader_LazyRecord, toArray) {
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
     }
 
-    if ((tmp = zend_hash_str_find(HASH_OF(metadata_array),
-                                  "record_size",
-                                  sizeof("record_size") - 1))) {
-        zend_update_property(metadata_ce,
-                             PROP_OBJ(object),
-                             "recordSize",
-                             sizeof("recordSize") - 1,
-                             tmp);
-        if (Z_TYPE_P(tmp) == IS_LONG) {
-            record_size = Z_LVAL_P(tmp);
+    maxminddb_lazy_record_obj *record = Z_LAZY_RECORD_P(ZEND_THIS);
+    if (Z_TYPE(record->array) == IS_UNDEF) {
+        zval array;
+        int status = decode_data(&record->handle->mmdb,
+                                 record->offset,
+                                 NULL,
+                                 NULL,
+                                 &array TSRMLS_CC);
+        if (MMDB_SUCCESS != status) {
+            if (MAXMINDDB_DECODE_THROWN != status) {
+                zend_throw_exception_ex(
+                    maxminddb_exception_ce,
+                    0 TSRMLS_CC,
+                    "Error while decoding data at offset %u. %s",
+                    record->offset,
+                    MMDB_strerror(status));
+            }
+            return;
         }
+        ZVAL_COPY_VALUE(&record->array, &array);
     }
+    RETURN_ZVAL(&record->array, 1, 0);
+}
 
-    if (record_size != 0) {
-        zend_update_property_long(metadata_ce,
-                                  PROP_OBJ(object),
-                                  "nodeByteSize",
-                                  sizeof("nodeByteSize") - 1,
-                                  record_size / 4);
-    }
+static void lazy_record_free_storage(free_obj_t *object TSRMLS_DC) {
+    maxminddb_lazy_record_obj *record =
+        php_maxminddb_lazy_record_fetch_object((zend_object *)object);
 
-    if ((tmp = zend_hash_str_find(HASH_OF(metadata_array),
-                                  "node_count",
-                                  sizeof("node_count") - 1))) {
-        zend_update_property(metadata_ce,
-                             PROP_OBJ(object),
-                             "nodeCount",
-                             sizeof("nodeCount") - 1,
-                             tmp);
-        if (Z_TYPE_P(tmp) == IS_LONG) {
-            node_count = Z_LVAL_P(tmp);
-        }
+    if (record->values) {
+        zend_hash_destroy(record->values);
+        FREE_HASHTABLE(record->values);
     }
-
-    if (record_size != 0) {
-        zend_update_property_long(metadata_ce,
-                                  PROP_OBJ(object),
-                                  "searchTreeSize",
-                                  sizeof("searchTreeSize") - 1,
-                                  record_size * node_count / 4);
+    zval_ptr_dtor(&record->array);
+    if (record->handle) {
+        handle_release(record->handle);
     }
+
+    zend_object_std_dtor(&record->std TSRMLS_CC);
+}
+
+static zend_object *
+lazy_record_create_handler(zend_class_entry *type TSRMLS_DC) {
+    maxminddb_lazy_record_obj *record =
+        ecalloc(1, sizeof(maxminddb_lazy_record_obj));
+    zend_object_std_init(&record->std, type TSRMLS_CC);
+    object_properties_init(&(record->std), type);
+
+    record->std.handlers = &lazy_record_obj_handlers;
+
+    return &record->std;
 }
 
 // clang-format off
-static zend_function_entry metadata_methods[] = {
-    PHP_ME(MaxMind_Db_Reader_Metadata, __construct, arginfo_metadata_construct, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
+static zend_function_entry lazy_record_methods[] = {
+    PHP_ME(MaxMind_Db_Reader_LazyRecord, __construct, arginfo_lazy_record_construct, ZEND_ACC_PRIVATE | ZEND_ACC_CTOR)
+    PHP_ME(MaxMind_Db_Reader_LazyRecord, offsetExists, arginfo_lazy_record_offsetExists, ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader_LazyRecord, offsetGet, arginfo_lazy_record_offsetGet, ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader_LazyRecord, offsetSet, arginfo_lazy_record_offsetSet, ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader_LazyRecord, offsetUnset, arginfo_lazy_record_offsetUnset, ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader_LazyRecord, count, arginfo_lazy_record_count, ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader_LazyRecord, getIterator, arginfo_lazy_record_getIterator, ZEND_ACC_PUBLIC)
+    PHP_ME(MaxMind_Db_Reader_LazyRecord, toArray, arginfo_lazy_record_toArray, ZEND_ACC_PUBLIC)
     {NULL, NULL, NULL}
 };
 // clang-format on
 
+static PHP_INI_MH(maxminddb_update_stats) {
+    maxminddb_stats_enabled = zend_ini_parse_bool(new_value);
+    return SUCCESS;
+}
+
+PHP_INI_BEGIN()
+PHP_INI_ENTRY("maxminddb.preload", "", PHP_INI_SYSTEM, NULL)
+PHP_INI_ENTRY("maxminddb.stats", "0", PHP_INI_SYSTEM, maxminddb_update_stats)
+PHP_INI_END()
+
 PHP_MINIT_FUNCTION(maxminddb) {
     zend_class_entry ce;
 
+    REGISTER_INI_ENTRIES();
+
     INIT_CLASS_ENTRY(ce, PHP_MAXMINDDB_READER_EX_NS, NULL);
     maxminddb_exception_ce =
         zend_register_internal_class_ex(&ce, zend_ce_exception);
@@ -742,6 +5916,38 @@ PHP_MINIT_FUNCTION(maxminddb) {
     maxminddb_ce = zend_register_internal_class(&ce TSRMLS_CC);
     maxminddb_ce->create_object = maxminddb_create_handler;
 
+    INIT_CLASS_ENTRY(
+        ce, PHP_MAXMINDDB_NETWORK_ITERATOR_NS, network_iterator_methods);
+    network_iterator_ce = zend_register_internal_class(&ce TSRMLS_CC);
+    network_iterator_ce->create_object = network_iterator_create_handler;
+    network_iterator_ce->ce_flags |= ZEND_ACC_FINAL;
+    zend_class_implements(network_iterator_ce TSRMLS_CC, 1, zend_ce_iterator);
+
+    memcpy(&network_iterator_obj_handlers,
+           zend_get_std_object_handlers(),
+           sizeof(zend_object_handlers));
+    network_iterator_obj_handlers.clone_obj = NULL;
+    network_iterator_obj_handlers.offset =
+        offsetof(maxminddb_network_iterator_obj, std);
+    network_iterator_obj_handlers.free_obj = network_iterator_free_storage;
+
+    INIT_CLASS_ENTRY(ce, PHP_MAXMINDDB_LAZY_RECORD_NS, lazy_record_methods);
+    lazy_record_ce = zend_register_internal_class(&ce TSRMLS_CC);
+    lazy_record_ce->create_object = lazy_record_create_handler;
+    lazy_record_ce->ce_flags |= ZEND_ACC_FINAL;
+    zend_class_implements(lazy_record_ce TSRMLS_CC,
+                          3,
+                          zend_ce_arrayaccess,
+                          zend_ce_countable,
+                          zend_ce_aggregate);
+
+    memcpy(&lazy_record_obj_handlers,
+           zend_get_std_object_handlers(),
+           sizeof(zend_object_handlers));
+    lazy_record_obj_handlers.clone_obj = NULL;
+    lazy_record_obj_handlers.offset = offsetof(maxminddb_lazy_record_obj, std);
+    lazy_record_obj_handlers.free_obj = lazy_record_free_storage;
+
     INIT_CLASS_ENTRY(ce, PHP_MAXMINDDB_METADATA_NS, metadata_methods);
     metadata_ce = zend_register_internal_class(&ce TSRMLS_CC);
     zend_declare_property_null(metadata_ce,
@@ -788,9 +5994,76 @@ PHP_MINIT_FUNCTION(maxminddb) {
                                        sizeof("MMDB_LIB_VERSION") - 1,
                                        MMDB_lib_version() TSRMLS_CC);
 
+#ifdef ZTS
+    maxminddb_registry_mutex = tsrm_mutex_alloc();
+#endif
+    zend_hash_init(&maxminddb_registry, 8, NULL, registry_entry_dtor, 1);
+#ifdef ZTS
+    zend_hash_init(&maxminddb_shared, 8, NULL, NULL, 1);
+#endif
+
+    const char *preload = INI_STR("maxminddb.preload");
+    if (preload && *preload) {
+        preload_databases(preload TSRMLS_CC);
+    }
+
+    return SUCCESS;
+}
+
+PHP_MSHUTDOWN_FUNCTION(maxminddb) {
+    zend_hash_destroy(&maxminddb_registry);
+#ifdef ZTS
+    zend_hash_destroy(&maxminddb_shared);
+#endif
+#ifdef ZTS
+    tsrm_mutex_free(maxminddb_registry_mutex);
+#endif
+
+    UNREGISTER_INI_ENTRIES();
+
     return SUCCESS;
 }
 
+/* Prints the process totals, which cover the readers freed or reset so far,
+   as phpinfo() rows. */
+static void print_process_stats(void) {
+    maxminddb_stats stats;
+    REGISTRY_LOCK();
+    stats = maxminddb_process_stats;
+    REGISTRY_UNLOCK();
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), ZEND_ULONG_FMT, stats.lookups);
+    php_info_print_table_row(2, "Lookups", buf);
+    snprintf(buf, sizeof(buf), ZEND_ULONG_FMT, stats.not_found);
+    php_info_print_table_row(2, "Addresses not found", buf);
+    snprintf(buf, sizeof(buf), ZEND_ULONG_FMT, stats.invalid_addresses);
+    php_info_print_table_row(2, "Invalid addresses", buf);
+    snprintf(buf, sizeof(buf), ZEND_ULONG_FMT, stats.values_decoded);
+    php_info_print_table_row(2, "Values decoded", buf);
+    snprintf(buf, sizeof(buf), ZEND_ULONG_FMT, stats.bytes_decoded);
+    php_info_print_table_row(2, "Bytes decoded", buf);
+    snprintf(buf, sizeof(buf), "%.6f", (double)stats.lookup_ns / 1e9);
+    php_info_print_table_row(2, "Lookup time (seconds)", buf);
+
+    smart_str depths = {0};
+    int i;
+    for (i = 0; i < 129; i++) {
+        if (stats.depths[i]) {
+            if (depths.s) {
+                smart_str_appends(&depths, ", ");
+            }
+            smart_str_append_long(&depths, i);
+            smart_str_appends(&depths, ": ");
+            smart_str_append_unsigned(&depths, stats.depths[i]);
+        }
+    }
+    smart_str_0(&depths);
+    php_info_print_table_row(
+        2, "Lookups by tree depth", depths.s ? ZSTR_VAL(depths.s) : "none");
+    smart_str_free(&depths);
+}
+
 static PHP_MINFO_FUNCTION(maxminddb) {
     php_info_print_table_start();
 
@@ -800,14 +6073,37 @@ static PHP_MINFO_FUNCTION(maxminddb) {
     php_info_print_table_row(
         2, "libmaxminddb library version", MMDB_lib_version());
 
+    REGISTRY_LOCK();
+    uint32_t persistent_count = zend_hash_num_elements(&maxminddb_registry);
+#ifdef ZTS
+    uint32_t shared_count = zend_hash_num_elements(&maxminddb_shared);
+#endif
+    REGISTRY_UNLOCK();
+    char persistent_buf[16];
+    snprintf(persistent_buf, sizeof(persistent_buf), "%u", persistent_count);
+    php_info_print_table_row(2, "Persistent databases", persistent_buf);
+#ifdef ZTS
+    snprintf(persistent_buf, sizeof(persistent_buf), "%u", shared_count);
+    php_info_print_table_row(2, "Databases shared by threads", persistent_buf);
+#endif
+
+    php_info_print_table_row(2,
+                             "Lookup statistics",
+                             maxminddb_stats_enabled ? "enabled" : "disabled");
+    if (maxminddb_stats_enabled) {
+        print_process_stats();
+    }
+
     php_info_print_table_end();
+
+    DISPLAY_INI_ENTRIES();
 }
 
 zend_module_entry maxminddb_module_entry = {STANDARD_MODULE_HEADER,
                                             PHP_MAXMINDDB_EXTNAME,
                                             NULL,
                                             PHP_MINIT(maxminddb),
-                                            NULL,
+                                            PHP_MSHUTDOWN(maxminddb),
                                             NULL,
                                             NULL,
                                             PHP_MINFO(maxminddb),
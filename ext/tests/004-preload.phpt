@@ -0,0 +1,33 @@
+--TEST--
+maxminddb.preload opens databases that Reader::persistent() then shares
+--SKIPIF--
+<?php if (!extension_loaded('maxminddb')) {
+    echo 'skip';
+} elseif (!is_file(__DIR__ . '/../../tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb')) {
+    echo 'skip the test databases are not checked out';
+} ?>
+--INI--
+maxminddb.preload={PWD}/../../tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb
+--FILE--
+<?php
+use MaxMind\Db\Reader;
+
+var_dump(ini_get('maxminddb.preload') !== '');
+
+$reader = Reader::persistent(__DIR__ . '/../../tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb');
+var_dump($reader->get('1.1.1.3'));
+$reader->close();
+
+$reader = Reader::persistent(__DIR__ . '/../../tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb');
+var_dump($reader->get('1.1.1.1'));
+?>
+--EXPECT--
+bool(true)
+array(1) {
+  ["ip"]=>
+  string(7) "1.1.1.2"
+}
+array(1) {
+  ["ip"]=>
+  string(7) "1.1.1.1"
+}
@@ -0,0 +1,54 @@
+--TEST--
+maxminddb.stats counts the lookups of each reader
+--SKIPIF--
+<?php if (!extension_loaded('maxminddb')) {
+    echo 'skip';
+} elseif (!is_file(__DIR__ . '/../../tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb')) {
+    echo 'skip the test databases are not checked out';
+} ?>
+--INI--
+maxminddb.stats=1
+--FILE--
+<?php
+use MaxMind\Db\Reader;
+
+$reader = new Reader(__DIR__ . '/../../tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb');
+$reader->get('1.1.1.1');
+$reader->get('1.1.1.3');
+
+$stats = $reader->stats();
+var_dump($stats['enabled'], $stats['lookups'], $stats['depths']);
+var_dump($stats['values_decoded'], $stats['bytes_decoded']);
+var_dump(is_float($stats['lookup_time']));
+
+$reader->get('2.2.2.2');
+try {
+    $reader->get('not an address');
+} catch (InvalidArgumentException $e) {
+}
+
+$stats = $reader->stats();
+var_dump($stats['lookups'], $stats['not_found'], $stats['invalid_addresses']);
+
+$reader->resetStats();
+$stats = $reader->stats();
+var_dump($stats['lookups'], $stats['depths']);
+?>
+--EXPECT--
+bool(true)
+int(2)
+array(2) {
+  [31]=>
+  int(1)
+  [32]=>
+  int(1)
+}
+int(6)
+int(18)
+bool(true)
+int(4)
+int(1)
+int(1)
+int(0)
+array(0) {
+}
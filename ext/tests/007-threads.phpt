@@ -0,0 +1,61 @@
+--TEST--
+Readers in different threads share one handle per database
+--SKIPIF--
+<?php if (!extension_loaded('maxminddb')) {
+    echo 'skip';
+} elseif (!PHP_ZTS || !extension_loaded('parallel')) {
+    echo 'skip requires a thread-safe build with the parallel extension';
+} elseif (!is_file(__DIR__ . '/../../tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb')) {
+    echo 'skip the test databases are not checked out';
+} ?>
+--FILE--
+<?php
+use MaxMind\Db\Reader;
+
+$file = __DIR__ . '/../../tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb';
+
+// Keeps the handle open while the threads open and close readers on it.
+$reader = new Reader($file);
+
+$lookups = static function (string $file): int {
+    $found = 0;
+    for ($i = 0; $i < 2000; ++$i) {
+        $reader = new MaxMind\Db\Reader($file);
+        if ($reader->get('1.1.1.1') === ['ip' => '1.1.1.1']) {
+            ++$found;
+        }
+        if ($i % 2) {
+            $reader->close();
+        }
+    }
+
+    return $found;
+};
+
+$futures = [];
+for ($i = 0; $i < 8; ++$i) {
+    $futures[] = (new parallel\Runtime())->run($lookups, [$file]);
+}
+$found = 0;
+foreach ($futures as $future) {
+    $found += $future->value();
+}
+var_dump($found);
+var_dump($reader->get('1.1.1.3'));
+
+// The last reader to close the handle unmaps it, and a new one opens it
+// again.
+$reader->close();
+$reader = new Reader($file);
+var_dump($reader->get('1.1.1.1'));
+?>
+--EXPECT--
+int(16000)
+array(1) {
+  ["ip"]=>
+  string(7) "1.1.1.2"
+}
+array(1) {
+  ["ip"]=>
+  string(7) "1.1.1.1"
+}
@@ -0,0 +1,131 @@
+--TEST--
+Records decoded by the extension match the pure PHP decoder on every record
+--SKIPIF--
+<?php if (!extension_loaded('maxminddb')) {
+    echo 'skip';
+} elseif (!is_file(__DIR__ . '/../../tests/data/test-data/MaxMind-DB-test-decoder.mmdb')) {
+    echo 'skip the test databases are not checked out';
+} ?>
+--FILE--
+<?php
+require_once __DIR__ . '/../../src/MaxMind/Db/Reader/Util.php';
+require_once __DIR__ . '/../../src/MaxMind/Db/Reader/Decoder.php';
+
+use MaxMind\Db\Reader;
+use MaxMind\Db\Reader\Decoder;
+use MaxMind\Db\Reader\LazyRecord;
+
+// The pure PHP decoder shares no code with the extension, so it is the
+// reference for get(), networks() and lazy records, whether read whole or
+// one entry at a time.
+$expand = static function ($value) use (&$expand) {
+    if (!$value instanceof LazyRecord) {
+        return $value;
+    }
+    $array = [];
+    foreach ($value as $key => $entry) {
+        $array[$key] = $expand($entry);
+    }
+
+    return $array;
+};
+$outcome = static function (callable $decode) use ($expand) {
+    try {
+        return $expand($decode());
+    } catch (Exception $e) {
+        return get_class($e);
+    }
+};
+
+// Returns the search tree record the address leads to.
+$findRecord = static function (string $buffer, Reader\Metadata $metadata, string $address) {
+    $packed = inet_pton($address);
+    if ($metadata->ipVersion === 6 && strlen($packed) === 4) {
+        $packed = str_repeat("\0", 12) . $packed;
+    }
+    $nodeSize = $metadata->recordSize / 4;
+    $node = 0;
+    for ($i = 0; $i < strlen($packed) * 8 && $node < $metadata->nodeCount; ++$i) {
+        $bit = 1 & (ord($packed[$i >> 3]) >> 7 - ($i % 8));
+        $bytes = substr($buffer, $node * $nodeSize, $nodeSize);
+        switch ($metadata->recordSize) {
+            case 24:
+                $node = unpack('N', "\0" . substr($bytes, $bit * 3, 3))[1];
+                break;
+            case 28:
+                $middle = ord($bytes[3]);
+                $node = $bit === 0
+                    ? (($middle & 0xF0) << 20) | unpack('N', "\0" . substr($bytes, 0, 3))[1]
+                    : (($middle & 0x0F) << 24) | unpack('N', "\0" . substr($bytes, 4, 3))[1];
+                break;
+            default:
+                $node = unpack('N', substr($bytes, $bit * 4, 4))[1];
+        }
+    }
+
+    return $node;
+};
+
+foreach (glob(__DIR__ . '/../../tests/data/test-data/*.mmdb') as $file) {
+    try {
+        $reader = new Reader($file);
+        $lazy = new Reader($file, ['lazyRecords' => true]);
+    } catch (Exception $e) {
+        continue;
+    }
+
+    $networks = [];
+    try {
+        foreach ($reader->networks() as $network => $record) {
+            $networks[$network] = $record;
+        }
+    } catch (Exception $e) {
+        // Broken databases are still compared on the networks found so far.
+    }
+
+    $metadata = $reader->metadata();
+    $buffer = file_get_contents($file);
+    $decoder = new Decoder($buffer, $metadata->searchTreeSize + 16);
+
+    $base = basename($file);
+    foreach ($networks as $network => $record) {
+        $address = strstr($network, '/', true);
+        $node = $findRecord($buffer, $metadata, $address);
+        $expected = $outcome(static function () use ($decoder, $metadata, $node) {
+            [$value] = $decoder->decode($node - $metadata->nodeCount + $metadata->searchTreeSize);
+
+            return $value;
+        });
+
+        if ($expected !== $record) {
+            echo "$base: networks() differs for $network\n";
+        }
+        $actual = $outcome(static function () use ($reader, $address) {
+            return $reader->get($address);
+        });
+        if ($expected !== $actual) {
+            echo "$base: get() differs for $address\n";
+        }
+        $actual = $outcome(static function () use ($lazy, $address) {
+            return $lazy->get($address);
+        });
+        if ($expected !== $actual) {
+            echo "$base: lazy record entries differ for $address\n";
+        }
+        $actual = $outcome(static function () use ($lazy, $address) {
+            $record = $lazy->get($address);
+
+            return $record instanceof LazyRecord ? $record->toArray() : $record;
+        });
+        if ($expected !== $actual) {
+            echo "$base: LazyRecord::toArray() differs for $address\n";
+        }
+    }
+
+    $reader->close();
+    $lazy->close();
+}
+echo "done\n";
+?>
+--EXPECT--
+done
@@ -0,0 +1,37 @@
+--TEST--
+verify() finds the same problems however many threads it uses
+--SKIPIF--
+<?php if (!extension_loaded('maxminddb')) {
+    echo 'skip';
+} elseif (!is_file(__DIR__ . '/../../tests/data/test-data/MaxMind-DB-test-decoder.mmdb')) {
+    echo 'skip the test databases are not checked out';
+} ?>
+--FILE--
+<?php
+use MaxMind\Db\Reader;
+
+foreach (glob(__DIR__ . '/../../tests/data/test-data/*.mmdb') as $file) {
+    try {
+        $reader = new Reader($file);
+    } catch (Exception $e) {
+        continue;
+    }
+
+    $base = basename($file);
+    $expected = $reader->verify(['maxProblems' => 1000]);
+    foreach ([2, 3, 8] as $threads) {
+        $problems = $reader->verify(['maxProblems' => 1000, 'threads' => $threads]);
+        if ($problems !== $expected) {
+            echo "$base: verify() differs with $threads threads\n";
+        }
+    }
+    if ($expected && $reader->verify(['maxProblems' => 1, 'threads' => 4]) !== [$expected[0]]) {
+        echo "$base: verify() does not return the first problem\n";
+    }
+
+    $reader->close();
+}
+echo "done\n";
+?>
+--EXPECT--
+done
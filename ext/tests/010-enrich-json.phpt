@@ -0,0 +1,64 @@
+--TEST--
+enrichStream() writes every record as json_encode() writes what get() returns
+--SKIPIF--
+<?php if (!extension_loaded('maxminddb')) {
+    echo 'skip';
+} elseif (!is_file(__DIR__ . '/../../tests/data/test-data/MaxMind-DB-test-decoder.mmdb')) {
+    echo 'skip the test databases are not checked out';
+} ?>
+--FILE--
+<?php
+use MaxMind\Db\Reader;
+
+// The flags the pure PHP reader encodes records with.
+$flags = JSON_UNESCAPED_SLASHES | JSON_UNESCAPED_UNICODE
+    | JSON_INVALID_UTF8_SUBSTITUTE | JSON_PARTIAL_OUTPUT_ON_ERROR;
+
+foreach (glob(__DIR__ . '/../../tests/data/test-data/*.mmdb') as $file) {
+    try {
+        $reader = new Reader($file);
+    } catch (Exception $e) {
+        continue;
+    }
+
+    $addresses = [];
+    try {
+        foreach ($reader->networks() as $network => $record) {
+            $addresses[] = strstr($network, '/', true);
+        }
+    } catch (Exception $e) {
+        // Broken databases are still compared on the networks found so far.
+    }
+
+    $input = fopen('php://memory', 'w+b');
+    $expected = '';
+    foreach ($addresses as $address) {
+        try {
+            $record = $reader->get($address);
+        } catch (Exception $e) {
+            continue;
+        }
+        fwrite($input, "$address\n");
+        $expected .= json_encode(['ip' => $address, 'record' => $record], $flags) . "\n";
+    }
+    rewind($input);
+    $output = fopen('php://memory', 'w+b');
+    $reader->enrichStream($input, $output);
+    rewind($output);
+
+    $base = basename($file);
+    $actual = explode("\n", stream_get_contents($output));
+    foreach (explode("\n", $expected) as $i => $line) {
+        if ($line !== ($actual[$i] ?? null)) {
+            echo "$base: line ", $i + 1, " differs\n  expected: $line\n  actual:   ", $actual[$i] ?? '', "\n";
+
+            break;
+        }
+    }
+
+    $reader->close();
+}
+echo "done\n";
+?>
+--EXPECT--
+done
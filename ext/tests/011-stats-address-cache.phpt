@@ -0,0 +1,37 @@
+--TEST--
+maxminddb.stats counts addresses served from the address cache as lookups
+--SKIPIF--
+<?php if (!extension_loaded('maxminddb')) {
+    echo 'skip';
+} elseif (!is_file(__DIR__ . '/../../tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb')) {
+    echo 'skip the test databases are not checked out';
+} ?>
+--INI--
+maxminddb.stats=1
+--FILE--
+<?php
+use MaxMind\Db\Reader;
+
+$reader = new Reader(__DIR__ . '/../../tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb');
+$reader->enableAddressCache(16);
+foreach (['1.1.1.1', '1.1.1.1', '2.2.2.2', '2.2.2.2', '1.1.1.1'] as $address) {
+    $reader->get($address);
+}
+
+$cache = $reader->addressCacheStats();
+var_dump($cache['hits'], $cache['misses']);
+
+$stats = $reader->stats();
+var_dump($stats['lookups'], $stats['not_found']);
+var_dump($stats['depths'][32], array_sum($stats['depths']));
+// Only the two lookups that missed the cache decoded anything.
+var_dump($stats['values_decoded']);
+?>
+--EXPECT--
+int(3)
+int(2)
+int(5)
+int(2)
+int(3)
+int(5)
+int(3)
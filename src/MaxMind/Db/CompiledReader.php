@@ -0,0 +1,581 @@
+<?php
+
+declare(strict_types=1);
+
+namespace MaxMind\Db;
+
+use MaxMind\Db\Reader\Decoder;
+use MaxMind\Db\Reader\InvalidDatabaseException;
+use MaxMind\Db\Reader\Lookups;
+use MaxMind\Db\Reader\Metadata;
+
+/**
+ * A reader for a MaxMind DB file that has been compiled into a PHP file by
+ * compile(). The compiled file returns the search tree as a string and every
+ * record already decoded, so with opcache the whole database is kept in
+ * shared memory as immutable values and lookups decode nothing. This is meant
+ * for smaller databases, such as Country and ASN databases, on hosts without
+ * the C extension.
+ *
+ * Lookups return the same values as MaxMind\Db\Reader.
+ */
+class CompiledReader
+{
+    use Lookups;
+
+    /**
+     * The version of the compiled file format, which is checked when the
+     * file is loaded.
+     *
+     * @var int
+     */
+    private static $FORMAT = 1;
+
+    /**
+     * @var int
+     */
+    private static $DATA_SECTION_SEPARATOR_SIZE = 16;
+
+    /**
+     * @var string
+     */
+    private static $METADATA_START_MARKER = "\xAB\xCD\xEFMaxMind.com";
+
+    /**
+     * @var int
+     */
+    private static $METADATA_MAX_SIZE = 131072; // 128 * 1024 = 128KiB
+
+    /**
+     * The number of records written on each line of the compiled file.
+     *
+     * @var int
+     */
+    private static $RECORDS_PER_LINE = 64;
+
+    /**
+     * The search tree, with both records of each node as 32-bit big-endian
+     * integers. A record above the node count is the index of a record in
+     * $records plus the node count plus one.
+     *
+     * @var string
+     */
+    private $tree;
+
+    /**
+     * @var array<int, mixed>
+     */
+    private $records;
+
+    /**
+     * @var array<string, mixed>
+     */
+    private $metadataArray;
+
+    /**
+     * @var int
+     */
+    private $nodeCount;
+
+    /**
+     * @var int
+     */
+    private $ipVersion;
+
+    /**
+     * @var int
+     */
+    private $ipV4Start;
+
+    /**
+     * @var bool
+     */
+    private $closed = false;
+
+    /**
+     * Loads a database compiled by compile().
+     *
+     * @param string $compiledFile the PHP file compile() wrote
+     *
+     * @throws \InvalidArgumentException if the file does not exist or is not readable
+     * @throws InvalidDatabaseException  if the file is not a compiled database of this version
+     */
+    public function __construct(string $compiledFile)
+    {
+        if (\func_num_args() !== 1) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 1 parameter, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        if (!is_file($compiledFile) || !is_readable($compiledFile)) {
+            throw new \InvalidArgumentException(
+                "The file \"$compiledFile\" does not exist or is not readable."
+            );
+        }
+
+        $compiled = include $compiledFile;
+        if (!\is_array($compiled) || ($compiled['format'] ?? null) !== self::$FORMAT) {
+            throw new InvalidDatabaseException(
+                "Error opening compiled database file ($compiledFile). "
+                . 'Is this a MaxMind DB file compiled by this version of the reader?'
+            );
+        }
+
+        $this->tree = $compiled['tree'];
+        $this->records = $compiled['records'];
+        $this->metadataArray = $compiled['metadata'];
+        $this->nodeCount = $compiled['metadata']['node_count'];
+        $this->ipVersion = $compiled['metadata']['ip_version'];
+        $this->ipV4Start = $compiled['ipV4Start'];
+    }
+
+    /**
+     * Compiles a MaxMind DB file into a PHP file for the constructor to
+     * load. Every record is decoded, once for each distinct record, so the
+     * compiled file can be much larger than the database. The file is
+     * written under a temporary name and renamed into place, so that
+     * requests loading it never see part of it.
+     *
+     * @param string $database     the MaxMind DB file to compile
+     * @param string $compiledFile the PHP file to write
+     *
+     * @throws \InvalidArgumentException if the database does not exist or is not readable
+     * @throws \RuntimeException         if the compiled file cannot be written
+     * @throws InvalidDatabaseException
+     *                                   if the database is invalid
+     */
+    public static function compile(string $database, string $compiledFile): void
+    {
+        if (\func_num_args() !== 2) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 2 parameters, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $buffer = is_dir($database) ? false : @file_get_contents($database);
+        if ($buffer === false) {
+            throw new \InvalidArgumentException(
+                "The file \"$database\" does not exist or is not readable."
+            );
+        }
+        $fileSize = \strlen($buffer);
+
+        $minStart = $fileSize - min(self::$METADATA_MAX_SIZE, $fileSize);
+        $markerOffset = strrpos(substr($buffer, $minStart), self::$METADATA_START_MARKER);
+        if ($markerOffset === false) {
+            throw new InvalidDatabaseException(
+                "Error opening database file ($database). "
+                . 'Is this a valid MaxMind DB file?'
+            );
+        }
+        $metadataStart = $minStart + $markerOffset + \strlen(self::$METADATA_START_MARKER);
+        [$metadataArray] = (new Decoder($buffer, $metadataStart))->decode($metadataStart);
+        $metadata = new Metadata($metadataArray);
+
+        $nodeCount = $metadata->nodeCount;
+        $searchTreeSize = $metadata->searchTreeSize;
+        if ($searchTreeSize + self::$DATA_SECTION_SEPARATOR_SIZE > $fileSize) {
+            throw new InvalidDatabaseException(
+                "The MaxMind DB file's search tree is corrupt"
+            );
+        }
+
+        // Decode each record the tree points to once, numbering the records
+        // in the order they are first reached.
+        $decoder = new Decoder($buffer, $searchTreeSize + self::$DATA_SECTION_SEPARATOR_SIZE);
+        $recordIndexes = [];
+        $records = [];
+        $tree = '';
+        for ($node = 0; $node < $nodeCount; ++$node) {
+            foreach ([0, 1] as $index) {
+                $record = self::readRecord($buffer, $metadata, $node, $index);
+                if ($record > $nodeCount) {
+                    $offset = $record - $nodeCount + $searchTreeSize;
+                    if ($offset >= $fileSize) {
+                        throw new InvalidDatabaseException(
+                            "The MaxMind DB file's search tree is corrupt"
+                        );
+                    }
+                    if (!isset($recordIndexes[$offset])) {
+                        $recordIndexes[$offset] = \count($records);
+                        [$records[]] = $decoder->decode($offset);
+                    }
+                    $record = $nodeCount + 1 + $recordIndexes[$offset];
+                }
+                $tree .= pack('N', $record);
+            }
+        }
+
+        $ipV4Start = 0;
+        if ($metadata->ipVersion === 6) {
+            for ($i = 0; $i < 96 && $ipV4Start < $nodeCount; ++$i) {
+                [, $ipV4Start] = unpack('N', $tree, $ipV4Start * 8);
+            }
+        }
+
+        $code = "<?php\n\n// Compiled from " . str_replace(["\r", "\n", '?>'], ' ', basename($database))
+            . ' by MaxMind\Db\CompiledReader::compile(). Do not edit.'
+            . "\n\nreturn [\n"
+            . '    \'format\' => ' . self::$FORMAT . ",\n"
+            . '    \'metadata\' => ' . self::export($metadataArray) . ",\n"
+            . '    \'ipV4Start\' => ' . $ipV4Start . ",\n"
+            . '    \'tree\' => ' . self::exportString($tree) . ",\n"
+            . "    'records' => [\n";
+        foreach (array_chunk($records, self::$RECORDS_PER_LINE) as $chunk) {
+            $code .= '        ' . implode(', ', array_map([self::class, 'export'], $chunk)) . ",\n";
+        }
+        $code .= "    ],\n];\n";
+
+        $tempFile = @tempnam(\dirname($compiledFile), basename($compiledFile));
+        if ($tempFile === false
+            || @file_put_contents($tempFile, $code) !== \strlen($code)
+            || !@chmod($tempFile, 0644)
+            || !@rename($tempFile, $compiledFile)
+        ) {
+            if ($tempFile !== false) {
+                @unlink($tempFile);
+            }
+
+            throw new \RuntimeException(
+                "Unable to write the compiled database to \"$compiledFile\"."
+            );
+        }
+    }
+
+    /**
+     * Reads one of the two records of a node in the database's own format.
+     */
+    private static function readRecord(string $buffer, Metadata $metadata, int $node, int $index): int
+    {
+        $baseOffset = $node * $metadata->nodeByteSize;
+
+        switch ($metadata->recordSize) {
+            case 24:
+                [, $record] = unpack('N', "\x00" . substr($buffer, $baseOffset + $index * 3, 3));
+
+                return $record;
+
+            case 28:
+                $bytes = substr($buffer, $baseOffset + 3 * $index, 4);
+                if ($index === 0) {
+                    $middle = (0xF0 & \ord($bytes[3])) >> 4;
+                } else {
+                    $middle = 0x0F & \ord($bytes[0]);
+                }
+                [, $record] = unpack('N', \chr($middle) . substr($bytes, $index, 3));
+
+                return $record;
+
+            case 32:
+                [, $record] = unpack('N', $buffer, $baseOffset + $index * 4);
+
+                return $record;
+
+            default:
+                throw new InvalidDatabaseException(
+                    'Unknown record size: ' . $metadata->recordSize
+                );
+        }
+    }
+
+    /**
+     * Writes a decoded value as a PHP constant expression.
+     *
+     * @param mixed $value
+     */
+    private static function export($value): string
+    {
+        if (\is_array($value)) {
+            $isList = $value === [] || array_keys($value) === range(0, \count($value) - 1);
+            $items = [];
+            foreach ($value as $key => $item) {
+                $items[] = ($isList ? '' : (\is_int($key) ? $key : self::exportString($key)) . ' => ')
+                    . self::export($item);
+            }
+
+            return '[' . implode(', ', $items) . ']';
+        }
+        if (\is_string($value)) {
+            return self::exportString($value);
+        }
+
+        return var_export($value, true);
+    }
+
+    /**
+     * Writes a string as a double-quoted literal, escaping the characters
+     * that are special there and the control characters. Other bytes are
+     * written as they are, so binary strings stay a single literal.
+     */
+    private static function exportString(string $value): string
+    {
+        static $escapes = null;
+        if ($escapes === null) {
+            $escapes = ['\\' => '\\\\', '"' => '\\"', '$' => '\\$', "\x7F" => '\\177'];
+            for ($i = 0; $i < 0x20; ++$i) {
+                $escapes[\chr($i)] = \sprintf('\\%03o', $i);
+            }
+        }
+
+        return '"' . strtr($value, $escapes) . '"';
+    }
+
+    /**
+     * Retrieves the record for the IP address.
+     *
+     * @param string $ipAddress the IP address to look up
+     *
+     * @throws \BadMethodCallException   if this method is called on a closed database
+     * @throws \InvalidArgumentException if something other than a single IP address is passed to the method
+     * @throws InvalidDatabaseException  if the search tree is corrupt
+     *
+     * @return mixed the record for the IP address
+     */
+    public function get(string $ipAddress)
+    {
+        if (\func_num_args() !== 1) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 1 parameter, %d given', __METHOD__, \func_num_args())
+            );
+        }
+        [$record] = $this->getWithPrefixLen($ipAddress);
+
+        return $record;
+    }
+
+    /**
+     * Retrieves the record for the IP address and its associated network prefix length.
+     *
+     * @param string $ipAddress the IP address to look up
+     *
+     * @throws \BadMethodCallException   if this method is called on a closed database
+     * @throws \InvalidArgumentException if something other than a single IP address is passed to the method
+     * @throws InvalidDatabaseException  if the search tree is corrupt
+     *
+     * @return array{0:mixed, 1:int} an array where the first element is the record and the
+     *                               second the network prefix length for the record
+     */
+    public function getWithPrefixLen(string $ipAddress): array
+    {
+        if (\func_num_args() !== 1) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 1 parameter, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $this->checkNotClosed();
+
+        $packedAddr = @inet_pton($ipAddress);
+        if ($packedAddr === false) {
+            throw new \InvalidArgumentException(
+                "The value \"$ipAddress\" is not a valid IP address."
+            );
+        }
+
+        return $this->lookup($packedAddr, $ipAddress);
+    }
+
+    /**
+     * Retrieves the record for an IP address in the packed in_addr form
+     * returned by inet_pton().
+     *
+     * @param string $packedAddress the 4 or 16 byte packed IP address
+     *
+     * @throws \BadMethodCallException   if this method is called on a closed database
+     * @throws \InvalidArgumentException if the packed address is neither 4 nor 16 bytes long
+     * @throws InvalidDatabaseException  if the search tree is corrupt
+     *
+     * @return mixed the record for the IP address
+     */
+    public function getPacked(string $packedAddress)
+    {
+        if (\func_num_args() !== 1) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 1 parameter, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $this->checkNotClosed();
+
+        $length = \strlen($packedAddress);
+        if ($length !== 4 && $length !== 16) {
+            throw new \InvalidArgumentException(
+                "The packed address must be 4 or 16 bytes long, $length given."
+            );
+        }
+
+        [$record] = $this->lookup($packedAddress, null);
+
+        return $record;
+    }
+
+    /**
+     * Retrieves only the requested fields of the record for an IP address,
+     * as Reader::getFields() does.
+     *
+     * @param string                  $ipAddress the IP address to look up
+     * @param array<array-key, mixed> $paths     the paths to return, each either a dot-separated
+     *                                           string such as 'country.iso_code' or an array of
+     *                                           map keys and array indexes
+     *
+     * @throws \BadMethodCallException   if this method is called on a closed database
+     * @throws \InvalidArgumentException if something other than a single IP address is passed to the method
+     *                                   or a path is neither a string nor an array
+     * @throws InvalidDatabaseException  if the search tree is corrupt
+     *
+     * @return array<array-key, mixed>|null the value of each path under the path's key, with
+     *                                      null for paths not in the record, or null if there
+     *                                      is no record for the IP address
+     */
+    public function getFields(string $ipAddress, array $paths): ?array
+    {
+        if (\func_num_args() !== 2) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 2 parameters, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        [$record] = $this->getWithPrefixLen($ipAddress);
+        if ($record === null) {
+            return null;
+        }
+
+        $fields = [];
+        foreach ($paths as $key => $path) {
+            $fields[$key] = self::valueAtPath($record, self::lookupPath($path));
+        }
+
+        return $fields;
+    }
+
+    /**
+     * Follows the path through a decoded record. Maps and arrays are both
+     * PHP arrays here; an index that is not a key is taken as a position,
+     * counting back from the end if it is negative, when the value is a list.
+     *
+     * @param mixed             $value
+     * @param array<int|string> $path
+     *
+     * @return mixed
+     */
+    private static function valueAtPath($value, array $path)
+    {
+        foreach ($path as $key) {
+            if (!\is_array($value)) {
+                return null;
+            }
+            if (\array_key_exists($key, $value)) {
+                $value = $value[$key];
+
+                continue;
+            }
+            if (\is_string($key) && !preg_match('/\A-?\d+\z/', $key)) {
+                return null;
+            }
+            $index = (int) $key;
+            if ($index < 0) {
+                $index += \count($value);
+            }
+            if ($index < 0 || !\array_key_exists($index, $value)
+                || array_keys($value) !== range(0, \count($value) - 1)
+            ) {
+                return null;
+            }
+            $value = $value[$index];
+        }
+
+        return $value;
+    }
+
+    /**
+     * @return array{0:mixed, 1:int}
+     */
+    private function lookup(string $packedAddr, ?string $ipAddress): array
+    {
+        $bitCount = \strlen($packedAddr) * 8;
+        $nodeCount = $this->nodeCount;
+
+        $node = 0;
+        if ($this->ipVersion === 6) {
+            if ($bitCount === 32) {
+                $node = $this->ipV4Start;
+            }
+        } elseif ($bitCount === 128) {
+            if ($ipAddress === null) {
+                $ipAddress = inet_ntop($packedAddr);
+            }
+
+            throw new \InvalidArgumentException(
+                "Error looking up $ipAddress. You attempted to look up an"
+                . ' IPv6 address in an IPv4-only database.'
+            );
+        }
+
+        $tree = $this->tree;
+        for ($i = 0; $i < $bitCount && $node < $nodeCount; ++$i) {
+            $bit = 1 & (\ord($packedAddr[$i >> 3]) >> 7 - ($i % 8));
+            [, $node] = unpack('N', $tree, ($node * 2 + $bit) * 4);
+        }
+        if ($node === $nodeCount) {
+            // Record is empty
+            return [null, $i];
+        }
+        if ($node > $nodeCount) {
+            return [$this->records[$node - $nodeCount - 1], $i];
+        }
+
+        throw new InvalidDatabaseException(
+            'Invalid or corrupt database. Maximum search depth reached without finding a leaf node'
+        );
+    }
+
+    /**
+     * @throws \BadMethodCallException if the database has been closed
+     *
+     * @return Metadata object for the database
+     */
+    public function metadata(): Metadata
+    {
+        if (\func_num_args()) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 0 parameters, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $this->checkNotClosed();
+
+        return new Metadata($this->metadataArray);
+    }
+
+    /**
+     * Releases the reader's references to the compiled database. With
+     * opcache, the database itself stays in shared memory.
+     */
+    public function close(): void
+    {
+        if (\func_num_args()) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 0 parameters, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        if ($this->closed) {
+            throw new \BadMethodCallException(
+                'Attempt to close a closed MaxMind DB.'
+            );
+        }
+        $this->closed = true;
+        $this->tree = '';
+        $this->records = [];
+    }
+
+    protected function checkNotClosed(): void
+    {
+        if ($this->closed) {
+            throw new \BadMethodCallException(
+                'Attempt to read from a closed MaxMind DB.'
+            );
+        }
+    }
+}
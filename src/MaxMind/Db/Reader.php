@@ -6,6 +6,8 @@ namespace MaxMind\Db;
 
 use MaxMind\Db\Reader\Decoder;
 use MaxMind\Db\Reader\InvalidDatabaseException;
+use MaxMind\Db\Reader\LazyRecord;
+use MaxMind\Db\Reader\Lookups;
 use MaxMind\Db\Reader\Metadata;
 use MaxMind\Db\Reader\Util;
 
@@ -15,6 +17,8 @@ use MaxMind\Db\Reader\Util;
  */
 class Reader
 {
+    use Lookups;
+
     /**
      * @var int
      */
@@ -26,147 +30,1592 @@ class Reader
     private static $METADATA_START_MARKER = "\xAB\xCD\xEFMaxMind.com";
 
     /**
-     * @var int<0, max>
+     * @var int<0, max>
+     */
+    private static $METADATA_START_MARKER_LENGTH = 14;
+
+    /**
+     * @var int
+     */
+    private static $METADATA_MAX_SIZE = 131072; // 128 * 1024 = 128KiB
+
+    /**
+     * The number of decoded records networks() keeps so that records shared
+     * by several networks are decoded once.
+     *
+     * @var int
+     */
+    private static $NETWORK_RECORDS_SIZE = 4096;
+
+    /**
+     * How json_encode() writes the records for enrichStream(), as the C
+     * extension writes them.
+     *
+     * @var int
+     */
+    private static $JSON_FLAGS = \JSON_UNESCAPED_SLASHES | \JSON_UNESCAPED_UNICODE
+        | \JSON_INVALID_UTF8_SUBSTITUTE | \JSON_PARTIAL_OUTPUT_ON_ERROR;
+
+    /**
+     * The number of bytes enrichStream() collects before writing them out.
+     *
+     * @var int
+     */
+    private static $OUTPUT_BUFFER_SIZE = 65536;
+
+    /**
+     * @var Decoder
+     */
+    private $decoder;
+
+    /**
+     * @var string
+     */
+    private $database;
+
+    /**
+     * @var array<string, bool>
+     */
+    private $options;
+
+    /**
+     * @var resource
+     */
+    private $fileHandle;
+
+    /**
+     * The device, inode and modification time of the file when it was
+     * opened, used to tell when it has been replaced or modified.
+     *
+     * @var array{0:int, 1:int, 2:int}
+     */
+    private $fileIdentity;
+
+    /**
+     * The whole database when the inMemory option is set.
+     *
+     * @var string|null
+     */
+    private $buffer;
+
+    /**
+     * @var int
+     */
+    private $fileSize;
+
+    /**
+     * @var int
+     */
+    private $ipV4Start;
+
+    /**
+     * @var Metadata
+     */
+    private $metadata;
+
+    /**
+     * Decoded records by data section offset, least recently used first.
+     *
+     * @var array<int, mixed>
+     */
+    private $recordCache = [];
+
+    /**
+     * @var int
+     */
+    private $recordCacheCapacity = 0;
+
+    /**
+     * @var array{hits:int, misses:int, evictions:int}
+     */
+    private $recordCacheCounts = ['hits' => 0, 'misses' => 0, 'evictions' => 0];
+
+    /**
+     * Records and prefix lengths by packed address, least recently used
+     * first.
+     *
+     * @var array<array-key, array{0:mixed, 1:int}>
+     */
+    private $addressCache = [];
+
+    /**
+     * @var int
+     */
+    private $addressCacheCapacity = 0;
+
+    /**
+     * @var array{hits:int, misses:int, evictions:int}
+     */
+    private $addressCacheCounts = ['hits' => 0, 'misses' => 0, 'evictions' => 0];
+
+    /**
+     * Whether records are returned as LazyRecord objects.
+     *
+     * @var bool
+     */
+    private $lazyRecords = false;
+
+    /**
+     * The class registered with registerSchema().
+     *
+     * @var \ReflectionClass<object>|null
+     */
+    private $schemaClass;
+
+    /**
+     * The schema's paths merged into a tree, as Decoder::decodeSchema()
+     * takes them.
+     *
+     * @var array<string, mixed>
+     */
+    private $schemaTree = [];
+
+    /**
+     * Sets properties of an object of the schema class from within the
+     * class, so that private and readonly properties can be filled.
+     *
+     * @var \Closure|null
+     */
+    private $schemaHydrator;
+
+    /**
+     * Constructs a Reader for the MaxMind DB format. The file passed to it must
+     * be a valid MaxMind DB file such as a GeoIP database file.
+     *
+     * The supported options are:
+     *
+     * * `inMemory` - read the whole file into memory when opening it, so that
+     *   lookups do not have to read from the file. This uses as much memory
+     *   as the file is large. The C extension copies its mapping of the file
+     *   into anonymous memory.
+     * * `jumpTable` - with the C extension, start lookups from a table of
+     *   where the first 16 bits of an address lead in the search tree, once
+     *   the reader has made 1,000 lookups. The tables use about 320 KB for
+     *   each address family and are shared by the readers of the same open
+     *   file. This reader accepts the option and ignores it.
+     * * `prefault` - with the C extension, read the whole mapping in when
+     *   opening the file, so that the first lookups do not wait for it.
+     * * `lock` - with the C extension, lock the mapping into memory. A
+     *   \RuntimeException is thrown if that is not allowed.
+     * * `hugePages` - with the C extension, ask for transparent huge pages
+     *   for the mapping. This is most effective together with `inMemory`.
+     * * `lazyRecords` - return maps and arrays from get(), getMany(),
+     *   getPacked() and their variants as Reader\LazyRecord objects, which
+     *   decode each entry when it is first read. This saves decoding the
+     *   parts of a record that are not used.
+     * * `apcu` - keep the decoded metadata and the IPv4 start node of the
+     *   file in APCu, keyed by its path, inode, modification time and size,
+     *   so that later requests opening the same file skip finding and
+     *   decoding them. This is ignored when APCu is not enabled. The C
+     *   extension accepts the option and ignores it.
+     *
+     * This reader accepts `jumpTable`, `prefault`, `lock` and `hugePages` and
+     * ignores them.
+     *
+     * @param string              $database the MaxMind DB file to use
+     * @param array<string, bool> $options  the options for opening the file
+     *
+     * @throws \InvalidArgumentException for invalid database path or unknown arguments
+     * @throws InvalidDatabaseException
+     *                                   if the database is invalid or there is an error reading
+     *                                   from it
+     */
+    public function __construct(string $database, array $options = [])
+    {
+        if (\func_num_args() > 2) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects at most 2 parameters, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $inMemory = false;
+        $apcu = false;
+        foreach ($options as $name => $value) {
+            switch ($name) {
+                case 'inMemory':
+                    $inMemory = (bool) $value;
+
+                    break;
+
+                case 'lazyRecords':
+                    $this->lazyRecords = (bool) $value;
+
+                    break;
+
+                case 'apcu':
+                    $apcu = (bool) $value;
+
+                    break;
+
+                case 'jumpTable':
+                case 'prefault':
+                case 'lock':
+                case 'hugePages':
+                    // Only used by the C extension.
+                    break;
+
+                default:
+                    throw new \InvalidArgumentException(
+                        "Unknown option \"$name\"."
+                    );
+            }
+        }
+
+        if (is_dir($database)) {
+            // This matches the error that the C extension throws.
+            throw new InvalidDatabaseException(
+                "Error opening database file ($database). Is this a valid MaxMind DB file?"
+            );
+        }
+
+        $fileHandle = @fopen($database, 'rb');
+        if ($fileHandle === false) {
+            throw new \InvalidArgumentException(
+                "The file \"$database\" does not exist or is not readable."
+            );
+        }
+        $this->fileHandle = $fileHandle;
+
+        $fstat = fstat($fileHandle);
+        if ($fstat === false) {
+            throw new \UnexpectedValueException(
+                "Error determining the size of \"$database\"."
+            );
+        }
+        $this->fileSize = $fstat['size'];
+        $this->fileIdentity = [$fstat['dev'], $fstat['ino'], $fstat['mtime']];
+        $this->database = $database;
+        $this->options = $options;
+
+        if ($inMemory) {
+            $buffer = stream_get_contents($fileHandle, -1, 0);
+            if ($buffer === false || \strlen($buffer) !== $this->fileSize) {
+                throw new InvalidDatabaseException(
+                    "Error reading database file ($database)."
+                );
+            }
+            $this->buffer = $buffer;
+        }
+
+        $cacheKey = null;
+        $cached = false;
+        if ($apcu && \function_exists('apcu_enabled') && apcu_enabled()) {
+            $cacheKey = 'maxmind-db-reader:' . $fstat['dev'] . ':' . $fstat['ino']
+                . ':' . $fstat['mtime'] . ':' . $fstat['size'] . ':' . $database;
+            $cached = apcu_fetch($cacheKey);
+        }
+
+        if (\is_array($cached) && \count($cached) === 2) {
+            [$metadataArray, $ipV4Start] = $cached;
+        } else {
+            $start = $this->findMetadataStart($database);
+            $metadataDecoder = new Decoder($this->buffer ?? $this->fileHandle, $start);
+            [$metadataArray] = $metadataDecoder->decode($start);
+            $ipV4Start = null;
+        }
+        $this->metadata = new Metadata($metadataArray);
+        $this->decoder = new Decoder(
+            $this->buffer ?? $this->fileHandle,
+            $this->metadata->searchTreeSize + self::$DATA_SECTION_SEPARATOR_SIZE
+        );
+        $this->ipV4Start = $ipV4Start ?? $this->ipV4StartNode();
+
+        if ($cacheKey !== null && $ipV4Start === null) {
+            apcu_store($cacheKey, [$metadataArray, $this->ipV4Start]);
+        }
+    }
+
+    /**
+     * Returns a Reader backed by a process-wide copy of the database.
+     *
+     * With the C extension, the database is opened once per process and
+     * shared by every reader returned for the same file, including across
+     * requests, until the file is replaced or modified. Databases listed in
+     * the maxminddb.preload INI setting are opened when the extension loads.
+     * The pure PHP reader cannot keep state beyond a request, so here this is
+     * equivalent to the constructor.
+     *
+     * @param string $database the MaxMind DB file to use
+     *
+     * @throws \InvalidArgumentException for invalid database path or unknown arguments
+     * @throws InvalidDatabaseException
+     *                                   if the database is invalid or there is an error reading
+     *                                   from it
+     */
+    public static function persistent(string $database): self
+    {
+        if (\func_num_args() !== 1) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 1 parameter, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        return new self($database);
+    }
+
+    /**
+     * Retrieves the record for the IP address.
+     *
+     * @param string $ipAddress the IP address to look up
+     *
+     * @throws \BadMethodCallException   if this method is called on a closed database
+     * @throws \InvalidArgumentException if something other than a single IP address is passed to the method
+     * @throws InvalidDatabaseException
+     *                                   if the database is invalid or there is an error reading
+     *                                   from it
+     *
+     * @return mixed the record for the IP address
+     */
+    public function get(string $ipAddress)
+    {
+        if (\func_num_args() !== 1) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 1 parameter, %d given', __METHOD__, \func_num_args())
+            );
+        }
+        [$record] = $this->getWithPrefixLen($ipAddress);
+
+        return $record;
+    }
+
+    /**
+     * Retrieves the record for the IP address and its associated network prefix length.
+     *
+     * @param string $ipAddress the IP address to look up
+     *
+     * @throws \BadMethodCallException   if this method is called on a closed database
+     * @throws \InvalidArgumentException if something other than a single IP address is passed to the method
+     * @throws InvalidDatabaseException
+     *                                   if the database is invalid or there is an error reading
+     *                                   from it
+     *
+     * @return array{0:mixed, 1:int} an array where the first element is the record and the
+     *                               second the network prefix length for the record
+     */
+    public function getWithPrefixLen(string $ipAddress): array
+    {
+        if (\func_num_args() !== 1) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 1 parameter, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $this->checkNotClosed();
+
+        return $this->lookupPackedAddress($this->packAddress($ipAddress), $ipAddress);
+    }
+
+    /**
+     * Retrieves the record for an IP address in the packed in_addr form
+     * returned by inet_pton(). This skips parsing the textual address.
+     *
+     * @param string $packedAddress the 4 or 16 byte packed IP address
+     *
+     * @throws \BadMethodCallException   if this method is called on a closed database
+     * @throws \InvalidArgumentException if the packed address is neither 4 nor 16 bytes long
+     * @throws InvalidDatabaseException
+     *                                   if the database is invalid or there is an error reading
+     *                                   from it
+     *
+     * @return mixed the record for the IP address
+     */
+    public function getPacked(string $packedAddress)
+    {
+        if (\func_num_args() !== 1) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 1 parameter, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $this->checkNotClosed();
+
+        $length = \strlen($packedAddress);
+        if ($length !== 4 && $length !== 16) {
+            throw new \InvalidArgumentException(
+                "The packed address must be 4 or 16 bytes long, $length given."
+            );
+        }
+
+        [$record] = $this->lookupPackedAddress($packedAddress, null);
+
+        return $record;
+    }
+
+    /**
+     * Retrieves only the requested fields of the record for an IP address.
+     * The values along each path are located without decoding the rest of
+     * the record, which is much cheaper than get() when only a few fields
+     * of a large record are needed.
+     *
+     * @param string                  $ipAddress the IP address to look up
+     * @param array<array-key, mixed> $paths     the paths to return, each either a dot-separated
+     *                                           string such as 'country.iso_code' or an array of
+     *                                           map keys and array indexes
+     *
+     * @throws \BadMethodCallException   if this method is called on a closed database
+     * @throws \InvalidArgumentException if something other than a single IP address is passed to the method
+     *                                   or a path is neither a string nor an array
+     * @throws InvalidDatabaseException
+     *                                   if the database is invalid or there is an error reading
+     *                                   from it
+     *
+     * @return array<array-key, mixed>|null the value of each path under the path's key, with
+     *                                      null for paths not in the record, or null if there
+     *                                      is no record for the IP address
+     */
+    public function getFields(string $ipAddress, array $paths): ?array
+    {
+        if (\func_num_args() !== 2) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 2 parameters, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $this->checkNotClosed();
+
+        [$pointer] = $this->findAddressInTree($ipAddress);
+        if ($pointer === 0) {
+            return null;
+        }
+
+        $offset = $this->resolveDataOffset($pointer);
+
+        $fields = [];
+        foreach ($paths as $key => $path) {
+            $fields[$key] = $this->decoder->decodePath($offset, self::lookupPath($path));
+        }
+
+        return $fields;
+    }
+
+    /**
+     * Registers the class that getObject() returns records as, and the path
+     * in the record of each of its properties. With the C extension, the
+     * paths are compiled once into a plan that getObject() follows through
+     * the record, filling the object's properties as it reaches their values
+     * and skipping the rest of the record. Registering another schema
+     * replaces this one.
+     *
+     * The class must be final. Its properties must be declared and not
+     * static; they may be private or readonly, and typed properties are
+     * checked as in a strict assignment.
+     *
+     * @param string                  $class the class to return records as
+     * @param array<array-key, mixed> $paths the path of each property, under the property's
+     *                                       name, each either a dot-separated string such as
+     *                                       'location.latitude' or an array of map keys and
+     *                                       array indexes
+     *
+     * @throws \BadMethodCallException   if this method is called on a closed database
+     * @throws \InvalidArgumentException if the class is not a final class, a property is not
+     *                                   declared or a path is neither a string nor an array
+     */
+    public function registerSchema(string $class, array $paths): void
+    {
+        if (\func_num_args() !== 2) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 2 parameters, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $this->checkNotClosed();
+
+        if (!class_exists($class) && !interface_exists($class) && !trait_exists($class)) {
+            throw new \InvalidArgumentException("Class $class does not exist.");
+        }
+        $reflection = new \ReflectionClass($class);
+        if (!$reflection->isFinal() || $reflection->isInternal() || $reflection->isAbstract()
+            || $reflection->isInterface() || $reflection->isTrait()
+            || (method_exists($reflection, 'isEnum') && $reflection->isEnum())
+        ) {
+            throw new \InvalidArgumentException(
+                "The schema class must be a final, user-defined class; {$reflection->getName()} is not."
+            );
+        }
+
+        $tree = [];
+        foreach ($paths as $name => $path) {
+            if (!\is_string($name)) {
+                throw new \InvalidArgumentException(
+                    'Each key of the schema must be a property name.'
+                );
+            }
+            if (!$reflection->hasProperty($name)
+                || $reflection->getProperty($name)->isStatic()
+                // Virtual properties, from PHP 8.4, have no value to set.
+                || (method_exists(\ReflectionProperty::class, 'isVirtual')
+                    && $reflection->getProperty($name)->isVirtual())
+            ) {
+                throw new \InvalidArgumentException(
+                    "{$reflection->getName()}::\$$name is not a declared instance property."
+                );
+            }
+
+            $node = &$tree;
+            foreach (self::lookupPath($path) as $segment) {
+                $node = &$node['children'][$segment];
+            }
+            $node['properties'][] = $name;
+            unset($node);
+        }
+
+        $this->schemaClass = $reflection;
+        $this->schemaTree = $tree;
+        $this->schemaHydrator = \Closure::bind(
+            static function (object $object, array $values): void {
+                foreach ($values as $name => $value) {
+                    $object->{$name} = $value;
+                }
+            },
+            null,
+            $reflection->getName()
+        );
+    }
+
+    /**
+     * Retrieves the record for the IP address as an object of the class
+     * registered with registerSchema(). The class's constructor is not
+     * called. Properties whose paths are not in the record keep their
+     * default values, and typed properties without one are left
+     * uninitialized.
+     *
+     * @param string $ipAddress the IP address to look up
+     *
+     * @throws \BadMethodCallException   if this method is called on a closed database or before
+     *                                   a schema is registered
+     * @throws \InvalidArgumentException if something other than a single IP address is passed to the method
+     * @throws \TypeError                if a value does not match the type of its property
+     * @throws InvalidDatabaseException
+     *                                   if the database is invalid or there is an error reading
+     *                                   from it
+     *
+     * @return object|null the record, or null if there is no record for the IP address
+     */
+    public function getObject(string $ipAddress): ?object
+    {
+        if (\func_num_args() !== 1) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 1 parameter, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $this->checkNotClosed();
+
+        if ($this->schemaClass === null || $this->schemaHydrator === null) {
+            throw new \BadMethodCallException(
+                'No schema has been registered. Call registerSchema() first.'
+            );
+        }
+
+        [$pointer] = $this->findAddressInTree($ipAddress);
+        if ($pointer === 0) {
+            return null;
+        }
+
+        $values = $this->decoder->decodeSchema(
+            $this->resolveDataOffset($pointer),
+            $this->schemaTree
+        );
+        $object = $this->schemaClass->newInstanceWithoutConstructor();
+        ($this->schemaHydrator)($object, $values);
+
+        return $object;
+    }
+
+    /**
+     * Looks up the IP address on each line of a stream, such as a log file,
+     * and writes a line with its record to another stream. With the C
+     * extension, the whole stream is handled in C and the records are
+     * written out without being converted to PHP values.
+     *
+     * The supported options are:
+     *
+     * * `format` - `jsonl`, the default, writes a JSON object per line with
+     *   the address under `ip` and what get(), or getFields() if `fields` is
+     *   given, returns for it under `record`. `tsv` writes the address and
+     *   then each field, separated by tabs. Tabs, newlines, carriage returns
+     *   and backslashes in strings are escaped with a backslash, maps and
+     *   arrays are written as JSON, and missing fields are left empty.
+     * * `fields` - the paths to write instead of the whole record, as
+     *   getFields() takes them. The `tsv` format requires them.
+     * * `column` - the column of each line that holds the address,
+     *   counting from 0, rather than the whole line.
+     * * `delimiter` - the character that separates the columns, a tab by
+     *   default.
+     *
+     * Blank lines are skipped. An address that is not valid, or that the
+     * database cannot hold, is written with a null record, as is one that
+     * is not in the database.
+     *
+     * If reading the database or writing the output fails, the lines before
+     * the one that failed are written out before the exception is thrown,
+     * so that the output always ends with a whole line.
+     *
+     * @param resource             $input   the stream to read addresses from
+     * @param resource             $output  the stream to write records to
+     * @param array<string, mixed> $options the format and the fields to write
+     *
+     * @throws \BadMethodCallException   if this method is called on a closed database
+     * @throws \InvalidArgumentException if a stream or an option is not valid
+     * @throws \RuntimeException         if writing to the output stream fails
+     * @throws InvalidDatabaseException
+     *                                   if the database is invalid or there is an error reading
+     *                                   from it
+     *
+     * @return int the number of lines written
+     */
+    public function enrichStream($input, $output, array $options = []): int
+    {
+        if (\func_num_args() > 3) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects at most 3 parameters, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $this->checkNotClosed();
+
+        foreach (['input' => $input, 'output' => $output] as $name => $stream) {
+            if (!\is_resource($stream) || get_resource_type($stream) !== 'stream') {
+                throw new \InvalidArgumentException("The $name must be a stream.");
+            }
+        }
+
+        $tsv = false;
+        $fields = null;
+        $column = null;
+        $delimiter = "\t";
+        foreach ($options as $name => $value) {
+            switch ($name) {
+                case 'format':
+                    if ($value !== 'jsonl' && $value !== 'tsv') {
+                        throw new \InvalidArgumentException(
+                            'The format must be "jsonl" or "tsv".'
+                        );
+                    }
+                    $tsv = $value === 'tsv';
+
+                    break;
+
+                case 'fields':
+                    if (!\is_array($value)) {
+                        throw new \InvalidArgumentException(
+                            'The fields must be an array of paths.'
+                        );
+                    }
+                    $fields = array_map([self::class, 'lookupPath'], $value);
+
+                    break;
+
+                case 'column':
+                    if ($value !== null && (!\is_int($value) || $value < 0)) {
+                        throw new \InvalidArgumentException(
+                            'The column must be a non-negative integer.'
+                        );
+                    }
+                    $column = $value;
+
+                    break;
+
+                case 'delimiter':
+                    if (!\is_string($value) || \strlen($value) !== 1) {
+                        throw new \InvalidArgumentException(
+                            'The delimiter must be a single character.'
+                        );
+                    }
+                    $delimiter = $value;
+
+                    break;
+
+                default:
+                    throw new \InvalidArgumentException("Unknown option \"$name\".");
+            }
+        }
+        if ($tsv && $fields === null) {
+            throw new \InvalidArgumentException('The tsv format requires fields.');
+        }
+
+        $lines = 0;
+        // Only whole lines are added to the buffer.
+        $buffer = '';
+        try {
+            while (($line = fgets($input)) !== false) {
+                $line = rtrim($line, "\r\n");
+                if ($line === '') {
+                    continue;
+                }
+
+                $address = $line;
+                if ($column !== null) {
+                    $address = explode($delimiter, $line, $column + 2)[$column] ?? '';
+                }
+                $address = trim($address, " \t");
+
+                try {
+                    $record = $fields === null ? $this->get($address) : $this->getFields($address, $fields);
+                } catch (\InvalidArgumentException $e) {
+                    $record = null;
+                }
+
+                if ($tsv) {
+                    $row = [self::tsvValue($address)];
+                    foreach (array_keys($fields) as $key) {
+                        $row[] = self::tsvValue($record[$key] ?? null);
+                    }
+                    $buffer .= implode("\t", $row) . "\n";
+                } else {
+                    if ($record instanceof LazyRecord) {
+                        $record = $record->toArray();
+                    }
+                    $buffer .= json_encode(['ip' => $address, 'record' => $record], self::$JSON_FLAGS) . "\n";
+                }
+                ++$lines;
+
+                if (\strlen($buffer) >= self::$OUTPUT_BUFFER_SIZE) {
+                    $chunk = $buffer;
+                    $buffer = '';
+                    self::writeAll($output, $chunk);
+                }
+            }
+        } catch (\Throwable $e) {
+            // Write out the lines before the one that failed, so that the
+            // output ends with a whole line.
+            @fwrite($output, $buffer);
+
+            throw $e;
+        }
+        self::writeAll($output, $buffer);
+
+        return $lines;
+    }
+
+    /**
+     * Formats a value for the tsv format of enrichStream().
+     *
+     * @param mixed $value
+     */
+    private static function tsvValue($value): string
+    {
+        if ($value === null) {
+            return '';
+        }
+        if (\is_string($value)) {
+            return strtr($value, ['\\' => '\\\\', "\t" => '\\t', "\n" => '\\n', "\r" => '\\r']);
+        }
+
+        return (string) json_encode($value, self::$JSON_FLAGS);
+    }
+
+    /**
+     * @param resource $stream
+     */
+    private static function writeAll($stream, string $data): void
+    {
+        if ($data !== '' && fwrite($stream, $data) !== \strlen($data)) {
+            throw new \RuntimeException('Unable to write to the output stream.');
+        }
+    }
+
+    /**
+     * Enables caching of decoded records. Many networks in a database share
+     * one record, so a lookup in a network near a recent one can often
+     * return the cached record instead of decoding it again. Calling this
+     * again replaces the cache and resets its statistics.
+     *
+     * @param int $capacity the maximum number of records to keep, or 0 to
+     *                      disable the cache
+     *
+     * @throws \BadMethodCallException   if this method is called on a closed database
+     * @throws \InvalidArgumentException if the capacity is negative
+     */
+    public function enableRecordCache(int $capacity): void
+    {
+        if (\func_num_args() !== 1) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 1 parameter, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $this->checkNotClosed();
+
+        if ($capacity < 0) {
+            throw new \InvalidArgumentException(
+                'The record cache capacity must not be negative.'
+            );
+        }
+
+        $this->recordCache = [];
+        $this->recordCacheCapacity = $capacity;
+        $this->recordCacheCounts = ['hits' => 0, 'misses' => 0, 'evictions' => 0];
+    }
+
+    /**
+     * Returns the record cache's capacity, the number of records it holds,
+     * and its hit, miss and eviction counts.
+     *
+     * @return array{capacity:int, size:int, hits:int, misses:int, evictions:int}
+     */
+    public function recordCacheStats(): array
+    {
+        if (\func_num_args()) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 0 parameters, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        return [
+            'capacity' => $this->recordCacheCapacity,
+            'size' => \count($this->recordCache),
+        ] + $this->recordCacheCounts;
+    }
+
+    /**
+     * Enables caching of the results of lookups by address. When a few
+     * addresses make up most lookups, a repeated address returns its cached
+     * record and prefix length without searching the tree or decoding the
+     * record again. Calling this again replaces the cache and resets its
+     * statistics.
+     *
+     * @param int $capacity the maximum number of addresses to keep, or 0 to
+     *                      disable the cache
+     *
+     * @throws \BadMethodCallException   if this method is called on a closed database
+     * @throws \InvalidArgumentException if the capacity is negative
+     */
+    public function enableAddressCache(int $capacity): void
+    {
+        if (\func_num_args() !== 1) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 1 parameter, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $this->checkNotClosed();
+
+        if ($capacity < 0) {
+            throw new \InvalidArgumentException(
+                'The address cache capacity must not be negative.'
+            );
+        }
+
+        $this->addressCache = [];
+        $this->addressCacheCapacity = $capacity;
+        $this->addressCacheCounts = ['hits' => 0, 'misses' => 0, 'evictions' => 0];
+    }
+
+    /**
+     * Returns the address cache's capacity, the number of addresses it
+     * holds, and its hit, miss and eviction counts.
+     *
+     * @return array{capacity:int, size:int, hits:int, misses:int, evictions:int}
+     */
+    public function addressCacheStats(): array
+    {
+        if (\func_num_args()) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 0 parameters, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        return [
+            'capacity' => $this->addressCacheCapacity,
+            'size' => \count($this->addressCache),
+        ] + $this->addressCacheCounts;
+    }
+
+    /**
+     * Returns the reader's lookup statistics. These are only collected by
+     * the C extension, when maxminddb.stats is enabled, so this reader
+     * always reports them as disabled, with every count at zero.
+     *
+     * @return array{enabled:bool, lookups:int, not_found:int, invalid_addresses:int, depths:array<int, int>, bytes_decoded:int, values_decoded:int, lookup_time:float}
+     */
+    public function stats(): array
+    {
+        if (\func_num_args()) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 0 parameters, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        return [
+            'enabled' => false,
+            'lookups' => 0,
+            'not_found' => 0,
+            'invalid_addresses' => 0,
+            'depths' => [],
+            'bytes_decoded' => 0,
+            'values_decoded' => 0,
+            'lookup_time' => 0.0,
+        ];
+    }
+
+    /**
+     * Sets the reader's lookup statistics back to zero. As this reader does
+     * not collect them, this does nothing.
+     */
+    public function resetStats(): void
+    {
+        if (\func_num_args()) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 0 parameters, %d given', __METHOD__, \func_num_args())
+            );
+        }
+    }
+
+    /**
+     * Opens the database again if the file has been replaced or modified
+     * since it was opened, so that long-running processes can pick up
+     * updates without creating a new reader. The new file is opened and
+     * checked before the reader switches to it; if that fails, the reader
+     * keeps using the database it has. A missing file is taken to be in the
+     * middle of being replaced and is not an error. Iterators returned by
+     * networks() finish walking the database they started on.
+     *
+     * @throws \BadMethodCallException  if this method is called on a closed database
+     * @throws InvalidDatabaseException
+     *                                  if the new file is not a valid MaxMind DB file
+     *
+     * @return bool whether the database was opened again
+     */
+    public function reloadIfChanged(): bool
+    {
+        if (\func_num_args()) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects exactly 0 parameters, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $this->checkNotClosed();
+
+        clearstatcache(true, $this->database);
+        $stat = @stat($this->database);
+        if ($stat === false
+            || $this->fileIdentity === [$stat['dev'], $stat['ino'], $stat['mtime']]
+        ) {
+            return false;
+        }
+
+        try {
+            $reader = new self($this->database, $this->options);
+        } catch (\InvalidArgumentException $e) {
+            // The file was removed after the stat() call above.
+            return false;
+        }
+
+        // The old file is closed once no iterator from networks() uses it.
+        $this->fileHandle = $reader->fileHandle;
+        $this->fileIdentity = $reader->fileIdentity;
+        $this->fileSize = $reader->fileSize;
+        $this->buffer = $reader->buffer;
+        $this->metadata = $reader->metadata;
+        $this->decoder = $reader->decoder;
+        $this->ipV4Start = $reader->ipV4Start;
+        $this->recordCache = [];
+        $this->recordCacheCounts = ['hits' => 0, 'misses' => 0, 'evictions' => 0];
+        $this->addressCache = [];
+        $this->addressCacheCounts = ['hits' => 0, 'misses' => 0, 'evictions' => 0];
+
+        return true;
+    }
+
+    /**
+     * Returns an iterator over every network in the database that has a
+     * record. It walks the search tree in address order, yielding each
+     * network in CIDR notation as the key and its record as the value. IPv4
+     * networks in an IPv6 database are given in IPv4 notation.
+     *
+     * The supported options are:
+     *
+     * * `includeAliasedNetworks` - also yield the networks, such as
+     *   ::ffff:0:0/96, that IPv6 databases alias to the IPv4 subtree. These
+     *   repeat the IPv4 networks, so they are skipped by default.
+     * * `skipEmptyValues` - skip networks whose record is an empty map or
+     *   array.
+     *
+     * @param array<string, bool> $options the iteration options
+     *
+     * @throws \BadMethodCallException   if this method is called on a closed database
+     * @throws \InvalidArgumentException if an option is not known
+     * @throws InvalidDatabaseException
+     *                                   if the database is invalid or there is an error reading
+     *                                   from it
+     *
+     * @return \Iterator<string, mixed>
+     */
+    public function networks(array $options = []): \Iterator
+    {
+        if (\func_num_args() > 1) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects at most 1 parameter, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $this->checkNotClosed();
+
+        [$includeAliasedNetworks, $skipEmptyValues] = $this->networkOptions($options);
+        $bitCount = $this->metadata->ipVersion === 6 ? 128 : 32;
+
+        // The walk uses a copy of the reader, which reloadIfChanged() leaves
+        // on the database it had.
+        return (clone $this)->walkNetworks(
+            $includeAliasedNetworks,
+            $skipEmptyValues,
+            0,
+            str_repeat("\x00", $bitCount >> 3),
+            0
+        );
+    }
+
+    /**
+     * Returns an iterator over the networks with a record within the given
+     * network, such as `'1.2.0.0/16'`, as networks() does for the whole
+     * database. Only the part of the search tree under the network is
+     * walked. If the database has a record for a larger network containing
+     * the given one, that network is the only one returned.
+     *
+     * It accepts the same options as networks().
+     *
+     * @param string              $network a network in CIDR notation
+     * @param array<string, bool> $options the iteration options
+     *
+     * @throws \BadMethodCallException   if this method is called on a closed database
+     * @throws \InvalidArgumentException if the network is not valid, is an IPv6
+     *                                   network and the database an IPv4 one,
+     *                                   or if an option is not known
+     * @throws InvalidDatabaseException
+     *                                   if the database is invalid or there is an error reading
+     *                                   from it
+     *
+     * @return \Iterator<string, mixed>
+     */
+    public function networksWithin(string $network, array $options = []): \Iterator
+    {
+        if (\func_num_args() > 2) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects at most 2 parameters, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $this->checkNotClosed();
+
+        [$includeAliasedNetworks, $skipEmptyValues] = $this->networkOptions($options);
+
+        $parts = explode('/', $network);
+        $packedAddr = \count($parts) === 2 ? @inet_pton($parts[0]) : false;
+        if ($packedAddr === false
+            || !preg_match('/\A[0-9]+\z/', $parts[1])
+            || (int) $parts[1] > \strlen($packedAddr) * 8
+        ) {
+            throw new \InvalidArgumentException(
+                "The value \"$network\" is not a valid network."
+            );
+        }
+        $prefixLength = (int) $parts[1];
+
+        // An IPv4 network in an IPv6 database is the matching one in ::/96.
+        if ($this->metadata->ipVersion === 6 && \strlen($packedAddr) === 4) {
+            $packedAddr = str_repeat("\x00", 12) . $packedAddr;
+            $prefixLength += 96;
+        } elseif ($this->metadata->ipVersion === 4 && \strlen($packedAddr) === 16) {
+            throw new \InvalidArgumentException(
+                "Error looking up $network. You attempted to look up an"
+                . ' IPv6 address in an IPv4-only database.'
+            );
+        }
+
+        // Follow the network's bits until they run out or reach a record.
+        $nodeCount = $this->metadata->nodeCount;
+        $node = 0;
+        $depth = 0;
+        while ($depth < $prefixLength && $node < $nodeCount) {
+            $bit = (\ord($packedAddr[$depth >> 3]) >> (7 - ($depth & 7))) & 1;
+            $node = $this->readNode($node, $bit);
+            ++$depth;
+        }
+
+        return (clone $this)->walkNetworks(
+            $includeAliasedNetworks,
+            $skipEmptyValues,
+            $node,
+            self::maskAddress($packedAddr, $depth),
+            $depth
+        );
+    }
+
+    /**
+     * Parses the options of networks() and networksWithin().
+     *
+     * @param array<string, bool> $options
+     *
+     * @throws \InvalidArgumentException if an option is not known
+     *
+     * @return array{0:bool, 1:bool} whether to include aliased networks and
+     *                               whether to skip empty values
+     */
+    private function networkOptions(array $options): array
+    {
+        $includeAliasedNetworks = false;
+        $skipEmptyValues = false;
+        foreach ($options as $name => $value) {
+            switch ($name) {
+                case 'includeAliasedNetworks':
+                    $includeAliasedNetworks = (bool) $value;
+
+                    break;
+
+                case 'skipEmptyValues':
+                    $skipEmptyValues = (bool) $value;
+
+                    break;
+
+                default:
+                    throw new \InvalidArgumentException(
+                        "Unknown option \"$name\"."
+                    );
+            }
+        }
+
+        return [$includeAliasedNetworks, $skipEmptyValues];
+    }
+
+    /**
+     * Clears the bits of a packed address past the first $bits.
      */
-    private static $METADATA_START_MARKER_LENGTH = 14;
+    private static function maskAddress(string $packedAddr, int $bits): string
+    {
+        $masked = substr($packedAddr, 0, $bits >> 3);
+        if ($bits & 7) {
+            $masked .= \chr(\ord($packedAddr[$bits >> 3]) & (0xFF << (8 - ($bits & 7))) & 0xFF);
+        }
 
-    /**
-     * @var int
-     */
-    private static $METADATA_MAX_SIZE = 131072; // 128 * 1024 = 128KiB
+        return str_pad($masked, \strlen($packedAddr), "\x00");
+    }
 
     /**
-     * @var Decoder
+     * Walks the tree from a node or record, given with the address bits
+     * leading to it and their count.
+     *
+     * @return \Generator<string, mixed>
      */
-    private $decoder;
+    private function walkNetworks(
+        bool $includeAliasedNetworks,
+        bool $skipEmptyValues,
+        int $startNode,
+        string $startIp,
+        int $startDepth
+    ): \Generator {
+        $nodeCount = $this->metadata->nodeCount;
+        $bitCount = $this->metadata->ipVersion === 6 ? 128 : 32;
+        // Only an IPv6 database has aliases of its IPv4 subtree.
+        $aliasedNode = $this->metadata->ipVersion === 6 ? $this->ipV4Start : -1;
+        $ipV4SubtreePrefix = str_repeat("\x00", 12);
 
-    /**
-     * @var resource
-     */
-    private $fileHandle;
+        // Records decoded so far, by data section offset, oldest first
+        $records = [];
 
-    /**
-     * @var int
-     */
-    private $fileSize;
+        // Each entry is a node, the address bits leading to it, and their
+        // count. The right branch is pushed so that the left is walked first.
+        $stack = [[$startNode, $startIp, $startDepth]];
+        while ($stack) {
+            [$node, $ip, $depth] = array_pop($stack);
 
-    /**
-     * @var int
-     */
-    private $ipV4Start;
+            while ($node < $nodeCount) {
+                if ($node === $aliasedNode && !$includeAliasedNetworks
+                    && ($depth !== 96 || strncmp($ip, $ipV4SubtreePrefix, 12) !== 0)
+                ) {
+                    continue 2;
+                }
+                if ($depth >= $bitCount) {
+                    throw new InvalidDatabaseException(
+                        "The MaxMind DB file's search tree is corrupt"
+                    );
+                }
 
-    /**
-     * @var Metadata
-     */
-    private $metadata;
+                $right = $ip;
+                $right[$depth >> 3] = \chr(\ord($ip[$depth >> 3]) | (0x80 >> ($depth & 7)));
+                $stack[] = [$this->readNode($node, 1), $right, $depth + 1];
+
+                $node = $this->readNode($node, 0);
+                ++$depth;
+            }
+
+            if ($node === $nodeCount) {
+                continue;
+            }
+
+            $offset = $this->resolveDataOffset($node);
+            if (\array_key_exists($offset, $records)) {
+                $record = $records[$offset];
+            } else {
+                [$record] = $this->decoder->decode($offset);
+                if (\count($records) >= self::$NETWORK_RECORDS_SIZE) {
+                    reset($records);
+                    unset($records[key($records)]);
+                }
+                $records[$offset] = $record;
+            }
+
+            if ($skipEmptyValues && $record === []) {
+                continue;
+            }
+
+            if ($bitCount === 128 && $depth >= 96
+                && strncmp($ip, $ipV4SubtreePrefix, 12) === 0
+            ) {
+                yield inet_ntop(substr($ip, 12)) . '/' . ($depth - 96) => $record;
+            } else {
+                yield inet_ntop($ip) . '/' . $depth => $record;
+            }
+        }
+    }
 
     /**
-     * Constructs a Reader for the MaxMind DB format. The file passed to it must
-     * be a valid MaxMind DB file such as a GeoIP database file.
+     * Checks the whole database without decoding its records into PHP
+     * values, and returns the problems found, such as a search tree record
+     * pointing outside the data section, a node that can be reached through
+     * more bits than an address has or a record that cannot be decoded.
+     * Each problem is an array with the `offset` in the file where it was
+     * found and a `message`. They are sorted by offset, and an empty array
+     * means that the database is valid.
      *
-     * @param string $database the MaxMind DB file to use
+     * Each record in the data section, and each map or array that pointers
+     * lead to, is checked once however many networks share it.
      *
-     * @throws \InvalidArgumentException for invalid database path or unknown arguments
-     * @throws InvalidDatabaseException
-     *                                   if the database is invalid or there is an error reading
-     *                                   from it
+     * The supported options are:
+     *
+     * * `maxProblems` - the most problems to return, 100 by default.
+     * * `threads` - with the C extension, the number of threads to split the
+     *   search tree and the data section across, 1 by default. This reader
+     *   accepts the option and ignores it.
+     *
+     * @param array<string, int> $options the verification options
+     *
+     * @throws \BadMethodCallException   if this method is called on a closed database
+     * @throws \InvalidArgumentException if an option is not known or not valid
+     *
+     * @return array<int, array{offset:int, message:string}>
      */
-    public function __construct(string $database)
+    public function verify(array $options = []): array
     {
-        if (\func_num_args() !== 1) {
+        if (\func_num_args() > 1) {
             throw new \ArgumentCountError(
-                \sprintf('%s() expects exactly 1 parameter, %d given', __METHOD__, \func_num_args())
+                \sprintf('%s() expects at most 1 parameter, %d given', __METHOD__, \func_num_args())
             );
         }
 
-        if (is_dir($database)) {
-            // This matches the error that the C extension throws.
-            throw new InvalidDatabaseException(
-                "Error opening database file ($database). Is this a valid MaxMind DB file?"
-            );
+        $this->checkNotClosed();
+
+        $maxProblems = 100;
+        foreach ($options as $name => $value) {
+            switch ($name) {
+                case 'maxProblems':
+                    if (!\is_int($value) || $value < 1) {
+                        throw new \InvalidArgumentException(
+                            'The maximum number of problems must be a positive integer.'
+                        );
+                    }
+                    $maxProblems = $value;
+
+                    break;
+
+                case 'threads':
+                    if (!\is_int($value) || $value < 1) {
+                        throw new \InvalidArgumentException(
+                            'The number of threads must be a positive integer.'
+                        );
+                    }
+
+                    // Only used by the C extension.
+                    break;
+
+                default:
+                    throw new \InvalidArgumentException(
+                        "Unknown option \"$name\"."
+                    );
+            }
         }
 
-        $fileHandle = @fopen($database, 'rb');
-        if ($fileHandle === false) {
-            throw new \InvalidArgumentException(
-                "The file \"$database\" does not exist or is not readable."
+        $metadata = $this->metadata;
+        $nodeCount = $metadata->nodeCount;
+        $nodeByteSize = $metadata->nodeByteSize;
+        $searchTreeSize = $metadata->searchTreeSize;
+        $dataStart = $searchTreeSize + self::$DATA_SECTION_SEPARATOR_SIZE;
+        $metadataStart = $this->findMetadataStart($this->database);
+        $dataEnd = max($dataStart, $metadataStart - self::$METADATA_START_MARKER_LENGTH);
+
+        // The problems are collected in the same order as the C extension
+        // collects them, so that both return the same ones.
+        $nodeProblems = [];
+        $recordProblems = [];
+        $treeProblems = [];
+
+        if ($metadata->binaryFormatMajorVersion !== 2) {
+            self::addProblem(
+                $treeProblems,
+                $maxProblems,
+                $metadataStart,
+                \sprintf('The binary format major version is %d, not 2.', $metadata->binaryFormatMajorVersion)
             );
         }
-        $this->fileHandle = $fileHandle;
+        $validRecordSize = \in_array($metadata->recordSize, [24, 28, 32], true);
+        if (!$validRecordSize) {
+            self::addProblem(
+                $treeProblems,
+                $maxProblems,
+                $metadataStart,
+                \sprintf('The record size is %d, not 24, 28 or 32.', $metadata->recordSize)
+            );
+        }
+        if ($metadata->ipVersion !== 4 && $metadata->ipVersion !== 6) {
+            self::addProblem(
+                $treeProblems,
+                $maxProblems,
+                $metadataStart,
+                \sprintf('The IP version is %d, not 4 or 6.', $metadata->ipVersion)
+            );
+        }
+        if ($nodeCount === 0) {
+            self::addProblem($treeProblems, $maxProblems, $metadataStart, 'The search tree has no nodes.');
+        }
+        if ((string) $metadata->databaseType === '') {
+            self::addProblem($treeProblems, $maxProblems, $metadataStart, 'The database type is empty.');
+        }
+        // libmaxminddb refuses to open such a file, so the C extension never
+        // gets this far.
+        if (!$validRecordSize) {
+            return self::sortProblems([$treeProblems], $maxProblems);
+        }
 
-        $fstat = fstat($fileHandle);
-        if ($fstat === false) {
-            throw new \UnexpectedValueException(
-                "Error determining the size of \"$database\"."
+        $separator = $this->read($searchTreeSize, self::$DATA_SECTION_SEPARATOR_SIZE);
+        if ($separator !== str_repeat("\x00", self::$DATA_SECTION_SEPARATOR_SIZE)) {
+            self::addProblem(
+                $treeProblems,
+                $maxProblems,
+                $searchTreeSize,
+                'The data section separator is not all zeros.'
             );
         }
-        $this->fileSize = $fstat['size'];
 
-        $start = $this->findMetadataStart($database);
-        $metadataDecoder = new Decoder($this->fileHandle, $start);
-        [$metadataArray] = $metadataDecoder->decode($start);
-        $this->metadata = new Metadata($metadataArray);
-        $this->decoder = new Decoder(
-            $this->fileHandle,
-            $this->metadata->searchTreeSize + self::$DATA_SECTION_SEPARATOR_SIZE
-        );
-        $this->ipV4Start = $this->ipV4StartNode();
+        // Check every record of every node, and collect the offsets of the
+        // records in the data section.
+        $dataSize = $dataEnd - $dataStart;
+        $starts = [];
+        for ($node = 0; $node < $nodeCount; ++$node) {
+            for ($index = 0; $index < 2; ++$index) {
+                $record = $this->readNode($node, $index);
+                if ($record <= $nodeCount) {
+                    continue;
+                }
+                $offset = $record - $nodeCount - self::$DATA_SECTION_SEPARATOR_SIZE;
+                if ($offset < 0) {
+                    self::addProblem(
+                        $nodeProblems,
+                        $maxProblems,
+                        $node * $nodeByteSize,
+                        "Node $node has a record that points into the data section separator."
+                    );
+                } elseif ($offset >= $dataSize) {
+                    self::addProblem(
+                        $nodeProblems,
+                        $maxProblems,
+                        $node * $nodeByteSize,
+                        "Node $node has a record that points past the end of the data section."
+                    );
+                } else {
+                    $starts[$dataStart + $offset] = true;
+                }
+            }
+        }
+
+        if ($nodeCount > 0) {
+            $this->verifyDepth($treeProblems, $maxProblems);
+        }
+
+        ksort($starts);
+        $verified = [];
+        foreach ($starts as $offset => $unused) {
+            try {
+                $this->decoder->verify($offset, $dataEnd, $verified);
+            } catch (InvalidDatabaseException $e) {
+                self::addProblem(
+                    $recordProblems,
+                    $maxProblems,
+                    $offset,
+                    'The record is invalid: ' . $e->getMessage() . '.'
+                );
+            }
+        }
+
+        return self::sortProblems([$nodeProblems, $recordProblems, $treeProblems], $maxProblems);
     }
 
     /**
-     * Retrieves the record for the IP address.
+     * Checks that every node lies on a path no longer than an address, which
+     * also rules out cycles. $heights has a byte per node: 0 for a node not
+     * reached yet, 1 for one on the current path, and otherwise 2 plus the
+     * number of nodes on the longest path down from it.
      *
-     * @param string $ipAddress the IP address to look up
+     * @param array<int, array{offset:int, message:string}> $problems
+     */
+    private function verifyDepth(array &$problems, int $maxProblems): void
+    {
+        $nodeCount = $this->metadata->nodeCount;
+        $nodeByteSize = $this->metadata->nodeByteSize;
+        $ipVersion = $this->metadata->ipVersion;
+        $bitCount = $ipVersion === 4 ? 32 : 128;
+
+        $heights = str_repeat("\x00", $nodeCount);
+        $heights[0] = "\x01";
+        // The node, the next of its records to follow and its height so far.
+        $stack = [[0, 0, 0]];
+        while ($stack) {
+            $top = \count($stack) - 1;
+            [$node, $index, $height] = $stack[$top];
+            if ($index === 2) {
+                ++$height;
+                $heights[$node] = \chr(2 + $height);
+                array_pop($stack);
+                if ($top > 0 && $height > $stack[$top - 1][2]) {
+                    $stack[$top - 1][2] = $height;
+                }
+
+                continue;
+            }
+
+            $stack[$top][1] = $index + 1;
+            $child = $this->readNode($node, $index);
+            if ($child >= $nodeCount) {
+                continue;
+            }
+
+            $state = \ord($heights[$child]);
+            $depth = $top + 1;
+            if ($state === 1) {
+                self::addProblem(
+                    $problems,
+                    $maxProblems,
+                    $child * $nodeByteSize,
+                    "Node $child is part of a cycle in the search tree."
+                );
+            } elseif ($state === 0) {
+                if ($depth >= $bitCount) {
+                    self::addProblem(
+                        $problems,
+                        $maxProblems,
+                        $child * $nodeByteSize,
+                        "Node $child can be reached through more bits than an IPv$ipVersion address has."
+                    );
+
+                    continue;
+                }
+                $heights[$child] = "\x01";
+                $stack[] = [$child, 0, 0];
+            } elseif ($depth + $state - 2 > $bitCount) {
+                self::addProblem(
+                    $problems,
+                    $maxProblems,
+                    $child * $nodeByteSize,
+                    "Node $child can be reached through more bits than an IPv$ipVersion address has."
+                );
+            } elseif ($state - 2 > $height) {
+                $stack[$top][2] = $state - 2;
+            }
+        }
+    }
+
+    /**
+     * @param array<int, array{offset:int, message:string}> $problems
+     */
+    private static function addProblem(array &$problems, int $maxProblems, int $offset, string $message): void
+    {
+        if (\count($problems) < $maxProblems) {
+            $problems[] = ['offset' => $offset, 'message' => $message];
+        }
+    }
+
+    /**
+     * Merges the lists of problems and returns the first $maxProblems by
+     * offset. Problems at the same offset keep their order.
      *
-     * @throws \BadMethodCallException   if this method is called on a closed database
-     * @throws \InvalidArgumentException if something other than a single IP address is passed to the method
-     * @throws InvalidDatabaseException
-     *                                   if the database is invalid or there is an error reading
-     *                                   from it
+     * @param array<int, array<int, array{offset:int, message:string}>> $lists
      *
-     * @return mixed the record for the IP address
+     * @return array<int, array{offset:int, message:string}>
      */
-    public function get(string $ipAddress)
+    private static function sortProblems(array $lists, int $maxProblems): array
     {
-        if (\func_num_args() !== 1) {
-            throw new \ArgumentCountError(
-                \sprintf('%s() expects exactly 1 parameter, %d given', __METHOD__, \func_num_args())
+        $problems = array_merge(...$lists);
+        $offsets = array_column($problems, 'offset');
+        $order = array_keys($problems);
+        array_multisort($offsets, \SORT_NUMERIC, $order, \SORT_NUMERIC, $problems);
+
+        return \array_slice($problems, 0, $maxProblems);
+    }
+
+    /**
+     * @return array{0:int, 1:int}
+     */
+    private function findAddressInTree(string $ipAddress): array
+    {
+        return $this->findPackedAddressInTree($this->packAddress($ipAddress), $ipAddress);
+    }
+
+    private function packAddress(string $ipAddress): string
+    {
+        $packedAddr = @inet_pton($ipAddress);
+        if ($packedAddr === false) {
+            throw new \InvalidArgumentException(
+                "The value \"$ipAddress\" is not a valid IP address."
             );
         }
-        [$record] = $this->getWithPrefixLen($ipAddress);
 
-        return $record;
+        return $packedAddr;
     }
 
     /**
-     * Retrieves the record for the IP address and its associated network prefix length.
-     *
-     * @param string $ipAddress the IP address to look up
+     * Returns the record and prefix length for the packed address, from the
+     * address cache when it is enabled. Failed lookups are not cached.
      *
-     * @throws \BadMethodCallException   if this method is called on a closed database
-     * @throws \InvalidArgumentException if something other than a single IP address is passed to the method
-     * @throws InvalidDatabaseException
-     *                                   if the database is invalid or there is an error reading
-     *                                   from it
+     * @param string|null $ipAddress the textual address for error messages,
+     *                               if the caller has it
      *
-     * @return array{0:mixed, 1:int} an array where the first element is the record and the
-     *                               second the network prefix length for the record
+     * @return array{0:mixed, 1:int}
      */
-    public function getWithPrefixLen(string $ipAddress): array
+    private function lookupPackedAddress(string $packedAddr, ?string $ipAddress): array
     {
-        if (\func_num_args() !== 1) {
-            throw new \ArgumentCountError(
-                \sprintf('%s() expects exactly 1 parameter, %d given', __METHOD__, \func_num_args())
-            );
+        if ($this->addressCacheCapacity === 0) {
+            return $this->decodePackedAddress($packedAddr, $ipAddress);
         }
 
-        if (!\is_resource($this->fileHandle)) {
-            throw new \BadMethodCallException(
-                'Attempt to read from a closed MaxMind DB.'
-            );
+        if (\array_key_exists($packedAddr, $this->addressCache)) {
+            ++$this->addressCacheCounts['hits'];
+            $result = $this->addressCache[$packedAddr];
+            // Move the address to the end, keeping the least recently used
+            // address first.
+            unset($this->addressCache[$packedAddr]);
+            $this->addressCache[$packedAddr] = $result;
+
+            return $result;
         }
 
-        [$pointer, $prefixLen] = $this->findAddressInTree($ipAddress);
+        ++$this->addressCacheCounts['misses'];
+        $result = $this->decodePackedAddress($packedAddr, $ipAddress);
+
+        if (\count($this->addressCache) >= $this->addressCacheCapacity) {
+            reset($this->addressCache);
+            unset($this->addressCache[key($this->addressCache)]);
+            ++$this->addressCacheCounts['evictions'];
+        }
+        $this->addressCache[$packedAddr] = $result;
+
+        return $result;
+    }
+
+    /**
+     * @return array{0:mixed, 1:int}
+     */
+    private function decodePackedAddress(string $packedAddr, ?string $ipAddress): array
+    {
+        [$pointer, $prefixLen] = $this->findPackedAddressInTree($packedAddr, $ipAddress);
         if ($pointer === 0) {
             return [null, $prefixLen];
         }
@@ -175,17 +1624,13 @@ class Reader
     }
 
     /**
+     * @param string|null $ipAddress the textual address for error messages,
+     *                               if the caller has it
+     *
      * @return array{0:int, 1:int}
      */
-    private function findAddressInTree(string $ipAddress): array
+    private function findPackedAddressInTree(string $packedAddr, ?string $ipAddress): array
     {
-        $packedAddr = @inet_pton($ipAddress);
-        if ($packedAddr === false) {
-            throw new \InvalidArgumentException(
-                "The value \"$ipAddress\" is not a valid IP address."
-            );
-        }
-
         $rawAddress = unpack('C*', $packedAddr);
         if ($rawAddress === false) {
             throw new InvalidDatabaseException(
@@ -208,6 +1653,10 @@ class Reader
                 $node = $this->ipV4Start;
             }
         } elseif ($metadata->ipVersion === 4 && $bitCount === 128) {
+            if ($ipAddress === null) {
+                $ipAddress = inet_ntop($packedAddr);
+            }
+
             throw new \InvalidArgumentException(
                 "Error looking up $ipAddress. You attempted to look up an"
                 . ' IPv6 address in an IPv4-only database.'
@@ -252,13 +1701,31 @@ class Reader
         return $node;
     }
 
+    /**
+     * @param int<0, max> $numberOfBytes
+     */
+    private function read(int $offset, int $numberOfBytes): string
+    {
+        if ($this->buffer === null) {
+            return Util::read($this->fileHandle, $offset, $numberOfBytes);
+        }
+
+        if ($offset + $numberOfBytes > $this->fileSize) {
+            throw new InvalidDatabaseException(
+                'The MaxMind DB file contains bad data'
+            );
+        }
+
+        return substr($this->buffer, $offset, $numberOfBytes);
+    }
+
     private function readNode(int $nodeNumber, int $index): int
     {
         $baseOffset = $nodeNumber * $this->metadata->nodeByteSize;
 
         switch ($this->metadata->recordSize) {
             case 24:
-                $bytes = Util::read($this->fileHandle, $baseOffset + $index * 3, 3);
+                $bytes = $this->read($baseOffset + $index * 3, 3);
                 $rc = unpack('N', "\x00" . $bytes);
                 if ($rc === false) {
                     throw new InvalidDatabaseException(
@@ -270,7 +1737,7 @@ class Reader
                 return $node;
 
             case 28:
-                $bytes = Util::read($this->fileHandle, $baseOffset + 3 * $index, 4);
+                $bytes = $this->read($baseOffset + 3 * $index, 4);
                 if ($index === 0) {
                     $middle = (0xF0 & \ord($bytes[3])) >> 4;
                 } else {
@@ -287,7 +1754,7 @@ class Reader
                 return $node;
 
             case 32:
-                $bytes = Util::read($this->fileHandle, $baseOffset + $index * 4, 4);
+                $bytes = $this->read($baseOffset + $index * 4, 4);
                 $rc = unpack('N', $bytes);
                 if ($rc === false) {
                     throw new InvalidDatabaseException(
@@ -310,6 +1777,51 @@ class Reader
      * @return mixed
      */
     private function resolveDataPointer(int $pointer)
+    {
+        $offset = $this->resolveDataOffset($pointer);
+
+        if ($this->recordCacheCapacity === 0) {
+            return $this->decodeRecord($offset);
+        }
+
+        if (\array_key_exists($offset, $this->recordCache)) {
+            ++$this->recordCacheCounts['hits'];
+            $data = $this->recordCache[$offset];
+            // Move the record to the end, keeping the least recently used
+            // record first.
+            unset($this->recordCache[$offset]);
+            $this->recordCache[$offset] = $data;
+
+            return $data;
+        }
+
+        ++$this->recordCacheCounts['misses'];
+        $data = $this->decodeRecord($offset);
+
+        if (\count($this->recordCache) >= $this->recordCacheCapacity) {
+            reset($this->recordCache);
+            unset($this->recordCache[key($this->recordCache)]);
+            ++$this->recordCacheCounts['evictions'];
+        }
+        $this->recordCache[$offset] = $data;
+
+        return $data;
+    }
+
+    /**
+     * @return mixed
+     */
+    private function decodeRecord(int $offset)
+    {
+        if ($this->lazyRecords) {
+            return $this->decoder->decodeLazy($offset);
+        }
+        [$data] = $this->decoder->decode($offset);
+
+        return $data;
+    }
+
+    private function resolveDataOffset(int $pointer): int
     {
         $resolved = $pointer - $this->metadata->nodeCount
             + $this->metadata->searchTreeSize;
@@ -319,34 +1831,25 @@ class Reader
             );
         }
 
-        [$data] = $this->decoder->decode($resolved);
-
-        return $data;
+        return $resolved;
     }
 
     /*
-     * This is an extremely naive but reasonably readable implementation. There
-     * are much faster algorithms (e.g., Boyer-Moore) for this if speed is ever
-     * an issue, but I suspect it won't be.
+     * The metadata is in the last 128KiB of the file, so that block is read
+     * at once and searched from the end for the last start marker.
      */
     private function findMetadataStart(string $filename): int
     {
-        $handle = $this->fileHandle;
         $fileSize = $this->fileSize;
-        $marker = self::$METADATA_START_MARKER;
-        $markerLength = self::$METADATA_START_MARKER_LENGTH;
-
         $minStart = $fileSize - min(self::$METADATA_MAX_SIZE, $fileSize);
 
-        for ($offset = $fileSize - $markerLength; $offset >= $minStart; --$offset) {
-            if (fseek($handle, $offset) !== 0) {
-                break;
-            }
-
-            $value = fread($handle, $markerLength);
-            if ($value === $marker) {
-                return $offset + $markerLength;
-            }
+        try {
+            $offset = strrpos($this->read($minStart, $fileSize - $minStart), self::$METADATA_START_MARKER);
+        } catch (InvalidDatabaseException $e) {
+            $offset = false;
+        }
+        if ($offset !== false) {
+            return $minStart + $offset + self::$METADATA_START_MARKER_LENGTH;
         }
 
         throw new InvalidDatabaseException(
@@ -371,11 +1874,7 @@ class Reader
 
         // Not technically required, but this makes it consistent with
         // C extension and it allows us to change our implementation later.
-        if (!\is_resource($this->fileHandle)) {
-            throw new \BadMethodCallException(
-                'Attempt to read from a closed MaxMind DB.'
-            );
-        }
+        $this->checkNotClosed();
 
         return clone $this->metadata;
     }
@@ -400,5 +1899,21 @@ class Reader
             );
         }
         fclose($this->fileHandle);
+        $this->buffer = null;
+        $this->recordCache = [];
+        $this->recordCacheCapacity = 0;
+        $this->recordCacheCounts = ['hits' => 0, 'misses' => 0, 'evictions' => 0];
+        $this->addressCache = [];
+        $this->addressCacheCapacity = 0;
+        $this->addressCacheCounts = ['hits' => 0, 'misses' => 0, 'evictions' => 0];
+    }
+
+    protected function checkNotClosed(): void
+    {
+        if (!\is_resource($this->fileHandle)) {
+            throw new \BadMethodCallException(
+                'Attempt to read from a closed MaxMind DB.'
+            );
+        }
     }
 }
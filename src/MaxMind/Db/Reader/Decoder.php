@@ -9,10 +9,22 @@ namespace MaxMind\Db\Reader;
 class Decoder
 {
     /**
-     * @var resource
+     * @var resource|null
      */
     private $fileStream;
 
+    /**
+     * The whole database when it was loaded into memory.
+     *
+     * @var string|null
+     */
+    private $buffer;
+
+    /**
+     * @var int
+     */
+    private $bufferSize = 0;
+
     /**
      * @var int
      */
@@ -30,6 +42,27 @@ class Decoder
      */
     private $switchByteOrder;
 
+    /**
+     * The values decoded at pointer targets during the current call to
+     * decode() or decodePath(), by offset. Records reuse the same pointed-to
+     * keys and maps, such as names, many times over.
+     *
+     * @var array<int, mixed>
+     */
+    private $pointerCache = [];
+
+    /**
+     * The number of bytes read at once from a file, enough for the control
+     * bytes and the payload of most values.
+     */
+    private const FETCH_SIZE = 32;
+
+    /**
+     * How deeply maps, arrays and pointers may nest in a record that
+     * verify() accepts, as in libmaxminddb.
+     */
+    private const MAX_DEPTH = 512;
+
     private const _EXTENDED = 0;
     private const _POINTER = 1;
     private const _UTF8_STRING = 2;
@@ -48,14 +81,19 @@ class Decoder
     private const _FLOAT = 15;
 
     /**
-     * @param resource $fileStream
+     * @param resource|string $fileStream the database file, or its contents
      */
     public function __construct(
         $fileStream,
         int $pointerBase = 0,
         bool $pointerTestHack = false
     ) {
-        $this->fileStream = $fileStream;
+        if (\is_string($fileStream)) {
+            $this->buffer = $fileStream;
+            $this->bufferSize = \strlen($fileStream);
+        } else {
+            $this->fileStream = $fileStream;
+        }
         $this->pointerBase = $pointerBase;
 
         $this->pointerTestHack = $pointerTestHack;
@@ -68,93 +106,531 @@ class Decoder
      */
     public function decode(int $offset): array
     {
-        $ctrlByte = \ord(Util::read($this->fileStream, $offset, 1));
-        ++$offset;
+        $this->pointerCache = [];
 
-        $type = $ctrlByte >> 5;
+        // for unit testing
+        if ($this->pointerTestHack
+            && (\ord($this->read($offset, 1)) >> 5) === self::_POINTER
+        ) {
+            return [$this->decodeValue($offset)];
+        }
 
-        // Pointers are a special case, we don't read the next $size bytes, we
-        // use the size to determine the length of the pointer and then follow
-        // it.
-        if ($type === self::_POINTER) {
-            [$pointer, $offset] = $this->decodePointer($ctrlByte, $offset);
+        $value = $this->decodeValue($offset);
 
-            // for unit testing
-            if ($this->pointerTestHack) {
-                return [$pointer];
+        return [$value, $offset];
+    }
+
+    /**
+     * Decodes the value at $offset, returning maps and arrays as LazyRecord
+     * objects that decode their entries as they are read.
+     *
+     * @return mixed
+     */
+    public function decodeLazy(int $offset)
+    {
+        $this->pointerCache = [];
+
+        $start = $offset;
+        $type = $this->decodeHeader($start, $size);
+        if ($type === self::_MAP || $type === self::_ARRAY) {
+            return new LazyRecord($this, $offset);
+        }
+
+        return $this->decodeValue($offset);
+    }
+
+    /**
+     * Returns the offsets of the values in the map or array at $offset, by
+     * key, without decoding the values.
+     *
+     * @return array<int|string, int>
+     */
+    public function entryOffsets(int $offset): array
+    {
+        $this->pointerCache = [];
+
+        $type = $this->decodeHeader($offset, $size);
+        $offsets = [];
+        if ($type === self::_MAP) {
+            for ($i = 0; $i < $size; ++$i) {
+                $key = $this->decodeValue($offset);
+                $offsets[$key] = $offset;
+                $this->skip($offset);
             }
 
-            [$result] = $this->decode($pointer);
+            return $offsets;
+        }
 
-            return [$result, $offset];
+        if ($type !== self::_ARRAY) {
+            throw new InvalidDatabaseException(
+                'Expected a map or an array, found type ' . $type
+            );
+        }
+        for ($i = 0; $i < $size; ++$i) {
+            $offsets[] = $offset;
+            $this->skip($offset);
         }
 
-        if ($type === self::_EXTENDED) {
-            $nextByte = \ord(Util::read($this->fileStream, $offset, 1));
+        return $offsets;
+    }
+
+    /**
+     * Decodes the value found by following $path, a list of map keys and
+     * array indexes, from the data structure at $offset. Only the value at
+     * the end of the path is decoded; the map and array entries passed over
+     * on the way are skipped without building them.
+     *
+     * @param array<int|string> $path
+     *
+     * @return mixed the value, or null if the path does not exist
+     */
+    public function decodePath(int $offset, array $path)
+    {
+        $this->pointerCache = [];
+
+        foreach ($path as $key) {
+            $type = $this->decodeHeader($offset, $size);
+
+            if ($type === self::_MAP) {
+                $key = (string) $key;
+                for ($i = 0; $i < $size; ++$i) {
+                    if ($this->decodeValue($offset) === $key) {
+                        continue 2;
+                    }
+                    $this->skip($offset);
+                }
+
+                return null;
+            }
+
+            if ($type !== self::_ARRAY) {
+                return null;
+            }
+
+            if (!\is_int($key)) {
+                if (!preg_match('/\A-?\d+\z/', $key)) {
+                    return null;
+                }
+                $key = (int) $key;
+            }
+            // Negative indexes count back from the end of the array, as
+            // they do in libmaxminddb.
+            if ($key < 0) {
+                $key += $size;
+            }
+            if ($key < 0 || $key >= $size) {
+                return null;
+            }
+            for ($i = 0; $i < $key; ++$i) {
+                $this->skip($offset);
+            }
+        }
+
+        return $this->decodeValue($offset);
+    }
+
+    /**
+     * Decodes the values that a schema registered with
+     * Reader::registerSchema() needs from the data structure at $offset. The
+     * schema's paths are merged into $tree: each node lists under
+     * `properties` the properties that take the value reached there, and
+     * under `children` the nodes below it by map key or array index. Map
+     * entries that no path goes through are skipped without decoding them.
+     *
+     * @param array<string, mixed> $tree
+     *
+     * @return array<string, mixed> the values by property name, without the
+     *                              paths not in the record
+     */
+    public function decodeSchema(int $offset, array $tree): array
+    {
+        $this->pointerCache = [];
+
+        $values = [];
+        $this->decodeSchemaNode($offset, $tree, $values);
 
-            $type = $nextByte + 7;
+        return $values;
+    }
 
-            if ($type < 8) {
+    /**
+     * @param array<string, mixed> $node
+     * @param array<string, mixed> $values
+     */
+    private function decodeSchemaNode(int $offset, array $node, array &$values): void
+    {
+        if (isset($node['properties'])) {
+            $valueOffset = $offset;
+            $value = $this->decodeValue($valueOffset);
+            foreach ($node['properties'] as $name) {
+                $values[$name] = $value;
+            }
+        }
+        if (!isset($node['children'])) {
+            return;
+        }
+        $children = $node['children'];
+
+        $type = $this->decodeHeader($offset, $size);
+
+        if ($type === self::_MAP) {
+            for ($i = 0; $i < $size; ++$i) {
+                $key = $this->decodeValue($offset);
+                if (isset($children[$key])) {
+                    $this->decodeSchemaNode($offset, $children[$key], $values);
+                }
+                $this->skip($offset);
+            }
+
+            return;
+        }
+
+        if ($type !== self::_ARRAY) {
+            return;
+        }
+
+        foreach ($children as $index => $child) {
+            if (!\is_int($index)) {
+                if (!preg_match('/\A-?\d+\z/', $index)) {
+                    continue;
+                }
+                $index = (int) $index;
+            }
+            if ($index < 0) {
+                $index += $size;
+            }
+            if ($index < 0 || $index >= $size) {
+                continue;
+            }
+            $elementOffset = $offset;
+            for ($i = 0; $i < $index; ++$i) {
+                $this->skip($elementOffset);
+            }
+            $this->decodeSchemaNode($elementOffset, $child, $values);
+        }
+    }
+
+    /**
+     * Checks the value at $offset without decoding it, as Reader::verify()
+     * does for each record, and returns the offset after it. Nothing at or
+     * past $end is read. The maps and arrays at pointer targets that have
+     * been checked are kept in $verified by offset, so that each is checked
+     * once.
+     *
+     * @param array<int, bool> $verified
+     *
+     * @throws InvalidDatabaseException with the reason the value is invalid
+     */
+    public function verify(int $offset, int $end, array &$verified): int
+    {
+        return $this->verifyValue($offset, $end, $verified, false, 0);
+    }
+
+    /**
+     * @param array<int, bool> $verified
+     */
+    private function verifyValue(int $offset, int $end, array &$verified, bool $isKey, int $depth): int
+    {
+        if ($depth >= self::MAX_DEPTH) {
+            throw new InvalidDatabaseException(
+                'maps, arrays and pointers are nested too deeply'
+            );
+        }
+        ++$depth;
+
+        $type = $this->verifyHeader($offset, $end, $size);
+
+        if ($type === self::_POINTER) {
+            $target = $size;
+            $targetOffset = $target;
+            $targetType = $this->verifyHeader($targetOffset, $end, $targetSize);
+            if ($targetType === self::_POINTER) {
                 throw new InvalidDatabaseException(
-                    'Something went horribly wrong in the decoder. An extended type '
-                    . 'resolved to a type number < 8 ('
-                    . $type
-                    . ')'
+                    'a pointer points to another pointer'
                 );
             }
+            if ($isKey && $targetType !== self::_UTF8_STRING) {
+                throw new InvalidDatabaseException('a map key is not a string');
+            }
+            if ($targetType !== self::_MAP && $targetType !== self::_ARRAY) {
+                $this->verifyValue($target, $end, $verified, $isKey, $depth);
+            } elseif (!isset($verified[$target])) {
+                $this->verifyValue($target, $end, $verified, $isKey, $depth);
+                $verified[$target] = true;
+            }
+
+            return $offset;
+        }
+
+        if ($isKey && $type !== self::_UTF8_STRING) {
+            throw new InvalidDatabaseException('a map key is not a string');
+        }
+
+        switch ($type) {
+            case self::_MAP:
+                for ($i = 0; $i < $size; ++$i) {
+                    $offset = $this->verifyValue($offset, $end, $verified, true, $depth);
+                    $offset = $this->verifyValue($offset, $end, $verified, false, $depth);
+                }
+
+                return $offset;
+
+            case self::_ARRAY:
+                for ($i = 0; $i < $size; ++$i) {
+                    $offset = $this->verifyValue($offset, $end, $verified, false, $depth);
+                }
+
+                return $offset;
 
+            case self::_UTF8_STRING:
+            case self::_DOUBLE:
+            case self::_BYTES:
+            case self::_UINT16:
+            case self::_UINT32:
+            case self::_INT32:
+            case self::_UINT64:
+            case self::_UINT128:
+            case self::_BOOLEAN:
+            case self::_FLOAT:
+                return $offset + $size;
+
+            default:
+                throw new InvalidDatabaseException(
+                    'the value has an unknown data type'
+                );
+        }
+    }
+
+    /**
+     * Reads the control byte, any extended type and size bytes at $offset,
+     * with the checks that the C extension's verifier makes, and leaves
+     * $offset at the payload. A pointer is not followed: $size is set to
+     * the offset it points to, and $offset is left past it. Booleans have a
+     * size of 0.
+     */
+    private function verifyHeader(int &$offset, int $end, ?int &$size): int
+    {
+        if ($offset >= $end) {
+            throw self::truncatedValue();
+        }
+        $ctrlByte = \ord($this->read($offset, 1));
+        ++$offset;
+
+        $type = $ctrlByte >> 5;
+        if ($type === self::_EXTENDED) {
+            if ($offset >= $end) {
+                throw self::truncatedValue();
+            }
+            // Unlike checkExtendedType(), this takes an extended type of 7
+            // to be a map, as libmaxminddb does.
+            $type = 7 + \ord($this->read($offset, 1));
             ++$offset;
         }
 
-        [$size, $offset] = $this->sizeFromCtrlByte($ctrlByte, $offset);
+        if ($type === self::_POINTER) {
+            $pointerSize = (($ctrlByte >> 3) & 0x3) + 1;
+            if ($pointerSize > $end - $offset) {
+                throw self::truncatedValue();
+            }
+            $size = $this->decodePointer($ctrlByte, $this->read($offset, $pointerSize));
+            $offset += $pointerSize;
+
+            return $type;
+        }
+
+        $size = $ctrlByte & 0x1F;
+        if ($size >= 29) {
+            if ($size - 28 > $end - $offset) {
+                throw self::truncatedValue();
+            }
+            $bytes = $this->read($offset, $size - 28);
+            $pos = 0;
+            $size = $this->decodeLongSize($size, $bytes, $pos, \strlen($bytes));
+            $offset += $pos;
+        }
+
+        if ($type === self::_MAP || $type === self::_ARRAY) {
+            return $type;
+        }
+        if ($type === self::_BOOLEAN) {
+            $size = 0;
+
+            return $type;
+        }
+
+        if ($size > $end - $offset) {
+            throw self::truncatedValue();
+        }
+        switch ($type) {
+            case self::_UINT16:
+                $valid = $size <= 2;
+
+                break;
+
+            case self::_UINT32:
+            case self::_INT32:
+                $valid = $size <= 4;
+
+                break;
+
+            case self::_UINT64:
+                $valid = $size <= 8;
+
+                break;
+
+            case self::_UINT128:
+                $valid = $size <= 16;
+
+                break;
+
+            case self::_FLOAT:
+                $valid = $size === 4;
+
+                break;
+
+            case self::_DOUBLE:
+                $valid = $size === 8;
+
+                break;
+
+            default:
+                $valid = true;
+        }
+        if (!$valid) {
+            throw self::truncatedValue();
+        }
+
+        return $type;
+    }
 
-        return $this->decodeByType($type, $offset, $size);
+    private static function truncatedValue(): InvalidDatabaseException
+    {
+        return new InvalidDatabaseException(
+            'the value is truncated or its size is not valid for its type'
+        );
     }
 
     /**
-     * @param int<0, max> $size
+     * Decodes the value at $offset and advances $offset past it. The control
+     * byte, any extended type and size bytes, and the payload are taken from
+     * a single read whenever the payload is small enough.
      *
-     * @return array{0:mixed, 1:int}
+     * @return mixed
      */
-    private function decodeByType(int $type, int $offset, int $size): array
+    private function decodeValue(int &$offset)
     {
+        if ($this->buffer !== null) {
+            $data = $this->buffer;
+            $pos = $offset;
+            $end = $this->bufferSize;
+        } else {
+            $data = $this->fetch($offset);
+            $pos = 0;
+            $end = \strlen($data);
+        }
+        $start = $pos;
+
+        if ($pos >= $end) {
+            throw new InvalidDatabaseException(
+                'The MaxMind DB file contains bad data'
+            );
+        }
+        $ctrlByte = \ord($data[$pos++]);
+        $type = $ctrlByte >> 5;
+
+        // Pointers are a special case, we don't read the next $size bytes, we
+        // use the size to determine the length of the pointer and then follow
+        // it.
+        if ($type === self::_POINTER) {
+            $pointerSize = (($ctrlByte >> 3) & 0x3) + 1;
+            if ($pos + $pointerSize > $end) {
+                throw new InvalidDatabaseException(
+                    'The MaxMind DB file contains bad data'
+                );
+            }
+            $pointer = $this->decodePointer($ctrlByte, substr($data, $pos, $pointerSize));
+            $offset += 1 + $pointerSize;
+
+            // for unit testing
+            if ($this->pointerTestHack) {
+                return $pointer;
+            }
+
+            if (!\array_key_exists($pointer, $this->pointerCache)) {
+                $target = $pointer;
+                $this->pointerCache[$pointer] = $this->decodeValue($target);
+            }
+
+            return $this->pointerCache[$pointer];
+        }
+
+        if ($type === self::_EXTENDED) {
+            if ($pos >= $end) {
+                throw new InvalidDatabaseException(
+                    'The MaxMind DB file contains bad data'
+                );
+            }
+            $type = $this->checkExtendedType(\ord($data[$pos++]));
+        }
+
+        $size = $ctrlByte & 0x1F;
+        if ($size >= 29) {
+            $size = $this->decodeLongSize($size, $data, $pos, $end);
+        }
+
+        $offset += $pos - $start;
+
         switch ($type) {
             case self::_MAP:
-                return $this->decodeMap($size, $offset);
+                $map = [];
+                for ($i = 0; $i < $size; ++$i) {
+                    $key = $this->decodeValue($offset);
+                    $map[$key] = $this->decodeValue($offset);
+                }
+
+                return $map;
 
             case self::_ARRAY:
-                return $this->decodeArray($size, $offset);
+                $array = [];
+                for ($i = 0; $i < $size; ++$i) {
+                    $array[] = $this->decodeValue($offset);
+                }
+
+                return $array;
 
             case self::_BOOLEAN:
-                return [$this->decodeBoolean($size), $offset];
+                return $size !== 0;
         }
 
-        $newOffset = $offset + $size;
-        $bytes = Util::read($this->fileStream, $offset, $size);
+        if ($pos + $size <= $end) {
+            $bytes = substr($data, $pos, $size);
+        } else {
+            $bytes = $this->read($offset, $size);
+        }
+        $offset += $size;
 
         switch ($type) {
             case self::_BYTES:
             case self::_UTF8_STRING:
-                return [$bytes, $newOffset];
+                return $bytes;
 
             case self::_DOUBLE:
                 $this->verifySize(8, $size);
 
-                return [$this->decodeDouble($bytes), $newOffset];
+                return $this->decodeDouble($bytes);
 
             case self::_FLOAT:
                 $this->verifySize(4, $size);
 
-                return [$this->decodeFloat($bytes), $newOffset];
+                return $this->decodeFloat($bytes);
 
             case self::_INT32:
-                return [$this->decodeInt32($bytes, $size), $newOffset];
+                return $this->decodeInt32($bytes, $size);
 
             case self::_UINT16:
             case self::_UINT32:
             case self::_UINT64:
             case self::_UINT128:
-                return [$this->decodeUint($bytes, $size), $newOffset];
+                return $this->decodeUint($bytes, $size);
 
             default:
                 throw new InvalidDatabaseException(
@@ -163,33 +639,114 @@ class Decoder
         }
     }
 
-    private function verifySize(int $expected, int $actual): void
+    /**
+     * Reads the control byte and any size bytes at $offset, following a
+     * pointer if there is one. $offset is left at the payload and the size
+     * is stored in $size.
+     */
+    private function decodeHeader(int &$offset, ?int &$size): int
     {
-        if ($expected !== $actual) {
-            throw new InvalidDatabaseException(
-                "The MaxMind DB file's data section contains bad data (unknown data type or corrupt data)"
-            );
+        $ctrlByte = \ord($this->read($offset, 1));
+        ++$offset;
+
+        $type = $ctrlByte >> 5;
+
+        if ($type === self::_POINTER) {
+            $pointerSize = (($ctrlByte >> 3) & 0x3) + 1;
+            $offset = $this->decodePointer($ctrlByte, $this->read($offset, $pointerSize));
+
+            return $this->decodeHeader($offset, $size);
         }
+
+        if ($type === self::_EXTENDED) {
+            $type = $this->checkExtendedType(\ord($this->read($offset, 1)));
+            ++$offset;
+        }
+
+        $size = $ctrlByte & 0x1F;
+        if ($size >= 29) {
+            $bytes = $this->read($offset, $size - 28);
+            $pos = 0;
+            $size = $this->decodeLongSize($size, $bytes, $pos, \strlen($bytes));
+            $offset += $pos;
+        }
+
+        return $type;
     }
 
     /**
-     * @return array{0:array<mixed>, 1:int}
+     * Advances $offset past the value there without decoding it. A pointer
+     * is skipped rather than followed.
      */
-    private function decodeArray(int $size, int $offset): array
+    private function skip(int &$offset): void
     {
-        $array = [];
+        $ctrlByte = \ord($this->read($offset, 1));
+        ++$offset;
 
-        for ($i = 0; $i < $size; ++$i) {
-            [$value, $offset] = $this->decode($offset);
-            $array[] = $value;
+        $type = $ctrlByte >> 5;
+
+        if ($type === self::_POINTER) {
+            $offset += (($ctrlByte >> 3) & 0x3) + 1;
+
+            return;
+        }
+
+        if ($type === self::_EXTENDED) {
+            $type = $this->checkExtendedType(\ord($this->read($offset, 1)));
+            ++$offset;
+        }
+
+        $size = $ctrlByte & 0x1F;
+        if ($size >= 29) {
+            $bytes = $this->read($offset, $size - 28);
+            $pos = 0;
+            $size = $this->decodeLongSize($size, $bytes, $pos, \strlen($bytes));
+            $offset += $pos;
+        }
+
+        switch ($type) {
+            case self::_MAP:
+                $size *= 2;
+
+                // fall through
+            case self::_ARRAY:
+                for ($i = 0; $i < $size; ++$i) {
+                    $this->skip($offset);
+                }
+
+                return;
+
+            case self::_BOOLEAN:
+                return;
+
+            default:
+                $offset += $size;
         }
+    }
+
+    private function checkExtendedType(int $nextByte): int
+    {
+        $type = $nextByte + 7;
 
-        return [$array, $offset];
+        if ($type < 8) {
+            throw new InvalidDatabaseException(
+                'Something went horribly wrong in the decoder. An extended type '
+                . 'resolved to a type number < 8 ('
+                . $type
+                . ')'
+            );
+        }
+
+        return $type;
     }
 
-    private function decodeBoolean(int $size): bool
+    private function verifySize(int $expected, int $actual): void
     {
-        return $size !== 0;
+        if ($expected !== $actual) {
+            throw new InvalidDatabaseException(
+                "The MaxMind DB file's data section contains bad data (unknown data type or corrupt data)"
+            );
+        }
     }
 
     private function decodeDouble(string $bytes): float
@@ -256,98 +813,46 @@ class Decoder
     }
 
     /**
-     * @return array{0:array<string, mixed>, 1:int}
-     */
-    private function decodeMap(int $size, int $offset): array
-    {
-        $map = [];
-
-        for ($i = 0; $i < $size; ++$i) {
-            [$key, $offset] = $this->decode($offset);
-            [$value, $offset] = $this->decode($offset);
-            $map[$key] = $value;
-        }
-
-        return [$map, $offset];
-    }
-
-    /**
-     * @return array{0:int, 1:int}
+     * @param string $bytes the 1 to 4 bytes following the control byte
      */
-    private function decodePointer(int $ctrlByte, int $offset): array
+    private function decodePointer(int $ctrlByte, string $bytes): int
     {
-        $pointerSize = (($ctrlByte >> 3) & 0x3) + 1;
-
-        $buffer = Util::read($this->fileStream, $offset, $pointerSize);
-        $offset += $pointerSize;
-
-        switch ($pointerSize) {
+        switch (\strlen($bytes)) {
             case 1:
-                $packed = \chr($ctrlByte & 0x7) . $buffer;
-                $rc = unpack('n', $packed);
-                if ($rc === false) {
-                    throw new InvalidDatabaseException(
-                        'Could not unpack an unsigned short value from the given bytes (pointerSize is 1).'
-                    );
-                }
-                [, $pointer] = $rc;
-                $pointer += $this->pointerBase;
-
-                break;
+                return ((($ctrlByte & 0x7) << 8) | \ord($bytes))
+                    + $this->pointerBase;
 
             case 2:
-                $packed = "\x00" . \chr($ctrlByte & 0x7) . $buffer;
-                $rc = unpack('N', $packed);
-                if ($rc === false) {
-                    throw new InvalidDatabaseException(
-                        'Could not unpack an unsigned long value from the given bytes (pointerSize is 2).'
-                    );
-                }
-                [, $pointer] = $rc;
-                $pointer += $this->pointerBase + 2048;
-
-                break;
+                return ((($ctrlByte & 0x7) << 16) | (\ord($bytes[0]) << 8) | \ord($bytes[1]))
+                    + $this->pointerBase + 2048;
 
             case 3:
-                $packed = \chr($ctrlByte & 0x7) . $buffer;
-
-                // It is safe to use 'N' here, even on 32 bit machines as the
-                // first bit is 0.
-                $rc = unpack('N', $packed);
-                if ($rc === false) {
-                    throw new InvalidDatabaseException(
-                        'Could not unpack an unsigned long value from the given bytes (pointerSize is 3).'
-                    );
-                }
-                [, $pointer] = $rc;
-                $pointer += $this->pointerBase + 526336;
-
-                break;
+                // It is safe to shift by 24 here, even on 32 bit machines, as
+                // the first bit is 0.
+                return ((($ctrlByte & 0x7) << 24) | (\ord($bytes[0]) << 16)
+                        | (\ord($bytes[1]) << 8) | \ord($bytes[2]))
+                    + $this->pointerBase + 526336;
 
             case 4:
                 // We cannot use unpack here as we might overflow on 32 bit
                 // machines
-                $pointerOffset = $this->decodeUint($buffer, $pointerSize);
+                $pointerOffset = $this->decodeUint($bytes, 4);
 
                 $pointerBase = $this->pointerBase;
 
-                if (\PHP_INT_MAX - $pointerBase >= $pointerOffset) {
-                    $pointer = $pointerOffset + $pointerBase;
-                } else {
-                    throw new \RuntimeException(
-                        'The database offset is too large to be represented on your platform.'
-                    );
+                if (\is_int($pointerOffset) && \PHP_INT_MAX - $pointerBase >= $pointerOffset) {
+                    return $pointerOffset + $pointerBase;
                 }
 
-                break;
+                throw new \RuntimeException(
+                    'The database offset is too large to be represented on your platform.'
+                );
 
             default:
                 throw new InvalidDatabaseException(
-                    'Unexpected pointer size ' . $pointerSize
+                    'Unexpected pointer size ' . \strlen($bytes)
                 );
         }
-
-        return [$pointer, $offset];
     }
 
     // @phpstan-ignore-next-line
@@ -393,42 +898,66 @@ class Decoder
     }
 
     /**
-     * @return array{0:int, 1:int}
+     * Reads up to FETCH_SIZE bytes at $offset from the file. Fewer are
+     * returned at the end of the file.
      */
-    private function sizeFromCtrlByte(int $ctrlByte, int $offset): array
+    private function fetch(int $offset): string
     {
-        $size = $ctrlByte & 0x1F;
+        if (fseek($this->fileStream, $offset) === 0) {
+            $value = fread($this->fileStream, self::FETCH_SIZE);
+            if ($value !== false && $value !== '') {
+                return $value;
+            }
+        }
+
+        throw new InvalidDatabaseException(
+            'The MaxMind DB file contains bad data'
+        );
+    }
 
-        if ($size < 29) {
-            return [$size, $offset];
+    /**
+     * @param int<0, max> $numberOfBytes
+     */
+    private function read(int $offset, int $numberOfBytes): string
+    {
+        if ($this->buffer === null) {
+            // @phpstan-ignore-next-line
+            return Util::read($this->fileStream, $offset, $numberOfBytes);
         }
 
+        if ($offset + $numberOfBytes > $this->bufferSize) {
+            throw new InvalidDatabaseException(
+                'The MaxMind DB file contains bad data'
+            );
+        }
+
+        return substr($this->buffer, $offset, $numberOfBytes);
+    }
+
+    /**
+     * Decodes the size of a value whose control byte holds 29, 30 or 31,
+     * reading the following bytes from $data at $pos and advancing $pos.
+     */
+    private function decodeLongSize(int $size, string $data, int &$pos, int $end): int
+    {
         $bytesToRead = $size - 28;
-        $bytes = Util::read($this->fileStream, $offset, $bytesToRead);
+        if ($pos + $bytesToRead > $end) {
+            throw new InvalidDatabaseException(
+                'The MaxMind DB file contains bad data'
+            );
+        }
 
+        $b0 = \ord($data[$pos]);
         if ($size === 29) {
-            $size = 29 + \ord($bytes);
+            $size = 29 + $b0;
         } elseif ($size === 30) {
-            $rc = unpack('n', $bytes);
-            if ($rc === false) {
-                throw new InvalidDatabaseException(
-                    'Could not unpack an unsigned short value from the given bytes.'
-                );
-            }
-            [, $adjust] = $rc;
-            $size = 285 + $adjust;
+            $size = 285 + (($b0 << 8) | \ord($data[$pos + 1]));
         } else {
-            $rc = unpack('N', "\x00" . $bytes);
-            if ($rc === false) {
-                throw new InvalidDatabaseException(
-                    'Could not unpack an unsigned long value from the given bytes.'
-                );
-            }
-            [, $adjust] = $rc;
-            $size = $adjust + 65821;
+            $size = 65821 + (($b0 << 16) | (\ord($data[$pos + 1]) << 8) | \ord($data[$pos + 2]));
         }
+        $pos += $bytesToRead;
 
-        return [$size, $offset + $bytesToRead];
+        return $size;
     }
 
     private function maybeSwitchByteOrder(string $bytes): string
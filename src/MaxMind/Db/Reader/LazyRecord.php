@@ -0,0 +1,163 @@
+<?php
+
+declare(strict_types=1);
+
+namespace MaxMind\Db\Reader;
+
+/**
+ * A map or array from the database that is decoded as it is accessed. It is
+ * returned in place of the record by readers opened with the `lazyRecords`
+ * option. Each entry is decoded the first time it is read, with nested maps
+ * and arrays returned as further lazy records, and kept for later reads.
+ *
+ * The record is read-only. Reading an entry that does not exist returns
+ * null. With the pure PHP reader, entries can only be read while the reader
+ * is open, unless the database was read into memory.
+ *
+ * @implements \ArrayAccess<int|string, mixed>
+ * @implements \IteratorAggregate<int|string, mixed>
+ */
+final class LazyRecord implements \ArrayAccess, \Countable, \IteratorAggregate
+{
+    /**
+     * @var Decoder
+     */
+    private $decoder;
+
+    /**
+     * @var int
+     */
+    private $offset;
+
+    /**
+     * The data section offsets of the entries' values, by key, once they
+     * have been read.
+     *
+     * @var array<int|string, int>|null
+     */
+    private $offsets;
+
+    /**
+     * The entries decoded so far.
+     *
+     * @var array<int|string, mixed>
+     */
+    private $values = [];
+
+    /**
+     * @var array<int|string, mixed>|null
+     */
+    private $array;
+
+    /**
+     * @internal records are created by the reader
+     */
+    public function __construct(Decoder $decoder, int $offset)
+    {
+        $this->decoder = $decoder;
+        $this->offset = $offset;
+    }
+
+    /**
+     * @param mixed $offset
+     */
+    public function offsetExists($offset): bool
+    {
+        return isset($this->offsets()[$offset]);
+    }
+
+    /**
+     * @param mixed $offset
+     *
+     * @throws InvalidDatabaseException if the database is invalid or there is an error reading
+     *                                  from it
+     *
+     * @return mixed
+     */
+    #[\ReturnTypeWillChange]
+    public function offsetGet($offset)
+    {
+        if (\array_key_exists($offset, $this->values)) {
+            return $this->values[$offset];
+        }
+
+        $offsets = $this->offsets();
+        if (!isset($offsets[$offset])) {
+            return null;
+        }
+
+        return $this->values[$offset] = $this->decoder->decodeLazy($offsets[$offset]);
+    }
+
+    /**
+     * @param mixed $offset
+     * @param mixed $value
+     *
+     * @throws \BadMethodCallException always, as the record is read-only
+     */
+    public function offsetSet($offset, $value): void
+    {
+        throw new \BadMethodCallException('Lazy records are read-only.');
+    }
+
+    /**
+     * @param mixed $offset
+     *
+     * @throws \BadMethodCallException always, as the record is read-only
+     */
+    public function offsetUnset($offset): void
+    {
+        throw new \BadMethodCallException('Lazy records are read-only.');
+    }
+
+    public function count(): int
+    {
+        return \count($this->offsets());
+    }
+
+    /**
+     * Returns an iterator over the entries, in the order of the database.
+     * This decodes every entry, but not the maps and arrays in them.
+     *
+     * @return \ArrayIterator<int|string, mixed>
+     */
+    public function getIterator(): \Iterator
+    {
+        $values = [];
+        foreach ($this->offsets() as $key => $offset) {
+            $values[$key] = $this->offsetGet($key);
+        }
+
+        return new \ArrayIterator($values);
+    }
+
+    /**
+     * Decodes the whole record into the arrays that a reader without the
+     * `lazyRecords` option returns.
+     *
+     * @throws InvalidDatabaseException if the database is invalid or there is an error reading
+     *                                  from it
+     *
+     * @return array<int|string, mixed>
+     */
+    public function toArray(): array
+    {
+        if ($this->array === null) {
+            [$this->array] = $this->decoder->decode($this->offset);
+        }
+
+        return $this->array;
+    }
+
+    /**
+     * @return array<int|string, int>
+     */
+    private function offsets(): array
+    {
+        if ($this->offsets === null) {
+            $this->offsets = $this->decoder->entryOffsets($this->offset);
+        }
+
+        return $this->offsets;
+    }
+}
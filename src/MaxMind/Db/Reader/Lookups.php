@@ -0,0 +1,139 @@
+<?php
+
+declare(strict_types=1);
+
+namespace MaxMind\Db\Reader;
+
+/**
+ * The batch lookups and the path handling that MaxMind\Db\Reader and
+ * MaxMind\Db\CompiledReader share. Each reader provides getWithPrefixLen()
+ * and its own check for a closed database.
+ *
+ * @internal
+ */
+trait Lookups
+{
+    /**
+     * Retrieves the records for several IP addresses at once.
+     *
+     * The returned array uses the same keys as the one passed in. An address
+     * that cannot be looked up does not abort the batch; it is left out of the
+     * result and, if $errors is given, the exception that get() would have
+     * thrown for it is stored there under the address's key. Only the
+     * \InvalidArgumentException and InvalidDatabaseException a lookup throws
+     * are stored; any other exception aborts the batch.
+     *
+     * @param array<mixed>           $ipAddresses the IP addresses to look up
+     * @param array<\Exception>|null $errors      receives the per-address errors
+     *
+     * @throws \BadMethodCallException if this method is called on a closed database
+     *
+     * @return array<mixed> the records for the IP addresses
+     */
+    public function getMany(array $ipAddresses, ?array &$errors = null): array
+    {
+        if (\func_num_args() > 2) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects at most 2 parameters, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        $records = [];
+        foreach ($this->lookupMany($ipAddresses, $errors) as $key => [$record]) {
+            $records[$key] = $record;
+        }
+
+        return $records;
+    }
+
+    /**
+     * Retrieves the records and network prefix lengths for several IP
+     * addresses at once. Errors are handled as in getMany().
+     *
+     * @param array<mixed>           $ipAddresses the IP addresses to look up
+     * @param array<\Exception>|null $errors      receives the per-address errors
+     *
+     * @throws \BadMethodCallException if this method is called on a closed database
+     *
+     * @return array<array{0:mixed, 1:int}> an array of [record, prefix length] pairs
+     */
+    public function getManyWithPrefixLen(array $ipAddresses, ?array &$errors = null): array
+    {
+        if (\func_num_args() > 2) {
+            throw new \ArgumentCountError(
+                \sprintf('%s() expects at most 2 parameters, %d given', __METHOD__, \func_num_args())
+            );
+        }
+
+        return $this->lookupMany($ipAddresses, $errors);
+    }
+
+    /**
+     * @return array{0:mixed, 1:int}
+     */
+    abstract public function getWithPrefixLen(string $ipAddress): array;
+
+    /**
+     * @throws \BadMethodCallException if the database has been closed
+     */
+    abstract protected function checkNotClosed(): void;
+
+    /**
+     * @param array<mixed>           $ipAddresses
+     * @param array<\Exception>|null $errors
+     *
+     * @return array<array{0:mixed, 1:int}>
+     */
+    private function lookupMany(array $ipAddresses, ?array &$errors): array
+    {
+        $this->checkNotClosed();
+
+        $errors = [];
+        $results = [];
+        foreach ($ipAddresses as $key => $ipAddress) {
+            if (!\is_string($ipAddress)) {
+                $errors[$key] = new \InvalidArgumentException(
+                    'Expected the IP address to be a string.'
+                );
+
+                continue;
+            }
+
+            try {
+                $results[$key] = $this->getWithPrefixLen($ipAddress);
+            } catch (\InvalidArgumentException|InvalidDatabaseException $e) {
+                $errors[$key] = $e;
+            }
+        }
+
+        return $results;
+    }
+
+    /**
+     * Splits a path passed to getFields() into its keys.
+     *
+     * @param mixed $path
+     *
+     * @return array<int|string>
+     */
+    private static function lookupPath($path): array
+    {
+        if (\is_string($path)) {
+            return explode('.', $path);
+        }
+        if (!\is_array($path)) {
+            throw new \InvalidArgumentException(
+                'Each path must be a string or an array of keys.'
+            );
+        }
+        foreach ($path as $segment) {
+            if (!\is_string($segment) && !\is_int($segment)) {
+                throw new \InvalidArgumentException(
+                    'Each key in a path must be a string or an integer.'
+                );
+            }
+        }
+
+        return $path;
+    }
+}
@@ -0,0 +1,147 @@
+<?php
+
+declare(strict_types=1);
+
+namespace MaxMind\Db\Test;
+
+use MaxMind\Db\CompiledReader;
+use MaxMind\Db\Reader;
+use MaxMind\Db\Reader\InvalidDatabaseException;
+use PHPUnit\Framework\TestCase;
+
+/**
+ * @coversNothing
+ *
+ * @internal
+ */
+class CompiledReaderTest extends TestCase
+{
+    /**
+     * @var array<string>
+     */
+    private $compiledFiles = [];
+
+    protected function tearDown(): void
+    {
+        foreach ($this->compiledFiles as $file) {
+            @unlink($file);
+        }
+    }
+
+    public function testLookups(): void
+    {
+        $tests = [
+            'MaxMind-DB-test-decoder.mmdb' => ['::1.1.1.0', '::', '1.1.1.3', '::ffff:1.1.1.128', '::2:0:0'],
+            'MaxMind-DB-test-ipv4-24.mmdb' => ['1.1.1.1', '1.1.1.3', '1.1.1.33', '2.2.2.2', '255.255.255.255'],
+            'MaxMind-DB-test-ipv4-28.mmdb' => ['1.1.1.1', '1.1.1.16', '1.1.1.32'],
+            'MaxMind-DB-test-ipv4-32.mmdb' => ['1.1.1.1', '1.1.1.8'],
+            'MaxMind-DB-test-ipv6-24.mmdb' => ['::1:ffff:ffff', '::2:0:1', '89fa::', '1.1.1.1'],
+            'MaxMind-DB-test-mixed-24.mmdb' => ['1.1.1.1', '::1.1.1.1', '::ffff:1.1.1.1', '2001:0:101:101::', '::2:0:40'],
+            'MaxMind-DB-test-no-ipv4-search-tree.mmdb' => ['1.1.1.1', '192.1.1.1', '::1:ffff:ffff'],
+            'MaxMind-DB-test-metadata-pointers.mmdb' => ['1.1.1.1'],
+        ];
+        foreach ($tests as $dbFile => $addresses) {
+            $reader = new Reader('tests/data/test-data/' . $dbFile);
+            $compiled = $this->compile($dbFile);
+
+            $this->assertEquals($reader->metadata(), $compiled->metadata(), "metadata of $dbFile");
+            foreach ($addresses as $address) {
+                $this->assertSame(
+                    $reader->getWithPrefixLen($address),
+                    $compiled->getWithPrefixLen($address),
+                    "lookup of $address in $dbFile"
+                );
+                $this->assertSame(
+                    $reader->getPacked(inet_pton($address)),
+                    $compiled->getPacked(inet_pton($address)),
+                    "packed lookup of $address in $dbFile"
+                );
+            }
+
+            $reader->close();
+            $compiled->close();
+        }
+    }
+
+    public function testGetManyAndFields(): void
+    {
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $compiled = $this->compile('MaxMind-DB-test-decoder.mmdb');
+
+        $addresses = ['a' => '::1.1.1.0', 'b' => 'not an ip', 'c' => '::', 'd' => 5];
+        $this->assertSame(
+            $reader->getManyWithPrefixLen($addresses, $expectedErrors),
+            $compiled->getManyWithPrefixLen($addresses, $errors)
+        );
+        $this->assertSame(array_keys($expectedErrors), array_keys($errors));
+        $this->assertSame($reader->getMany($addresses), $compiled->getMany($addresses));
+
+        $paths = [
+            'string' => 'map.mapX.utf8_stringX',
+            'last' => ['array', -1],
+            'index' => 'map.mapX.arrayX.1',
+            'missing' => 'map.mapY',
+            'past' => ['array', 3],
+            'scalar' => 'boolean.x',
+        ];
+        $this->assertSame(
+            $reader->getFields('::1.1.1.0', $paths),
+            $compiled->getFields('::1.1.1.0', $paths)
+        );
+        $this->assertNull($compiled->getFields('::2.2.2.2', $paths));
+
+        $reader->close();
+        $compiled->close();
+    }
+
+    public function testV6AddressV4Database(): void
+    {
+        $this->expectException(\InvalidArgumentException::class);
+        $this->expectExceptionMessage('Error looking up 2001::. You attempted to look up an IPv6 address in an IPv4-only database');
+        $this->compile('MaxMind-DB-test-ipv4-24.mmdb')->get('2001::');
+    }
+
+    public function testClosed(): void
+    {
+        $compiled = $this->compile('MaxMind-DB-test-ipv4-24.mmdb');
+        $compiled->close();
+
+        $this->expectException(\BadMethodCallException::class);
+        $this->expectExceptionMessage('Attempt to read from a closed MaxMind DB.');
+        $compiled->get('1.1.1.1');
+    }
+
+    public function testInvalidCompiledFile(): void
+    {
+        $file = tempnam(sys_get_temp_dir(), 'mmdb');
+        $this->compiledFiles[] = $file;
+        file_put_contents($file, "<?php\n\nreturn ['format' => 0];\n");
+
+        $this->expectException(InvalidDatabaseException::class);
+        $this->expectExceptionMessage('Is this a MaxMind DB file compiled by this version of the reader?');
+        new CompiledReader($file);
+    }
+
+    public function testInvalidDatabase(): void
+    {
+        $this->expectException(InvalidDatabaseException::class);
+        $this->expectExceptionMessage('Is this a valid MaxMind DB file?');
+        CompiledReader::compile('README.md', sys_get_temp_dir() . '/never-written.php');
+    }
+
+    public function testMissingDatabase(): void
+    {
+        $this->expectException(\InvalidArgumentException::class);
+        $this->expectExceptionMessage('The file "file-does-not-exist.mmdb" does not exist or is not readable.');
+        CompiledReader::compile('file-does-not-exist.mmdb', sys_get_temp_dir() . '/never-written.php');
+    }
+
+    private function compile(string $dbFile): CompiledReader
+    {
+        $file = tempnam(sys_get_temp_dir(), 'mmdb');
+        $this->compiledFiles[] = $file;
+        CompiledReader::compile('tests/data/test-data/' . $dbFile, $file);
+
+        return new CompiledReader($file);
+    }
+}
@@ -0,0 +1,66 @@
+<?php
+
+declare(strict_types=1);
+
+namespace MaxMind\Db\Test\Reader;
+
+/**
+ * A class that ReaderTest registers as a schema.
+ *
+ * @internal
+ */
+final class SchemaRecord
+{
+    /**
+     * @var mixed
+     */
+    public $string;
+
+    /**
+     * @var mixed
+     */
+    public $list;
+
+    /**
+     * @var mixed
+     */
+    public $last;
+
+    /**
+     * @var mixed
+     */
+    public $missing = 'default';
+
+    /**
+     * @var mixed
+     */
+    public $uint16;
+
+    /**
+     * @var mixed
+     */
+    public $alsoUint16;
+
+    /**
+     * @var mixed
+     */
+    public $mapX;
+
+    /**
+     * @var mixed
+     */
+    private $double;
+
+    public function __construct()
+    {
+        throw new \LogicException('The constructor should not be called.');
+    }
+
+    /**
+     * @return mixed
+     */
+    public function double()
+    {
+        return $this->double;
+    }
+}
@@ -0,0 +1,19 @@
+<?php
+
+declare(strict_types=1);
+
+namespace MaxMind\Db\Test\Reader;
+
+/**
+ * A schema class with typed properties, which need PHP 7.4.
+ *
+ * @internal
+ */
+final class TypedSchemaRecord
+{
+    public int $uint16;
+
+    public float $float;
+
+    public ?string $string = null;
+}
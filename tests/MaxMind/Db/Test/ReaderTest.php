@@ -6,6 +6,9 @@ namespace MaxMind\Db\Test;
 
 use MaxMind\Db\Reader;
 use MaxMind\Db\Reader\InvalidDatabaseException;
+use MaxMind\Db\Reader\LazyRecord;
+use MaxMind\Db\Test\Reader\SchemaRecord;
+use MaxMind\Db\Test\Reader\TypedSchemaRecord;
 use PHPUnit\Framework\TestCase;
 
 /**
@@ -248,6 +251,965 @@ class ReaderTest extends TestCase
         }
     }
 
+    public function testGetMany(): void
+    {
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb');
+
+        $records = $reader->getMany(
+            ['a' => '1.1.1.1', 'b' => '1.1.1.3', 'c' => '1.1.1.33', 7 => 'not_ip', 'd' => '2001::'],
+            $errors
+        );
+        $this->assertSame(
+            [
+                'a' => ['ip' => '1.1.1.1'],
+                'b' => ['ip' => '1.1.1.2'],
+                'c' => null,
+            ],
+            $records
+        );
+
+        $this->assertSame([7, 'd'], array_keys($errors));
+        $this->assertInstanceOf(\InvalidArgumentException::class, $errors[7]);
+        $this->assertSame('The value "not_ip" is not a valid IP address.', $errors[7]->getMessage());
+        $this->assertInstanceOf(\InvalidArgumentException::class, $errors['d']);
+
+        $this->assertSame(
+            [0 => ['ip' => '1.1.1.1'], 2 => ['ip' => '1.1.1.2']],
+            $reader->getMany(['1.1.1.1', 'not_ip', '1.1.1.3'])
+        );
+
+        $this->assertSame(
+            ['x' => [['ip' => '1.1.1.2'], 31]],
+            $reader->getManyWithPrefixLen(['x' => '1.1.1.3'])
+        );
+    }
+
+    public function testGetManyRethrowsUnexpectedExceptions(): void
+    {
+        if (\PHP_VERSION_ID < 70400) {
+            $this->markTestSkipped('Narrowing the extension\'s ?array return type requires PHP 7.4');
+        }
+        $reader = new class('tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb') extends Reader {
+            public function getWithPrefixLen(string $ipAddress): array
+            {
+                if ($ipAddress === '1.1.1.3') {
+                    throw new \RuntimeException('unexpected');
+                }
+
+                return parent::getWithPrefixLen($ipAddress);
+            }
+        };
+
+        $this->assertSame(
+            ['a' => ['ip' => '1.1.1.1']],
+            $reader->getMany(['a' => '1.1.1.1', 'b' => 'not_ip'], $errors)
+        );
+        $this->assertSame(['b'], array_keys($errors));
+
+        foreach (['getMany', 'getManyWithPrefixLen'] as $method) {
+            $errors = null;
+
+            try {
+                $reader->{$method}(['a' => 'not_ip', 'b' => '1.1.1.3', 'c' => '1.1.1.1'], $errors);
+                $this->fail("$method() did not throw");
+            } catch (\RuntimeException $e) {
+                $this->assertSame('unexpected', $e->getMessage());
+            }
+            // The addresses before the one that failed were still looked up.
+            $this->assertSame(['a'], array_keys($errors));
+        }
+    }
+
+    public function testClosedGetMany(): void
+    {
+        $this->expectException(\BadMethodCallException::class);
+        $this->expectExceptionMessage('Attempt to read from a closed MaxMind DB.');
+        $reader = new Reader(
+            'tests/data/test-data/MaxMind-DB-test-decoder.mmdb'
+        );
+        $reader->close();
+        $reader->getMany(['1.1.1.1']);
+    }
+
+    public function testGetPacked(): void
+    {
+        foreach ([4, 6] as $ipVersion) {
+            $reader = new Reader(
+                'tests/data/test-data/MaxMind-DB-test-ipv' . $ipVersion . '-24.mmdb'
+            );
+            $addresses = $ipVersion === 4
+                ? ['1.1.1.1', '1.1.1.3', '1.1.1.33']
+                : ['::1:ffff:ffff', '::2:0:1', '1.1.1.33', '89fa::'];
+
+            foreach ($addresses as $address) {
+                $this->assertSame(
+                    $reader->get($address),
+                    $reader->getPacked(inet_pton($address)),
+                    "packed lookup of $address"
+                );
+            }
+        }
+    }
+
+    public function testGetPackedInvalidLength(): void
+    {
+        $this->expectException(\InvalidArgumentException::class);
+        $this->expectExceptionMessage('The packed address must be 4 or 16 bytes long, 3 given.');
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $reader->getPacked('abc');
+    }
+
+    public function testGetPackedV6AddressV4Database(): void
+    {
+        $this->expectException(\InvalidArgumentException::class);
+        $this->expectExceptionMessage('Error looking up 2001::. You attempted to look up an IPv6 address in an IPv4-only database');
+        if (\defined('MaxMind\Db\Reader::MMDB_LIB_VERSION') && version_compare(Reader::MMDB_LIB_VERSION, '1.2.0', '<')) {
+            $this->markTestSkipped('MMDB_LIB_VERSION < 1.2.0');
+        }
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb');
+        $reader->getPacked(inet_pton('2001::'));
+    }
+
+    public function testGetFields(): void
+    {
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+
+        $this->assertSame(
+            [
+                'string' => 'hello',
+                'list' => 2,
+                'nested' => [7, 8, 9],
+                'last' => 9,
+                'whole' => [1, 2, 3],
+                'uint16' => 100,
+                'missing' => null,
+                'not-a-map' => null,
+                'out-of-range' => null,
+                'not-an-index' => null,
+                5 => pack('N', 42),
+            ],
+            $reader->getFields('::1.1.1.0', [
+                'string' => 'map.mapX.utf8_stringX',
+                'list' => ['array', 1],
+                'nested' => 'map.mapX.arrayX',
+                'last' => ['map', 'mapX', 'arrayX', '2'],
+                'whole' => 'array',
+                'uint16' => 'uint16',
+                'missing' => 'map.mapY',
+                'not-a-map' => 'utf8_string.x',
+                'out-of-range' => ['array', 3],
+                'not-an-index' => 'array.x',
+                5 => 'bytes',
+            ])
+        );
+
+        $this->assertSame(
+            ['map' => $reader->get('::1.1.1.0')['map']],
+            $reader->getFields('::1.1.1.0', ['map' => 'map'])
+        );
+
+        $reader->close();
+
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-ipv6-32.mmdb');
+        $this->assertNull($reader->getFields('1.1.1.1', ['ip']));
+        $reader->close();
+    }
+
+    public function testGetFieldsInvalidPath(): void
+    {
+        $this->expectException(\InvalidArgumentException::class);
+        $this->expectExceptionMessage('Each path must be a string or an array of keys.');
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $reader->getFields('::1.1.1.0', [1.5]);
+    }
+
+    public function testGetObject(): void
+    {
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $reader->registerSchema(SchemaRecord::class, [
+            'string' => 'map.mapX.utf8_stringX',
+            'list' => ['array', 1],
+            'last' => 'map.mapX.arrayX.-1',
+            'missing' => 'map.mapY',
+            'uint16' => 'uint16',
+            'alsoUint16' => ['uint16'],
+            'mapX' => 'map.mapX',
+            'double' => 'double',
+        ]);
+
+        $record = $reader->getObject('::1.1.1.0');
+        $this->assertInstanceOf(SchemaRecord::class, $record);
+        $this->assertSame('hello', $record->string);
+        $this->assertSame(2, $record->list);
+        $this->assertSame(9, $record->last);
+        $this->assertSame('default', $record->missing);
+        $this->assertSame(100, $record->uint16);
+        $this->assertSame(100, $record->alsoUint16);
+        $this->assertSame($reader->get('::1.1.1.0')['map']['mapX'], $record->mapX);
+        $this->assertSame(42.123456, $record->double());
+
+        $this->assertNull($reader->getObject('::2.2.2.2'));
+        $reader->close();
+    }
+
+    public function testGetObjectTypedProperties(): void
+    {
+        if (\PHP_VERSION_ID < 70400) {
+            $this->markTestSkipped('Typed properties require PHP 7.4');
+        }
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $reader->registerSchema(TypedSchemaRecord::class, [
+            'uint16' => 'uint16',
+            'float' => 'uint32',
+            'string' => 'map.mapY',
+        ]);
+        $record = $reader->getObject('::1.1.1.0');
+        $this->assertSame(100, $record->uint16);
+        $this->assertSame(268435456.0, $record->float);
+        $this->assertNull($record->string);
+
+        $reader->registerSchema(TypedSchemaRecord::class, ['uint16' => 'utf8_string']);
+        $this->expectException(\TypeError::class);
+        $reader->getObject('::1.1.1.0');
+    }
+
+    public function testRegisterSchemaNotFinal(): void
+    {
+        $this->expectException(\InvalidArgumentException::class);
+        $this->expectExceptionMessage('The schema class must be a final, user-defined class; MaxMind\Db\Reader is not.');
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $reader->registerSchema(Reader::class, []);
+    }
+
+    public function testRegisterSchemaUndeclaredProperty(): void
+    {
+        $this->expectException(\InvalidArgumentException::class);
+        $this->expectExceptionMessage('MaxMind\Db\Test\Reader\SchemaRecord::$nope is not a declared instance property.');
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $reader->registerSchema(SchemaRecord::class, ['nope' => 'uint16']);
+    }
+
+    public function testGetObjectWithoutSchema(): void
+    {
+        $this->expectException(\BadMethodCallException::class);
+        $this->expectExceptionMessage('No schema has been registered. Call registerSchema() first.');
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $reader->getObject('::1.1.1.0');
+    }
+
+    public function testEnrichStream(): void
+    {
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb');
+        $input = $this->memoryStream("1.1.1.1\n\n1.1.1.3\r\n2.2.2.2\nnot an ip\n::1\n");
+        $output = $this->memoryStream('');
+
+        $this->assertSame(5, $reader->enrichStream($input, $output));
+        rewind($output);
+        $this->assertSame(
+            '{"ip":"1.1.1.1","record":{"ip":"1.1.1.1"}}' . "\n"
+            . '{"ip":"1.1.1.3","record":{"ip":"1.1.1.2"}}' . "\n"
+            . '{"ip":"2.2.2.2","record":null}' . "\n"
+            . '{"ip":"not an ip","record":null}' . "\n"
+            . '{"ip":"::1","record":null}' . "\n",
+            stream_get_contents($output)
+        );
+        $reader->close();
+
+        // Every type, and the empty map and array of the zeros record, is
+        // written as json_encode() writes the record get() returns.
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $input = $this->memoryStream("::1.1.1.0\n::\n");
+        $output = $this->memoryStream('');
+
+        $this->assertSame(2, $reader->enrichStream($input, $output));
+        rewind($output);
+        $flags = \JSON_UNESCAPED_SLASHES | \JSON_UNESCAPED_UNICODE
+            | \JSON_INVALID_UTF8_SUBSTITUTE | \JSON_PARTIAL_OUTPUT_ON_ERROR;
+        $expected = '';
+        foreach (['::1.1.1.0', '::'] as $address) {
+            $expected .= json_encode(['ip' => $address, 'record' => $reader->get($address)], $flags) . "\n";
+        }
+        $this->assertSame($expected, stream_get_contents($output));
+        $reader->close();
+    }
+
+    public function testEnrichStreamFields(): void
+    {
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $fields = ['string' => 'map.mapX.utf8_stringX', 'array' => 'array', 'boolean' => 'boolean', 'missing' => 'map.mapY'];
+
+        $input = $this->memoryStream("a\t::1.1.1.0\tx\nb\tbogus\n");
+        $output = $this->memoryStream('');
+        $this->assertSame(2, $reader->enrichStream($input, $output, ['fields' => $fields, 'column' => 1]));
+        rewind($output);
+        $this->assertSame(
+            '{"ip":"::1.1.1.0","record":{"string":"hello","array":[1,2,3],"boolean":true,"missing":null}}' . "\n"
+            . '{"ip":"bogus","record":null}' . "\n",
+            stream_get_contents($output)
+        );
+
+        $input = $this->memoryStream("first, ::1.1.1.0\nsecond,bogus\nthird\n");
+        $output = $this->memoryStream('');
+        $this->assertSame(3, $reader->enrichStream($input, $output, [
+            'format' => 'tsv',
+            'fields' => array_values($fields) + [4 => 'uint16'],
+            'column' => 1,
+            'delimiter' => ',',
+        ]));
+        rewind($output);
+        $this->assertSame(
+            "::1.1.1.0\thello\t[1,2,3]\ttrue\t\t100\n"
+            . "bogus\t\t\t\t\t\n"
+            . "\t\t\t\t\t\n",
+            stream_get_contents($output)
+        );
+        $reader->close();
+    }
+
+    public function testEnrichStreamWritesLinesBeforeError(): void
+    {
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-broken-pointers-24.mmdb');
+        $input = $this->memoryStream("not an ip\n1.1.1.16\nnot an ip\n");
+        $output = $this->memoryStream('');
+
+        try {
+            $reader->enrichStream($input, $output);
+            $this->fail('InvalidDatabaseException was not thrown');
+        } catch (InvalidDatabaseException $e) {
+            $this->assertStringContainsString('contains bad data', $e->getMessage());
+        }
+        rewind($output);
+        $this->assertSame('{"ip":"not an ip","record":null}' . "\n", stream_get_contents($output));
+        $reader->close();
+    }
+
+    public function testEnrichStreamInvalidOptions(): void
+    {
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $tests = [
+            [['format' => 'csv'], 'The format must be "jsonl" or "tsv".'],
+            [['format' => 'tsv'], 'The tsv format requires fields.'],
+            [['column' => -1], 'The column must be a non-negative integer.'],
+            [['delimiter' => '::'], 'The delimiter must be a single character.'],
+            [['fields' => 'country'], 'The fields must be an array of paths.'],
+            [['fields' => [1.5]], 'Each path must be a string or an array of keys.'],
+            [['everything' => true], 'Unknown option "everything".'],
+        ];
+        foreach ($tests as [$options, $message]) {
+            try {
+                $reader->enrichStream($this->memoryStream(''), $this->memoryStream(''), $options);
+                $this->fail("$message was not thrown");
+            } catch (\InvalidArgumentException $e) {
+                $this->assertSame($message, $e->getMessage());
+            }
+        }
+
+        $this->expectException(\InvalidArgumentException::class);
+        $this->expectExceptionMessage('The input must be a stream.');
+        $reader->enrichStream('::1.1.1.0', $this->memoryStream(''));
+    }
+
+    public function testRecordCache(): void
+    {
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $this->assertSame(
+            ['capacity' => 0, 'size' => 0, 'hits' => 0, 'misses' => 0, 'evictions' => 0],
+            $reader->recordCacheStats()
+        );
+
+        $record = $reader->get('::1.1.1.0');
+        $zeros = $reader->get('::');
+
+        $reader->enableRecordCache(1);
+        $this->assertSame($record, $reader->get('::1.1.1.0'));
+        // Same network, so the same record
+        $this->assertSame($record, $reader->get('::1.1.1.1'));
+        $this->assertSame(
+            ['capacity' => 1, 'size' => 1, 'hits' => 1, 'misses' => 1, 'evictions' => 0],
+            $reader->recordCacheStats()
+        );
+
+        $this->assertSame($zeros, $reader->get('::'));
+        $this->assertSame($record, $reader->get('::1.1.1.2'));
+        $this->assertSame(
+            ['capacity' => 1, 'size' => 1, 'hits' => 1, 'misses' => 3, 'evictions' => 2],
+            $reader->recordCacheStats()
+        );
+
+        // Modifying a returned record must not change the cached one.
+        $copy = $reader->get('::1.1.1.3');
+        $copy['map']['mapX']['utf8_stringX'] = 'changed';
+        $this->assertSame($record, $reader->get('::1.1.1.4'));
+
+        $reader->enableRecordCache(0);
+        $this->assertSame($record, $reader->get('::1.1.1.0'));
+        $this->assertSame(
+            ['capacity' => 0, 'size' => 0, 'hits' => 0, 'misses' => 0, 'evictions' => 0],
+            $reader->recordCacheStats()
+        );
+        $reader->close();
+    }
+
+    public function testRecordCacheNegativeCapacity(): void
+    {
+        $this->expectException(\InvalidArgumentException::class);
+        $this->expectExceptionMessage('The record cache capacity must not be negative.');
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $reader->enableRecordCache(-1);
+    }
+
+    public function testAddressCache(): void
+    {
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb');
+        $this->assertSame(
+            ['capacity' => 0, 'size' => 0, 'hits' => 0, 'misses' => 0, 'evictions' => 0],
+            $reader->addressCacheStats()
+        );
+
+        $expected = $reader->getWithPrefixLen('1.1.1.3');
+        $missing = $reader->getWithPrefixLen('2.2.2.2');
+        $this->assertNull($missing[0]);
+
+        $reader->enableAddressCache(2);
+        $this->assertSame($expected, $reader->getWithPrefixLen('1.1.1.3'));
+        $this->assertSame($expected, $reader->getWithPrefixLen('1.1.1.3'));
+        // The same address in its packed form shares the cached result.
+        $this->assertSame($expected[0], $reader->getPacked(inet_pton('1.1.1.3')));
+        // Addresses without a record are cached with their prefix length.
+        $this->assertSame($missing, $reader->getWithPrefixLen('2.2.2.2'));
+        $this->assertSame($missing, $reader->getWithPrefixLen('2.2.2.2'));
+        $this->assertSame(
+            ['capacity' => 2, 'size' => 2, 'hits' => 3, 'misses' => 2, 'evictions' => 0],
+            $reader->addressCacheStats()
+        );
+
+        // Failed lookups are not cached.
+        try {
+            $reader->get('not an ip');
+            $this->fail('The invalid address was looked up');
+        } catch (\InvalidArgumentException $e) {
+        }
+        $this->assertSame(['ip' => '1.1.1.1'], $reader->get('1.1.1.1'));
+        $this->assertSame(
+            ['capacity' => 2, 'size' => 2, 'hits' => 3, 'misses' => 3, 'evictions' => 1],
+            $reader->addressCacheStats()
+        );
+
+        // Modifying a returned record must not change the cached one.
+        $copy = $reader->get('1.1.1.1');
+        $copy['ip'] = 'changed';
+        $this->assertSame(['ip' => '1.1.1.1'], $reader->get('1.1.1.1'));
+
+        $reader->enableAddressCache(0);
+        $this->assertSame($expected, $reader->getWithPrefixLen('1.1.1.3'));
+        $this->assertSame(
+            ['capacity' => 0, 'size' => 0, 'hits' => 0, 'misses' => 0, 'evictions' => 0],
+            $reader->addressCacheStats()
+        );
+
+        // Closing the reader drops the cache.
+        $reader->enableAddressCache(2);
+        $reader->get('1.1.1.3');
+        $reader->close();
+        $this->assertSame(
+            ['capacity' => 0, 'size' => 0, 'hits' => 0, 'misses' => 0, 'evictions' => 0],
+            $reader->addressCacheStats()
+        );
+    }
+
+    public function testAddressCacheNegativeCapacity(): void
+    {
+        $this->expectException(\InvalidArgumentException::class);
+        $this->expectExceptionMessage('The address cache capacity must not be negative.');
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $reader->enableAddressCache(-1);
+    }
+
+    public function testLazyRecords(): void
+    {
+        $eager = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $expected = $eager->get('::1.1.1.0');
+        $eager->close();
+
+        $reader = new Reader(
+            'tests/data/test-data/MaxMind-DB-test-decoder.mmdb',
+            ['lazyRecords' => true]
+        );
+        $record = $reader->get('::1.1.1.0');
+        $this->assertInstanceOf(LazyRecord::class, $record);
+        $this->assertSame(\count($expected), \count($record));
+
+        $this->assertSame($expected['utf8_string'], $record['utf8_string']);
+        $this->assertSame($expected['uint128'], $record['uint128']);
+        $this->assertSame('hello', $record['map']['mapX']['utf8_stringX']);
+        $this->assertSame(8, $record['map']['mapX']['arrayX'][1]);
+        $this->assertTrue(isset($record['array'][2]));
+        $this->assertFalse(isset($record['array'][3]));
+        $this->assertFalse(isset($record['missing']));
+        $this->assertNull($record['missing']);
+
+        $entries = iterator_to_array($record);
+        $this->assertSame(array_keys($expected), array_keys($entries));
+        $this->assertInstanceOf(LazyRecord::class, $entries['map']);
+        $this->assertSame($expected['map'], $entries['map']->toArray());
+        $this->assertSame($expected, $record->toArray());
+
+        [$record, $prefixLen] = $reader->getWithPrefixLen('::1.1.1.0');
+        $this->assertSame(120, $prefixLen);
+        $this->assertSame($expected, $record->toArray());
+
+        $reader->close();
+
+        // Records that are not maps or arrays are returned as they are.
+        $reader = new Reader(
+            'tests/data/test-data/MaxMind-DB-no-ipv4-search-tree.mmdb',
+            ['lazyRecords' => true]
+        );
+        $this->assertSame('::/64', $reader->get('200.0.2.1'));
+        $reader->close();
+    }
+
+    public function testLazyRecordIsReadOnly(): void
+    {
+        $this->expectException(\BadMethodCallException::class);
+        $this->expectExceptionMessage('Lazy records are read-only.');
+        $reader = new Reader(
+            'tests/data/test-data/MaxMind-DB-test-decoder.mmdb',
+            ['lazyRecords' => true]
+        );
+        $record = $reader->get('::1.1.1.0');
+        $record['boolean'] = false;
+    }
+
+    public function testStatsDisabled(): void
+    {
+        if (\ini_get('maxminddb.stats')) {
+            $this->markTestSkipped('maxminddb.stats is enabled');
+        }
+
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $reader->get('::1.1.1.0');
+        $reader->resetStats();
+        $this->assertSame(
+            [
+                'enabled' => false,
+                'lookups' => 0,
+                'not_found' => 0,
+                'invalid_addresses' => 0,
+                'depths' => [],
+                'bytes_decoded' => 0,
+                'values_decoded' => 0,
+                'lookup_time' => 0.0,
+            ],
+            $reader->stats()
+        );
+        $reader->close();
+    }
+
+    public function testNetworks(): void
+    {
+        $tests = [
+            'MaxMind-DB-test-ipv4-24.mmdb' => [
+                '1.1.1.1/32',
+                '1.1.1.2/31',
+                '1.1.1.4/30',
+                '1.1.1.8/29',
+                '1.1.1.16/28',
+                '1.1.1.32/32',
+            ],
+            'MaxMind-DB-test-ipv6-24.mmdb' => [
+                '::1:ffff:ffff/128',
+                '::2:0:0/122',
+                '::2:0:40/124',
+                '::2:0:50/125',
+                '::2:0:58/127',
+            ],
+        ];
+        foreach ($tests as $dbFile => $networks) {
+            $reader = new Reader('tests/data/test-data/' . $dbFile);
+            $records = iterator_to_array($reader->networks());
+            $this->assertSame($networks, array_keys($records), "networks in $dbFile");
+            foreach ($records as $network => $record) {
+                $this->assertSame(
+                    ['ip' => explode('/', $network)[0]],
+                    $record,
+                    "record for $network in $dbFile"
+                );
+            }
+            $reader->close();
+        }
+
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-no-ipv4-search-tree.mmdb');
+        $this->assertSame(['::/64' => '::/64'], iterator_to_array($reader->networks()));
+        $reader->close();
+    }
+
+    public function testNetworksAliasedNetworks(): void
+    {
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $record = $reader->get('1.1.1.1');
+
+        $networks = iterator_to_array($reader->networks());
+        $this->assertSame($record, $networks['1.1.1.0/24']);
+        $this->assertArrayNotHasKey('::ffff:1.1.1.0/120', $networks);
+
+        $networks = iterator_to_array(
+            $reader->networks(['includeAliasedNetworks' => true])
+        );
+        $this->assertSame($record, $networks['1.1.1.0/24']);
+        $this->assertSame($record, $networks['::ffff:1.1.1.0/120']);
+
+        $count = 0;
+        foreach ($reader->networks(['skipEmptyValues' => true]) as $network => $record) {
+            $this->assertNotSame([], $record, "record for $network");
+            ++$count;
+        }
+        $this->assertGreaterThan(0, $count);
+        $reader->close();
+    }
+
+    public function testNetworksWithin(): void
+    {
+        $tests = [
+            ['MaxMind-DB-test-ipv4-24.mmdb', '1.1.1.0/28', ['1.1.1.1/32', '1.1.1.2/31', '1.1.1.4/30', '1.1.1.8/29']],
+            ['MaxMind-DB-test-ipv4-24.mmdb', '1.1.1.3/32', ['1.1.1.2/31']],
+            ['MaxMind-DB-test-ipv4-24.mmdb', '2.0.0.0/8', []],
+            ['MaxMind-DB-test-ipv6-24.mmdb', '::2:0:0/120', ['::2:0:0/122', '::2:0:40/124', '::2:0:50/125', '::2:0:58/127']],
+            ['MaxMind-DB-test-ipv6-24.mmdb', '::2:0:40/123', ['::2:0:40/124', '::2:0:50/125', '::2:0:58/127']],
+        ];
+        foreach ($tests as [$dbFile, $network, $networks]) {
+            $reader = new Reader('tests/data/test-data/' . $dbFile);
+            $records = iterator_to_array($reader->networksWithin($network));
+            $this->assertSame($networks, array_keys($records), "networks within $network in $dbFile");
+            foreach ($records as $subnet => $record) {
+                $this->assertSame(['ip' => explode('/', $subnet)[0]], $record, "record for $subnet in $dbFile");
+            }
+            $reader->close();
+        }
+
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $this->assertSame(
+            ['1.1.1.0/24' => $reader->get('1.1.1.1')],
+            iterator_to_array($reader->networksWithin('1.1.1.0/24'))
+        );
+        $reader->close();
+    }
+
+    public function testNetworksWithinInvalidNetwork(): void
+    {
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb');
+        foreach (['1.1.1.0', '1.1.1.0/33', '1.1.1.0/-1', 'not/8', '1.1.1.0/8/8'] as $network) {
+            try {
+                $reader->networksWithin($network);
+                $this->fail("$network was accepted");
+            } catch (\InvalidArgumentException $e) {
+                $this->assertSame("The value \"$network\" is not a valid network.", $e->getMessage());
+            }
+        }
+
+        $this->expectException(\InvalidArgumentException::class);
+        $this->expectExceptionMessage('You attempted to look up an IPv6 address in an IPv4-only database');
+        $reader->networksWithin('::/64');
+    }
+
+    public function testNetworksUnknownOption(): void
+    {
+        $this->expectException(\InvalidArgumentException::class);
+        $this->expectExceptionMessage('Unknown option "includeEverything".');
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $reader->networks(['includeEverything' => true]);
+    }
+
+    public function testClosedNetworks(): void
+    {
+        $this->expectException(\BadMethodCallException::class);
+        $this->expectExceptionMessage('Attempt to read from a closed MaxMind DB.');
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $reader->close();
+        $reader->networks();
+    }
+
+    public function testVerify(): void
+    {
+        foreach ([
+            'MaxMind-DB-test-decoder.mmdb',
+            'MaxMind-DB-test-ipv4-24.mmdb',
+            'MaxMind-DB-test-ipv4-28.mmdb',
+            'MaxMind-DB-test-ipv4-32.mmdb',
+            'MaxMind-DB-test-ipv6-24.mmdb',
+            'MaxMind-DB-test-mixed-24.mmdb',
+            'MaxMind-DB-test-mixed-32.mmdb',
+            'MaxMind-DB-test-metadata-pointers.mmdb',
+        ] as $dbFile) {
+            $reader = new Reader('tests/data/test-data/' . $dbFile);
+            $this->assertSame([], $reader->verify(), $dbFile);
+            $this->assertSame([], $reader->verify(['threads' => 4]), "$dbFile with threads");
+            $reader->close();
+        }
+    }
+
+    public function testVerifyBrokenDatabase(): void
+    {
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-broken-pointers-24.mmdb');
+        $problems = $reader->verify();
+        $this->assertGreaterThanOrEqual(2, \count($problems));
+        $messages = implode("\n", array_column($problems, 'message'));
+        $this->assertStringContainsString('points past the end of the data section', $messages);
+        $this->assertStringContainsString('The record is invalid', $messages);
+
+        $offsets = array_column($problems, 'offset');
+        $sorted = $offsets;
+        sort($sorted);
+        $this->assertSame($sorted, $offsets);
+        $this->assertSame($problems, $reader->verify(['threads' => 3]));
+        $this->assertSame(\array_slice($problems, 0, 1), $reader->verify(['maxProblems' => 1]));
+
+        $reader = new Reader('tests/data/test-data/GeoIP2-City-Test-Broken-Double-Format.mmdb');
+        $this->assertContains(
+            'The record is invalid: the value is truncated or its size is not valid for its type.',
+            array_column($reader->verify(), 'message')
+        );
+    }
+
+    public function testVerifyInvalidOption(): void
+    {
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        foreach ([
+            'The maximum number of problems must be a positive integer.' => ['maxProblems' => 0],
+            'The number of threads must be a positive integer.' => ['threads' => '2'],
+            'Unknown option "fast".' => ['fast' => true],
+        ] as $message => $options) {
+            try {
+                $reader->verify($options);
+                $this->fail('No exception was thrown for ' . key($options));
+            } catch (\InvalidArgumentException $e) {
+                $this->assertSame($message, $e->getMessage());
+            }
+        }
+    }
+
+    public function testClosedVerify(): void
+    {
+        $this->expectException(\BadMethodCallException::class);
+        $this->expectExceptionMessage('Attempt to read from a closed MaxMind DB.');
+        $reader = new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb');
+        $reader->close();
+        $reader->verify();
+    }
+
+    public function testInMemory(): void
+    {
+        $tests = [
+            'MaxMind-DB-test-decoder.mmdb' => ['::1.1.1.0', '::', '1.1.1.3', '::ffff:1.1.1.128'],
+            'MaxMind-DB-test-ipv4-24.mmdb' => ['1.1.1.1', '1.1.1.3', '1.1.1.33', '2.2.2.2'],
+            'MaxMind-DB-test-ipv6-24.mmdb' => ['::1:ffff:ffff', '::2:0:1', '89fa::'],
+        ];
+        foreach ($tests as $dbFile => $addresses) {
+            $reader = new Reader('tests/data/test-data/' . $dbFile);
+            $inMemoryReader = new Reader('tests/data/test-data/' . $dbFile, ['inMemory' => true]);
+
+            $this->assertEquals($reader->metadata(), $inMemoryReader->metadata());
+            foreach ($addresses as $address) {
+                $this->assertSame(
+                    $reader->getWithPrefixLen($address),
+                    $inMemoryReader->getWithPrefixLen($address),
+                    "lookup of $address in $dbFile"
+                );
+            }
+
+            $reader->close();
+            $inMemoryReader->close();
+        }
+    }
+
+    public function testInMemoryCloseAndReopen(): void
+    {
+        $fileName = 'tests/data/test-data/MaxMind-DB-test-decoder.mmdb';
+        $reader = new Reader($fileName);
+        $expected = $reader->getWithPrefixLen('1.1.1.3');
+        $reader->close();
+
+        for ($i = 0; $i < 3; ++$i) {
+            $first = new Reader($fileName, ['inMemory' => true]);
+            $second = new Reader($fileName, ['inMemory' => true]);
+            $this->assertSame($expected, $first->getWithPrefixLen('1.1.1.3'));
+            $first->close();
+
+            // Closing one copy leaves the other, and the file, usable.
+            $this->assertSame($expected, $second->getWithPrefixLen('1.1.1.3'));
+            $this->assertSame('Test', $second->metadata()->databaseType);
+            $second->close();
+        }
+
+        $reader = new Reader($fileName);
+        $this->assertSame($expected, $reader->getWithPrefixLen('1.1.1.3'));
+        $reader->close();
+    }
+
+    public function testJumpTable(): void
+    {
+        $tests = [
+            'MaxMind-DB-test-decoder.mmdb' => ['::1.1.1.0', '::', '1.1.1.3', '::ffff:1.1.1.128'],
+            'MaxMind-DB-test-ipv4-24.mmdb' => ['1.1.1.1', '1.1.1.3', '1.1.1.33', '2.2.2.2', '255.255.255.255'],
+            'MaxMind-DB-test-ipv4-28.mmdb' => ['1.1.1.1', '1.1.1.16', '1.1.1.32'],
+            'MaxMind-DB-test-ipv4-32.mmdb' => ['1.1.1.1', '1.1.1.8'],
+            'MaxMind-DB-test-ipv6-24.mmdb' => ['::1:ffff:ffff', '::2:0:1', '89fa::', '1.1.1.1'],
+            'MaxMind-DB-test-mixed-24.mmdb' => ['1.1.1.1', '::1.1.1.1', '::ffff:1.1.1.1', '2001:0:101:101::', '::2:0:40'],
+            'MaxMind-DB-test-no-ipv4-search-tree.mmdb' => ['1.1.1.1', '192.1.1.1', '::1:ffff:ffff'],
+        ];
+        foreach ($tests as $dbFile => $addresses) {
+            $reader = new Reader('tests/data/test-data/' . $dbFile);
+            $jumpTableReader = new Reader('tests/data/test-data/' . $dbFile, ['jumpTable' => true]);
+            // The extension only uses the tables after 1,000 lookups.
+            for ($i = 0; $i < 1000; ++$i) {
+                $jumpTableReader->get($addresses[0]);
+            }
+
+            foreach ($addresses as $address) {
+                $this->assertSame(
+                    $reader->getWithPrefixLen($address),
+                    $jumpTableReader->getWithPrefixLen($address),
+                    "lookup of $address in $dbFile"
+                );
+            }
+
+            $reader->close();
+            $jumpTableReader->close();
+        }
+    }
+
+    public function testMemoryOptions(): void
+    {
+        $fileName = 'tests/data/test-data/MaxMind-DB-test-decoder.mmdb';
+        $reader = new Reader($fileName);
+        foreach ([['prefault' => true], ['hugePages' => true], ['inMemory' => true, 'hugePages' => true, 'prefault' => true]] as $options) {
+            $optionsReader = new Reader($fileName, $options);
+            $this->assertEquals($reader->metadata(), $optionsReader->metadata());
+            foreach (['::1.1.1.0', '::', '1.1.1.3'] as $address) {
+                $this->assertSame(
+                    $reader->getWithPrefixLen($address),
+                    $optionsReader->getWithPrefixLen($address),
+                    "lookup of $address with " . json_encode($options)
+                );
+            }
+            $optionsReader->close();
+        }
+        $reader->close();
+    }
+
+    public function testApcuOpenState(): void
+    {
+        $tests = [
+            'MaxMind-DB-test-decoder.mmdb' => ['::1.1.1.0', '::', '1.1.1.3'],
+            'MaxMind-DB-test-ipv4-24.mmdb' => ['1.1.1.1', '1.1.1.3', '2.2.2.2'],
+            'MaxMind-DB-test-no-ipv4-search-tree.mmdb' => ['1.1.1.1', '::1:ffff:ffff'],
+        ];
+        foreach ($tests as $dbFile => $addresses) {
+            $reader = new Reader('tests/data/test-data/' . $dbFile);
+            // The second reader is opened from what the first stored, when
+            // APCu is enabled.
+            foreach ([1, 2] as $open) {
+                $apcuReader = new Reader('tests/data/test-data/' . $dbFile, ['apcu' => true]);
+                $this->assertEquals($reader->metadata(), $apcuReader->metadata());
+                foreach ($addresses as $address) {
+                    $this->assertSame(
+                        $reader->getWithPrefixLen($address),
+                        $apcuReader->getWithPrefixLen($address),
+                        "lookup of $address in $dbFile, open $open"
+                    );
+                }
+                $apcuReader->close();
+            }
+            $reader->close();
+        }
+    }
+
+    public function testUnknownConstructorOption(): void
+    {
+        $this->expectException(\InvalidArgumentException::class);
+        $this->expectExceptionMessage('Unknown option "inMemmory".');
+        new Reader('tests/data/test-data/MaxMind-DB-test-decoder.mmdb', ['inMemmory' => true]);
+    }
+
+    public function testReloadIfChanged(): void
+    {
+        $fileName = tempnam(sys_get_temp_dir(), 'mmdb');
+        copy('tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb', $fileName);
+
+        $reader = new Reader($fileName);
+        $this->assertFalse($reader->reloadIfChanged());
+        $networks = $reader->networks();
+        $reader->enableAddressCache(4);
+        $reader->get('1.1.1.1');
+
+        $newFileName = tempnam(sys_get_temp_dir(), 'mmdb');
+        copy('tests/data/test-data/MaxMind-DB-test-ipv6-24.mmdb', $newFileName);
+        rename($newFileName, $fileName);
+
+        $this->assertTrue($reader->reloadIfChanged());
+        $this->assertFalse($reader->reloadIfChanged());
+        $this->assertSame(6, $reader->metadata()->ipVersion);
+        $this->assertSame(['ip' => '::2:0:0'], $reader->get('::2:0:1'));
+        // The address cache keeps its capacity but not the old results.
+        $this->assertSame(
+            ['capacity' => 4, 'size' => 1, 'hits' => 0, 'misses' => 1, 'evictions' => 0],
+            $reader->addressCacheStats()
+        );
+
+        // An iteration started before the reload stays on the old database.
+        $this->assertSame('1.1.1.1/32', $networks->key());
+        $this->assertSame(['ip' => '1.1.1.1'], $networks->current());
+
+        $reader->close();
+        unlink($fileName);
+    }
+
+    public function testReloadIfChangedInvalidDatabase(): void
+    {
+        $fileName = tempnam(sys_get_temp_dir(), 'mmdb');
+        copy('tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb', $fileName);
+        $reader = new Reader($fileName);
+
+        $newFileName = tempnam(sys_get_temp_dir(), 'mmdb');
+        copy('README.md', $newFileName);
+        rename($newFileName, $fileName);
+
+        try {
+            $reader->reloadIfChanged();
+            $this->fail('Expected an InvalidDatabaseException');
+        } catch (InvalidDatabaseException $e) {
+            $this->assertSame(['ip' => '1.1.1.1'], $reader->get('1.1.1.1'));
+        } finally {
+            $reader->close();
+            unlink($fileName);
+        }
+    }
+
+    public function testPersistent(): void
+    {
+        $fileName = 'tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb';
+        $first = Reader::persistent($fileName);
+        $second = Reader::persistent($fileName);
+
+        $this->assertInstanceOf(Reader::class, $first);
+        $this->assertSame(['ip' => '1.1.1.1'], $first->get('1.1.1.1'));
+
+        // Closing one reader must not affect the others sharing the database.
+        $first->close();
+        $this->assertSame(['ip' => '1.1.1.2'], $second->get('1.1.1.3'));
+        $this->assertSame(
+            $second->metadata()->nodeCount,
+            (new Reader($fileName))->metadata()->nodeCount
+        );
+    }
+
+    public function testPersistentMissingDatabase(): void
+    {
+        $this->expectException(\InvalidArgumentException::class);
+        $this->expectExceptionMessage('The file "file-does-not-exist.mmdb" does not exist or is not readable.');
+        Reader::persistent('file-does-not-exist.mmdb');
+    }
+
     public function testV6AddressV4Database(): void
     {
         $this->expectException(\InvalidArgumentException::class);
@@ -315,8 +1277,8 @@ class ReaderTest extends TestCase
     public function testTooManyConstructorArgs(): void
     {
         $this->expectException(\ArgumentCountError::class);
-        $this->expectExceptionMessage('MaxMind\Db\Reader::__construct() expects exactly 1');
-        new Reader('README.md', 1);
+        $this->expectExceptionMessage('MaxMind\Db\Reader::__construct() expects at most 2');
+        new Reader('README.md', [], 1);
     }
 
     /**
@@ -524,4 +1486,17 @@ class ReaderTest extends TestCase
             $this->assertNull($reader->get($ip));
         }
     }
+
+    /**
+     * @return resource
+     */
+    private function memoryStream(string $contents)
+    {
+        $stream = fopen('php://memory', 'w+b');
+        \assert($stream !== false);
+        fwrite($stream, $contents);
+        rewind($stream);
+
+        return $stream;
+    }
 }